@@ -30,6 +30,10 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef AE_STATS
+#include "fmacros.h"
+#include <dlfcn.h>
+#endif
 #include <stdio.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -61,6 +65,81 @@
     #endif
 #endif
 
+/* Loop instrumentation, compiled in with AE_STATS only: the busy part of
+ * each iteration, the events each poll returns, the time blocked in the poll,
+ * and the cycles of each callback by its function, all read from the TSC so
+ * the overhead stays in the tens of cycles. The callback running is noted in
+ * currentProc for a sampler to see, see profile.c. Without it, callbacks are
+ * called as is. */
+#ifdef AE_STATS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define aeCycles() __rdtsc()
+#else
+static inline unsigned long long aeCycles(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+/* Cycles and time at loop creation, to turn cycles into microseconds */
+static unsigned long long statsBaseCycles;
+static long long statsBaseNs;
+
+static long long aeMonotonicNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void aeRecordHandler(aeEventLoop *eventLoop, void *proc, unsigned long long cycles) {
+    unsigned long slot = ((unsigned long) proc >> 4) & (AE_STATS_HANDLERS - 1);
+    int i;
+
+    for (i = 0; i < AE_STATS_HANDLERS; i++) {
+        aeHandlerStats *h = &eventLoop->stats.handlers[slot];
+        if (h->proc == proc || h->proc == NULL) {
+            h->proc = proc;
+            h->calls++;
+            h->cycles += cycles;
+            if (cycles > h->maxCycles) h->maxCycles = cycles;
+            return;
+        }
+        slot = (slot + 1) & (AE_STATS_HANDLERS - 1);
+    }
+}
+
+static void aeRecordIteration(aeEventLoop *eventLoop, int numevents, unsigned long long cycles) {
+    aeStats *stats = &eventLoop->stats;
+    int bucket = cycles > 0 ? 63 - __builtin_clzll(cycles) : 0;
+
+    stats->iterations++;
+    stats->iterHist[bucket < AE_STATS_BUCKETS ? bucket : AE_STATS_BUCKETS - 1]++;
+    if (cycles > stats->maxIterCycles) stats->maxIterCycles = cycles;
+    stats->busyCycles += cycles;
+    if (numevents > 0) {
+        stats->events += numevents;
+        if (numevents > stats->maxEvents) stats->maxEvents = numevents;
+    }
+}
+
+/* Run 'call' and charge its cycles to 'proc', read before the call as the
+ * callback may replace itself. */
+#define AE_INVOKE(eventLoop, proc, call) do { \
+        void *calledProc = (void *) (proc); \
+        unsigned long long callStart = aeCycles(); \
+        (eventLoop)->currentProc = calledProc; \
+        call; \
+        (eventLoop)->currentProc = NULL; \
+        aeRecordHandler(eventLoop, calledProc, aeCycles() - callStart); \
+    } while (0)
+#else
+#define AE_INVOKE(eventLoop, proc, call) do { \
+        call; \
+    } while (0)
+#endif
+
 aeEventLoop *aeCreateEventLoop(int setsize) {
     aeEventLoop *eventLoop;
     int i;
@@ -77,6 +156,12 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     eventLoop->maxfd = -1;
     eventLoop->beforesleep = NULL;
     eventLoop->aftersleep = NULL;
+#ifdef AE_STATS
+    eventLoop->currentProc = NULL;
+    memset(&eventLoop->stats, 0, sizeof(eventLoop->stats));
+    statsBaseCycles = aeCycles();
+    statsBaseNs = aeMonotonicNs();
+#endif
     if (aeApiCreate(eventLoop) == -1) goto err;
     /* Events with mask == AE_NONE are not set. So let's initialize the
      * vector with it. */
@@ -332,7 +417,7 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
             int retval;
 
             id = te->id;
-            retval = te->timeProc(eventLoop, id, te->clientData);
+            AE_INVOKE(eventLoop, te->timeProc, retval = te->timeProc(eventLoop, id, te->clientData));
             processed++;
             if (retval != AE_NOMORE) {
                 aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
@@ -361,7 +446,10 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
  * The function returns the number of events processed. */
 int aeProcessEvents(aeEventLoop *eventLoop, int flags)
 {
-    int processed = 0, numevents;
+    int processed = 0, numevents = 0;
+#ifdef AE_STATS
+    unsigned long long busyStart = 0;
+#endif
 
     /* Nothing to do? return ASAP */
 //    if (!(flags & AE_TIME_EVENTS) && !(flags & AE_FILE_EVENTS)) return 0;
@@ -374,31 +462,33 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
 //        ((flags & AE_TIME_EVENTS) && !(flags & AE_DONT_WAIT))) {
     if (eventLoop->maxfd != -1) {
         int j;
-//        aeTimeEvent *shortest = NULL;
+        aeTimeEvent *shortest = NULL;
         struct timeval tv, *tvp;
 
-//        if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
-//            shortest = aeSearchNearestTimer(eventLoop);
-//        if (shortest) {
-//            long now_sec, now_ms;
-//
-//            aeGetTime(&now_sec, &now_ms);
-//            tvp = &tv;
-//
-//            /* How many milliseconds we need to wait for the next
-//             * time event to fire? */
-//            long long ms =
-//                (shortest->when_sec - now_sec)*1000 +
-//                shortest->when_ms - now_ms;
-//
-//            if (ms > 0) {
-//                tvp->tv_sec = ms/1000;
-//                tvp->tv_usec = (ms % 1000)*1000;
-//            } else {
-//                tvp->tv_sec = 0;
-//                tvp->tv_usec = 0;
-//            }
-//        } else {
+        /* Timers are rare here, don't pay for the search without them. */
+        if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT) &&
+            eventLoop->timeEventHead != NULL)
+            shortest = aeSearchNearestTimer(eventLoop);
+        if (shortest) {
+            long now_sec, now_ms;
+
+            aeGetTime(&now_sec, &now_ms);
+            tvp = &tv;
+
+            /* How many milliseconds we need to wait for the next
+             * time event to fire? */
+            long long ms =
+                (shortest->when_sec - now_sec)*1000 +
+                shortest->when_ms - now_ms;
+
+            if (ms > 0) {
+                tvp->tv_sec = ms/1000;
+                tvp->tv_usec = (ms % 1000)*1000;
+            } else {
+                tvp->tv_sec = 0;
+                tvp->tv_usec = 0;
+            }
+        } else {
             /* If we have to check for events but need to return
              * ASAP because of AE_DONT_WAIT we need to set the timeout
              * to zero */
@@ -409,11 +499,18 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
                 /* Otherwise we can block */
                 tvp = NULL; /* wait forever */
             }
-//        }
+        }
 
         /* Call the multiplexing API, will return only on timeout or when
          * some event fires. */
+#ifdef AE_STATS
+        unsigned long long pollStart = aeCycles();
+        numevents = aeApiPoll(eventLoop, tvp);
+        busyStart = aeCycles();
+        eventLoop->stats.pollCycles += busyStart - pollStart;
+#else
         numevents = aeApiPoll(eventLoop, tvp);
+#endif
 
 //        /* After sleep callback. */
 //        if (eventLoop->aftersleep != NULL && flags & AE_CALL_AFTER_SLEEP)
@@ -445,14 +542,14 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
              * Fire the readable event if the call sequence is not
              * inverted. */
             if (!invert && fe->mask & mask & AE_READABLE) {
-                fe->rfileProc(eventLoop,fd,fe->clientData,mask);
+                AE_INVOKE(eventLoop, fe->rfileProc, fe->rfileProc(eventLoop,fd,fe->clientData,mask));
                 fired++;
             }
 
             /* Fire the writable event. */
             if (fe->mask & mask & AE_WRITABLE) {
                 if (!fired || fe->wfileProc != fe->rfileProc) {
-                    fe->wfileProc(eventLoop,fd,fe->clientData,mask);
+                    AE_INVOKE(eventLoop, fe->wfileProc, fe->wfileProc(eventLoop,fd,fe->clientData,mask));
                     fired++;
                 }
             }
@@ -461,7 +558,7 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
              * after the writable one. */
             if (invert && fe->mask & mask & AE_READABLE) {
                 if (!fired || fe->wfileProc != fe->rfileProc) {
-                    fe->rfileProc(eventLoop,fd,fe->clientData,mask);
+                    AE_INVOKE(eventLoop, fe->rfileProc, fe->rfileProc(eventLoop,fd,fe->clientData,mask));
                     fired++;
                 }
             }
@@ -469,10 +566,13 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
             processed++;
         }
     }
-//    /* Check time events */
-//    if (flags & AE_TIME_EVENTS)
-//        processed += processTimeEvents(eventLoop);
+    /* Check time events */
+    if (flags & AE_TIME_EVENTS && eventLoop->timeEventHead != NULL)
+        processed += processTimeEvents(eventLoop);
 
+#ifdef AE_STATS
+    if (busyStart) aeRecordIteration(eventLoop, numevents, aeCycles() - busyStart);
+#endif
     return processed; /* return the number of processed file/time events */
 }
 
@@ -504,7 +604,7 @@ void aeMain(aeEventLoop *eventLoop) {
 //        if (eventLoop->beforesleep != NULL)
 //            eventLoop->beforesleep(eventLoop);
 //        aeProcessEvents(eventLoop, AE_ALL_EVENTS|AE_CALL_AFTER_SLEEP);
-        aeProcessEvents(eventLoop, AE_FILE_EVENTS);
+        aeProcessEvents(eventLoop, AE_ALL_EVENTS);
     }
 }
 
@@ -519,3 +619,51 @@ void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep
 void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep) {
     eventLoop->aftersleep = aftersleep;
 }
+
+#ifdef AE_STATS
+static int aeCompareHandlers(const void *a, const void *b) {
+    const aeHandlerStats *x = a, *y = b;
+    return x->cycles < y->cycles ? 1 : x->cycles > y->cycles ? -1 : 0;
+}
+
+/* Upper bound of the iteration time bucket the given share of iterations
+ * falls in, in cycles. */
+static unsigned long long aeIterPercentile(aeStats *stats, double share) {
+    unsigned long long seen = 0, rank = (unsigned long long) (stats->iterations * share);
+    int i;
+
+    for (i = 0; i < AE_STATS_BUCKETS; i++) {
+        seen += stats->iterHist[i];
+        if (seen > rank) break;
+    }
+    return i < AE_STATS_BUCKETS ? 2ULL << i : stats->maxIterCycles;
+}
+
+/* Log the health of the loop since the last report, and start over. */
+void aeReportStats(aeEventLoop *eventLoop) {
+    aeStats *stats = &eventLoop->stats;
+    long long ns = aeMonotonicNs() - statsBaseNs;
+    double cyclesPerUs = ns > 0 ? (double) (aeCycles() - statsBaseCycles) * 1000 / ns : 1;
+    double total = (double) (stats->busyCycles + stats->pollCycles);
+    int i;
+
+    if (stats->iterations == 0 || total == 0) return;
+    log_msg(INFO, "Loop: %llu iterations, %.1f%% busy, %.1f%% blocked in poll, %.2f events per poll (max %d), "
+                  "iteration p50 < %.1f us, p99 < %.1f us, p99.9 < %.1f us, max %.1f us",
+            stats->iterations, stats->busyCycles * 100 / total, stats->pollCycles * 100 / total,
+            (double) stats->events / stats->iterations, stats->maxEvents,
+            aeIterPercentile(stats, 0.5) / cyclesPerUs, aeIterPercentile(stats, 0.99) / cyclesPerUs,
+            aeIterPercentile(stats, 0.999) / cyclesPerUs, stats->maxIterCycles / cyclesPerUs);
+
+    qsort(stats->handlers, AE_STATS_HANDLERS, sizeof(aeHandlerStats), aeCompareHandlers);
+    for (i = 0; i < AE_STATS_TOP && stats->handlers[i].calls > 0; i++) {
+        aeHandlerStats *h = &stats->handlers[i];
+        Dl_info info;
+        const char *name = dladdr(h->proc, &info) && info.dli_sname != NULL ? info.dli_sname : "?";
+        log_msg(INFO, "Loop handler %s (%p): %llu calls, %.2f us each, max %.1f us, %.1f%% of busy time",
+                name, h->proc, h->calls, h->cycles / cyclesPerUs / h->calls, h->maxCycles / cyclesPerUs,
+                stats->busyCycles > 0 ? h->cycles * 100.0 / stats->busyCycles : 0);
+    }
+    memset(stats, 0, sizeof(*stats));
+}
+#endif
@@ -93,6 +93,33 @@ typedef struct aeFiredEvent {
     int mask;
 } aeFiredEvent;
 
+#ifdef AE_STATS
+#define AE_STATS_BUCKETS 48   /* of iteration time, by log2 of its TSC cycles */
+#define AE_STATS_HANDLERS 64  /* callbacks timed apart, a power of 2 */
+#define AE_STATS_TOP 8        /* callbacks reported, the costliest first */
+
+/* Time spent in one callback, see aeReportStats() */
+typedef struct aeHandlerStats {
+    void *proc;
+    unsigned long long calls;
+    unsigned long long cycles;
+    unsigned long long maxCycles;
+} aeHandlerStats;
+
+/* Health of the loop since the last report, in TSC cycles. Only compiled in
+ * with AE_STATS, see LOOP_STATS in the Makefile. */
+typedef struct aeStats {
+    unsigned long long iterations;
+    unsigned long long iterHist[AE_STATS_BUCKETS]; /* busy part of each */
+    unsigned long long maxIterCycles;
+    unsigned long long busyCycles;  /* running callbacks */
+    unsigned long long pollCycles;  /* blocked in aeApiPoll() */
+    unsigned long long events;      /* fired, over 'iterations' polls */
+    int maxEvents;
+    aeHandlerStats handlers[AE_STATS_HANDLERS];
+} aeStats;
+#endif
+
 /* State of an event based program */
 typedef struct aeEventLoop {
     int maxfd;   /* highest file descriptor currently registered */
@@ -106,6 +133,10 @@ typedef struct aeEventLoop {
     void *apidata; /* This is used for polling API specific data */
     aeBeforeSleepProc *beforesleep;
     aeBeforeSleepProc *aftersleep;
+#ifdef AE_STATS
+    void * volatile currentProc; /* callback running, NULL in the loop itself */
+    aeStats stats;
+#endif
 } aeEventLoop;
 
 /* Prototypes */
@@ -128,5 +159,8 @@ void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep
 void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep);
 int aeGetSetSize(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
+#ifdef AE_STATS
+void aeReportStats(aeEventLoop *eventLoop);
+#endif
 
 #endif
@@ -45,6 +45,7 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stddef.h>
 
 #include "anet.h"
 #include "log.h"
@@ -370,23 +371,37 @@ int anetTcpNonBlockBestEffortBindConnect(char *err, char *addr, int port,
             ANET_CONNECT_NONBLOCK|ANET_CONNECT_BE_BINDING);
 }
 
+/* Fill 'sa' with the address of the unix socket at 'path', which is in the
+ * abstract namespace if it starts with '@'. Abstract names are not terminated,
+ * so the length of the address to pass along is returned. */
+static socklen_t anetUnixAddress(struct sockaddr_un *sa, char *path)
+{
+    memset(sa,0,sizeof(*sa));
+    sa->sun_family = AF_LOCAL;
+    strncpy(sa->sun_path,path,sizeof(sa->sun_path)-1);
+    if (path[0] != '@')
+        return sizeof(*sa);
+    sa->sun_path[0] = '\0';
+    return offsetof(struct sockaddr_un,sun_path) + strlen(sa->sun_path+1) + 1;
+}
+
 int anetUnixGenericConnect(char *err, char *path, int flags)
 {
     int s;
     struct sockaddr_un sa;
+    socklen_t salen;
 
     if ((s = anetCreateSocket(err,AF_LOCAL)) == ANET_ERR)
         return ANET_ERR;
 
-    sa.sun_family = AF_LOCAL;
-    strncpy(sa.sun_path,path,sizeof(sa.sun_path)-1);
+    salen = anetUnixAddress(&sa,path);
     if (flags & ANET_CONNECT_NONBLOCK) {
         if (anetNonBlock(err,s) != ANET_OK) {
             close(s);
             return ANET_ERR;
         }
     }
-    if (connect(s,(struct sockaddr*)&sa,sizeof(sa)) == -1) {
+    if (connect(s,(struct sockaddr*)&sa,salen) == -1) {
         if (errno == EINPROGRESS &&
             flags & ANET_CONNECT_NONBLOCK)
             return s;
@@ -520,16 +535,15 @@ int anetUnixServer(char *err, char *path, mode_t perm, int backlog)
 {
     int s;
     struct sockaddr_un sa;
+    socklen_t salen;
 
     if ((s = anetCreateSocket(err,AF_LOCAL)) == ANET_ERR)
         return ANET_ERR;
 
-    memset(&sa,0,sizeof(sa));
-    sa.sun_family = AF_LOCAL;
-    strncpy(sa.sun_path,path,sizeof(sa.sun_path)-1);
-    if (anetListen(err,s,(struct sockaddr*)&sa,sizeof(sa),backlog) == ANET_ERR)
+    salen = anetUnixAddress(&sa,path);
+    if (anetListen(err,s,(struct sockaddr*)&sa,salen,backlog) == ANET_ERR)
         return ANET_ERR;
-    if (perm)
+    if (perm && path[0] != '@')
         chmod(sa.sun_path, perm);
     return s;
 }
@@ -580,6 +594,75 @@ int anetUnixAccept(char *err, int s) {
     return fd;
 }
 
+/* Send 'len' bytes of 'buf' over the unix socket 'sock', passing along the
+ * file descriptor 'fd' with SCM_RIGHTS unless it is -1. */
+int anetSendFd(char *err, int sock, int fd, void *buf, size_t len) {
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } cmsgbuf;
+
+    memset(&msg,0,sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd != -1) {
+        struct cmsghdr *cmsg;
+
+        memset(&cmsgbuf,0,sizeof(cmsgbuf));
+        msg.msg_control = cmsgbuf.buf;
+        msg.msg_controllen = sizeof(cmsgbuf.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg),&fd,sizeof(int));
+    }
+    while (sendmsg(sock,&msg,0) == -1) {
+        if (errno == EINTR) continue;
+        anetSetError(err, "sendmsg: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+}
+
+/* Receive up to 'len' bytes into 'buf' from the unix socket 'sock'. A file
+ * descriptor passed with SCM_RIGHTS is stored in '*fd', otherwise '*fd' is
+ * set to -1. Returns the number of bytes received, 0 on EOF. */
+int anetRecvFd(char *err, int sock, int *fd, void *buf, size_t len) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    ssize_t nread;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } cmsgbuf;
+
+    memset(&msg,0,sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgbuf.buf;
+    msg.msg_controllen = sizeof(cmsgbuf.buf);
+    while ((nread = recvmsg(sock,&msg,0)) == -1) {
+        if (errno == EINTR) continue;
+        anetSetError(err, "recvmsg: %s", strerror(errno));
+        return ANET_ERR;
+    }
+
+    *fd = -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(fd,CMSG_DATA(cmsg),sizeof(int));
+    return (int) nread;
+}
+
 int anetPeerToString(int fd, char *ip, size_t ip_len, int *port) {
     struct sockaddr_storage sa;
     socklen_t salen = sizeof(sa);
@@ -0,0 +1,364 @@
+#include "fmacros.h"
+#include <string.h>
+#include "cache.h"
+#include "util.h"
+
+/*
+ * Response cache for idempotent calls, keyed by the interface, method, parameter
+ * types and parameter of a request. Only calls listed as idempotent are cached or
+ * coalesced, see cache_allow(). Each shard is an open addressing table with
+ * linear probing and backward shift deletion, so lookups touch a few adjacent
+ * slots and no tombstones build up. When a shard is over its share of memory or
+ * slots, a CLOCK hand sweeps its slots: recently hit entries get a second chance,
+ * the others (and expired ones) are evicted.
+ */
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+typedef struct cache_entry {
+    uint64_t hash;
+    long expires_us;
+    uint32_t key_len[CACHE_KEY_FIELDS];
+    uint32_t value_len;
+    bool referenced;
+    char data[]; // key fields back to back, then the value
+} cache_entry_t;
+
+typedef struct cache_slot {
+    uint64_t hash;
+    cache_entry_t *entry; // NULL if empty
+} cache_slot_t;
+
+// Listed idempotent call, all methods of the interface if 'method' is NULL
+typedef struct cache_call {
+    char *interface;
+    size_t interface_len;
+    char *method;
+    size_t method_len;
+} cache_call_t;
+
+typedef struct cache_shard {
+    cache_slot_t slots[CACHE_SHARD_SLOTS];
+    int hand;
+    int num_entries;
+    long bytes;
+} cache_shard_t;
+
+static cache_shard_t *shards = NULL;
+static long max_shard_bytes = 0;
+static long ttl_us = 0;
+static cache_stats_t stats;
+static cache_call_t calls[CACHE_MAX_CALLS];
+static int num_calls = 0;
+
+static const char *key_names[CACHE_KEY_FIELDS] = {"interface=", "method=", "parameterTypesString=", "parameter="};
+
+
+void cache_init(long max_bytes, int ttl_ms) {
+    shards = calloc(CACHE_NUM_SHARDS, sizeof(cache_shard_t));
+    if (shards == NULL) {
+        log_msg(FATAL, "Failed to allocate response cache");
+        exit(EXIT_FAILURE);
+    }
+    max_shard_bytes = max_bytes / CACHE_NUM_SHARDS;
+    ttl_us = (long) ttl_ms * 1000;
+    stats.max_bytes = max_bytes;
+    log_msg(INFO, "Init response cache of %ld bytes in %d shards, TTL %d ms", max_bytes, CACHE_NUM_SHARDS, ttl_ms);
+}
+
+bool cache_enabled() {
+    return shards != NULL;
+}
+
+/*
+ * Calls that are safe to answer with the response of an identical one, comma separated, each
+ * "<interface>" for all of its methods or "<interface>#<method>". Returns the number listed.
+ */
+int cache_allow(const char *call_list) {
+    for (const char *call = call_list; *call != '\0' && num_calls < CACHE_MAX_CALLS;) {
+        const char *next = strchr(call, ',');
+        if (next == NULL) {
+            next = call + strlen(call);
+        }
+        const char *hash = memchr(call, '#', (size_t) (next - call));
+        cache_call_t *entry = &calls[num_calls];
+        entry->interface_len = (size_t) ((hash != NULL ? hash : next) - call);
+        entry->interface = strndup(call, entry->interface_len);
+        if (hash != NULL) {
+            entry->method_len = (size_t) (next - hash - 1);
+            entry->method = strndup(hash + 1, entry->method_len);
+        }
+        if (entry->interface_len > 0) {
+            log_msg(INFO, "Key calls of %s#%s as idempotent", entry->interface, hash != NULL ? entry->method : "*");
+            num_calls++;
+        }
+        call = *next == ',' ? next + 1 : next;
+    }
+    return num_calls;
+}
+
+// Listed by cache_allow(), the cache and coalescing take nothing else
+bool cache_call_allowed(const cache_key_t *key) {
+    for (int i = 0; i < num_calls; i++) {
+        const cache_call_t *call = &calls[i];
+        if (key->len[CACHE_KEY_INTERFACE] == call->interface_len &&
+            memcmp(key->field[CACHE_KEY_INTERFACE], call->interface, call->interface_len) == 0 &&
+            (call->method == NULL || (key->len[CACHE_KEY_METHOD] == call->method_len &&
+                                      memcmp(key->field[CACHE_KEY_METHOD], call->method, call->method_len) == 0))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline uint64_t hash_bytes(uint64_t hash, const char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t) buf[i]) * FNV_PRIME;
+    }
+    // Field separator, so that "ab" + "c" differs from "a" + "bc"
+    return (hash ^ 0xff) * FNV_PRIME;
+}
+
+/*
+ * Find the form fields of a complete HTTP request. Returns false if the request
+ * is not complete in 'req' yet or is not a call the cache understands. Whether the
+ * call may be cached at all is up to cache_call_allowed().
+ */
+bool cache_parse_key(const char *req, size_t len, cache_key_t *key) {
+    const char *end = req + len;
+    const char *body = memmem(req, len, "\r\n\r\n", 4);
+    if (UNLIKELY(body == NULL)) {
+        return false;
+    }
+    body += 4;
+
+    const char *header = find_header(req, body, "Content-Length:", 15);
+    if (UNLIKELY(header == NULL)) {
+        return false;
+    }
+    long content_length = strtol(header, NULL, 10);
+    if (content_length != end - body) {
+        // Partially read, or pipelined behind another request
+        return false;
+    }
+
+    memset(key, 0, sizeof(cache_key_t));
+    const char *field = body;
+    while (field < end) {
+        const char *next = memchr(field, '&', (size_t) (end - field));
+        if (next == NULL) {
+            next = end;
+        }
+        for (int i = 0; i < CACHE_KEY_FIELDS; i++) {
+            size_t name_len = strlen(key_names[i]);
+            if ((size_t) (next - field) >= name_len && memcmp(field, key_names[i], name_len) == 0) {
+                key->field[i] = field + name_len;
+                key->len[i] = (uint32_t) (next - field - name_len);
+                break;
+            }
+        }
+        field = next + 1;
+    }
+    if (key->field[CACHE_KEY_INTERFACE] == NULL || key->field[CACHE_KEY_METHOD] == NULL ||
+        key->field[CACHE_KEY_PARAMETER] == NULL) {
+        return false;
+    }
+
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (int i = 0; i < CACHE_KEY_FIELDS; i++) {
+        hash = hash_bytes(hash, key->field[i], key->len[i]);
+    }
+    key->hash = hash;
+    return true;
+}
+
+// Only whole successful responses are cached
+bool cache_response_complete(const char *resp, size_t len) {
+    if (len < 12 || memcmp(resp, "HTTP/1.1 200", 12) != 0) {
+        return false;
+    }
+    const char *end = resp + len;
+    const char *body = memmem(resp, len, "\r\n\r\n", 4);
+    if (body == NULL) {
+        return false;
+    }
+    body += 4;
+    const char *header = find_header(resp, body, "Content-Length:", 15);
+    return header != NULL && strtol(header, NULL, 10) == end - body;
+}
+
+static inline cache_shard_t *shard_of(uint64_t hash) {
+    // High bits pick the shard, low bits the slot
+    return &shards[(hash >> 32) % CACHE_NUM_SHARDS];
+}
+
+static inline const char *entry_value(const cache_entry_t *entry) {
+    const char *value = entry->data;
+    for (int i = 0; i < CACHE_KEY_FIELDS; i++) {
+        value += entry->key_len[i];
+    }
+    return value;
+}
+
+// Bytes as allocated by cache_put(), 'data' may start inside the padding of the struct
+static inline size_t entry_size(const cache_entry_t *entry) {
+    return sizeof(cache_entry_t) + (size_t) (entry_value(entry) - entry->data) + entry->value_len;
+}
+
+bool cache_key_equal(const cache_key_t *a, const cache_key_t *b) {
+    if (a->hash != b->hash) {
+        return false;
+    }
+    for (int i = 0; i < CACHE_KEY_FIELDS; i++) {
+        if (a->len[i] != b->len[i] || memcmp(a->field[i], b->field[i], a->len[i]) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool entry_matches(const cache_entry_t *entry, const cache_key_t *key) {
+    const char *data = entry->data;
+    for (int i = 0; i < CACHE_KEY_FIELDS; i++) {
+        if (entry->key_len[i] != key->len[i] || memcmp(data, key->field[i], key->len[i]) != 0) {
+            return false;
+        }
+        data += key->len[i];
+    }
+    return true;
+}
+
+static int find_slot(cache_shard_t *shard, const cache_key_t *key) {
+    int i = (int) (key->hash % CACHE_SHARD_SLOTS);
+    while (shard->slots[i].entry != NULL) {
+        if (shard->slots[i].hash == key->hash && entry_matches(shard->slots[i].entry, key)) {
+            return i;
+        }
+        i = (i + 1) % CACHE_SHARD_SLOTS;
+    }
+    return -1;
+}
+
+static void remove_slot(cache_shard_t *shard, int i) {
+    cache_entry_t *entry = shard->slots[i].entry;
+    size_t size = entry_size(entry);
+    shard->bytes -= size;
+    shard->num_entries--;
+    stats.entries--;
+    stats.bytes -= size;
+    free(entry);
+
+    // Shift back the entries of the probe run that can no longer be reached past the hole
+    int j = i;
+    for (;;) {
+        j = (j + 1) % CACHE_SHARD_SLOTS;
+        if (shard->slots[j].entry == NULL) {
+            break;
+        }
+        int home = (int) (shard->slots[j].hash % CACHE_SHARD_SLOTS);
+        bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (!stays) {
+            shard->slots[i] = shard->slots[j];
+            i = j;
+        }
+    }
+    shard->slots[i].entry = NULL;
+}
+
+static void evict_one(cache_shard_t *shard, long now) {
+    for (;;) {
+        cache_slot_t *slot = &shard->slots[shard->hand];
+        if (slot->entry != NULL) {
+            if (slot->entry->referenced && slot->entry->expires_us > now) {
+                slot->entry->referenced = false;
+            } else {
+                if (slot->entry->expires_us > now) {
+                    stats.evictions++;
+                } else {
+                    stats.expirations++;
+                }
+                // The hand stays, another entry may have been shifted into this slot
+                remove_slot(shard, shard->hand);
+                return;
+            }
+        }
+        shard->hand = (shard->hand + 1) % CACHE_SHARD_SLOTS;
+    }
+}
+
+const char *cache_get(const cache_key_t *key, size_t *value_len) {
+    cache_shard_t *shard = shard_of(key->hash);
+    int i = find_slot(shard, key);
+    if (i < 0) {
+        stats.misses++;
+        return NULL;
+    }
+    cache_entry_t *entry = shard->slots[i].entry;
+    if (UNLIKELY(entry->expires_us <= get_current_time_us())) {
+        stats.expirations++;
+        stats.misses++;
+        remove_slot(shard, i);
+        return NULL;
+    }
+    stats.hits++;
+    entry->referenced = true;
+    *value_len = entry->value_len;
+    return entry_value(entry);
+}
+
+void cache_put(const cache_key_t *key, const char *value, size_t value_len) {
+    size_t size = sizeof(cache_entry_t) + value_len;
+    for (int i = 0; i < CACHE_KEY_FIELDS; i++) {
+        size += key->len[i];
+    }
+    if (UNLIKELY((long) size > max_shard_bytes)) {
+        return;
+    }
+
+    cache_shard_t *shard = shard_of(key->hash);
+    int i = find_slot(shard, key);
+    if (i >= 0) {
+        // Answered again while cached, e.g. requests that missed together
+        remove_slot(shard, i);
+    }
+
+    long now = get_current_time_us();
+    while (shard->num_entries >= CACHE_SHARD_SLOTS * CACHE_MAX_LOAD_PERCENT / 100 ||
+           shard->bytes + (long) size > max_shard_bytes) {
+        evict_one(shard, now);
+    }
+
+    cache_entry_t *entry = malloc(size);
+    if (UNLIKELY(entry == NULL)) {
+        log_msg(ERR, "Failed to allocate response cache entry of %zu bytes", size);
+        return;
+    }
+    entry->hash = key->hash;
+    entry->expires_us = now + ttl_us;
+    entry->value_len = (uint32_t) value_len;
+    entry->referenced = false;
+    char *data = entry->data;
+    for (int j = 0; j < CACHE_KEY_FIELDS; j++) {
+        entry->key_len[j] = key->len[j];
+        memcpy(data, key->field[j], key->len[j]);
+        data += key->len[j];
+    }
+    memcpy(data, value, value_len);
+
+    i = (int) (key->hash % CACHE_SHARD_SLOTS);
+    while (shard->slots[i].entry != NULL) {
+        i = (i + 1) % CACHE_SHARD_SLOTS;
+    }
+    shard->slots[i].hash = key->hash;
+    shard->slots[i].entry = entry;
+    shard->num_entries++;
+    shard->bytes += size;
+    stats.entries++;
+    stats.bytes += size;
+    stats.insertions++;
+}
+
+void cache_get_stats(cache_stats_t *out) {
+    *out = stats;
+}
@@ -0,0 +1,60 @@
+#ifndef MESH_AGENT_NATIVE_CACHE_H
+#define MESH_AGENT_NATIVE_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "common.h"
+
+// Adjustable params
+#define CACHE_NUM_SHARDS 16
+#define CACHE_SHARD_SLOTS 4096       // power of 2, open addressing with linear probing
+#define CACHE_MAX_LOAD_PERCENT 75
+#define CACHE_MAX_CALLS 64           // idempotent calls listed, see cache_allow()
+
+// Request fields a response is keyed by, see cache_parse_key()
+#define CACHE_KEY_INTERFACE 0
+#define CACHE_KEY_METHOD 1
+#define CACHE_KEY_TYPES 2
+#define CACHE_KEY_PARAMETER 3
+#define CACHE_KEY_FIELDS 4
+
+// Points into the request buffer, valid until it is overwritten
+typedef struct cache_key {
+    uint64_t hash;
+    const char *field[CACHE_KEY_FIELDS];
+    uint32_t len[CACHE_KEY_FIELDS];
+} cache_key_t;
+
+typedef struct cache_stats {
+    long hits;
+    long misses;
+    long insertions;
+    long evictions;  // by CLOCK to stay within memory or slot limits
+    long expirations;
+    long entries;
+    long bytes;
+    long max_bytes;
+} cache_stats_t;
+
+void cache_init(long max_bytes, int ttl_ms);
+
+bool cache_enabled();
+
+int cache_allow(const char *call_list);
+
+bool cache_call_allowed(const cache_key_t *key);
+
+bool cache_parse_key(const char *req, size_t len, cache_key_t *key);
+
+bool cache_response_complete(const char *resp, size_t len);
+
+bool cache_key_equal(const cache_key_t *a, const cache_key_t *b);
+
+const char *cache_get(const cache_key_t *key, size_t *value_len);
+
+void cache_put(const cache_key_t *key, const char *value, size_t value_len);
+
+void cache_get_stats(cache_stats_t *stats);
+
+#endif //MESH_AGENT_NATIVE_CACHE_H
@@ -1,3 +1,5 @@
+#include "fmacros.h"
+#include <fcntl.h>
 #include "consumer.h"
 #include "util.h"
 
@@ -8,16 +10,44 @@
 #define NUM_CONN_PER_PROVIDER 512
 //#define NUM_CONN_FOR_CONSUMER 512
 //#define NUM_CONN_PER_PROVIDER 256
-
-#ifdef LATENCY_AWARE
-#define LOAD_BALANCE_THRESHOLD 10000
-#define LOAD_PROTECT_THRESHOLD 100
-#endif
+#define NUM_SPLICE_PIPES_PREALLOC 256
+#define MIN_CONN_PER_PROVIDER 32
+#define CONNECT_BACKOFF_MIN_MS 100
+#define CONNECT_BACKOFF_MAX_MS 5000
+#define HEALTH_CHECK_INTERVAL_MS 1000
+#define OUTLIER_CONSECUTIVE_FAILURES 5
+#define OUTLIER_MIN_REQUESTS 50         // per health check interval to judge error rate and latency
+#define OUTLIER_MIN_PROBES 5            // same for an endpoint being probed
+#define OUTLIER_ERROR_RATE_PERCENT 20
+#define OUTLIER_LATENCY_FACTOR 3        // of the mean latency of peers
+#define OUTLIER_LATENCY_MIN_MS 10
+#define OUTLIER_EJECTION_MS 5000        // multiplied by the number of recent ejections
+#define OUTLIER_MAX_EJECTION_MS 60000
+#define OUTLIER_MAX_EJECTION_PERCENT 50
+#define OUTLIER_PROBE_START_PERCENT 10
+#define LIMIT_INITIAL 100               // for the endpoint of the highest capacity
+#define LIMIT_MIN 4
+#define LIMIT_MIN_WINDOW 16             // samples per limit update, at least the limit itself
+#define LIMIT_ALPHA 3                   // queued requests tolerated, times digits of limit
+#define LIMIT_BETA 6
+#define LIMIT_MIN_RTT_RESET_WINDOWS 200
+#define HEDGE_TICK_MS 1                 // between checks for late requests at the soonest
+#define HEDGE_MIN_SAMPLES 200           // RTT samples of an endpoint before its requests are hedged
+#define HEDGE_MIN_DELAY_US 1000
+#define HEDGE_BUDGET_PERCENT 5          // of requests sent
+#define HEDGE_BUDGET_BURST 100          // hedges saved up at most
+#define INFLIGHT_TABLE_SIZE 4096
+#define LOAD_REPORT_MAX_AGE_MS 1000     // of the load reported by a remote agent to be used
+#define SHM_RETRY_INTERVAL_MS 5000      // to attach a channel to a remote agent that registered one
+#define CACHE_STATS_FILE "mesh-agent-consumer.prom"
 
 static char neterr[256];
 
-static endpoint_t endpoints[3];
+static endpoint_t endpoints[MAX_ENDPOINTS];
 static int num_endpoints = 0;
+static service_t services[ROUTE_MAX_SERVICES];
+static char *service_names[ROUTE_MAX_SERVICES]; // indexed by route_build()
+static int num_services = 0;
 //static int round_robin_id = 0;
 
 #ifdef LATENCY_AWARE
@@ -26,38 +56,224 @@ static int request_counter = 0;
 #endif
 
 static Pool *connection_ca_pool = NULL;
+static Pool *splice_pipe_pool = NULL;
+
+static int forward_mode = FORWARD_MODE_COPY;
+static bool draining = false;
+static bool growing_pools = true; // whether pools may create connection objects to connect
+static bool consumers_throttled = false;
+static connection_ca_t *throttled_list = NULL;
+static connection_ca_t *throttled_tail = NULL;
+static int probe_counter = 0;
+static int hedge_percentile = 0;
+static int hedge_tokens = 0; // 100 per hedge
+static long long hedge_timer = -1; // armed while a candidate may be hedged, see track_hedge_candidate()
+static long hedge_deadline_us = 0;
+static int num_hedged = 0;
+static int num_hedges_won = 0;
+static cache_stats_t last_cache_stats;
+static bool coalescing = false;
+static connection_ca_t *inflight_calls[INFLIGHT_TABLE_SIZE]; // leaders chained by next_inflight
+static long num_coalesced = 0;
+static long last_coalesced = 0;
+static char stats_path[320];  // of the Prometheus textfile, see export_cache_stats()
+static bool encoding = false;  // requests to remote agents that relay them are Dubbo frames
+static bool going_direct = false; // and to the providers of endpoints that advertise their port
+static uint32_t cur_request_id = 1;
+static char value_text[CONSUMER_HTTP_RESP_BUF_SIZE]; // response value decoded to text
+static bool echoing = false;  // requests are answered here, nothing is upstream
+static long num_echoed = 0;
 
 
 void discover_etcd_services() ;
 void on_etcd_service_endpoint(const char *key, const char *value, void *arg);
+void size_endpoints() ;
+void bypass_remote_agents() ;
+bool route_connection_ca(aeEventLoop *event_loop, connection_ca_t *conn_ca, const char *req, size_t len) ;
 
 int init_connection_apa(void *elem, void *data) ;
 void cleanup_connection_apa(void *elem) ;
 
+void warm_up_endpoint(aeEventLoop *event_loop, endpoint_t *endpoint) ;
+void connect_remote_agent(aeEventLoop *event_loop, connection_apa_t *conn_apa) ;
+void on_remote_agent_connected(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+void retry_connection_apa(aeEventLoop *event_loop, connection_apa_t *conn_apa) ;
+int reconnect_remote_agent(aeEventLoop *event_loop, long long id, void *client_data) ;
+void replace_connection_apa(aeEventLoop *event_loop, connection_apa_t *conn_apa) ;
+int check_remote_agents(aeEventLoop *event_loop, long long id, void *client_data) ;
+
+bool attach_shm_channel(aeEventLoop *event_loop, endpoint_t *endpoint) ;
+void detach_shm_channel(aeEventLoop *event_loop, endpoint_t *endpoint) ;
+bool attach_connection_apa(connection_apa_t *conn_apa) ;
+void detach_connection_apa(connection_apa_t *conn_apa) ;
+void send_over_shm(aeEventLoop *event_loop, connection_ca_t *conn_ca) ;
+void read_from_shm_provider(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+void take_shm_response(aeEventLoop *event_loop, endpoint_t *endpoint, uint32_t tag, const char *msg, size_t len) ;
+void finish_shm_channel(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+void on_shm_channel_closed(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+
+void record_success(endpoint_t *endpoint, long rtt_us) ;
+void record_failure(endpoint_t *endpoint) ;
+void update_limit(endpoint_t *endpoint, long rtt_us) ;
+
+void track_hedge_candidate(aeEventLoop *event_loop, connection_ca_t *conn_ca) ;
+void untrack_hedge_candidate(connection_ca_t *conn_ca) ;
+int hedge_requests(aeEventLoop *event_loop, long long id, void *client_data) ;
+void hedge_request(aeEventLoop *event_loop, connection_ca_t *conn_ca) ;
+void read_hedge_from_remote_agent(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+void cancel_hedge(aeEventLoop *event_loop, connection_apa_t *conn_apa) ;
+void discard_from_remote_agent(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+void update_hedge_delays() ;
+bool serve_from_cache(aeEventLoop *event_loop, connection_ca_t *conn_ca) ;
+bool follow_request(aeEventLoop *event_loop, connection_ca_t *conn_ca) ;
+void unfollow_request(connection_ca_t *conn_ca) ;
+void share_response(aeEventLoop *event_loop, connection_ca_t *conn_ca) ;
+void release_followers(aeEventLoop *event_loop, connection_ca_t *conn_ca) ;
+void report_cache_stats() ;
+void export_cache_stats(const cache_stats_t *stats) ;
+void eject_endpoint(endpoint_t *endpoint, long now, const char *reason) ;
+void detect_outliers() ;
+void parse_load(endpoint_t *endpoint, const char *resp, ssize_t len) ;
+ssize_t strip_load(char *resp, ssize_t len) ;
+void start_trace(connection_ca_t *conn_ca) ;
+bool request_complete(const char *req, size_t len) ;
+bool encode_request(connection_ca_t *conn_ca) ;
+ssize_t decode_response(connection_ca_t *conn_ca) ;
+void answer_provider_heartbeat(connection_ca_t *conn_ca, int fd, const char *frame) ;
+bool answer_idle_heartbeats(connection_apa_t *conn_apa) ;
+void echo_to_consumer(aeEventLoop *event_loop, connection_ca_t *conn_ca) ;
+
 void read_from_consumer(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
 void write_to_remote_agent(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
 bool _write_to_remote_agent(aeEventLoop *event_loop, int fd, void *privdata) ;
 void read_from_remote_agent(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+void take_remote_agent_read(aeEventLoop *event_loop, int fd, connection_ca_t *conn_ca, ssize_t nread) ;
 void write_to_consumer(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
 bool _write_to_consumer(aeEventLoop *event_loop, int fd, void *privdata) ;
 
+int init_splice_pipe(void *elem, void *data) ;
+void cleanup_splice_pipe(void *elem) ;
+void release_splice_pipe(connection_ca_t *conn_ca) ;
+
+void splice_from_consumer(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+void splice_to_remote_agent(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+void splice_from_remote_agent(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+void splice_to_consumer(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+
+void dispatch_request(aeEventLoop *event_loop, connection_ca_t *conn_ca) ;
+static inline connection_apa_t *acquire_connection_apa(endpoint_t *endpoint) ;
+static inline bool endpoint_takes_dubbo(endpoint_t *endpoint) ;
+void forward_to_remote_agent(aeEventLoop *event_loop, connection_ca_t *conn_ca) ;
+void release_connection_apa(aeEventLoop *event_loop, connection_apa_t *conn_apa) ;
+void park_connection_ca(aeEventLoop *event_loop, endpoint_t *endpoint, connection_ca_t *conn_ca) ;
+void resume_connection_ca(aeEventLoop *event_loop, connection_ca_t *conn_ca) ;
+void throttle_consumer(aeEventLoop *event_loop, connection_ca_t *conn_ca) ;
+void unthrottle_consumers(aeEventLoop *event_loop) ;
+
+void close_connection_ca(aeEventLoop *event_loop, connection_ca_t *conn_ca) ;
 void abort_connection_ca(aeEventLoop *event_loop, connection_ca_t *conn_ca) ;
 
-endpoint_t *get_endpoint_least_loaded() ;
+endpoint_t *get_endpoint_least_loaded(service_t *service) ;
 
-endpoint_t *get_endpoint_min_latency() ;
+endpoint_t *get_endpoint_min_latency(service_t *service) ;
 
-endpoint_t *get_endpoint_min_latency_prob() ;
+endpoint_t *get_endpoint_min_latency_prob(service_t *service) ;
 
-void consumer_init() {
+void consumer_init(aeEventLoop *event_loop, int mode, int percentile, int cache_mb, int cache_ttl_ms,
+                   bool coalesce, const char *idempotent_calls, const char *stats_dir, int protocol, bool echo) {
     log_msg(INFO, "Consumer init begin");
-    discover_etcd_services();
+    forward_mode = mode;
+    if (echo) {
+        // Measures the consumer agent alone: no etcd, no remote agents, see echo_to_consumer()
+        log_msg(INFO, "Echo mode, answer requests without remote agents");
+        echoing = true;
+        forward_mode = FORWARD_MODE_COPY;
+        protocol = PROTOCOL_HTTP;
+        percentile = 0;
+        cache_mb = 0;
+        coalesce = false;
+    }
+    if (trace_enabled() && (forward_mode == FORWARD_MODE_SPLICE || echoing)) {
+        // Sampled in read_from_consumer() only, see start_trace()
+        log_msg(WARN, "Requests are not traced in %s mode", echoing ? "echo" : "splice");
+    }
+    if (protocol != PROTOCOL_HTTP) {
+        if (forward_mode == FORWARD_MODE_SPLICE) {
+            log_msg(WARN, "Encoding requests is not supported in splice mode");
+        } else if (protocol == PROTOCOL_DIRECT) {
+            log_msg(INFO, "Encode requests as Dubbo, straight to providers that advertise their port");
+            encoding = going_direct = true;
+        } else {
+            log_msg(INFO, "Encode requests as Dubbo for remote agents that relay them");
+            encoding = true;
+        }
+    }
+    if (!echoing) {
+        discover_etcd_services();
+
+        // Connections to remote agents are built by the event loop, serving starts right away
+        for (int i = 0; i < num_endpoints; i++) {
+            warm_up_endpoint(event_loop, &endpoints[i]);
+        }
+        growing_pools = false;
+        aeCreateTimeEvent(event_loop, HEALTH_CHECK_INTERVAL_MS, check_remote_agents, NULL, NULL);
+    }
+
+    if (percentile > 0 && percentile < 100) {
+        if (forward_mode == FORWARD_MODE_SPLICE) {
+            // Request bytes only pass through a pipe, nothing is left to duplicate
+            log_msg(WARN, "Request hedging is not supported in splice mode");
+        } else if (num_endpoints > 1) {
+            log_msg(INFO, "Hedge requests slower than p%d of their endpoint", percentile);
+            hedge_percentile = percentile;
+        }
+    }
+
+    if ((cache_mb > 0 || coalesce) && forward_mode != FORWARD_MODE_SPLICE &&
+        (idempotent_calls == NULL || cache_allow(idempotent_calls) == 0)) {
+        // Nothing is known to be safe to answer with the response of another call
+        log_msg(WARN, "No idempotent calls listed, responses are neither cached nor shared");
+        cache_mb = 0;
+        coalesce = false;
+    }
+    if (cache_mb > 0) {
+        if (forward_mode == FORWARD_MODE_SPLICE) {
+            // Neither requests nor responses are seen in splice mode
+            log_msg(WARN, "Response cache is not supported in splice mode");
+        } else {
+            cache_init((long) cache_mb << 20, cache_ttl_ms);
+        }
+    }
+    if (coalesce) {
+        if (forward_mode == FORWARD_MODE_SPLICE) {
+            log_msg(WARN, "Request coalescing is not supported in splice mode");
+        } else {
+            log_msg(INFO, "Coalesce identical calls in flight");
+            coalescing = true;
+        }
+    }
+    if (cache_enabled() || coalescing) {
+        snprintf(stats_path, sizeof(stats_path), "%s/" CACHE_STATS_FILE, stats_dir);
+        log_msg(INFO, "Export response cache stats into %s", stats_path);
+    }
 
     log_msg(INFO, "Init connection pool for consumer");
     connection_ca_pool = PoolInit(NUM_CONN_FOR_CONSUMER, NUM_CONN_FOR_CONSUMER,
                                   sizeof(connection_ca_t), NULL, NULL, NULL, NULL, NULL);
     PoolPrintSaturation(connection_ca_pool);
 
+    if (forward_mode == FORWARD_MODE_SPLICE) {
+        // Pipes are only held by in-flight requests, so most of them stay in pool
+        log_msg(INFO, "Init splice pipe pool for consumer");
+        splice_pipe_pool = PoolInit(NUM_CONN_FOR_CONSUMER, NUM_SPLICE_PIPES_PREALLOC, sizeof(splice_pipe_t),
+                                    NULL, init_splice_pipe, NULL, cleanup_splice_pipe, NULL);
+        if (splice_pipe_pool == NULL) {
+            log_msg(FATAL, "Failed to init splice pipe pool");
+            exit(EXIT_FAILURE);
+        }
+        PoolPrintSaturation(splice_pipe_pool);
+    }
+
     srand((unsigned int) time(NULL));
 
     log_msg(INFO, "Consumer init done");
@@ -67,6 +283,74 @@ void consumer_cleanup() {
     log_msg(INFO, "Consumer cleanup done");
 }
 
+/*
+ * Hand idle connections over to a new agent process, on both sides. Connections
+ * with a request in flight stay here and are passed once the response is written.
+ */
+void consumer_handoff(aeEventLoop *event_loop, int sock) {
+    connection_apa_t *idle[NUM_CONN_PER_PROVIDER];
+    draining = true;
+    // Throttled consumers are idle too, let them be found below
+    unthrottle_consumers(event_loop);
+
+    for (int i = 0; i < num_endpoints; i++) {
+        endpoint_t *endpoint = &endpoints[i];
+        int num_idle = 0;
+        while (num_idle < NUM_CONN_PER_PROVIDER && (idle[num_idle] = PoolGet(endpoint->conn_pool)) != NULL) {
+            connection_apa_t *conn_apa = idle[num_idle++];
+            if (conn_apa->fd >= 0) {
+                handoff_send(sock, HANDOFF_UPSTREAM, endpoint->ip, endpoint->port, conn_apa->fd);
+                close(conn_apa->fd);
+                conn_apa->fd = -1;
+            }
+        }
+        for (int j = 0; j < num_idle; j++) {
+            PoolReturn(endpoint->conn_pool, idle[j]);
+        }
+        log_msg(INFO, "Handed off %d idle connections to remote agent %s:%d", num_idle, endpoint->ip, endpoint->port);
+    }
+
+    int num_clients = 0;
+    for (int fd = 0; fd <= event_loop->maxfd; fd++) {
+        aeFileEvent *fe = &event_loop->events[fd];
+        if (!(fe->mask & AE_READABLE) ||
+            (fe->rfileProc != read_from_consumer && fe->rfileProc != splice_from_consumer)) {
+            continue;
+        }
+        connection_ca_t *conn_ca = fe->clientData;
+        if (conn_ca->conn_apa != NULL || conn_ca->nread_in > 0) {
+            continue;
+        }
+        aeDeleteFileEvent(event_loop, fd, AE_WRITABLE | AE_READABLE);
+        if (handoff_send(sock, HANDOFF_CLIENT, NULL, 0, fd) == ANET_OK) {
+            num_clients++;
+        }
+        close(fd);
+        conn_ca->fd = -1;
+        PoolReturn(connection_ca_pool, conn_ca);
+    }
+    log_msg(INFO, "Handed off %d idle consumer connections, %d still active",
+            num_clients, connection_ca_pool->outstanding);
+}
+
+static void pass_connection_apa(connection_apa_t *conn_apa) {
+    if (conn_apa->fd < 0) {
+        // Over shared memory, the new agent attaches its own channel
+        return;
+    }
+    handoff_pass_upstream(conn_apa->endpoint->ip, conn_apa->endpoint->port, conn_apa->fd);
+    close(conn_apa->fd);
+    conn_apa->fd = -1;
+}
+
+long consumer_echoed_requests() {
+    return num_echoed;
+}
+
+int consumer_active_connections() {
+    return connection_ca_pool->outstanding;
+}
+
 void consumer_http_handler(aeEventLoop *event_loop, int fd) {
     // Fetch a connection object from pool
     connection_ca_t *conn_ca = PoolGet(connection_ca_pool);
@@ -79,9 +363,12 @@ void consumer_http_handler(aeEventLoop *event_loop, int fd) {
 
     memset(conn_ca, 0, sizeof(connection_ca_t));
     conn_ca->fd = fd;
+    // With a single service there is nothing to route, see route_connection_ca()
+    conn_ca->service = &services[0];
 
     // Read from consumer
-    if (UNLIKELY(aeCreateFileEvent(event_loop, fd, AE_READABLE, read_from_consumer, conn_ca) == AE_ERR)) {
+    aeFileProc *proc = forward_mode == FORWARD_MODE_SPLICE ? splice_from_consumer : read_from_consumer;
+    if (UNLIKELY(aeCreateFileEvent(event_loop, fd, AE_READABLE, proc, conn_ca) == AE_ERR)) {
         log_msg(ERR, "Failed to create readable event for read_from_consumer, socket %d", fd);
         abort_connection_ca(event_loop, conn_ca);
     }
@@ -95,6 +382,12 @@ void read_from_consumer(aeEventLoop *event_loop, int fd, void *privdata, int mas
         return;
     }
 
+    if (UNLIKELY(consumers_throttled) && conn_ca->conn_apa == NULL && conn_ca->nread_in == 0) {
+        // Leave new requests in socket buffer
+        throttle_consumer(event_loop, conn_ca);
+        return;
+    }
+
     ssize_t nread = read(fd, conn_ca->buf_in + conn_ca->nread_in,
                          sizeof(conn_ca->buf_in) - conn_ca->nread_in);
 
@@ -106,37 +399,40 @@ void read_from_consumer(aeEventLoop *event_loop, int fd, void *privdata, int mas
         conn_ca->nread_out = 0;
         conn_ca->nwrite_out = 0;
 
-        // Get connection to remote agent
-        connection_apa_t *conn_apa = conn_ca->conn_apa;
-        if (LIKELY(conn_apa == NULL)) {
-//            endpoint_t *endpoint = get_endpoint_least_loaded();
-            endpoint_t *endpoint = get_endpoint_min_latency();
-//            endpoint_t *endpoint = get_endpoint_min_latency_prob();
-            conn_apa = PoolGet(endpoint->conn_pool);
-            if (UNLIKELY(conn_apa == NULL)) {
-                log_msg(ERR, "No connection to remote agent available for socket %d", fd);
-                abort_connection_ca(event_loop, conn_ca);
+        if (UNLIKELY(echoing)) {
+            if (conn_ca->nread_in < (ssize_t) sizeof(conn_ca->buf_in) &&
+                !request_complete(conn_ca->buf_in, (size_t) conn_ca->nread_in)) {
                 return;
             }
-            conn_ca->conn_apa = conn_apa;
-            log_msg(DEBUG, "Pick up connection to %s:%d with socket %d",
-                    conn_apa->endpoint->ip, conn_apa->endpoint->port, conn_apa->fd);
+            echo_to_consumer(event_loop, conn_ca);
+            return;
         }
-
-//        if (UNLIKELY(!_write_to_remote_agent(event_loop, conn_apa->fd, conn_ca))) {
-            // Write to remote agent
-            if (UNLIKELY(aeCreateFileEvent(event_loop, conn_apa->fd, AE_WRITABLE, write_to_remote_agent, conn_ca) ==
-                         AE_ERR)) {
-                log_msg(ERR, "Failed to create writable event for write_to_remote_agent: %s", strerror(errno));
-                abort_connection_ca(event_loop, conn_ca);
+        if (UNLIKELY(num_services > 1) && conn_ca->conn_apa == NULL && conn_ca->leader == NULL &&
+            !route_connection_ca(event_loop, conn_ca, conn_ca->buf_in, (size_t) conn_ca->nread_in)) {
+            return;
+        }
+        if (UNLIKELY(encoding) && conn_ca->conn_apa == NULL && conn_ca->leader == NULL &&
+            conn_ca->nread_in < (ssize_t) sizeof(conn_ca->buf_in) &&
+            !request_complete(conn_ca->buf_in, (size_t) conn_ca->nread_in)) {
+            // Encoded in one go, see encode_request()
+            return;
+        }
+        if (trace_sampled() && conn_ca->conn_apa == NULL && conn_ca->leader == NULL && conn_ca->span.trace_id == 0) {
+            // Nothing is sent yet and nothing points into buf_in
+            start_trace(conn_ca);
+        }
+        if (UNLIKELY(cache_enabled() || coalescing) && conn_ca->conn_apa == NULL) {
+            if (UNLIKELY(conn_ca->leader != NULL)) {
+                // Waiting for the response to the identical call it follows
+                return;
+            }
+            conn_ca->keyed = cache_parse_key(conn_ca->buf_in, (size_t) conn_ca->nread_in, &conn_ca->cache_key) &&
+                             cache_call_allowed(&conn_ca->cache_key);
+            if (conn_ca->keyed && (serve_from_cache(event_loop, conn_ca) || follow_request(event_loop, conn_ca))) {
+                return;
             }
-//        }
-
-        // Read from remote agent
-        if (UNLIKELY(aeCreateFileEvent(event_loop, conn_apa->fd, AE_READABLE, read_from_remote_agent, conn_ca) == AE_ERR)) {
-            log_msg(ERR, "Failed to create readable event for read_from_remote_agent: %s", strerror(errno));
-            abort_connection_ca(event_loop, conn_ca);
         }
+        dispatch_request(event_loop, conn_ca);
 
     } else if (UNLIKELY(nread < 0)) {
         if (errno == EAGAIN) {
@@ -148,96 +444,221 @@ void read_from_consumer(aeEventLoop *event_loop, int fd, void *privdata, int mas
 
     } else {
 //        log_msg(INFO, "Consumer closed connection for socket %d", fd);
-        aeDeleteFileEvent(event_loop, fd, AE_WRITABLE | AE_READABLE);
-        PoolReturn(connection_ca_pool, conn_ca);
-        conn_ca->fd = -1;
-        close(fd);
-        log_msg(DEBUG, "Returned connection object to pool, active: %d", connection_ca_pool->outstanding);
+        close_connection_ca(event_loop, conn_ca);
+    }
+}
+
+void dispatch_request(aeEventLoop *event_loop, connection_ca_t *conn_ca) {
+    // Get connection to remote agent
+    connection_apa_t *conn_apa = conn_ca->conn_apa;
+    if (LIKELY(conn_apa == NULL)) {
+        service_t *service = conn_ca->service;
+//        endpoint_t *endpoint = get_endpoint_least_loaded(service);
+        endpoint_t *endpoint = get_endpoint_min_latency(service);
+//        endpoint_t *endpoint = get_endpoint_min_latency_prob(service);
+        conn_apa = acquire_connection_apa(endpoint);
+        if (UNLIKELY(conn_apa == NULL)) {
+            // Request stays in buf_in until a connection is released
+            park_connection_ca(event_loop, endpoint, conn_ca);
+            return;
+        }
+        conn_ca->conn_apa = conn_apa;
+        log_msg(DEBUG, "Pick up connection to %s:%d with socket %d",
+                conn_apa->endpoint->ip, conn_apa->endpoint->port, conn_apa->fd);
+    }
+    forward_to_remote_agent(event_loop, conn_ca);
+}
+
+void forward_to_remote_agent(aeEventLoop *event_loop, connection_ca_t *conn_ca) {
+    connection_apa_t *conn_apa = conn_ca->conn_apa;
+    if (UNLIKELY(encoding) && conn_ca->nwrite_in == 0) {
+        // Sent as HTTP if the remote agent does not relay or the request does not parse
+        endpoint_t *endpoint = conn_apa->endpoint;
+        conn_ca->dubbo = endpoint_takes_dubbo(endpoint) && encode_request(conn_ca);
+        if (UNLIKELY(endpoint->direct && !conn_ca->dubbo)) {
+            // Nothing else goes to a provider
+            log_msg(WARN, "Request from socket %d is not a call, cannot send it to provider %s:%d",
+                    conn_ca->fd, endpoint->ip, endpoint->port);
+            conn_ca->conn_apa = NULL;
+            release_connection_apa(event_loop, conn_apa);
+            abort_connection_ca(event_loop, conn_ca);
+            return;
+        }
+    }
+    if (conn_apa->shm) {
+        send_over_shm(event_loop, conn_ca);
+        return;
+    }
+
+//        if (UNLIKELY(!_write_to_remote_agent(event_loop, conn_apa->fd, conn_ca))) {
+        // Write to remote agent
+        if (UNLIKELY(aeCreateFileEvent(event_loop, conn_apa->fd, AE_WRITABLE, write_to_remote_agent, conn_ca) ==
+                     AE_ERR)) {
+            log_msg(ERR, "Failed to create writable event for write_to_remote_agent: %s", strerror(errno));
+            abort_connection_ca(event_loop, conn_ca);
+            return;
+        }
+//        }
+
+    // Read from remote agent
+    if (UNLIKELY(aeCreateFileEvent(event_loop, conn_apa->fd, AE_READABLE, read_from_remote_agent, conn_ca) == AE_ERR)) {
+        log_msg(ERR, "Failed to create readable event for read_from_remote_agent: %s", strerror(errno));
+        abort_connection_ca(event_loop, conn_ca);
+    }
+}
+
+/*
+ * A probing endpoint takes a share of requests, see detect_outliers().
+ */
+static inline bool endpoint_admits(endpoint_t *endpoint) {
+    return LIKELY(endpoint->health == ENDPOINT_HEALTHY)
+           || (endpoint->health == ENDPOINT_PROBING && probe_counter++ % 100 < endpoint->probe_percent);
+}
+
+// A remote agent that relays frames, or a provider called directly
+static inline bool endpoint_takes_dubbo(endpoint_t *endpoint) {
+    return endpoint->relay || endpoint->direct;
+}
+
+/*
+ * Live connections not idle in pool, the ones out of pool for reconnecting are not live.
+ */
+static inline int endpoint_inflight(endpoint_t *endpoint) {
+    return endpoint->num_live - (int) endpoint->conn_pool->alloc_stack_size;
+}
+
+/*
+ * 2 - can take a request now, 1 - at its concurrency limit, all connections busy or still
+ * warming up, 0 - ejected from balancing or without live connection.
+ */
+static inline int endpoint_rank(endpoint_t *endpoint) {
+    if (UNLIKELY(endpoint->num_live == 0 || !endpoint_admits(endpoint))) {
+        return 0;
+    }
+    return endpoint->conn_pool->alloc_stack_size > 0 && endpoint_inflight(endpoint) < endpoint->limit ? 2 : 1;
+}
+
+static inline connection_apa_t *acquire_connection_apa(endpoint_t *endpoint) {
+    if (UNLIKELY(endpoint_inflight(endpoint) >= endpoint->limit)) {
+        return NULL;
     }
+    return PoolGet(endpoint->conn_pool);
 }
 
-endpoint_t *get_endpoint_least_loaded() {
-    endpoint_t *endpoint = &endpoints[0];
-    int min_outstanding = endpoints[0].conn_pool->outstanding;
-    for (int i = 1; i < num_endpoints; i++) {
-        if (min_outstanding > endpoints[i].conn_pool->outstanding) {
-            min_outstanding = endpoints[i].conn_pool->outstanding;
-            endpoint = &endpoints[i];
+endpoint_t *get_endpoint_least_loaded(service_t *service) {
+    endpoint_t *endpoint = service->endpoints[0];
+    int max_rank = endpoint_rank(endpoint);
+    int max_headroom = service->endpoints[0]->limit - endpoint_inflight(service->endpoints[0]);
+    for (int i = 1; i < service->num_endpoints; i++) {
+        // Prefer endpoints that can take a request now, then the ones not ejected
+        int rank = endpoint_rank(service->endpoints[i]);
+        if (rank < max_rank) {
+            continue;
+        }
+        int headroom = service->endpoints[i]->limit - endpoint_inflight(service->endpoints[i]);
+        if (rank > max_rank || max_headroom < headroom) {
+            max_rank = rank;
+            max_headroom = headroom;
+            endpoint = service->endpoints[i];
         }
     }
-//    for (int i = 0; i < num_endpoints; i++) {
-//        log_msg(INFO, "Endpoint %d: %s:%d - outstanding %d",
-//                i, endpoints[i].ip, endpoints[i].port, endpoints[i].conn_pool->outstanding);
+//    for (int i = 0; i < service->num_endpoints; i++) {
+//        log_msg(INFO, "Endpoint %d: %s:%d - in flight %d, limit %d", i, service->endpoints[i]->ip,
+//                service->endpoints[i]->port, endpoint_inflight(service->endpoints[i]), service->endpoints[i]->limit);
 //    }
-    log_msg(DEBUG, "Load balance to endpoint %s:%d with outstanding %d",
-            endpoint->ip, endpoint->port, min_outstanding);
+    log_msg(DEBUG, "Load balance to endpoint %s:%d with headroom %d",
+            endpoint->ip, endpoint->port, max_headroom);
     return endpoint;
 }
 
 #ifdef LATENCY_AWARE
-endpoint_t *get_endpoint_min_latency() {
-    endpoint_t *endpoint = &endpoints[0];
-    if (UNLIKELY(endpoint->num_reqs < LOAD_BALANCE_THRESHOLD)) {
-        return get_endpoint_least_loaded();
+/*
+ * Expected latency of a new request from the load reported by the remote agent: its average
+ * service time, stretched by the requests of all consumer agents queued in the provider.
+ */
+static inline long reported_latency_us(endpoint_t *endpoint) {
+    int serving = endpoint->remote_inflight - endpoint->remote_queued;
+    return endpoint->remote_service_us * (endpoint->remote_inflight + 1) / (serving > 0 ? serving + 1 : 1);
+}
+
+endpoint_t *get_endpoint_min_latency(service_t *service) {
+    endpoint_t *endpoint = service->endpoints[0];
+    // Latency stats are not trusted before the limiter of every endpoint has its RTT baseline
+    for (int i = 0; i < service->num_endpoints; i++) {
+        if (UNLIKELY(service->endpoints[i]->min_rtt_us == 0)) {
+            return get_endpoint_least_loaded(service);
+        }
+    }
+    // Reported load sees other consumer agents, own latency stats only what this one sent
+    bool reported = true;
+    long now = get_current_time_us();
+    for (int i = 0; i < service->num_endpoints; i++) {
+        if (now - service->endpoints[i]->load_updated_us > LOAD_REPORT_MAX_AGE_MS * 1000) {
+            reported = false;
+        }
     }
     // Load balance: min-latency
-    long min_latency = endpoints[0].total_ms / endpoints[0].num_reqs;
-    for (int i = 1; i < num_endpoints; i++) {
-        long latency = endpoints[i].total_ms / endpoints[i].num_reqs;
+    long min_latency = reported ? reported_latency_us(service->endpoints[0])
+                                : service->endpoints[0]->total_ms * 1000 / service->endpoints[0]->num_reqs;
+    for (int i = 1; i < service->num_endpoints; i++) {
+        long latency = reported ? reported_latency_us(service->endpoints[i])
+                                : service->endpoints[i]->total_ms * 1000 / service->endpoints[i]->num_reqs;
         if (min_latency > latency) {
             min_latency = latency;
-            endpoint = &endpoints[i];
+            endpoint = service->endpoints[i];
         }
     }
-    for (int i = 0; i < num_endpoints; i++) {
-        log_msg(DEBUG, "Endpoint %d: %ld ms = %ld / %d",
-                i, endpoints[i].total_ms / endpoints[i].num_reqs,
-                endpoints[i].total_ms, endpoints[i].num_reqs);
+    for (int i = 0; i < service->num_endpoints; i++) {
+        endpoint_t *e = service->endpoints[i];
+        log_msg(DEBUG, "Endpoint %d: %ld ms = %ld / %d, reported in flight %d, queued %d, service %ld us",
+                i, e->total_ms / e->num_reqs, e->total_ms, e->num_reqs,
+                e->remote_inflight, e->remote_queued, e->remote_service_us);
     }
-    log_msg(DEBUG, "Load balance to endpoint %s:%d with latency %ld ms (%ld / %d)",
-            endpoint->ip, endpoint->port, min_latency, endpoint->total_ms, endpoint->num_reqs);
+    log_msg(DEBUG, "Load balance to endpoint %s:%d with latency %ld us (%s)",
+            endpoint->ip, endpoint->port, min_latency, reported ? "reported" : "measured");
 
-    if (endpoint->conn_pool->outstanding >= LOAD_PROTECT_THRESHOLD) {
-        log_msg(DEBUG, "Endpoint %s:%d: outstanding - %d, latency - %ld ms (%ld / %d)",
-                endpoint->ip, endpoint->port, endpoint->conn_pool->outstanding,
+    if (endpoint_rank(endpoint) < 2) {
+        log_msg(DEBUG, "Endpoint %s:%d: in flight - %d, limit - %d, latency - %ld ms (%ld / %d)",
+                endpoint->ip, endpoint->port, endpoint_inflight(endpoint), endpoint->limit,
                 endpoint->total_ms / endpoint->num_reqs, endpoint->total_ms, endpoint->num_reqs);
-        return get_endpoint_least_loaded();
+        return get_endpoint_least_loaded(service);
     }
     return endpoint;
 }
 
-endpoint_t *get_endpoint_min_latency_prob() {
-    endpoint_t *endpoint = &endpoints[0];
+endpoint_t *get_endpoint_min_latency_prob(service_t *service) {
+    endpoint_t *endpoint = service->endpoints[0];
     if (request_counter++ % 100 == 0) {
         total_score = 0;
-        for (int i = 0; i < num_endpoints; i++) {
-            endpoint[i].score = (int) (1000000 / (endpoints[i].total_ms / endpoints[i].num_reqs));
-            total_score += endpoint[i].score;
+        for (int i = 0; i < service->num_endpoints; i++) {
+            service->endpoints[i]->score =
+                    (int) (1000000 / (service->endpoints[i]->total_ms / service->endpoints[i]->num_reqs));
+            total_score += service->endpoints[i]->score;
             log_msg(DEBUG, "Endpoint %d: latency - %ld ms (%ld / %d), score - %d", i,
-                    endpoints[i].total_ms / endpoints[i].num_reqs,
-                    endpoints[i].total_ms, endpoints[i].num_reqs, endpoint[i].score);
+                    service->endpoints[i]->total_ms / service->endpoints[i]->num_reqs,
+                    service->endpoints[i]->total_ms, service->endpoints[i]->num_reqs, service->endpoints[i]->score);
         }
     }
 
     int pointer = rand() % total_score;
     log_msg(DEBUG, "Generate random pointer %d with total score %d", pointer, total_score);
 
-    for (int i = 0; i < num_endpoints; i++) {
-        if (pointer < endpoint[i].score) {
-            endpoint = &endpoints[i];
+    for (int i = 0; i < service->num_endpoints; i++) {
+        if (pointer < service->endpoints[i]->score) {
+            endpoint = service->endpoints[i];
             break;
         }
-        pointer -= endpoint[i].score;
+        pointer -= service->endpoints[i]->score;
     }
     log_msg(DEBUG, "Load balance to endpoint %s:%d: latency - %ld ms (%ld / %d)",
             endpoint->ip, endpoint->port, endpoint->total_ms / endpoint->num_reqs,
             endpoint->total_ms, endpoint->num_reqs);
 
-    if (endpoint->conn_pool->outstanding >= LOAD_PROTECT_THRESHOLD) {
-        log_msg(DEBUG, "Endpoint %s:%d: outstanding - %d, latency - %ld ms (%ld / %d)",
-                endpoint->ip, endpoint->port, endpoint->conn_pool->outstanding,
+    if (endpoint_rank(endpoint) < 2) {
+        log_msg(DEBUG, "Endpoint %s:%d: in flight - %d, limit - %d, latency - %ld ms (%ld / %d)",
+                endpoint->ip, endpoint->port, endpoint_inflight(endpoint), endpoint->limit,
                 endpoint->total_ms / endpoint->num_reqs, endpoint->total_ms, endpoint->num_reqs);
-        return get_endpoint_least_loaded();
+        return get_endpoint_least_loaded(service);
     }
     return endpoint;
 }
@@ -255,21 +676,29 @@ bool _write_to_remote_agent(aeEventLoop *event_loop, int fd, void *privdata) {
         return true;
     }
 
-    ssize_t nwrite = write(fd, conn_ca->buf_in + conn_ca->nwrite_in,
-                           (size_t) (conn_ca->nread_in - conn_ca->nwrite_in));
+    const char *req = conn_ca->buf_in;
+    ssize_t len = conn_ca->nread_in;
+    if (UNLIKELY(conn_ca->dubbo)) {
+        req = conn_ca->buf_req;
+        len = conn_ca->len_req;
+    }
+    ssize_t nwrite = write(fd, req + conn_ca->nwrite_in, (size_t) (len - conn_ca->nwrite_in));
 
     if (LIKELY(nwrite >= 0)) {
         log_msg(DEBUG, "Write %d bytes to remote agent for socket %d", nwrite, fd);
         conn_ca->nwrite_in += nwrite;
-        if (LIKELY(conn_ca->nwrite_in == conn_ca->nread_in)) {
+        if (LIKELY(conn_ca->nwrite_in == len)) {
             // Done writing
             aeDeleteFileEvent(event_loop, fd, AE_WRITABLE);
 
-#ifdef LATENCY_AWARE
             // Record request start
-            connection_apa_t *conn_apa = conn_ca->conn_apa;
-            conn_apa->req_start = get_current_time_ms();
-#endif
+            conn_ca->conn_apa->req_start_us = get_current_time_us();
+            if (UNLIKELY(conn_ca->span.trace_id != 0)) {
+                conn_ca->span.upstream_write_us = conn_ca->conn_apa->req_start_us;
+            }
+            if (hedge_percentile > 0) {
+                track_hedge_candidate(event_loop, conn_ca);
+            }
         } else {
             log_msg(WARN, "Partial write for socket %d", fd);
         }
@@ -283,6 +712,7 @@ bool _write_to_remote_agent(aeEventLoop *event_loop, int fd, void *privdata) {
             return true;
         }
         log_msg(ERR, "Failed to write to remote agent: %s", strerror(errno));
+        record_failure(conn_ca->conn_apa->endpoint);
         abort_connection_ca(event_loop, conn_ca);
     }
     return true;
@@ -298,9 +728,42 @@ void read_from_remote_agent(aeEventLoop *event_loop, int fd, void *privdata, int
 
     ssize_t nread = read(fd, conn_ca->buf_out + conn_ca->nread_out,
                          sizeof(conn_ca->buf_out) - conn_ca->nread_out);
+    take_remote_agent_read(event_loop, fd, conn_ca, nread);
+}
 
+/*
+ * Handles 'nread' bytes put at the end of buf_out, or the error of the read, by a read of the
+ * remote agent or otherwise, see take_shm_response() and read_hedge_from_remote_agent().
+ */
+void take_remote_agent_read(aeEventLoop *event_loop, int fd, connection_ca_t *conn_ca, ssize_t nread) {
     if (LIKELY(nread > 0)) {
         log_msg(DEBUG, "Read %d bytes from remote agent for socket %d", nread, fd);
+        if (UNLIKELY(conn_ca->span.trace_id != 0) && conn_ca->span.upstream_first_byte_us == 0) {
+            conn_ca->span.upstream_first_byte_us = get_current_time_us();
+        }
+        if (UNLIKELY(conn_ca->dubbo)) {
+            // Taken on as a single read of the HTTP response it is decoded to
+            conn_ca->nread_out += nread;
+            nread = decode_response(conn_ca);
+            if (nread == 0) {
+                return;
+            }
+            if (UNLIKELY(nread < 0)) {
+                record_failure(conn_ca->conn_apa->endpoint);
+                abort_connection_ca(event_loop, conn_ca);
+                return;
+            }
+            conn_ca->nread_out = 0;
+        }
+        if (UNLIKELY(conn_ca->hedge_endpoint != NULL)) {
+            untrack_hedge_candidate(conn_ca);
+        }
+        if (UNLIKELY(conn_ca->conn_hedge != NULL)) {
+            // Answered first, the duplicate is ignored
+            cancel_hedge(event_loop, conn_ca->conn_hedge);
+            conn_ca->conn_hedge = NULL;
+        }
+        bool first_read = conn_ca->nread_out == 0;
         conn_ca->nread_out += nread;
 
         // Reset buf_in pointers
@@ -315,12 +778,33 @@ void read_from_remote_agent(aeEventLoop *event_loop, int fd, void *privdata, int
             }
 //        }
 
-#ifdef LATENCY_AWARE
         connection_apa_t *conn_apa = conn_ca->conn_apa;
+        long rtt_us = get_current_time_us() - conn_apa->req_start_us;
+#ifdef LATENCY_AWARE
         conn_apa->endpoint->num_reqs++;
-//        conn_apa->endpoint->total_ms += (get_current_time_ms() - conn_apa->req_start) - 10;
-        conn_apa->endpoint->total_ms += (get_current_time_ms() - conn_apa->req_start);
+//        conn_apa->endpoint->total_ms += rtt_us / 1000 - 10;
+        conn_apa->endpoint->total_ms += rtt_us / 1000;
 #endif
+        if (LIKELY(first_read)) {
+            // Status line "HTTP/1.1 200 OK"
+            if (LIKELY(conn_ca->nread_out < 10 || conn_ca->buf_out[9] == '2')) {
+                record_success(conn_apa->endpoint, rtt_us);
+                parse_load(conn_apa->endpoint, conn_ca->buf_out, conn_ca->nread_out);
+            } else {
+                record_failure(conn_apa->endpoint);
+            }
+            conn_ca->nread_out -= strip_load(conn_ca->buf_out, conn_ca->nread_out);
+        }
+        // Request bytes are still in buf_in until the consumer sends the next one
+        if (UNLIKELY(conn_ca->keyed) && cache_response_complete(conn_ca->buf_out, (size_t) conn_ca->nread_out)) {
+            if (cache_enabled()) {
+                cache_put(&conn_ca->cache_key, conn_ca->buf_out, (size_t) conn_ca->nread_out);
+            }
+            if (conn_ca->leading) {
+                share_response(event_loop, conn_ca);
+            }
+            conn_ca->keyed = false;
+        }
 
     } else if (UNLIKELY(nread < 0)) {
         if (errno == EAGAIN) {
@@ -328,11 +812,13 @@ void read_from_remote_agent(aeEventLoop *event_loop, int fd, void *privdata, int
             return;
         }
         log_msg(ERR, "Failed to read from remote agent: %s", strerror(errno));
+        record_failure(conn_ca->conn_apa->endpoint);
         abort_connection_ca(event_loop, conn_ca);
 
     } else {
         log_msg(ERR, "Remote agent from %s:%d closed connection for socket %d",
                 conn_ca->conn_apa->endpoint->ip, conn_ca->conn_apa->endpoint->port, fd);
+        record_failure(conn_ca->conn_apa->endpoint);
         abort_connection_ca(event_loop, conn_ca);
     }
 }
@@ -360,16 +846,28 @@ bool _write_to_consumer(aeEventLoop *event_loop, int fd, void *privdata) {
             // Done writing
             aeDeleteFileEvent(event_loop, fd, AE_WRITABLE);
 
-            // Release current connection to remote agent
+            // Release current connection to remote agent, none if answered from cache
             connection_apa_t *conn_apa = conn_ca->conn_apa;
             if (LIKELY(conn_apa != NULL)) {
-                aeDeleteFileEvent(event_loop, conn_apa->fd, AE_WRITABLE | AE_READABLE);
-                PoolReturn(conn_apa->endpoint->conn_pool, conn_apa);
+                if (conn_apa->fd >= 0) {
+                    aeDeleteFileEvent(event_loop, conn_apa->fd, AE_WRITABLE | AE_READABLE);
+                }
                 conn_ca->conn_apa = NULL;
                 log_msg(DEBUG, "Release connection to remote agent %s:%d for socket %d",
                         conn_apa->endpoint->ip, conn_apa->endpoint->port, conn_apa->fd);
-            } else {
-                log_msg(ERR, "No connection to remote agent to release for socket %d", fd);
+                release_connection_apa(event_loop, conn_apa);
+            }
+            if (UNLIKELY(conn_ca->span.trace_id != 0)) {
+                trace_finish(&conn_ca->span);
+            }
+            if (UNLIKELY(conn_ca->leading)) {
+                release_followers(event_loop, conn_ca);
+            }
+
+            if (UNLIKELY(draining)) {
+                // Let the new agent serve further requests on this connection
+                handoff_pass_client(fd);
+                close_connection_ca(event_loop, conn_ca);
             }
         }
     } else {
@@ -386,96 +884,2022 @@ bool _write_to_consumer(aeEventLoop *event_loop, int fd, void *privdata) {
     return true;
 }
 
-void discover_etcd_services() {
-    long long modifiedIndex = 0;
-    int ret = etcd_get_directory("/dubbomesh/com.alibaba.dubbo.performance.demo.provider.IHelloService/",
-                                 on_etcd_service_endpoint, NULL, &modifiedIndex);
-    if (UNLIKELY(ret != 0)) {
-        log_msg(ERR, "Failed to do etcd_get_directory: %d", ret);
-        exit(-1);
+/*
+ * Splice mode: same request/response lockstep as the copy path above, but bytes
+ * go socket -> pipe -> socket inside the kernel. Only the headers of a response
+ * are read into buf_out, for its Content-Length, and its body of any size is
+ * spliced after them. A pipe is taken from pool together with the connection to
+ * remote agent, and both are released once the whole response has been drained
+ * to consumer.
+ */
+void splice_from_consumer(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    connection_ca_t *conn_ca = privdata;
+    if (UNLIKELY(conn_ca->fd < 0)) {
+        log_msg(WARN, "Connection closed for socket %d, ignore splice_from_consumer", fd);
+        aeDeleteFileEvent(event_loop, fd, AE_WRITABLE | AE_READABLE);
+        return;
     }
-    log_msg(INFO, "Discovered total %d service endpoints", num_endpoints);
-}
 
-void on_etcd_service_endpoint(const char *key, const char *value, void *arg) {
-    log_msg(INFO, "Got etcd service: %s", key);
-    char *ip_and_port = strrchr(key, '/') + 1;
-    char *port = strdup(strrchr(key, ':') + 1);
-    char *ip = strndup(ip_and_port, strlen(ip_and_port) - strlen(port) - 1);
+    connection_apa_t *conn_apa = conn_ca->conn_apa;
+    if (LIKELY(conn_apa == NULL)) {
+        if (UNLIKELY(consumers_throttled)) {
+            throttle_consumer(event_loop, conn_ca);
+            return;
+        }
+        if (UNLIKELY(num_services > 1)) {
+            // Request bytes are only peeked at here, they still go to remote agent by splice.
+            // An interface not in yet is peeked at again as the socket stays readable.
+            ssize_t npeek = recv(fd, conn_ca->buf_in, sizeof(conn_ca->buf_in), MSG_PEEK);
+            if (UNLIKELY(npeek <= 0)) {
+                if (npeek == 0) {
+                    close_connection_ca(event_loop, conn_ca);
+                } else if (errno != EAGAIN) {
+                    log_msg(ERR, "Failed to peek from consumer: %s", strerror(errno));
+                    abort_connection_ca(event_loop, conn_ca);
+                }
+                return;
+            }
+            if (!route_connection_ca(event_loop, conn_ca, conn_ca->buf_in, (size_t) npeek)) {
+                return;
+            }
+        }
+        service_t *service = conn_ca->service;
+        endpoint_t *endpoint = get_endpoint_min_latency(service);
+        conn_apa = acquire_connection_apa(endpoint);
+        if (UNLIKELY(conn_apa == NULL)) {
+            // Nothing read yet, request stays in socket buffer until a connection is released
+            park_connection_ca(event_loop, endpoint, conn_ca);
+            return;
+        }
+        conn_ca->conn_apa = conn_apa;
 
-    endpoints[num_endpoints].ip = ip;
-    endpoints[num_endpoints].port = atoi(port);
+        conn_ca->pipe = PoolGet(splice_pipe_pool);
+        if (UNLIKELY(conn_ca->pipe == NULL)) {
+            log_msg(ERR, "No splice pipe available for socket %d", fd);
+            abort_connection_ca(event_loop, conn_ca);
+            return;
+        }
+        log_msg(DEBUG, "Pick up connection to %s:%d with socket %d",
+                conn_apa->endpoint->ip, conn_apa->endpoint->port, conn_apa->fd);
+
+    } else if (UNLIKELY(conn_ca->nread_out > 0)) {
+        // Response is occupying the pipe, hold consumer input until it's drained
+        log_msg(DEBUG, "Pause reading from consumer for socket %d", fd);
+        aeDeleteFileEvent(event_loop, fd, AE_READABLE);
+        conn_ca->reads_paused = true;
+        return;
+    }
 
-#ifdef LATENCY_AWARE
-    // Set up initial latency stats to avoid zero case
-    endpoints[num_endpoints].total_ms = 1;
-    endpoints[num_endpoints].num_reqs = 1;
-    endpoints[num_endpoints].score = 0;
-#endif
+    splice_pipe_t *sp = conn_ca->pipe;
+    ssize_t nread = splice(fd, NULL, sp->fd_w, NULL, CONSUMER_SPLICE_CHUNK_SIZE,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
 
-    // Set up connection pool to this endpoint
-    endpoints[num_endpoints].conn_pool = PoolInit(
-            NUM_CONN_PER_PROVIDER, NUM_CONN_PER_PROVIDER, sizeof(connection_apa_t),
-            NULL, init_connection_apa, &endpoints[num_endpoints], cleanup_connection_apa, NULL
-    );
-    PoolPrintSaturation(endpoints[num_endpoints].conn_pool);
-    num_endpoints++;
-}
+    if (LIKELY(nread > 0)) {
+        log_msg(DEBUG, "Splice %d bytes from consumer for socket %d", nread, fd);
+        sp->npipe += nread;
+        conn_ca->nread_in += nread;
 
-int init_connection_apa(void *elem, void *data) {
-    endpoint_t *endpoint = data;
-    connection_apa_t *conn_apa = elem;
-    memset(conn_apa, 0, sizeof(connection_apa_t));
-    conn_apa->endpoint = endpoint;
+        if (UNLIKELY(aeCreateFileEvent(event_loop, conn_apa->fd, AE_WRITABLE, splice_to_remote_agent, conn_ca) ==
+                     AE_ERR)) {
+            log_msg(ERR, "Failed to create writable event for splice_to_remote_agent: %s", strerror(errno));
+            abort_connection_ca(event_loop, conn_ca);
+            return;
+        }
+        if (UNLIKELY(aeCreateFileEvent(event_loop, conn_apa->fd, AE_READABLE, splice_from_remote_agent, conn_ca) ==
+                     AE_ERR)) {
+            log_msg(ERR, "Failed to create readable event for splice_from_remote_agent: %s", strerror(errno));
+            abort_connection_ca(event_loop, conn_ca);
+        }
 
-    int fd;
-    do {
-        fd = anetTcpConnect(neterr, endpoint->ip, endpoint->port);
-        if (fd < 0) {
-            log_msg(WARN, "Failed to connect to remote agent %s:%d - %s, Sleep 1 seconds to retry later",
-                    endpoint->ip, endpoint->port, neterr);
-            sleep(1);
-        } else {
-            anetNonBlock(NULL, fd);
-            anetEnableTcpNoDelay(NULL, fd);
-            conn_apa->fd = fd;
-            log_msg(DEBUG, "Build connection to remote agent %s:%d with socket %d", endpoint->ip, endpoint->port, fd);
+    } else if (UNLIKELY(nread < 0)) {
+        if (errno == EAGAIN) {
+            log_msg(WARN, "Got EAGAIN on splice_from_consumer: %s", strerror(errno));
+            return;
         }
-    } while (fd < 0);
+        log_msg(ERR, "Failed to splice from consumer: %s", strerror(errno));
+        abort_connection_ca(event_loop, conn_ca);
 
-    return 1;
-}
+    } else if (conn_ca->nread_in > 0) {
+        // Closed in the middle of a request, the remote agent connection is dirty
+        abort_connection_ca(event_loop, conn_ca);
 
-void cleanup_connection_apa(void *elem) {
-    log_msg(INFO, "Cleanup connection to remote agent");
-    connection_apa_t *conn_apa = elem;
-    if (conn_apa->fd > 0) {
-        log_msg(WARN, "Abort connection to provider agent with socket: %d", conn_apa->fd);
-        close(conn_apa->fd);
-        conn_apa->fd = -1;
+    } else {
+        release_splice_pipe(conn_ca);
+        if (conn_apa != NULL) {
+            conn_ca->conn_apa = NULL;
+            release_connection_apa(event_loop, conn_apa);
+        }
+        close_connection_ca(event_loop, conn_ca);
     }
 }
 
-void abort_connection_ca(aeEventLoop *event_loop, connection_ca_t *conn_ca) {
-    // Dump data
-    log_msg(WARN, "Conn ca: nread_in - %d, nwrite_in - %d, nread_out - %d, nwrite_out - %d",
-            conn_ca->nread_in, conn_ca->nwrite_in, conn_ca->nread_out, conn_ca->nwrite_out);
-//    log_msg(WARN, "Conn ca data: buf_in - %.*s, buf_out - %.*s",
-//            conn_ca->nread_in, conn_ca->buf_in, conn_ca->nread_out, conn_ca->buf_out);
+void splice_to_remote_agent(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    connection_ca_t *conn_ca = privdata;
+    if (UNLIKELY(conn_ca->fd < 0)) {
+        log_msg(WARN, "Connection closed for socket %d, ignore splice_to_remote_agent", fd);
+        return;
+    }
 
-    log_msg(ERR, "Abort connection to consumer with socket: %d", conn_ca->fd);
-    aeDeleteFileEvent(event_loop, conn_ca->fd, AE_WRITABLE | AE_READABLE);
-    close(conn_ca->fd);
-    conn_ca->fd = -1;
+    splice_pipe_t *sp = conn_ca->pipe;
+    ssize_t nwrite = splice(sp->fd_r, NULL, fd, NULL, (size_t) sp->npipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if (LIKELY(nwrite >= 0)) {
+        log_msg(DEBUG, "Splice %d bytes to remote agent for socket %d", nwrite, fd);
+        sp->npipe -= nwrite;
+        conn_ca->nwrite_in += nwrite;
+        if (LIKELY(sp->npipe == 0)) {
+            // Done writing
+            aeDeleteFileEvent(event_loop, fd, AE_WRITABLE);
+
+            conn_ca->conn_apa->req_start_us = get_current_time_us();
+        } else {
+            log_msg(WARN, "Partial splice for socket %d", fd);
+        }
+    } else {
+        if (errno == EAGAIN) {
+            log_msg(WARN, "Got EAGAIN on splice_to_remote_agent: %s", strerror(errno));
+            return;
+        }
+        log_msg(ERR, "Failed to splice to remote agent: %s", strerror(errno));
+        record_failure(conn_ca->conn_apa->endpoint);
+        abort_connection_ca(event_loop, conn_ca);
+    }
+}
+
+void splice_from_remote_agent(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    connection_ca_t *conn_ca = privdata;
+    if (UNLIKELY(conn_ca->fd < 0)) {
+        log_msg(WARN, "Connection closed for socket %d, ignore splice_from_remote_agent", fd);
+        aeDeleteFileEvent(event_loop, fd, AE_WRITABLE | AE_READABLE);
+        return;
+    }
 
     connection_apa_t *conn_apa = conn_ca->conn_apa;
-    if (conn_apa != NULL) {
-        log_msg(ERR, "Abort connection to provider agent with socket: %d", conn_apa->fd);
-        aeDeleteFileEvent(event_loop, conn_apa->fd, AE_WRITABLE | AE_READABLE);
-        close(conn_apa->fd);
-        conn_apa->fd = -1;
-//    PoolReturn(conn_apa->endpoint->pool, conn_apa);
+    splice_pipe_t *sp = conn_ca->pipe;
+    bool first_read = conn_ca->nread_out == 0;
+    ssize_t nread;
+    if (conn_ca->len_out == 0) {
+        // Headers are read for the length of the response, the rest of it is spliced
+        nread = read(fd, conn_ca->buf_out + conn_ca->nread_out,
+                     sizeof(conn_ca->buf_out) - conn_ca->nread_out);
+        if (LIKELY(nread > 0)) {
+            conn_ca->nread_out += nread;
+            if (LIKELY(first_read)) {
+                parse_load(conn_apa->endpoint, conn_ca->buf_out, conn_ca->nread_out);
+                conn_ca->nread_out -= strip_load(conn_ca->buf_out, conn_ca->nread_out);
+            }
+            ssize_t len = http_message_length(conn_ca->buf_out, (size_t) conn_ca->nread_out);
+            if (UNLIKELY(len < conn_ca->nread_out &&
+                         (len != 0 || conn_ca->nread_out == sizeof(conn_ca->buf_out)))) {
+                log_msg(ERR, "Bad response from remote agent %s:%d for socket %d",
+                        conn_apa->endpoint->ip, conn_apa->endpoint->port, conn_ca->fd);
+                record_failure(conn_apa->endpoint);
+                abort_connection_ca(event_loop, conn_ca);
+                return;
+            }
+            conn_ca->len_out = len;
+        }
+    } else {
+        size_t left = (size_t) (conn_ca->len_out - conn_ca->nread_out - conn_ca->nsplice_out);
+        nread = splice(fd, NULL, sp->fd_w, NULL, left < CONSUMER_SPLICE_CHUNK_SIZE ? left : CONSUMER_SPLICE_CHUNK_SIZE,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (LIKELY(nread > 0)) {
+            sp->npipe += nread;
+            conn_ca->nsplice_out += nread;
+        }
+    }
+
+    if (LIKELY(nread > 0)) {
+        log_msg(DEBUG, "Take %d bytes from remote agent for socket %d", nread, fd);
+        if (conn_ca->len_out > 0 && conn_ca->nread_out + conn_ca->nsplice_out == conn_ca->len_out) {
+            // Whole response is in, nothing else is read until the next request
+            aeDeleteFileEvent(event_loop, fd, AE_READABLE);
+        }
+
+        // Reset request counters
+        conn_ca->nread_in = 0;
+        conn_ca->nwrite_in = 0;
+
+        if (aeCreateFileEvent(event_loop, conn_ca->fd, AE_WRITABLE, splice_to_consumer, conn_ca) == AE_ERR) {
+            log_msg(ERR, "Failed to create writable event for splice_to_consumer: %s", strerror(errno));
+            abort_connection_ca(event_loop, conn_ca);
+            return;
+        }
+
+        long rtt_us = get_current_time_us() - conn_apa->req_start_us;
+#ifdef LATENCY_AWARE
+        conn_apa->endpoint->num_reqs++;
+        conn_apa->endpoint->total_ms += rtt_us / 1000;
+#endif
+        if (LIKELY(first_read)) {
+            // Response body stays in the kernel, only transport failures are seen here
+            record_success(conn_apa->endpoint, rtt_us);
+        }
+
+    } else if (UNLIKELY(nread < 0)) {
+        if (errno == EAGAIN) {
+            if (sp->npipe > 0) {
+                // Pipe may be full, read on once splice_to_consumer() drained it
+                aeDeleteFileEvent(event_loop, fd, AE_READABLE);
+                return;
+            }
+            log_msg(WARN, "Got EAGAIN on splice_from_remote_agent: %s", strerror(errno));
+            return;
+        }
+        log_msg(ERR, "Failed to splice from remote agent: %s", strerror(errno));
+        record_failure(conn_apa->endpoint);
+        abort_connection_ca(event_loop, conn_ca);
+
+    } else {
+        log_msg(ERR, "Remote agent from %s:%d closed connection for socket %d",
+                conn_apa->endpoint->ip, conn_apa->endpoint->port, fd);
+        record_failure(conn_apa->endpoint);
+        abort_connection_ca(event_loop, conn_ca);
+    }
+}
+
+void splice_to_consumer(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    connection_ca_t *conn_ca = privdata;
+    if (UNLIKELY(conn_ca->fd < 0)) {
+        log_msg(WARN, "Connection closed for socket %d, ignore splice_to_consumer", fd);
+        aeDeleteFileEvent(event_loop, fd, AE_WRITABLE | AE_READABLE);
+        return;
+    }
+
+    // Bytes read with the headers go first, then the ones in the pipe
+    splice_pipe_t *sp = conn_ca->pipe;
+    ssize_t nwrite;
+    if (conn_ca->nwrite_out < conn_ca->nread_out) {
+        nwrite = write(fd, conn_ca->buf_out + conn_ca->nwrite_out, (size_t) (conn_ca->nread_out - conn_ca->nwrite_out));
+        if (LIKELY(nwrite >= 0)) {
+            conn_ca->nwrite_out += nwrite;
+        }
+    } else {
+        nwrite = splice(sp->fd_r, NULL, fd, NULL, (size_t) sp->npipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (LIKELY(nwrite >= 0)) {
+            sp->npipe -= nwrite;
+        }
+    }
+
+    if (LIKELY(nwrite >= 0)) {
+        log_msg(DEBUG, "Splice %d bytes to consumer for socket %d", nwrite, fd);
+        if (conn_ca->nwrite_out < conn_ca->nread_out || sp->npipe > 0) {
+            return;
+        }
+        aeDeleteFileEvent(event_loop, fd, AE_WRITABLE);
+        connection_apa_t *conn_apa = conn_ca->conn_apa;
+        if (conn_ca->len_out == 0 || conn_ca->nread_out + conn_ca->nsplice_out < conn_ca->len_out) {
+            // Rest of the response is still to come
+            if (aeCreateFileEvent(event_loop, conn_apa->fd, AE_READABLE, splice_from_remote_agent, conn_ca) == AE_ERR) {
+                log_msg(ERR, "Failed to resume readable event for splice_from_remote_agent: %s", strerror(errno));
+                abort_connection_ca(event_loop, conn_ca);
+            }
+            return;
+        }
+
+        // Done writing
+        conn_ca->nread_out = 0;
+        conn_ca->nwrite_out = 0;
+        conn_ca->len_out = 0;
+        conn_ca->nsplice_out = 0;
+
+        // Release current connection to remote agent together with the pipe
+        aeDeleteFileEvent(event_loop, conn_apa->fd, AE_WRITABLE | AE_READABLE);
+        conn_ca->conn_apa = NULL;
+        release_splice_pipe(conn_ca);
+        release_connection_apa(event_loop, conn_apa);
+
+        if (UNLIKELY(draining)) {
+            // Let the new agent serve further requests on this connection
+            handoff_pass_client(fd);
+            close_connection_ca(event_loop, conn_ca);
+            return;
+        }
+        if (UNLIKELY(conn_ca->reads_paused)) {
+            conn_ca->reads_paused = false;
+            if (aeCreateFileEvent(event_loop, fd, AE_READABLE, splice_from_consumer, conn_ca) == AE_ERR) {
+                log_msg(ERR, "Failed to resume readable event for splice_from_consumer: %s", strerror(errno));
+                abort_connection_ca(event_loop, conn_ca);
+            }
+        }
+    } else {
+        if (errno == EAGAIN) {
+            log_msg(WARN, "Got EAGAIN on splice_to_consumer: %s", strerror(errno));
+            return;
+        }
+        log_msg(ERR, "Failed to splice to consumer: %s", strerror(errno));
+        abort_connection_ca(event_loop, conn_ca);
+    }
+}
+
+int init_splice_pipe(void *elem, void *data) {
+    splice_pipe_t *sp = elem;
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK) == -1) {
+        log_msg(ERR, "Failed to create splice pipe: %s", strerror(errno));
+        return 0;
+    }
+    sp->fd_r = fds[0];
+    sp->fd_w = fds[1];
+    sp->npipe = 0;
+    return 1;
+}
+
+void cleanup_splice_pipe(void *elem) {
+    splice_pipe_t *sp = elem;
+    close(sp->fd_r);
+    close(sp->fd_w);
+}
+
+void release_splice_pipe(connection_ca_t *conn_ca) {
+    splice_pipe_t *sp = conn_ca->pipe;
+    if (sp == NULL) {
+        return;
+    }
+    if (UNLIKELY(sp->npipe > 0)) {
+        // Left over bytes can't be discarded cheaply, just replace the pipe
+        cleanup_splice_pipe(sp);
+        if (init_splice_pipe(sp, NULL) != 1) {
+            sp->fd_r = sp->fd_w = -1;
+        }
+    }
+    PoolReturn(splice_pipe_pool, sp);
+    conn_ca->pipe = NULL;
+}
+
+void discover_etcd_services() {
+    long long modifiedIndex = 0;
+    int ret = etcd_get_directory("/dubbomesh/", on_etcd_service_endpoint, NULL, &modifiedIndex);
+    if (UNLIKELY(ret != 0)) {
+        log_msg(ERR, "Failed to do etcd_get_directory: %d", ret);
+        exit(-1);
+    }
+    for (int i = 0; i < num_services; i++) {
+        log_msg(INFO, "Service %s on %d endpoints", services[i].name, services[i].num_endpoints);
+    }
+    log_msg(INFO, "Discovered total %d services on %d endpoints", num_services, num_endpoints);
+    if (going_direct) {
+        bypass_remote_agents();
+    }
+    if (num_services > 1 && route_build(service_names, num_services) != 0) {
+        log_msg(FATAL, "Failed to build routing index");
+        exit(EXIT_FAILURE);
+    }
+    size_endpoints();
+}
+
+/*
+ * Point endpoints that advertise the port of their provider to it, so requests skip the hop
+ * through the remote agent. Balancing, limits and health checks stay the same, only against
+ * the provider. Endpoints of older agents are still called through them.
+ */
+void bypass_remote_agents() {
+    for (int i = 0; i < num_endpoints; i++) {
+        endpoint_t *endpoint = &endpoints[i];
+        if (endpoint->dubbo_port <= 0) {
+            log_msg(WARN, "Remote agent %s:%d does not advertise its provider, call through it",
+                    endpoint->ip, endpoint->port);
+            continue;
+        }
+        log_msg(INFO, "Bypass remote agent %s:%d, call its provider at port %d",
+                endpoint->ip, endpoint->port, endpoint->dubbo_port);
+        endpoint->port = endpoint->dubbo_port;
+        endpoint->direct = true;
+    }
+}
+
+static service_t *add_service(const char *name, size_t name_len) {
+    for (int i = 0; i < num_services; i++) {
+        if (strlen(services[i].name) == name_len && memcmp(services[i].name, name, name_len) == 0) {
+            return &services[i];
+        }
+    }
+    if (UNLIKELY(num_services == ROUTE_MAX_SERVICES)) {
+        return NULL;
+    }
+    service_t *service = &services[num_services];
+    service->name = strndup(name, name_len);
+    service->serialization = DUBBO_SERIALIZATION_FASTJSON;
+    service_names[num_services++] = service->name;
+    return service;
+}
+
+/*
+ * Keys are "/dubbomesh/<interface>/<ip>:<port>", an agent registers each service it serves.
+ */
+void on_etcd_service_endpoint(const char *key, const char *value, void *arg) {
+    log_msg(INFO, "Got etcd service: %s", key);
+    char *ip_and_port = strrchr(key, '/') + 1;
+    const char *name = ip_and_port - 1;
+    while (name > key && name[-1] != '/') {
+        name--;
+    }
+    service_t *service = add_service(name, (size_t) (ip_and_port - 1 - name));
+    if (UNLIKELY(service == NULL)) {
+        log_msg(ERR, "Too many services, ignore %s", key);
+        return;
+    }
+    if (strstr(value, "serialization=hessian2") != NULL) {
+        service->serialization = DUBBO_SERIALIZATION_HESSIAN2;
+    }
+    char *port = strrchr(key, ':') + 1;
+    size_t ip_len = strlen(ip_and_port) - strlen(port) - 1;
+
+    for (int i = 0; i < num_endpoints; i++) {
+        if (endpoints[i].port == atoi(port) && strlen(endpoints[i].ip) == ip_len &&
+            strncmp(endpoints[i].ip, ip_and_port, ip_len) == 0) {
+            // Already known from another of its services
+            service->endpoints[service->num_endpoints++] = &endpoints[i];
+            return;
+        }
+    }
+    if (UNLIKELY(num_endpoints == MAX_ENDPOINTS)) {
+        log_msg(ERR, "Too many endpoints, ignore %s", key);
+        return;
+    }
+
+    endpoint_t *endpoint = &endpoints[num_endpoints];
+    endpoint->ip = strndup(ip_and_port, ip_len);
+    endpoint->port = atoi(port);
+    service->endpoints[service->num_endpoints++] = endpoint;
+
+    // "weight=3,cores=4,max_concurrency=512,service_rate=6000,serialization=hessian2,relay=1,dubbo_port=20880,shm=1",
+    // empty from older agents
+    for (const char *field = value; field != NULL && *field != '\0'; field = strchr(field, ',')) {
+        if (*field == ',') {
+            field++;
+        }
+        sscanf(field, "weight=%d", &endpoint->weight);
+        sscanf(field, "cores=%d", &endpoint->cores);
+        sscanf(field, "max_concurrency=%d", &endpoint->max_concurrency);
+        sscanf(field, "service_rate=%d", &endpoint->service_rate);
+        sscanf(field, "dubbo_port=%d", &endpoint->dubbo_port);
+        if (strncmp(field, "relay=1", 7) == 0) {
+            endpoint->relay = true;
+        }
+        if (strncmp(field, "shm=1", 5) == 0) {
+            endpoint->shm = true;
+        }
+    }
+
+#ifdef LATENCY_AWARE
+    // Set up initial latency stats to avoid zero case
+    endpoint->total_ms = 1;
+    endpoint->num_reqs = 1;
+    endpoint->score = 0;
+#endif
+    num_endpoints++;
+}
+
+/*
+ * Seed pool sizes and concurrency limits from the capacity endpoints registered, so the bigger
+ * ones take their share from the first request instead of after the limiter has measured them.
+ * Measured service rates are compared if every endpoint has one, weights otherwise.
+ */
+void size_endpoints() {
+    bool rated = true;
+    int max_capacity = 0;
+    for (int i = 0; i < num_endpoints; i++) {
+        rated = rated && endpoints[i].service_rate > 0;
+    }
+    for (int i = 0; i < num_endpoints; i++) {
+        int capacity = rated ? endpoints[i].service_rate : endpoints[i].weight;
+        if (max_capacity < capacity) {
+            max_capacity = capacity;
+        }
+    }
+
+    for (int i = 0; i < num_endpoints; i++) {
+        endpoint_t *endpoint = &endpoints[i];
+        int capacity = rated ? endpoint->service_rate : endpoint->weight;
+        if (max_capacity == 0) {
+            // Nothing registered, all alike
+            capacity = max_capacity = 1;
+        } else if (capacity == 0) {
+            capacity = 1;
+        }
+        endpoint->pool_size = (int) ((long) NUM_CONN_PER_PROVIDER * capacity / max_capacity);
+        if (endpoint->max_concurrency > 0 && endpoint->pool_size > endpoint->max_concurrency) {
+            endpoint->pool_size = endpoint->max_concurrency;
+        }
+        if (endpoint->pool_size < MIN_CONN_PER_PROVIDER) {
+            endpoint->pool_size = MIN_CONN_PER_PROVIDER;
+        }
+        endpoint->limit = LIMIT_INITIAL * capacity / max_capacity;
+        if (endpoint->limit < LIMIT_MIN) {
+            endpoint->limit = LIMIT_MIN;
+        }
+        log_msg(INFO, "Endpoint %s:%d: weight %d, %d cores, max concurrency %d, service rate %d/s - "
+                      "pool of %d connections, initial limit %d", endpoint->ip, endpoint->port, endpoint->weight,
+                endpoint->cores, endpoint->max_concurrency, endpoint->service_rate, endpoint->pool_size,
+                endpoint->limit);
+
+        // Set up connection pool to this endpoint, after a handoff only the inherited connections
+        // are preallocated and the ones still busy in the old agent arrive as it drains
+        int prealloc = handoff_count_upstream(endpoint->ip, endpoint->port);
+        if (prealloc == 0 || prealloc > endpoint->pool_size) {
+            prealloc = endpoint->pool_size;
+        }
+        endpoint->conn_pool = PoolInit(endpoint->pool_size, prealloc, sizeof(connection_apa_t),
+                                       NULL, init_connection_apa, endpoint, cleanup_connection_apa, NULL);
+        PoolPrintSaturation(endpoint->conn_pool);
+    }
+}
+
+/*
+ * Route a new request to the service of its interface, only done with more than one service.
+ * Returns false if more of the request has to be read to tell, or if the connection was aborted
+ * for a request of no known service.
+ */
+bool route_connection_ca(aeEventLoop *event_loop, connection_ca_t *conn_ca, const char *req, size_t len) {
+    int i = route_request(req, len);
+    if (LIKELY(i >= 0)) {
+        conn_ca->service = &services[i];
+        return true;
+    }
+    if (i == ROUTE_INCOMPLETE && len < sizeof(conn_ca->buf_in)) {
+        return false;
+    }
+    log_msg(WARN, "No service for request from socket %d", conn_ca->fd);
+    abort_connection_ca(event_loop, conn_ca);
+    return false;
+}
+
+int init_connection_apa(void *elem, void *data) {
+    endpoint_t *endpoint = data;
+    connection_apa_t *conn_apa = elem;
+    memset(conn_apa, 0, sizeof(connection_apa_t));
+    conn_apa->endpoint = endpoint;
+    conn_apa->fd = -1;
+
+    int fd = handoff_take_upstream(endpoint->ip, endpoint->port);
+    if (fd >= 0) {
+        conn_apa->fd = fd;
+        endpoint->num_live++;
+        log_msg(DEBUG, "Inherit connection to remote agent %s:%d with socket %d", endpoint->ip, endpoint->port, fd);
+        return 1;
+    }
+    // Never connect in the request path, pools only grow there with connections handed off late
+    return growing_pools ? 1 : 0;
+}
+
+/*
+ * Take the connection objects without connection out of pool and connect them in parallel.
+ * Each one goes back to pool once connected, so the endpoint takes requests as soon as it
+ * has any connection. Until then it looks fully loaded to the balancer.
+ */
+void warm_up_endpoint(aeEventLoop *event_loop, endpoint_t *endpoint) {
+    endpoint->reconnect_list = NULL;
+    endpoint->retry_timer = -1;
+    endpoint->backoff_ms = CONNECT_BACKOFF_MIN_MS;
+    if (endpoint->shm) {
+        attach_shm_channel(event_loop, endpoint);
+    }
+
+    connection_apa_t *taken = NULL;
+    for (uint32_t n = endpoint->conn_pool->alloc_stack_size; n > 0; n--) {
+        connection_apa_t *conn_apa = PoolGet(endpoint->conn_pool);
+        conn_apa->next = taken;
+        taken = conn_apa;
+    }
+
+    int num_connecting = 0;
+    while (taken != NULL) {
+        connection_apa_t *conn_apa = taken;
+        taken = conn_apa->next;
+        if (conn_apa->fd >= 0) {
+            PoolReturn(endpoint->conn_pool, conn_apa);
+        } else {
+            connect_remote_agent(event_loop, conn_apa);
+            num_connecting++;
+        }
+    }
+    log_msg(INFO, "Warm up %d connections to remote agent %s:%d", num_connecting, endpoint->ip, endpoint->port);
+}
+
+void connect_remote_agent(aeEventLoop *event_loop, connection_apa_t *conn_apa) {
+    endpoint_t *endpoint = conn_apa->endpoint;
+    if (shm_attached(&endpoint->channel) && attach_connection_apa(conn_apa)) {
+        if (endpoint->num_live++ == 0) {
+            log_msg(INFO, "Remote agent %s:%d is live, take it into balancing", endpoint->ip, endpoint->port);
+        }
+        release_connection_apa(event_loop, conn_apa);
+        return;
+    }
+    int fd = anetTcpNonBlockConnect(neterr, endpoint->ip, endpoint->port);
+    if (UNLIKELY(fd == ANET_ERR)) {
+        log_msg(DEBUG, "Failed to connect to remote agent %s:%d - %s", endpoint->ip, endpoint->port, neterr);
+        retry_connection_apa(event_loop, conn_apa);
+        return;
+    }
+    conn_apa->fd = fd;
+    if (UNLIKELY(aeCreateFileEvent(event_loop, fd, AE_WRITABLE, on_remote_agent_connected, conn_apa) == AE_ERR)) {
+        log_msg(ERR, "Failed to create writable event for on_remote_agent_connected: %s", strerror(errno));
+        close(fd);
+        conn_apa->fd = -1;
+        retry_connection_apa(event_loop, conn_apa);
+    }
+}
+
+void on_remote_agent_connected(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    connection_apa_t *conn_apa = privdata;
+    endpoint_t *endpoint = conn_apa->endpoint;
+    aeDeleteFileEvent(event_loop, fd, AE_WRITABLE);
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+        err = errno;
+    }
+    if (UNLIKELY(err != 0)) {
+        log_msg(DEBUG, "Failed to connect to remote agent %s:%d - %s", endpoint->ip, endpoint->port, strerror(err));
+        close(fd);
+        conn_apa->fd = -1;
+        retry_connection_apa(event_loop, conn_apa);
+        return;
+    }
+
+    anetEnableTcpNoDelay(NULL, fd);
+    endpoint->backoff_ms = CONNECT_BACKOFF_MIN_MS;
+    if (endpoint->num_live++ == 0) {
+        log_msg(INFO, "Remote agent %s:%d is live, take it into balancing", endpoint->ip, endpoint->port);
+    }
+    release_connection_apa(event_loop, conn_apa);
+    log_msg(DEBUG, "Build connection to remote agent %s:%d with socket %d", endpoint->ip, endpoint->port, fd);
+}
+
+void retry_connection_apa(aeEventLoop *event_loop, connection_apa_t *conn_apa) {
+    endpoint_t *endpoint = conn_apa->endpoint;
+    conn_apa->next = endpoint->reconnect_list;
+    endpoint->reconnect_list = conn_apa;
+
+    if (endpoint->retry_timer == -1) {
+        log_msg(WARN, "Failed to connect to remote agent %s:%d, retry in %d ms",
+                endpoint->ip, endpoint->port, endpoint->backoff_ms);
+        endpoint->retry_timer = aeCreateTimeEvent(event_loop, endpoint->backoff_ms, reconnect_remote_agent,
+                                                  endpoint, NULL);
+        endpoint->backoff_ms *= 2;
+        if (endpoint->backoff_ms > CONNECT_BACKOFF_MAX_MS) {
+            endpoint->backoff_ms = CONNECT_BACKOFF_MAX_MS;
+        }
+    }
+}
+
+int reconnect_remote_agent(aeEventLoop *event_loop, long long id, void *client_data) {
+    endpoint_t *endpoint = client_data;
+    connection_apa_t *conn_apa = endpoint->reconnect_list;
+    endpoint->reconnect_list = NULL;
+    endpoint->retry_timer = -1;
+
+    while (conn_apa != NULL) {
+        connection_apa_t *next = conn_apa->next;
+        connect_remote_agent(event_loop, conn_apa);
+        conn_apa = next;
+    }
+    return AE_NOMORE;
+}
+
+/*
+ * Close a broken or dirty connection to remote agent. The object stays out of pool
+ * until it is reconnected, so the pool keeps its size.
+ */
+void replace_connection_apa(aeEventLoop *event_loop, connection_apa_t *conn_apa) {
+    endpoint_t *endpoint = conn_apa->endpoint;
+    if (conn_apa->shm) {
+        // Its tag is not taken again, a late response to it is dropped
+        detach_connection_apa(conn_apa);
+    } else {
+        aeDeleteFileEvent(event_loop, conn_apa->fd, AE_WRITABLE | AE_READABLE);
+        close(conn_apa->fd);
+    }
+    conn_apa->fd = -1;
+
+    if (--endpoint->num_live == 0) {
+        log_msg(WARN, "No live connection to remote agent %s:%d, eject it from balancing", endpoint->ip, endpoint->port);
+    }
+    if (!draining) {
+        retry_connection_apa(event_loop, conn_apa);
+    }
+}
+
+/*
+ * Idle connections have no event registered, so sweep them periodically for ones closed
+ * by remote agent, and top up pools that lost connection objects.
+ */
+int check_remote_agents(aeEventLoop *event_loop, long long id, void *client_data) {
+    static connection_apa_t *idle[NUM_CONN_PER_PROVIDER];
+    if (draining) {
+        return AE_NOMORE;
+    }
+
+    long now = get_current_time_ms();
+    for (int i = 0; i < num_endpoints; i++) {
+        endpoint_t *endpoint = &endpoints[i];
+        int num_idle = 0, num_dead = 0, num_new = 0;
+        if (UNLIKELY(shm_expired(&endpoint->channel, now))) {
+            log_msg(WARN, "Remote agent %s:%d did not take shared memory rings in %d ms",
+                    endpoint->ip, endpoint->port, SHM_CONNECT_TIMEOUT_MS);
+            aeDeleteFileEvent(event_loop, endpoint->channel.sock, AE_READABLE);
+            shm_close(&endpoint->channel);
+        }
+        if (UNLIKELY(endpoint->shm && shm_closed(&endpoint->channel))
+            && now - endpoint->shm_retry_ms >= SHM_RETRY_INTERVAL_MS) {
+            attach_shm_channel(event_loop, endpoint);
+        }
+        while (num_idle < NUM_CONN_PER_PROVIDER && (idle[num_idle] = PoolGet(endpoint->conn_pool)) != NULL) {
+            num_idle++;
+        }
+
+        // Pool is empty now, so getting more objects creates new ones up to its size. They are
+        // connected once all are taken, as ones over shared memory go back to pool right away.
+        if (!handoff_pending()) {
+            connection_apa_t *conn_apa, *fresh = NULL;
+            growing_pools = true;
+            while ((conn_apa = PoolGet(endpoint->conn_pool)) != NULL) {
+                conn_apa->next = fresh;
+                fresh = conn_apa;
+                num_new++;
+            }
+            growing_pools = false;
+            while (fresh != NULL) {
+                conn_apa = fresh;
+                fresh = conn_apa->next;
+                connect_remote_agent(event_loop, conn_apa);
+            }
+        }
+
+        for (int j = 0; j < num_idle; j++) {
+            connection_apa_t *conn_apa = idle[j];
+            if (conn_apa->shm) {
+                // Nothing to peek at, a channel closes as a whole, see on_shm_channel_closed()
+                PoolReturn(endpoint->conn_pool, conn_apa);
+                continue;
+            }
+            if (UNLIKELY(shm_attached(&endpoint->channel)) && attach_connection_apa(conn_apa)) {
+                // Channel attached again, move the connection over
+                close(conn_apa->fd);
+                conn_apa->fd = -1;
+                PoolReturn(endpoint->conn_pool, conn_apa);
+                continue;
+            }
+            char c;
+            // Idle connection must have nothing to read, EOF or stray bytes mean it is unusable
+            ssize_t n = recv(conn_apa->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (LIKELY(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
+                PoolReturn(endpoint->conn_pool, conn_apa);
+            } else if (n > 0 && endpoint->direct && answer_idle_heartbeats(conn_apa)) {
+                PoolReturn(endpoint->conn_pool, conn_apa);
+            } else {
+                replace_connection_apa(event_loop, conn_apa);
+                num_dead++;
+            }
+        }
+        // Nothing will be released to requests waiting for an ejected endpoint
+        while (UNLIKELY(endpoint->num_live == 0 && endpoint->num_waiting > 0)) {
+            connection_ca_t *conn_ca = endpoint->wait_queue[endpoint->wait_head];
+            endpoint->wait_head = (endpoint->wait_head + 1) % ENDPOINT_WAIT_QUEUE_SIZE;
+            endpoint->num_waiting--;
+            log_msg(ERR, "No live connection to remote agent %s:%d for waiting socket %d",
+                    endpoint->ip, endpoint->port, conn_ca->fd);
+            abort_connection_ca(event_loop, conn_ca);
+            if (UNLIKELY(consumers_throttled)) {
+                unthrottle_consumers(event_loop);
+            }
+        }
+        if (UNLIKELY(num_dead > 0 || num_new > 0)) {
+            log_msg(WARN, "Remote agent %s:%d: replace %d dead idle connections, add %d, %d live",
+                    endpoint->ip, endpoint->port, num_dead, num_new, endpoint->num_live);
+        }
+    }
+    detect_outliers();
+    if (hedge_percentile > 0) {
+        update_hedge_delays();
+    }
+    if (cache_enabled() || coalescing) {
+        report_cache_stats();
+    }
+    return HEALTH_CHECK_INTERVAL_MS;
+}
+
+/*
+ * Shared memory: a remote agent on this host takes the requests of all connections to it over
+ * one channel, each connection being a tag, see shm.c. The channel is tried for endpoints that
+ * registered one, reaching its socket is what tells they are on this host. Balancing, limits
+ * and health checks stay the same, hedges only go over TCP. The rings are passed without
+ * waiting, connections go over TCP until the remote agent has taken them.
+ */
+bool attach_shm_channel(aeEventLoop *event_loop, endpoint_t *endpoint) {
+    if (endpoint->direct || forward_mode != FORWARD_MODE_COPY) {
+        // Requests go to the provider, or bytes only pass through the kernel
+        endpoint->shm = false;
+        return false;
+    }
+    endpoint->shm_retry_ms = get_current_time_ms();
+
+    char path[64];
+    snprintf(path, sizeof(path), SHM_PATH_FORMAT, endpoint->ip, endpoint->port);
+    shm_channel_t *ch = &endpoint->channel;
+    if (shm_connect(neterr, ch, path) == SHM_ERR) {
+        log_msg(DEBUG, "No shared memory channel to remote agent %s:%d: %s", endpoint->ip, endpoint->port, neterr);
+        return false;
+    }
+    if (UNLIKELY(aeCreateFileEvent(event_loop, ch->sock, AE_READABLE, finish_shm_channel, endpoint) == AE_ERR)) {
+        log_msg(ERR, "Failed to create readable event for shared memory channel: %s", strerror(errno));
+        shm_close(ch);
+        return false;
+    }
+    return true;
+}
+
+// Remote agent answered the rings, idle connections move over at the next health check
+void finish_shm_channel(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    endpoint_t *endpoint = privdata;
+    shm_channel_t *ch = &endpoint->channel;
+    int ret = shm_finish_connect(neterr, ch);
+    if (ret == SHM_AGAIN) {
+        return;
+    }
+    aeDeleteFileEvent(event_loop, fd, AE_READABLE);
+    if (ret == SHM_ERR) {
+        log_msg(WARN, "No shared memory channel to remote agent %s:%d: %s", endpoint->ip, endpoint->port, neterr);
+        shm_close(ch);
+        return;
+    }
+    if (UNLIKELY(aeCreateFileEvent(event_loop, ch->efd_rx, AE_READABLE, read_from_shm_provider, endpoint) == AE_ERR
+                 || aeCreateFileEvent(event_loop, ch->sock, AE_READABLE, on_shm_channel_closed, endpoint) == AE_ERR)) {
+        log_msg(ERR, "Failed to create readable events for shared memory channel: %s", strerror(errno));
+        aeDeleteFileEvent(event_loop, ch->efd_rx, AE_READABLE);
+        shm_close(ch);
+        return;
+    }
+    log_msg(INFO, "Remote agent %s:%d is on this host, attach shared memory channel %d",
+            endpoint->ip, endpoint->port, ch->sock);
+}
+
+/*
+ * Requests in flight over a channel that went away fail, its connections are connected over
+ * TCP instead: idle ones now, busy ones once released.
+ */
+void detach_shm_channel(aeEventLoop *event_loop, endpoint_t *endpoint) {
+    static connection_apa_t *idle[NUM_CONN_PER_PROVIDER];
+    shm_channel_t *ch = &endpoint->channel;
+    aeDeleteFileEvent(event_loop, ch->efd_rx, AE_READABLE);
+    aeDeleteFileEvent(event_loop, ch->sock, AE_READABLE);
+    shm_close(ch);
+    endpoint->shm_retry_ms = get_current_time_ms();
+
+    for (int i = 0; i < SHM_MAX_TAGS; i++) {
+        connection_apa_t *conn_apa = endpoint->shm_conns[i];
+        if (conn_apa != NULL && conn_apa->conn_ca != NULL) {
+            record_failure(endpoint);
+            abort_connection_ca(event_loop, conn_apa->conn_ca);
+        }
+    }
+    int num_idle = 0;
+    while (num_idle < NUM_CONN_PER_PROVIDER && (idle[num_idle] = PoolGet(endpoint->conn_pool)) != NULL) {
+        num_idle++;
+    }
+    for (int i = 0; i < num_idle; i++) {
+        if (idle[i]->shm) {
+            replace_connection_apa(event_loop, idle[i]);
+        } else {
+            PoolReturn(endpoint->conn_pool, idle[i]);
+        }
+    }
+}
+
+bool attach_connection_apa(connection_apa_t *conn_apa) {
+    endpoint_t *endpoint = conn_apa->endpoint;
+    for (int i = 0; i < SHM_MAX_TAGS; i++) {
+        if (endpoint->shm_conns[i] == NULL) {
+            endpoint->shm_conns[i] = conn_apa;
+            conn_apa->shm = true;
+            conn_apa->tag = SHM_TAG(i, ++endpoint->shm_generation);
+            conn_apa->conn_ca = NULL;
+            return true;
+        }
+    }
+    return false;
+}
+
+void detach_connection_apa(connection_apa_t *conn_apa) {
+    conn_apa->endpoint->shm_conns[SHM_TAG_INDEX(conn_apa->tag)] = NULL;
+    conn_apa->shm = false;
+    conn_apa->conn_ca = NULL;
+}
+
+/*
+ * Request bytes not sent yet go into the ring in one message, there is no partial write.
+ */
+void send_over_shm(aeEventLoop *event_loop, connection_ca_t *conn_ca) {
+    connection_apa_t *conn_apa = conn_ca->conn_apa;
+    endpoint_t *endpoint = conn_apa->endpoint;
+    const char *req = conn_ca->buf_in;
+    ssize_t len = conn_ca->nread_in;
+    if (UNLIKELY(conn_ca->dubbo)) {
+        req = conn_ca->buf_req;
+        len = conn_ca->len_req;
+    }
+    if (UNLIKELY(!shm_send(&endpoint->channel, conn_apa->tag, req + conn_ca->nwrite_in,
+                           (size_t) (len - conn_ca->nwrite_in)))) {
+        log_msg(ERR, "No room for request from socket %d on shared memory channel to %s:%d",
+                conn_ca->fd, endpoint->ip, endpoint->port);
+        record_failure(endpoint);
+        abort_connection_ca(event_loop, conn_ca);
+        return;
+    }
+    conn_ca->nwrite_in = len;
+    conn_apa->conn_ca = conn_ca;
+    conn_apa->req_start_us = get_current_time_us();
+    if (UNLIKELY(conn_ca->span.trace_id != 0)) {
+        conn_ca->span.upstream_write_us = conn_apa->req_start_us;
+    }
+}
+
+void read_from_shm_provider(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    endpoint_t *endpoint = privdata;
+    shm_channel_t *ch = &endpoint->channel;
+    uint32_t tag;
+    size_t len;
+    const char *msg;
+    int ret;
+
+    shm_clear_wakeup(ch);
+    do {
+        while ((ret = shm_peek(ch, &msg, &tag, &len)) == SHM_OK) {
+            take_shm_response(event_loop, endpoint, tag, msg, len);
+            if (UNLIKELY(!shm_attached(ch))) {
+                // Detached while taking the response, the rings are gone
+                return;
+            }
+            shm_consume(ch);
+        }
+        if (UNLIKELY(ret == SHM_ERR)) {
+            log_msg(ERR, "Bad message from remote agent %s:%d over shared memory, go on over TCP",
+                    endpoint->ip, endpoint->port);
+            detach_shm_channel(event_loop, endpoint);
+            return;
+        }
+    } while (!shm_sleep(ch));
+}
+
+/*
+ * The response is copied into buf_out, which is written to consumer after the ring space is
+ * reused, and taken on as a read of it. An empty one tells the remote agent failed the request.
+ */
+void take_shm_response(aeEventLoop *event_loop, endpoint_t *endpoint, uint32_t tag, const char *msg, size_t len) {
+    if (UNLIKELY(!shm_tag_valid(tag))) {
+        log_msg(ERR, "Bad tag %u from remote agent %s:%d over shared memory, go on over TCP",
+                tag, endpoint->ip, endpoint->port);
+        detach_shm_channel(event_loop, endpoint);
+        return;
+    }
+    connection_apa_t *conn_apa = endpoint->shm_conns[SHM_TAG_INDEX(tag)];
+    connection_ca_t *conn_ca = conn_apa != NULL && conn_apa->tag == tag ? conn_apa->conn_ca : NULL;
+    if (UNLIKELY(conn_ca == NULL)) {
+        log_msg(WARN, "Drop stale response from remote agent %s:%d over shared memory", endpoint->ip, endpoint->port);
+        return;
+    }
+    conn_apa->conn_ca = NULL;
+    if (UNLIKELY(len == 0 || len > sizeof(conn_ca->buf_out) - (size_t) conn_ca->nread_out)) {
+        log_msg(ERR, "Remote agent %s:%d %s for socket %d", endpoint->ip, endpoint->port,
+                len == 0 ? "failed the request" : "sent a response too large", conn_ca->fd);
+        record_failure(endpoint);
+        abort_connection_ca(event_loop, conn_ca);
+        return;
+    }
+    memcpy(conn_ca->buf_out + conn_ca->nread_out, msg, len);
+    take_remote_agent_read(event_loop, -1, conn_ca, (ssize_t) len);
+}
+
+void on_shm_channel_closed(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    endpoint_t *endpoint = privdata;
+    char c;
+    ssize_t nread = read(fd, &c, 1);
+    if (nread < 0 && errno == EAGAIN) {
+        return;
+    }
+    log_msg(WARN, "Remote agent %s:%d closed shared memory channel %d, go on over TCP",
+            endpoint->ip, endpoint->port, fd);
+    detach_shm_channel(event_loop, endpoint);
+}
+
+/*
+ * Outlier detection: an endpoint failing consecutive requests is ejected right away, and one
+ * with high error rate or latency far above its peers at the end of a health check interval.
+ * After the ejection window it is probed with a share of requests, doubled every interval it
+ * stays healthy until it takes its full share again.
+ */
+void record_success(endpoint_t *endpoint, long rtt_us) {
+    endpoint->consecutive_failures = 0;
+    endpoint->win_reqs++;
+    endpoint->win_us += rtt_us;
+    update_limit(endpoint, rtt_us);
+
+    if (hedge_percentile > 0) {
+        int bucket = rtt_us < 4 ? (int) rtt_us : 0;
+        if (rtt_us >= 4) {
+            // 4 buckets per power of 2
+            int log2 = 63 - __builtin_clzl((unsigned long) rtt_us);
+            bucket = log2 * 4 + (int) ((rtt_us >> (log2 - 2)) & 3);
+            if (bucket >= HEDGE_LATENCY_BUCKETS) {
+                bucket = HEDGE_LATENCY_BUCKETS - 1;
+            }
+        }
+        endpoint->latency_hist[bucket]++;
+        endpoint->hist_count++;
+    }
+}
+
+void record_failure(endpoint_t *endpoint) {
+    endpoint->win_reqs++;
+    endpoint->win_errors++;
+    // Back off like a loss in TCP
+    endpoint->limit = endpoint->limit / 2 > LIMIT_MIN ? endpoint->limit / 2 : LIMIT_MIN;
+    endpoint->consecutive_failures++;
+    if (UNLIKELY(endpoint->health == ENDPOINT_PROBING)) {
+        // Any failure of probe traffic ends the probe
+        eject_endpoint(endpoint, get_current_time_ms(), "failed probe");
+    } else if (UNLIKELY(endpoint->consecutive_failures >= OUTLIER_CONSECUTIVE_FAILURES
+                        && endpoint->health == ENDPOINT_HEALTHY)) {
+        eject_endpoint(endpoint, get_current_time_ms(), "consecutive failures");
+    }
+}
+
+void eject_endpoint(endpoint_t *endpoint, long now, const char *reason) {
+    int num_ejected = 1;
+    for (int i = 0; i < num_endpoints; i++) {
+        if (endpoints[i].health == ENDPOINT_EJECTED) {
+            num_ejected++;
+        }
+    }
+    // Never leave too few endpoints to take the load
+    if (num_ejected * 100 > num_endpoints * OUTLIER_MAX_EJECTION_PERCENT) {
+        log_msg(DEBUG, "Keep remote agent %s:%d in balancing despite %s", endpoint->ip, endpoint->port, reason);
+        return;
+    }
+
+    long window = (long) OUTLIER_EJECTION_MS * ++endpoint->num_ejections;
+    if (window > OUTLIER_MAX_EJECTION_MS) {
+        window = OUTLIER_MAX_EJECTION_MS;
+    }
+    endpoint->health = ENDPOINT_EJECTED;
+    endpoint->ejected_until = now + window;
+    endpoint->consecutive_failures = 0;
+    log_msg(WARN, "Eject remote agent %s:%d from balancing for %ld ms: %s",
+            endpoint->ip, endpoint->port, window, reason);
+}
+
+void detect_outliers() {
+    long now = get_current_time_ms();
+
+    for (int i = 0; i < num_endpoints; i++) {
+        endpoint_t *endpoint = &endpoints[i];
+        if (endpoint->health == ENDPOINT_EJECTED) {
+            if (now >= endpoint->ejected_until) {
+                endpoint->health = ENDPOINT_PROBING;
+                endpoint->probe_percent = OUTLIER_PROBE_START_PERCENT;
+                log_msg(INFO, "Probe remote agent %s:%d with %d%% of requests",
+                        endpoint->ip, endpoint->port, endpoint->probe_percent);
+            }
+            continue;
+        }
+
+        int num_ok = endpoint->win_reqs - endpoint->win_errors;
+        bool judged = endpoint->win_reqs >= (endpoint->health == ENDPOINT_PROBING ? OUTLIER_MIN_PROBES
+                                                                                 : OUTLIER_MIN_REQUESTS);
+        if (judged) {
+            if (endpoint->win_errors * 100 >= endpoint->win_reqs * OUTLIER_ERROR_RATE_PERCENT) {
+                eject_endpoint(endpoint, now, "error rate");
+                continue;
+            }
+
+            // Mean latency of the other endpoints in balancing
+            long peer_us = 0;
+            int peer_reqs = 0;
+            for (int j = 0; j < num_endpoints; j++) {
+                if (j != i && endpoints[j].health != ENDPOINT_EJECTED) {
+                    peer_us += endpoints[j].win_us;
+                    peer_reqs += endpoints[j].win_reqs - endpoints[j].win_errors;
+                }
+            }
+            long latency = endpoint->win_us / num_ok;
+            if (peer_reqs >= OUTLIER_MIN_REQUESTS && latency > OUTLIER_LATENCY_MIN_MS * 1000
+                && latency > peer_us / peer_reqs * OUTLIER_LATENCY_FACTOR) {
+                log_msg(WARN, "Remote agent %s:%d: latency %ld us, peers %ld us",
+                        endpoint->ip, endpoint->port, latency, peer_us / peer_reqs);
+                eject_endpoint(endpoint, now, "latency");
+                continue;
+            }
+        }
+
+        if (endpoint->health == ENDPOINT_PROBING) {
+            // Not enough probe traffic to tell, keep the share
+            if (judged) {
+                endpoint->probe_percent *= 2;
+                if (endpoint->probe_percent >= 100) {
+                    endpoint->health = ENDPOINT_HEALTHY;
+                    log_msg(INFO, "Remote agent %s:%d is healthy, take it back into balancing",
+                            endpoint->ip, endpoint->port);
+                } else {
+                    log_msg(INFO, "Probe remote agent %s:%d with %d%% of requests",
+                            endpoint->ip, endpoint->port, endpoint->probe_percent);
+                }
+            }
+        } else if (UNLIKELY(endpoint->num_ejections > 0 && now - endpoint->ejected_until > OUTLIER_MAX_EJECTION_MS)) {
+            endpoint->num_ejections = 0;
+        }
+    }
+
+    for (int i = 0; i < num_endpoints; i++) {
+        endpoints[i].win_reqs = 0;
+        endpoints[i].win_errors = 0;
+        endpoints[i].win_us = 0;
+    }
+}
+
+/*
+ * Vegas-style concurrency limit: the queue built up at an endpoint is estimated from the
+ * RTT of its requests against the RTT without queueing, as limit * (1 - min_rtt / rtt).
+ * The limit grows while the queue is short and shrinks when it gets long, so it settles
+ * where the endpoint is busy but does not queue. The minimum RTT of each window is used
+ * as rtt, service times varying from request to request do not look like queueing then.
+ */
+void update_limit(endpoint_t *endpoint, long rtt_us) {
+    if (endpoint->win_samples == 0 || rtt_us < endpoint->win_min_rtt_us) {
+        endpoint->win_min_rtt_us = rtt_us > 0 ? rtt_us : 1;
+    }
+    int inflight = endpoint_inflight(endpoint);
+    if (endpoint->win_max_inflight < inflight) {
+        endpoint->win_max_inflight = inflight;
+    }
+    if (++endpoint->win_samples < endpoint->limit && endpoint->win_samples < LIMIT_MIN_WINDOW) {
+        return;
+    }
+
+    long rtt = endpoint->win_min_rtt_us;
+    if (endpoint->min_rtt_us == 0 || endpoint->min_rtt_us > rtt) {
+        endpoint->min_rtt_us = rtt;
+    }
+    int limit = endpoint->limit;
+    int digits = limit < 10 ? 1 : limit < 100 ? 2 : 3;
+    long queue = limit * (rtt - endpoint->min_rtt_us) / rtt;
+
+    if (queue >= LIMIT_BETA * digits) {
+        limit -= digits;
+    } else if (queue <= LIMIT_ALPHA * digits && endpoint->win_max_inflight * 2 >= limit) {
+        // Only grow when the limit is what holds requests back
+        limit += digits;
+    }
+    if (limit < LIMIT_MIN) {
+        limit = LIMIT_MIN;
+    } else if (limit > endpoint->pool_size) {
+        limit = endpoint->pool_size;
+    }
+    if (limit != endpoint->limit) {
+        log_msg(DEBUG, "Remote agent %s:%d: concurrency limit %d, RTT %ld us, min RTT %ld us",
+                endpoint->ip, endpoint->port, limit, rtt, endpoint->min_rtt_us);
+        endpoint->limit = limit;
+    }
+
+    // Follow an endpoint getting slower for good instead of squeezing its limit forever
+    if (++endpoint->num_windows == LIMIT_MIN_RTT_RESET_WINDOWS) {
+        log_msg(INFO, "Remote agent %s:%d: concurrency limit %d, min RTT %ld us, reset to %ld us",
+                endpoint->ip, endpoint->port, limit, endpoint->min_rtt_us, rtt);
+        endpoint->min_rtt_us = rtt;
+        endpoint->num_windows = 0;
+    }
+    endpoint->win_samples = 0;
+    endpoint->win_max_inflight = 0;
+}
+
+/*
+ * Remote agent reports the load of its provider right after the status line of a response,
+ * "X-Load:<in flight>,<queued>,<service time us>".
+ */
+void parse_load(endpoint_t *endpoint, const char *resp, ssize_t len) {
+    static const char status_line[] = "HTTP/1.1 200 OK\r\nX-Load:";
+    size_t prefix_len = sizeof(status_line) - 1;
+    if (UNLIKELY(len <= (ssize_t) prefix_len || memcmp(resp, status_line, prefix_len) != 0)) {
+        return;
+    }
+    char *end;
+    endpoint->remote_inflight = (int) strtol(resp + prefix_len, &end, 10);
+    endpoint->remote_queued = (int) strtol(end + 1, &end, 10);
+    endpoint->remote_service_us = strtol(end + 1, NULL, 10);
+    endpoint->load_updated_us = get_current_time_us();
+}
+
+/*
+ * Drop the load header from a response before it goes to the consumer or the cache. It is in
+ * the first read, which nothing was written from yet. Returns the number of bytes dropped.
+ */
+ssize_t strip_load(char *resp, ssize_t len) {
+    char *header = memchr(resp, '\n', (size_t) len);
+    if (UNLIKELY(header == NULL)) {
+        return 0;
+    }
+    header++;
+    ssize_t left = resp + len - header;
+    if (left < 7 || memcmp(header, "X-Load:", 7) != 0) {
+        return 0;
+    }
+    char *next = memchr(header, '\n', (size_t) left);
+    if (UNLIKELY(next == NULL)) {
+        return 0;
+    }
+    next++;
+    memmove(header, next, (size_t) (resp + len - next));
+    return next - header;
+}
+
+/*
+ * Sample the request just read: its trace ID goes upstream in a header right after the request
+ * line, and in the frame if it is encoded, see encode_request(). Left untraced if the request
+ * line is not read yet or there is no room for the header.
+ */
+void start_trace(connection_ca_t *conn_ca) {
+    uint32_t trace_id = trace_new_id();
+    char header[TRACE_HEADER_MAX + 1];
+    int len = snprintf(header, sizeof(header), TRACE_HEADER ":%08x\r\n", trace_id);
+    char *line_end = memchr(conn_ca->buf_in, '\n', (size_t) conn_ca->nread_in);
+    if (UNLIKELY(line_end == NULL || conn_ca->nread_in + len > (ssize_t) sizeof(conn_ca->buf_in))) {
+        return;
+    }
+    line_end++;
+    memmove(line_end + len, line_end, (size_t) (conn_ca->buf_in + conn_ca->nread_in - line_end));
+    memcpy(line_end, header, (size_t) len);
+    conn_ca->nread_in += len;
+
+    memset(&conn_ca->span, 0, sizeof(conn_ca->span));
+    conn_ca->span.trace_id = trace_id;
+    conn_ca->span.accept_us = get_current_time_us();
+}
+
+// Whether the headers and the whole body of an HTTP request are read
+bool request_complete(const char *req, size_t len) {
+    const char *body = memmem(req, len, "\r\n\r\n", 4);
+    if (body == NULL) {
+        return false;
+    }
+    body += 4;
+    const char *header = find_header(req, body, "Content-Length:", 15);
+    return header == NULL || strtol(header, NULL, 10) <= req + len - body;
+}
+
+/*
+ * Encode the call in buf_in as a Dubbo request to be relayed to the provider as it is, so
+ * provider agents are spared parsing HTTP. False if it does not have the fields of a call.
+ */
+bool encode_request(connection_ca_t *conn_ca) {
+    cache_key_t parsed;
+    cache_key_t *key = &conn_ca->cache_key;
+    if (!conn_ca->keyed) {
+        key = &parsed;
+        if (!cache_parse_key(conn_ca->buf_in, (size_t) conn_ca->nread_in, key)) {
+            return false;
+        }
+    }
+    if (UNLIKELY(key->field[CACHE_KEY_TYPES] == NULL)) {
+        return false;
+    }
+    conn_ca->len_req = dubbo_encode_request(
+            conn_ca->buf_req, sizeof(conn_ca->buf_req), cur_request_id++, conn_ca->service->serialization,
+            key->field[CACHE_KEY_INTERFACE], (int) key->len[CACHE_KEY_INTERFACE],
+            key->field[CACHE_KEY_METHOD], (int) key->len[CACHE_KEY_METHOD],
+            key->field[CACHE_KEY_TYPES], (int) key->len[CACHE_KEY_TYPES],
+            key->field[CACHE_KEY_PARAMETER], (int) key->len[CACHE_KEY_PARAMETER]);
+    if (UNLIKELY(conn_ca->span.trace_id != 0) && conn_ca->len_req > 0) {
+        // High half of the request ID, see trace.c
+        *((uint32_t *) &conn_ca->buf_req[4]) = htonl(conn_ca->span.trace_id);
+    }
+    return conn_ca->len_req > 0;
+}
+
+/*
+ * Turn the response frame read into buf_out into the HTTP response a remote agent would
+ * have sent, with the load it reports taken from the ID, see _write_to_consumer_agent() of
+ * provider agent. A provider called directly reports no load, its heartbeats are answered
+ * and stale responses dropped here. Returns the length of the response, 0 if the frame is
+ * not read in full yet, -1 if the remote agent did not answer with a frame.
+ */
+ssize_t decode_response(connection_ca_t *conn_ca) {
+    endpoint_t *endpoint = conn_ca->conn_apa->endpoint;
+    const char *frame = conn_ca->buf_out;
+    int frame_len;
+    for (;;) {
+        frame_len = dubbo_frame_len(frame, (size_t) conn_ca->nread_out);
+        if (UNLIKELY(frame_len < 0 || frame_len > (int) sizeof(conn_ca->buf_out))) {
+            log_msg(ERR, "Bad Dubbo response from remote agent for socket %d", conn_ca->fd);
+            return -1;
+        }
+        if (frame_len == 0 || conn_ca->nread_out < frame_len) {
+            return 0;
+        }
+        if (LIKELY(!(frame[2] & DUBBO_FLAG_EVENT))) {
+            if (LIKELY(!endpoint->direct || memcmp(frame + 4, conn_ca->buf_req + 4, 8) == 0)) {
+                break;
+            }
+            // Left by a request answered elsewhere, see discard_from_remote_agent()
+            log_msg(WARN, "Drop stale response from provider %s:%d for socket %d",
+                    endpoint->ip, endpoint->port, conn_ca->fd);
+        } else if ((frame[2] & DUBBO_FLAG_REQUEST) && (frame[2] & DUBBO_FLAG_TWOWAY)) {
+            answer_provider_heartbeat(conn_ca, conn_ca->conn_apa->fd, frame);
+        }
+        conn_ca->nread_out -= frame_len;
+        memmove(conn_ca->buf_out, frame + frame_len, (size_t) conn_ca->nread_out);
+    }
+
+    if (!endpoint->direct) {
+        endpoint->remote_inflight = ntohs(*((uint16_t *) &frame[4]));
+        endpoint->remote_queued = ntohs(*((uint16_t *) &frame[6]));
+        endpoint->remote_service_us = ntohl(*((uint32_t *) &frame[8]));
+        endpoint->load_updated_us = get_current_time_us();
+    }
+
+    const char *value;
+    size_t value_len;
+    int status = dubbo_decode_response(frame, (size_t) frame_len, value_text, sizeof(value_text), &value, &value_len);
+
+    char resp[CONSUMER_HTTP_RESP_BUF_SIZE];
+    int len = snprintf(resp, sizeof(resp), "HTTP/1.1 %s\r\nContent-Length:%zu\r\n\r\n%.*s",
+                       dubbo_http_status(status), value_len, (int) value_len, value);
+    if (UNLIKELY(len >= (int) sizeof(resp))) {
+        log_msg(WARN, "Response value of %zu bytes does not fit for socket %d", value_len, conn_ca->fd);
+        len = snprintf(resp, sizeof(resp), "HTTP/1.1 %s\r\nContent-Length:0\r\n\r\n", dubbo_http_status(500));
+    }
+    memcpy(conn_ca->buf_out, resp, (size_t) len);
+    return len;
+}
+
+/*
+ * Echo mode: answer the request in buf_in as the hash method of the demo service would, the
+ * Java hash code of its parameter as it came in the form, so the cost of the consumer agent
+ * alone can be measured, see report_echo_cost() of main.
+ */
+void echo_to_consumer(aeEventLoop *event_loop, connection_ca_t *conn_ca) {
+    cache_key_t key;
+    int len;
+    if (LIKELY(cache_parse_key(conn_ca->buf_in, (size_t) conn_ca->nread_in, &key))) {
+        char value[12];
+        int value_len = sprintf(value, "%d", java_string_hash(key.field[CACHE_KEY_PARAMETER],
+                                                               key.len[CACHE_KEY_PARAMETER]));
+        len = sprintf(conn_ca->buf_out, "HTTP/1.1 200 OK\r\nContent-Length:%d\r\n\r\n%s", value_len, value);
+    } else {
+        log_msg(WARN, "Request from socket %d is not a call, cannot echo it", conn_ca->fd);
+        len = sprintf(conn_ca->buf_out, "HTTP/1.1 %s\r\nContent-Length:0\r\n\r\n", dubbo_http_status(500));
+    }
+    conn_ca->nread_out = len;
+    num_echoed++;
+
+    // Reset buf_in pointers
+    conn_ca->nread_in = 0;
+    conn_ca->nwrite_in = 0;
+
+    if (UNLIKELY(aeCreateFileEvent(event_loop, conn_ca->fd, AE_WRITABLE, write_to_consumer, conn_ca) == AE_ERR)) {
+        log_msg(ERR, "Failed to create writable event for write_to_consumer: %s", strerror(errno));
+        abort_connection_ca(event_loop, conn_ca);
+    }
+}
+
+void answer_provider_heartbeat(connection_ca_t *conn_ca, int fd, const char *frame) {
+    if (UNLIKELY(conn_ca != NULL && conn_ca->nwrite_in < conn_ca->len_req)) {
+        // A request is half written, the provider sends another heartbeat if it misses this one
+        log_msg(WARN, "Skip heartbeat of provider with socket %d while writing request", fd);
+        return;
+    }
+    char buf[DUBBO_HEADER_LEN + 8];
+    size_t len = dubbo_encode_heartbeat(buf, (uint8_t) frame[2] & 0x1f, DUBBO_STATUS_OK, frame + 4);
+    if (UNLIKELY(write(fd, buf, len) != (ssize_t) len)) {
+        log_msg(WARN, "Failed to answer heartbeat of provider with socket %d", fd);
+    }
+}
+
+/*
+ * Providers send heartbeats on connections idle for a while, answer the ones read from an
+ * idle connection to a provider called directly. False if anything else was read, or a
+ * frame in part, then the connection is not clean.
+ */
+bool answer_idle_heartbeats(connection_apa_t *conn_apa) {
+    char buf[CONSUMER_HTTP_RESP_BUF_SIZE];
+    ssize_t n = recv(conn_apa->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n <= 0) {
+        return false;
+    }
+    for (ssize_t off = 0; off < n;) {
+        const char *frame = buf + off;
+        int frame_len = dubbo_frame_len(frame, (size_t) (n - off));
+        if (frame_len <= 0 || frame_len > n - off || !(frame[2] & DUBBO_FLAG_EVENT)) {
+            return false;
+        }
+        if ((frame[2] & DUBBO_FLAG_REQUEST) && (frame[2] & DUBBO_FLAG_TWOWAY)) {
+            answer_provider_heartbeat(NULL, conn_apa->fd, frame);
+        }
+        off += frame_len;
+    }
+    return true;
+}
+
+/*
+ * Request hedging: a request still unanswered after a percentile of its endpoint's latency
+ * is sent again to another endpoint, whichever answers first is written back to consumer.
+ * The loser's response is read and dropped when it comes, and its connection goes back to
+ * pool. Hedges are paid from a budget that grows with the requests sent, so a slow fleet
+ * does not get its load multiplied.
+ */
+// Timer interval up to a deadline, rounded up
+static inline int hedge_delay_ms(long delay_us) {
+    return delay_us > HEDGE_TICK_MS * 1000 ? (int) ((delay_us + 999) / 1000) : HEDGE_TICK_MS;
+}
+
+void track_hedge_candidate(aeEventLoop *event_loop, connection_ca_t *conn_ca) {
+    endpoint_t *endpoint = conn_ca->conn_apa->endpoint;
+    conn_ca->hedge_endpoint = endpoint;
+    conn_ca->next_candidate = NULL;
+    conn_ca->prev_candidate = endpoint->candidates_tail;
+    if (endpoint->candidates_tail != NULL) {
+        endpoint->candidates_tail->next_candidate = conn_ca;
+    } else {
+        endpoint->candidates_head = conn_ca;
+    }
+    endpoint->candidates_tail = conn_ca;
+
+    if (hedge_tokens < 100 * HEDGE_BUDGET_BURST) {
+        hedge_tokens += HEDGE_BUDGET_PERCENT;
+    }
+
+    // The timer only runs while a request may be late, so an idle loop sleeps in epoll
+    if (endpoint->hedge_delay_us > 0 && !draining) {
+        long deadline_us = conn_ca->conn_apa->req_start_us + endpoint->hedge_delay_us;
+        if (hedge_timer >= 0 && deadline_us < hedge_deadline_us) {
+            // Earlier than the one armed, of an endpoint with a shorter delay
+            aeDeleteTimeEvent(event_loop, hedge_timer);
+            hedge_timer = -1;
+        }
+        if (hedge_timer < 0) {
+            hedge_deadline_us = deadline_us;
+            hedge_timer = aeCreateTimeEvent(event_loop, hedge_delay_ms(endpoint->hedge_delay_us), hedge_requests,
+                                            NULL, NULL);
+        }
+    }
+}
+
+void untrack_hedge_candidate(connection_ca_t *conn_ca) {
+    endpoint_t *endpoint = conn_ca->hedge_endpoint;
+    if (conn_ca->prev_candidate != NULL) {
+        conn_ca->prev_candidate->next_candidate = conn_ca->next_candidate;
+    } else {
+        endpoint->candidates_head = conn_ca->next_candidate;
+    }
+    if (conn_ca->next_candidate != NULL) {
+        conn_ca->next_candidate->prev_candidate = conn_ca->prev_candidate;
+    } else {
+        endpoint->candidates_tail = conn_ca->prev_candidate;
+    }
+    conn_ca->hedge_endpoint = NULL;
+}
+
+int hedge_requests(aeEventLoop *event_loop, long long id, void *client_data) {
+    hedge_timer = -1;
+    if (UNLIKELY(draining)) {
+        return AE_NOMORE;
+    }
+    long now = get_current_time_us();
+    long next_deadline_us = 0;
+    for (int i = 0; i < num_endpoints; i++) {
+        endpoint_t *endpoint = &endpoints[i];
+        if (endpoint->hedge_delay_us == 0) {
+            continue;
+        }
+        // Oldest first, stop at the first one not late yet
+        connection_ca_t *conn_ca;
+        while ((conn_ca = endpoint->candidates_head) != NULL
+               && now - conn_ca->conn_apa->req_start_us >= endpoint->hedge_delay_us) {
+            untrack_hedge_candidate(conn_ca);
+            if (hedge_tokens >= 100) {
+                hedge_request(event_loop, conn_ca);
+            }
+        }
+        if (conn_ca != NULL) {
+            long deadline_us = conn_ca->conn_apa->req_start_us + endpoint->hedge_delay_us;
+            if (next_deadline_us == 0 || deadline_us < next_deadline_us) {
+                next_deadline_us = deadline_us;
+            }
+        }
+    }
+    if (next_deadline_us == 0) {
+        return AE_NOMORE;
+    }
+    hedge_timer = id;
+    hedge_deadline_us = next_deadline_us;
+    return hedge_delay_ms(next_deadline_us - now);
+}
+
+void hedge_request(aeEventLoop *event_loop, connection_ca_t *conn_ca) {
+    // Another endpoint of its service that can take it right now
+    service_t *service = conn_ca->service;
+    endpoint_t *primary = conn_ca->conn_apa->endpoint;
+    endpoint_t *endpoint = NULL;
+    int max_headroom = 0;
+    for (int i = 0; i < service->num_endpoints; i++) {
+        if (service->endpoints[i] != primary && endpoint_rank(service->endpoints[i]) == 2
+            && (conn_ca->dubbo ? endpoint_takes_dubbo(service->endpoints[i]) : !service->endpoints[i]->direct)
+            && !shm_attached(&service->endpoints[i]->channel)
+            && service->endpoints[i]->limit - endpoint_inflight(service->endpoints[i]) > max_headroom) {
+            max_headroom = service->endpoints[i]->limit - endpoint_inflight(service->endpoints[i]);
+            endpoint = service->endpoints[i];
+        }
+    }
+    if (endpoint == NULL) {
+        return;
+    }
+    connection_apa_t *conn_hedge = acquire_connection_apa(endpoint);
+    if (UNLIKELY(conn_hedge == NULL)) {
+        return;
+    }
+
+    // Idle connection has an empty send buffer, the request goes out in one write
+    const char *req = conn_ca->dubbo ? conn_ca->buf_req : conn_ca->buf_in;
+    ssize_t len = conn_ca->dubbo ? conn_ca->len_req : conn_ca->nread_in;
+    ssize_t nwrite = write(conn_hedge->fd, req, (size_t) len);
+    if (UNLIKELY(nwrite != len)) {
+        log_msg(WARN, "Failed to hedge request for socket %d to %s:%d", conn_ca->fd, endpoint->ip, endpoint->port);
+        replace_connection_apa(event_loop, conn_hedge);
+        return;
+    }
+    conn_hedge->req_start_us = get_current_time_us();
+    if (UNLIKELY(aeCreateFileEvent(event_loop, conn_hedge->fd, AE_READABLE,
+                                   read_hedge_from_remote_agent, conn_ca) == AE_ERR)) {
+        log_msg(ERR, "Failed to create readable event for read_hedge_from_remote_agent: %s", strerror(errno));
+        replace_connection_apa(event_loop, conn_hedge);
+        return;
+    }
+    conn_ca->conn_hedge = conn_hedge;
+    hedge_tokens -= 100;
+    num_hedged++;
+    log_msg(DEBUG, "Hedge request for socket %d to %s:%d", conn_ca->fd, endpoint->ip, endpoint->port);
+}
+
+void read_hedge_from_remote_agent(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    connection_ca_t *conn_ca = privdata;
+    connection_apa_t *conn_hedge = conn_ca->conn_hedge;
+
+    ssize_t nread = read(fd, conn_ca->buf_out, sizeof(conn_ca->buf_out));
+    if (LIKELY(nread > 0)) {
+        // Duplicate answered first, take it over as the connection of this request
+        connection_apa_t *conn_apa = conn_ca->conn_apa;
+        cancel_hedge(event_loop, conn_apa);
+        conn_ca->conn_apa = conn_hedge;
+        conn_ca->conn_hedge = NULL;
+        num_hedges_won++;
+
+        if (UNLIKELY(aeCreateFileEvent(event_loop, fd, AE_READABLE, read_from_remote_agent, conn_ca) == AE_ERR)) {
+            log_msg(ERR, "Failed to create readable event for read_from_remote_agent: %s", strerror(errno));
+            abort_connection_ca(event_loop, conn_ca);
+            return;
+        }
+        take_remote_agent_read(event_loop, fd, conn_ca, nread);
+
+    } else if (UNLIKELY(nread < 0 && errno == EAGAIN)) {
+        return;
+
+    } else {
+        log_msg(ERR, "Hedge to remote agent %s:%d failed for socket %d",
+                conn_hedge->endpoint->ip, conn_hedge->endpoint->port, conn_ca->fd);
+        record_failure(conn_hedge->endpoint);
+        conn_ca->conn_hedge = NULL;
+        replace_connection_apa(event_loop, conn_hedge);
+    }
+}
+
+/*
+ * Leave the response of a request answered elsewhere to be dropped when it comes.
+ */
+void cancel_hedge(aeEventLoop *event_loop, connection_apa_t *conn_apa) {
+    if (UNLIKELY(aeCreateFileEvent(event_loop, conn_apa->fd, AE_READABLE,
+                                   discard_from_remote_agent, conn_apa) == AE_ERR)) {
+        replace_connection_apa(event_loop, conn_apa);
+    }
+}
+
+void discard_from_remote_agent(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    static char discard_buf[CONSUMER_HTTP_RESP_BUF_SIZE];
+    connection_apa_t *conn_apa = privdata;
+
+    ssize_t nread = read(fd, discard_buf, sizeof(discard_buf));
+    if (LIKELY(nread > 0)) {
+        // Still a sample of how the endpoint is doing
+        record_success(conn_apa->endpoint, get_current_time_us() - conn_apa->req_start_us);
+        aeDeleteFileEvent(event_loop, fd, AE_READABLE);
+        release_connection_apa(event_loop, conn_apa);
+    } else if (nread == 0 || errno != EAGAIN) {
+        record_failure(conn_apa->endpoint);
+        replace_connection_apa(event_loop, conn_apa);
+    }
+}
+
+void update_hedge_delays() {
+    for (int i = 0; i < num_endpoints; i++) {
+        endpoint_t *endpoint = &endpoints[i];
+        if (endpoint->hist_count < HEDGE_MIN_SAMPLES) {
+            continue;
+        }
+
+        uint32_t rank = (uint32_t) ((uint64_t) endpoint->hist_count * hedge_percentile / 100);
+        uint32_t seen = 0;
+        int bucket = 0;
+        while (bucket < HEDGE_LATENCY_BUCKETS - 1 && (seen += endpoint->latency_hist[bucket]) <= rank) {
+            bucket++;
+        }
+        // Upper bound of the bucket
+        long delay = bucket < 8 ? bucket % 4 + 1 : (long) (4 + bucket % 4 + 1) << (bucket / 4 - 2);
+        endpoint->hedge_delay_us = delay > HEDGE_MIN_DELAY_US ? delay : HEDGE_MIN_DELAY_US;
+
+        // Forget older samples gradually
+        endpoint->hist_count = 0;
+        for (int j = 0; j < HEDGE_LATENCY_BUCKETS; j++) {
+            endpoint->latency_hist[j] /= 2;
+            endpoint->hist_count += endpoint->latency_hist[j];
+        }
+    }
+
+    if (num_hedged > 0) {
+        log_msg(INFO, "Hedged %d requests, %d answered first by the duplicate", num_hedged, num_hedges_won);
+        num_hedged = 0;
+        num_hedges_won = 0;
+    }
+}
+
+/*
+ * Answer a keyed request from the response cache without taking a connection
+ * to remote agent. On a miss the key is kept, and the response cached once read.
+ */
+bool serve_from_cache(aeEventLoop *event_loop, connection_ca_t *conn_ca) {
+    if (!cache_enabled()) {
+        return false;
+    }
+    size_t len;
+    const char *resp = cache_get(&conn_ca->cache_key, &len);
+    if (resp == NULL || UNLIKELY(len > sizeof(conn_ca->buf_out))) {
+        return false;
+    }
+    conn_ca->keyed = false;
+    memcpy(conn_ca->buf_out, resp, len);
+    conn_ca->nread_out = (ssize_t) len;
+
+    // Reset buf_in pointers
+    conn_ca->nread_in = 0;
+    conn_ca->nwrite_in = 0;
+
+    if (UNLIKELY(aeCreateFileEvent(event_loop, conn_ca->fd, AE_WRITABLE, write_to_consumer, conn_ca) == AE_ERR)) {
+        log_msg(ERR, "Failed to create writable event for write_to_consumer: %s", strerror(errno));
+        abort_connection_ca(event_loop, conn_ca);
+    }
+    return true;
+}
+
+/*
+ * Coalescing: a keyed request identical to one in flight is not sent upstream but follows
+ * it, and the response of the leader is copied to each of its followers. If the leader ends
+ * without a complete successful response, its followers are dispatched again on their own.
+ */
+bool follow_request(aeEventLoop *event_loop, connection_ca_t *conn_ca) {
+    if (!coalescing) {
+        return false;
+    }
+    int bucket = (int) (conn_ca->cache_key.hash % INFLIGHT_TABLE_SIZE);
+    for (connection_ca_t *leader = inflight_calls[bucket]; leader != NULL; leader = leader->next_inflight) {
+        if (cache_key_equal(&leader->cache_key, &conn_ca->cache_key)) {
+            conn_ca->leader = leader;
+            conn_ca->next_follower = leader->followers;
+            leader->followers = conn_ca;
+            num_coalesced++;
+            return true;
+        }
+    }
+    conn_ca->leading = true;
+    conn_ca->next_inflight = inflight_calls[bucket];
+    inflight_calls[bucket] = conn_ca;
+    return false;
+}
+
+void unfollow_request(connection_ca_t *conn_ca) {
+    connection_ca_t **prev = &conn_ca->leader->followers;
+    while (*prev != conn_ca) {
+        prev = &(*prev)->next_follower;
+    }
+    *prev = conn_ca->next_follower;
+    conn_ca->leader = NULL;
+}
+
+static connection_ca_t *stop_leading(connection_ca_t *conn_ca) {
+    connection_ca_t **prev = &inflight_calls[conn_ca->cache_key.hash % INFLIGHT_TABLE_SIZE];
+    while (*prev != conn_ca) {
+        prev = &(*prev)->next_inflight;
+    }
+    *prev = conn_ca->next_inflight;
+    conn_ca->leading = false;
+
+    connection_ca_t *followers = conn_ca->followers;
+    conn_ca->followers = NULL;
+    return followers;
+}
+
+void share_response(aeEventLoop *event_loop, connection_ca_t *conn_ca) {
+    connection_ca_t *follower = stop_leading(conn_ca);
+    while (follower != NULL) {
+        connection_ca_t *next = follower->next_follower;
+        follower->leader = NULL;
+        follower->keyed = false;
+        memcpy(follower->buf_out, conn_ca->buf_out, (size_t) conn_ca->nread_out);
+        follower->nread_out = conn_ca->nread_out;
+        follower->nwrite_out = 0;
+
+        // Reset buf_in pointers
+        follower->nread_in = 0;
+        follower->nwrite_in = 0;
+
+        if (UNLIKELY(aeCreateFileEvent(event_loop, follower->fd, AE_WRITABLE, write_to_consumer, follower) == AE_ERR)) {
+            log_msg(ERR, "Failed to create writable event for write_to_consumer: %s", strerror(errno));
+            abort_connection_ca(event_loop, follower);
+        }
+        follower = next;
+    }
+}
+
+void release_followers(aeEventLoop *event_loop, connection_ca_t *conn_ca) {
+    connection_ca_t *follower = stop_leading(conn_ca);
+    while (follower != NULL) {
+        connection_ca_t *next = follower->next_follower;
+        follower->leader = NULL;
+        // The first one leads the rest
+        if (!follow_request(event_loop, follower)) {
+            dispatch_request(event_loop, follower);
+        }
+        follower = next;
+    }
+}
+
+void report_cache_stats() {
+    cache_stats_t stats;
+    cache_get_stats(&stats);
+    export_cache_stats(&stats);
+    if (num_coalesced > last_coalesced) {
+        log_msg(INFO, "Coalesced %ld calls into identical ones in flight", num_coalesced - last_coalesced);
+        last_coalesced = num_coalesced;
+    }
+    long lookups = stats.hits + stats.misses - last_cache_stats.hits - last_cache_stats.misses;
+    if (lookups > 0) {
+        log_msg(INFO, "Response cache: %ld%% of %ld lookups hit, %ld entries, %ld of %ld bytes, "
+                      "%ld evicted, %ld expired",
+                (stats.hits - last_cache_stats.hits) * 100 / lookups, lookups, stats.entries, stats.bytes,
+                stats.max_bytes, stats.evictions - last_cache_stats.evictions,
+                stats.expirations - last_cache_stats.expirations);
+    }
+    last_cache_stats = stats;
+}
+
+/*
+ * Counters since start for the textfile collector of a Prometheus node exporter. The file is
+ * replaced as a whole, a scrape never sees it half written.
+ */
+void export_cache_stats(const cache_stats_t *stats) {
+    char tmp_path[sizeof(stats_path) + 4];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", stats_path);
+    FILE *f = fopen(tmp_path, "w");
+    if (f == NULL) {
+        log_msg(WARN, "Failed to open %s: %s", tmp_path, strerror(errno));
+        return;
+    }
+    fprintf(f, "# HELP mesh_agent_cache_hits_total Calls answered from the response cache.\n"
+               "# TYPE mesh_agent_cache_hits_total counter\n"
+               "mesh_agent_cache_hits_total %ld\n"
+               "# HELP mesh_agent_cache_misses_total Cache lookups of calls sent upstream.\n"
+               "# TYPE mesh_agent_cache_misses_total counter\n"
+               "mesh_agent_cache_misses_total %ld\n"
+               "# HELP mesh_agent_cache_insertions_total Responses put in the cache.\n"
+               "# TYPE mesh_agent_cache_insertions_total counter\n"
+               "mesh_agent_cache_insertions_total %ld\n"
+               "# HELP mesh_agent_cache_evictions_total Entries evicted to stay within the cache size.\n"
+               "# TYPE mesh_agent_cache_evictions_total counter\n"
+               "mesh_agent_cache_evictions_total %ld\n"
+               "# HELP mesh_agent_cache_expirations_total Entries dropped after their TTL.\n"
+               "# TYPE mesh_agent_cache_expirations_total counter\n"
+               "mesh_agent_cache_expirations_total %ld\n"
+               "# HELP mesh_agent_cache_entries Responses in the cache.\n"
+               "# TYPE mesh_agent_cache_entries gauge\n"
+               "mesh_agent_cache_entries %ld\n"
+               "# HELP mesh_agent_cache_bytes Bytes of the responses in the cache.\n"
+               "# TYPE mesh_agent_cache_bytes gauge\n"
+               "mesh_agent_cache_bytes %ld\n"
+               "# HELP mesh_agent_cache_max_bytes Size of the cache.\n"
+               "# TYPE mesh_agent_cache_max_bytes gauge\n"
+               "mesh_agent_cache_max_bytes %ld\n"
+               "# HELP mesh_agent_coalesced_total Calls that shared the response of an identical one in flight.\n"
+               "# TYPE mesh_agent_coalesced_total counter\n"
+               "mesh_agent_coalesced_total %ld\n",
+            stats->hits, stats->misses, stats->insertions, stats->evictions, stats->expirations,
+            stats->entries, stats->bytes, stats->max_bytes, num_coalesced);
+    if (fclose(f) != 0 || rename(tmp_path, stats_path) == -1) {
+        log_msg(WARN, "Failed to write %s: %s", stats_path, strerror(errno));
+    }
+}
+
+void cleanup_connection_apa(void *elem) {
+    log_msg(INFO, "Cleanup connection to remote agent");
+    connection_apa_t *conn_apa = elem;
+    if (conn_apa->fd > 0) {
+        log_msg(WARN, "Abort connection to provider agent with socket: %d", conn_apa->fd);
+        close(conn_apa->fd);
+        conn_apa->fd = -1;
+    }
+}
+
+/*
+ * Give a connection to remote agent back, or straight to the oldest request waiting for one.
+ */
+void release_connection_apa(aeEventLoop *event_loop, connection_apa_t *conn_apa) {
+    endpoint_t *endpoint = conn_apa->endpoint;
+    if (UNLIKELY(conn_apa->shm && !shm_attached(&endpoint->channel))) {
+        // Channel went away while it was busy, goes on over TCP
+        replace_connection_apa(event_loop, conn_apa);
+        return;
+    }
+
+    // Hand over unless the concurrency limit went down below the requests in flight
+    if (UNLIKELY(endpoint->num_waiting > 0) && endpoint_inflight(endpoint) <= endpoint->limit) {
+        connection_ca_t *conn_ca = endpoint->wait_queue[endpoint->wait_head];
+        endpoint->wait_head = (endpoint->wait_head + 1) % ENDPOINT_WAIT_QUEUE_SIZE;
+        endpoint->num_waiting--;
+        conn_ca->conn_apa = conn_apa;
+        resume_connection_ca(event_loop, conn_ca);
+
+        if (UNLIKELY(consumers_throttled) && endpoint->num_waiting <= ENDPOINT_WAIT_QUEUE_SIZE / 2) {
+            unthrottle_consumers(event_loop);
+        }
+        return;
+    }
+
+    if (UNLIKELY(draining)) {
+        pass_connection_apa(conn_apa);
+    }
+    PoolReturn(endpoint->conn_pool, conn_apa);
+}
+
+/*
+ * Park a request until a connection to the endpoint is released. Reads from its consumer
+ * are stopped meanwhile; once the queue is full, new requests from all consumers are
+ * left unread too, so bursts push back on clients instead of failing.
+ */
+void park_connection_ca(aeEventLoop *event_loop, endpoint_t *endpoint, connection_ca_t *conn_ca) {
+    if (UNLIKELY(endpoint->num_waiting == ENDPOINT_WAIT_QUEUE_SIZE)) {
+        // Requests read in the same batch as the one filling up the queue, dispatched again
+        // once consumers are unthrottled
+        throttle_consumer(event_loop, conn_ca);
+        return;
+    }
+    aeDeleteFileEvent(event_loop, conn_ca->fd, AE_READABLE);
+    int tail = (endpoint->wait_head + endpoint->num_waiting) % ENDPOINT_WAIT_QUEUE_SIZE;
+    endpoint->wait_queue[tail] = conn_ca;
+    endpoint->num_waiting++;
+    log_msg(DEBUG, "Wait for connection to remote agent %s:%d for socket %d, %d waiting",
+            endpoint->ip, endpoint->port, conn_ca->fd, endpoint->num_waiting);
+
+    if (UNLIKELY(endpoint->num_waiting == ENDPOINT_WAIT_QUEUE_SIZE && !consumers_throttled)) {
+        log_msg(WARN, "Wait queue for remote agent %s:%d is full, stop reading new requests",
+                endpoint->ip, endpoint->port);
+        consumers_throttled = true;
+    }
+}
+
+void resume_connection_ca(aeEventLoop *event_loop, connection_ca_t *conn_ca) {
+    int fd = conn_ca->fd;
+    int ret;
+    if (forward_mode == FORWARD_MODE_SPLICE) {
+        conn_ca->pipe = PoolGet(splice_pipe_pool);
+        if (UNLIKELY(conn_ca->pipe == NULL)) {
+            log_msg(ERR, "No splice pipe available for socket %d", fd);
+            abort_connection_ca(event_loop, conn_ca);
+            return;
+        }
+        ret = aeCreateFileEvent(event_loop, fd, AE_READABLE, splice_from_consumer, conn_ca);
+    } else {
+        forward_to_remote_agent(event_loop, conn_ca);
+        if (UNLIKELY(conn_ca->fd < 0)) {
+            return;
+        }
+        ret = aeCreateFileEvent(event_loop, fd, AE_READABLE, read_from_consumer, conn_ca);
+    }
+    if (UNLIKELY(ret == AE_ERR)) {
+        log_msg(ERR, "Failed to resume readable event for socket %d", fd);
+        abort_connection_ca(event_loop, conn_ca);
+    }
+}
+
+void throttle_consumer(aeEventLoop *event_loop, connection_ca_t *conn_ca) {
+    aeDeleteFileEvent(event_loop, conn_ca->fd, AE_READABLE);
+    // FIFO, the longest throttled consumers are resumed first
+    conn_ca->next_throttled = NULL;
+    if (throttled_tail != NULL) {
+        throttled_tail->next_throttled = conn_ca;
+    } else {
+        throttled_list = conn_ca;
+    }
+    throttled_tail = conn_ca;
+}
+
+void unthrottle_consumers(aeEventLoop *event_loop) {
+    int n = 0;
+    consumers_throttled = false;
+
+    // Consumers are resumed in order and their requests taken right away, until a wait queue
+    // fills up again. The rest stay throttled without a syscall spent on them.
+    while (throttled_list != NULL && (!consumers_throttled || UNLIKELY(draining))) {
+        connection_ca_t *conn_ca = throttled_list;
+        throttled_list = conn_ca->next_throttled;
+        if (throttled_list == NULL) {
+            throttled_tail = NULL;
+        }
+
+        int ret;
+        if (forward_mode == FORWARD_MODE_SPLICE) {
+            ret = aeCreateFileEvent(event_loop, conn_ca->fd, AE_READABLE, splice_from_consumer, conn_ca);
+        } else {
+            ret = aeCreateFileEvent(event_loop, conn_ca->fd, AE_READABLE, read_from_consumer, conn_ca);
+        }
+        if (UNLIKELY(ret == AE_ERR)) {
+            log_msg(ERR, "Failed to resume readable event for socket %d", conn_ca->fd);
+            abort_connection_ca(event_loop, conn_ca);
+        } else if (UNLIKELY(conn_ca->nread_in > 0 && conn_ca->conn_apa == NULL)) {
+            dispatch_request(event_loop, conn_ca);
+        } else if (UNLIKELY(draining)) {
+            // Left unread for consumer_handoff() to pass
+        } else if (forward_mode == FORWARD_MODE_SPLICE) {
+            splice_from_consumer(event_loop, conn_ca->fd, conn_ca, AE_READABLE);
+        } else {
+            read_from_consumer(event_loop, conn_ca->fd, conn_ca, AE_READABLE);
+        }
+        n++;
+    }
+    log_msg(DEBUG, "Resume reading new requests from %d consumers", n);
+}
+
+void close_connection_ca(aeEventLoop *event_loop, connection_ca_t *conn_ca) {
+    int fd = conn_ca->fd;
+    if (UNLIKELY(conn_ca->leading)) {
+        release_followers(event_loop, conn_ca);
+    }
+    if (UNLIKELY(conn_ca->leader != NULL)) {
+        unfollow_request(conn_ca);
+    }
+    if (UNLIKELY(conn_ca->hedge_endpoint != NULL)) {
+        untrack_hedge_candidate(conn_ca);
+    }
+    if (UNLIKELY(conn_ca->conn_hedge != NULL)) {
+        cancel_hedge(event_loop, conn_ca->conn_hedge);
+        conn_ca->conn_hedge = NULL;
+    }
+    aeDeleteFileEvent(event_loop, fd, AE_WRITABLE | AE_READABLE);
+    PoolReturn(connection_ca_pool, conn_ca);
+    conn_ca->fd = -1;
+    close(fd);
+    log_msg(DEBUG, "Returned connection object to pool, active: %d", connection_ca_pool->outstanding);
+}
+
+void abort_connection_ca(aeEventLoop *event_loop, connection_ca_t *conn_ca) {
+    // Dump data
+    log_msg(WARN, "Conn ca: nread_in - %d, nwrite_in - %d, nread_out - %d, nwrite_out - %d",
+            conn_ca->nread_in, conn_ca->nwrite_in, conn_ca->nread_out, conn_ca->nwrite_out);
+//    log_msg(WARN, "Conn ca data: buf_in - %.*s, buf_out - %.*s",
+//            conn_ca->nread_in, conn_ca->buf_in, conn_ca->nread_out, conn_ca->buf_out);
+
+    log_msg(ERR, "Abort connection to consumer with socket: %d", conn_ca->fd);
+    aeDeleteFileEvent(event_loop, conn_ca->fd, AE_WRITABLE | AE_READABLE);
+    close(conn_ca->fd);
+    conn_ca->fd = -1;
+
+    if (UNLIKELY(conn_ca->hedge_endpoint != NULL)) {
+        untrack_hedge_candidate(conn_ca);
+    }
+    if (UNLIKELY(conn_ca->conn_hedge != NULL)) {
+        cancel_hedge(event_loop, conn_ca->conn_hedge);
+        conn_ca->conn_hedge = NULL;
+    }
+    if (UNLIKELY(conn_ca->leading)) {
+        release_followers(event_loop, conn_ca);
+    }
+    if (UNLIKELY(conn_ca->leader != NULL)) {
+        unfollow_request(conn_ca);
+    }
+
+    connection_apa_t *conn_apa = conn_ca->conn_apa;
+    if (conn_apa != NULL) {
+        log_msg(ERR, "Abort connection to provider agent with socket: %d", conn_apa->fd);
+        // It may be in the middle of a response, replace it with a new one
+        replace_connection_apa(event_loop, conn_apa);
+        conn_ca->conn_apa = NULL;
     }
+    release_splice_pipe(conn_ca);
 
     PoolReturn(connection_ca_pool, conn_ca);
     log_msg(DEBUG, "Returned connection object to pool, active: %d", connection_ca_pool->outstanding);
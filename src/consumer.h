@@ -7,12 +7,37 @@
 #include "etcd.h"
 #include "http_parser.h"
 #include "anet.h"
+#include "handoff.h"
+#include "cache.h"
+#include "route.h"
+#include "dubbo.h"
+#include "shm.h"
+#include "trace.h"
 
 // Adjustable params
 #define CONSUMER_HTTP_REQ_BUF_SIZE 2048
 #define CONSUMER_HTTP_RESP_BUF_SIZE 256
+#define CONSUMER_DUBBO_REQ_BUF_SIZE 2048
+#define CONSUMER_SPLICE_CHUNK_SIZE 65536
+#define MAX_ENDPOINTS 16
+#define ENDPOINT_WAIT_QUEUE_SIZE 128
+#define HEDGE_LATENCY_BUCKETS 128
 #define LATENCY_AWARE
 
+// Forwarding modes
+#define FORWARD_MODE_COPY 0    // read(2)/write(2) through buf_in/buf_out
+#define FORWARD_MODE_SPLICE 1  // splice(2) socket-to-socket through a kernel pipe
+
+// Protocols to remote agents
+#define PROTOCOL_HTTP 0    // HTTP requests, encoded by provider agents
+#define PROTOCOL_DUBBO 1   // Dubbo frames to provider agents that relay them
+#define PROTOCOL_DIRECT 2  // Dubbo frames straight to providers that advertise their port
+
+// Endpoint health, see detect_outliers()
+#define ENDPOINT_HEALTHY 0
+#define ENDPOINT_EJECTED 1  // out of balancing until the ejection window ends
+#define ENDPOINT_PROBING 2  // admitted for a growing share of requests
+
 // Consumer <-> Agent
 typedef struct connection_ca {
     int fd;
@@ -25,34 +50,148 @@ typedef struct connection_ca {
     ssize_t nread_out;
     ssize_t nwrite_out;
 
+    // Request in buf_in encoded for a remote agent that relays Dubbo frames, see encode_request()
+    char buf_req[CONSUMER_DUBBO_REQ_BUF_SIZE];
+    ssize_t len_req;
+    bool dubbo;  // sent as buf_req and answered with a frame
+
+    struct service *service; // of the request in buf_in, see route_connection_ca()
     struct connection_apa *conn_apa;
+    struct splice_pipe *pipe; // only held by an in-flight request in splice mode
+    ssize_t len_out;          // of the response in splice mode, 0 until its headers are in buf_out
+    ssize_t nsplice_out;      // of its bytes spliced after the ones in buf_out
+    bool reads_paused;
+    struct connection_ca *next_throttled; // not read from while a wait queue is full
+
+    // Request hedging, copy mode only
+    struct connection_apa *conn_hedge; // duplicate of the request sent to another endpoint
+    struct endpoint *hedge_endpoint;   // whose hedge candidates this is in, see hedge_requests()
+    struct connection_ca *prev_candidate;
+    struct connection_ca *next_candidate;
+
+    // Response caching and coalescing of identical calls, copy mode only
+    cache_key_t cache_key; // of the request in flight, points into buf_in
+    bool keyed;            // until the response is cached and shared
+    bool leading;          // in the table of calls in flight, see follow_request()
+    struct connection_ca *next_inflight;
+    struct connection_ca *followers;     // waiting for the response of this one
+    struct connection_ca *next_follower;
+    struct connection_ca *leader;        // whose response this one waits for
+
+    trace_span_t span; // of the request in flight if sampled, copy mode only
 } connection_ca_t;
 
+// Kernel pipe used to move bytes between sockets in splice mode
+typedef struct splice_pipe {
+    int fd_r;
+    int fd_w;
+    ssize_t npipe; // bytes currently buffered in the pipe
+} splice_pipe_t;
+
 // Agent <-> Provider Agent
 typedef struct connection_apa {
     int fd;
     struct endpoint *endpoint;
-#ifdef LATENCY_AWARE
-    long req_start;
-#endif
+    long req_start_us;
+    struct connection_apa *next; // in endpoint's reconnect list
+
+    // Over the shared memory channel of the endpoint instead of fd, see attach_connection_apa()
+    bool shm;
+    uint32_t tag;
+    struct connection_ca *conn_ca; // waiting for its response
 } connection_apa_t;
 
 typedef struct endpoint {
     char *ip;
     int port;
+    bool relay; // takes Dubbo frames as well as HTTP requests
+    int dubbo_port; // of the provider behind the remote agent, 0 if not registered
+    bool direct;    // port is dubbo_port, the remote agent is bypassed and only frames are taken
+
+    // Shared memory channel to the remote agent if it is on this host, see attach_shm_channel()
+    bool shm;       // registered that it takes one
+    shm_channel_t channel;
+    struct connection_apa *shm_conns[SHM_MAX_TAGS]; // by tag index
+    uint16_t shm_generation;
+    long shm_retry_ms;
+
+    // Capacity registered by the remote agent, 0 if not known, see size_endpoints()
+    int weight;
+    int cores;
+    int max_concurrency;
+    int service_rate;
+    int pool_size;
 #ifdef LATENCY_AWARE
     long total_ms;
     int num_reqs;
     int score;
 #endif
-    Pool *conn_pool; // pool of connection_apa
+    Pool *conn_pool; // pool of connection_apa, only connected ones are in pool
+    int num_live;    // connected, in pool or in use
+
+    // Requests waiting for a connection from pool, FIFO
+    struct connection_ca *wait_queue[ENDPOINT_WAIT_QUEUE_SIZE];
+    int wait_head;
+    int num_waiting;
+
+    // Outlier detection, counters of the current health check interval
+    int health;
+    int probe_percent;
+    int consecutive_failures;
+    int num_ejections; // scales the ejection window, reset after a quiet period
+    long ejected_until;
+    int win_reqs;
+    int win_errors;
+    long win_us;
+
+    // Adaptive concurrency limit on requests in flight, see update_limit()
+    int limit;
+    long min_rtt_us;     // RTT without queueing, 0 until measured
+    long win_min_rtt_us;
+    int win_samples;
+    int win_max_inflight;
+    int num_windows;     // since min_rtt_us was last reset
+
+    // Request hedging, requests in flight in the order they were sent
+    uint32_t latency_hist[HEDGE_LATENCY_BUCKETS]; // log-linear buckets of RTT in us
+    uint32_t hist_count;
+    long hedge_delay_us; // 0 until enough samples
+    struct connection_ca *candidates_head;
+    struct connection_ca *candidates_tail;
+
+    // Load of the provider behind the remote agent, from all consumer agents, see parse_load()
+    int remote_inflight;
+    int remote_queued;
+    long remote_service_us;
+    long load_updated_us; // 0 until reported
+
+    // Connection objects waiting for the retry timer, see warm_up_endpoint()
+    connection_apa_t *reconnect_list;
+    long long retry_timer;
+    int backoff_ms;
 } endpoint_t;
 
+// Interface registered in etcd, balanced over the endpoints that registered it. An endpoint
+// may serve several services, its connections and load are shared among them.
+typedef struct service {
+    char *name;
+    int serialization; // Dubbo serialization ID its endpoints registered, fastjson if none
+    endpoint_t *endpoints[MAX_ENDPOINTS];
+    int num_endpoints;
+} service_t;
+
 
-void consumer_init();
+void consumer_init(aeEventLoop *event_loop, int forward_mode, int hedge_percentile, int cache_mb, int cache_ttl_ms,
+                   bool coalesce, const char *idempotent_calls, const char *stats_dir, int protocol, bool echo);
 
 void consumer_http_handler(aeEventLoop *event_loop, int fd);
 
 void consumer_cleanup();
 
+void consumer_handoff(aeEventLoop *event_loop, int sock);
+
+int consumer_active_connections();
+
+long consumer_echoed_requests();
+
 #endif //MESH_AGENT_NATIVE_CONSUMER_H
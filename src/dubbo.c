@@ -0,0 +1,383 @@
+#include "fmacros.h"
+#include <string.h>
+#include "dubbo.h"
+#include "hessian.h"
+
+/*
+ * Dubbo frames as both agents build and read them: requests from the fields of an HTTP
+ * form, responses to the text of an HTTP body. The payload is fastjson, one JSON value per
+ * line, or Hessian2, by the serialization ID in the flags.
+ */
+
+#define HESSIAN_PUT(write) \
+    do { \
+        int n = (write); \
+        if (UNLIKELY(n < 0)) { \
+            return -1; \
+        } \
+        p += n; \
+    } while (0)
+
+/*
+ * Same fields as the text form, one Hessian2 value each. The argument is written as the
+ * type of the method parameter, a string unless it is int, long or byte[].
+ */
+static int encode_hessian2_request(char *out, size_t size, const char *service, int service_len, const char *method,
+                                   int method_len, const char *type, int type_len, const char *arg, int arg_len) {
+    char *p = out;
+    char *end = out + size;
+    HESSIAN_PUT(hessian_write_string(p, (size_t) (end - p), DUBBO_VERSION, strlen(DUBBO_VERSION)));
+    HESSIAN_PUT(hessian_write_string(p, (size_t) (end - p), service, (size_t) service_len));
+    HESSIAN_PUT(hessian_write_null(p, (size_t) (end - p))); // service version
+    HESSIAN_PUT(hessian_write_string(p, (size_t) (end - p), method, (size_t) method_len));
+    HESSIAN_PUT(hessian_write_string(p, (size_t) (end - p), type, (size_t) type_len));
+
+    if (type_len == 1 && (type[0] == 'I' || type[0] == 'J')) {
+        char number[24];
+        snprintf(number, sizeof(number), "%.*s", arg_len, arg);
+        long long value = strtoll(number, NULL, 10);
+        HESSIAN_PUT(type[0] == 'I' ? hessian_write_int(p, (size_t) (end - p), (int32_t) value)
+                                   : hessian_write_long(p, (size_t) (end - p), (int64_t) value));
+    } else if (type_len == 2 && type[0] == '[' && type[1] == 'B') {
+        HESSIAN_PUT(hessian_write_bytes(p, (size_t) (end - p), arg, (size_t) arg_len));
+    } else {
+        HESSIAN_PUT(hessian_write_string(p, (size_t) (end - p), arg, (size_t) arg_len));
+    }
+
+    // attachments
+    HESSIAN_PUT(hessian_write_map_start(p, (size_t) (end - p)));
+    HESSIAN_PUT(hessian_write_string(p, (size_t) (end - p), "path", 4));
+    HESSIAN_PUT(hessian_write_string(p, (size_t) (end - p), service, (size_t) service_len));
+    HESSIAN_PUT(hessian_write_map_end(p, (size_t) (end - p)));
+    return (int) (p - out);
+}
+
+#undef HESSIAN_PUT
+
+/*
+ * Length of the frame at the start of 'buf', 0 if its header is not read in full yet,
+ * -1 if it is not a Dubbo frame.
+ */
+int dubbo_frame_len(const char *buf, size_t len) {
+    if (len < 2) {
+        return 0;
+    }
+    if (UNLIKELY((uint8_t) buf[0] != 0xda || (uint8_t) buf[1] != 0xbb)) {
+        return -1;
+    }
+    if (len < DUBBO_HEADER_LEN) {
+        return 0;
+    }
+    uint32_t data_len = ntohl(*((uint32_t *) &buf[12]));
+    if (UNLIKELY(data_len > (1u << 30))) {
+        return -1;
+    }
+    return (int) (DUBBO_HEADER_LEN + data_len);
+}
+
+/*
+ * Two-way request of the given ID, the fields are as they come in an HTTP form. Returns
+ * the length of the frame, -1 if it does not fit in 'size'.
+ */
+int dubbo_encode_request(char *buf, size_t size, uint32_t id, int serialization,
+                         const char *service, int service_len, const char *method, int method_len,
+                         const char *type, int type_len, const char *arg, int arg_len) {
+    if (UNLIKELY(size < DUBBO_HEADER_LEN)) {
+        return -1;
+    }
+    // magic & flags
+    *((uint16_t *) buf) = htons(0xdabb);
+    buf[2] = (char) (DUBBO_FLAG_REQUEST | DUBBO_FLAG_TWOWAY | serialization);
+    buf[3] = 0;
+
+    // request id, only the low half is used
+    memset(buf + 4, 0, 4);
+    *((uint32_t *) &buf[8]) = htonl(id);
+
+    // No runtime decoding, just look up pre-defined mapping (or better: prefix tree)
+    if (LIKELY(strncmp(type, "Ljava%2Flang%2FString%3B", (size_t) type_len) == 0)) {
+        type = "Ljava/lang/String;";
+        type_len = (int) strlen(type);
+    } else if (type_len == 4 && strncmp(type, "%5BB", 4) == 0) {
+        type = "[B";
+        type_len = 2;
+    }
+
+    /*
+       "\"2.0.1\"\n"  // dubbo version
+       "\"com.alibaba.dubbo.performance.demo.provider.IHelloService\"\n" // service name
+       "null\n"  // service version
+       "\"hash\"\n" // method name
+       "\"Ljava/lang/String;\"\n" // method parameter types
+       "\"123ab\"\n" // method arguments
+       "{\"path\":\"com.alibaba.dubbo.performance.demo.provider.IHelloService\"}\n" // attachments
+     */
+
+    char *data = buf + DUBBO_HEADER_LEN;
+    size_t data_size = size - DUBBO_HEADER_LEN;
+    int data_len;
+    if (serialization == DUBBO_SERIALIZATION_HESSIAN2) {
+        data_len = encode_hessian2_request(data, data_size, service, service_len, method, method_len,
+                                           type, type_len, arg, arg_len);
+    } else {
+        data_len = snprintf(data, data_size,
+                            "\"" DUBBO_VERSION "\"\n"  // dubbo version
+                            "\"%.*s\"\n"   // service name
+                            "null\n"       // service version
+                            "\"%.*s\"\n"   // method name
+                            "\"%.*s\"\n"   // method parameter types
+                            "\"%.*s\"\n"   // method arguments
+                            "{\"path\":\"%.*s\"}\n", // attachments
+                            service_len, service, method_len, method, type_len, type, arg_len, arg,
+                            service_len, service
+        );
+        if (UNLIKELY((size_t) data_len >= data_size)) {
+            data_len = -1;
+        }
+    }
+    if (UNLIKELY(data_len < 0)) {
+        return -1;
+    }
+
+    // data length
+    *((uint32_t *) &buf[12]) = htonl((uint32_t) data_len);
+    return DUBBO_HEADER_LEN + data_len;
+}
+
+/*
+ * Heartbeat request or response with the given ID, its data is a null of the serialization
+ * in the flags. Returns the length of the frame, at most DUBBO_HEADER_LEN + 5.
+ */
+size_t dubbo_encode_heartbeat(char *buf, uint8_t flags, uint8_t status, const char *id) {
+    const char *data = (flags & 0x1f) == DUBBO_SERIALIZATION_HESSIAN2 ? "N" : "null\n";
+    size_t data_len = strlen(data);
+
+    buf[0] = (char) 0xda;
+    buf[1] = (char) 0xbb;
+    buf[2] = (char) (DUBBO_FLAG_EVENT | flags);
+    buf[3] = (char) status;
+    memcpy(buf + 4, id, 8);
+    *((uint32_t *) &buf[12]) = htonl((uint32_t) data_len);
+    memcpy(buf + DUBBO_HEADER_LEN, data, data_len);
+    return DUBBO_HEADER_LEN + data_len;
+}
+
+/*
+ * Value of a complete response frame as the text of an HTTP body, by the serialization it
+ * came in, and the HTTP status it maps to: 200 for a value, 500 for an exception or a failed
+ * call, 503 if the provider was too busy to take it. Hessian2 values are rendered into
+ * 'text', fastjson ones point into the frame. Text responses have the response type and
+ * the value on lines of their own.
+ */
+int dubbo_decode_response(const char *frame, size_t len, char *text, size_t text_size,
+                          const char **value, size_t *value_len) {
+    const char *body = frame + DUBBO_HEADER_LEN;
+    size_t body_len = len - DUBBO_HEADER_LEN;
+    uint8_t serialization = (uint8_t) frame[2] & 0x1f;
+    uint8_t status = (uint8_t) frame[3];
+    bool hessian2 = serialization == DUBBO_SERIALIZATION_HESSIAN2;
+
+    *value = "";
+    *value_len = 0;
+
+    if (UNLIKELY(status != DUBBO_STATUS_OK)) {
+        // Body is the error message
+        log_msg(WARN, "Dubbo provider answered with status %d", status);
+        if (hessian2) {
+            *value = text;
+            if (hessian_read_text(body, body_len, text, text_size, value_len) < 0) {
+                *value_len = 0;
+            }
+        } else {
+            *value = body;
+            *value_len = body_len > 0 && body[body_len - 1] == '\n' ? body_len - 1 : body_len;
+        }
+        return status == DUBBO_STATUS_CLIENT_TIMEOUT || status == DUBBO_STATUS_SERVER_TIMEOUT ||
+               status == DUBBO_STATUS_THREADPOOL_EXHAUSTED ? 503 : 500;
+    }
+
+    int32_t type;
+    const char *rest;
+    size_t rest_len;
+    if (hessian2) {
+        int n = hessian_read_int(body, body_len, &type);
+        if (UNLIKELY(n < 0)) {
+            goto malformed;
+        }
+        rest = body + n;
+        rest_len = body_len - n;
+    } else {
+        const char *line = memchr(body, '\n', body_len);
+        if (UNLIKELY(line == NULL)) {
+            goto malformed;
+        }
+        type = (int32_t) strtol(body, NULL, 10);
+        rest = line + 1;
+        rest_len = (size_t) (body + body_len - rest);
+        // Attachments follow on a line of their own
+        line = memchr(rest, '\n', rest_len);
+        if (line != NULL) {
+            rest_len = (size_t) (line - rest);
+        }
+    }
+
+    switch (type) {
+        case DUBBO_RESPONSE_VALUE:
+        case DUBBO_RESPONSE_VALUE_WITH_ATTACHMENTS:
+            if (hessian2) {
+                *value = text;
+                if (UNLIKELY(hessian_read_text(rest, rest_len, text, text_size, value_len) < 0)) {
+                    goto malformed;
+                }
+            } else {
+                *value = rest;
+                *value_len = rest_len;
+            }
+            return 200;
+        case DUBBO_RESPONSE_NULL_VALUE:
+        case DUBBO_RESPONSE_NULL_VALUE_WITH_ATTACHMENTS:
+            *value = "null";
+            *value_len = 4;
+            return 200;
+        case DUBBO_RESPONSE_WITH_EXCEPTION:
+        case DUBBO_RESPONSE_WITH_EXCEPTION_WITH_ATTACHMENTS:
+            // Exceptions are Java objects in hessian2, only the text of fastjson ones is passed on
+            log_msg(WARN, "Dubbo provider answered with an exception");
+            if (!hessian2) {
+                *value = rest;
+                *value_len = rest_len;
+            }
+            return 500;
+        default:
+            break;
+    }
+
+malformed:
+    log_msg(WARN, "Failed to decode Dubbo response, serialization %d", serialization);
+    *value = "";
+    *value_len = 0;
+    return 500;
+}
+
+// Status line text of the HTTP status dubbo_decode_response() maps to
+const char *dubbo_http_status(int status) {
+    return status == 200 ? "200 OK" : status == 503 ? "503 Service Unavailable" : "500 Internal Server Error";
+}
+
+/*
+ * String.hashCode() of the UTF-8 text, over the UTF-16 units Java holds it in.
+ */
+int32_t java_string_hash(const char *text, size_t len) {
+    uint32_t hash = 0;
+    const uint8_t *p = (const uint8_t *) text;
+    const uint8_t *end = p + len;
+    while (p < end) {
+        uint32_t c = *p++;
+        int more = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+        c &= more == 3 ? 0x07 : more == 2 ? 0x0f : more == 1 ? 0x1f : 0x7f;
+        for (; more > 0 && p < end; more--) {
+            c = (c << 6) | (*p++ & 0x3f);
+        }
+        if (c >= 0x10000) {
+            c -= 0x10000;
+            hash = 31 * hash + (0xd800 + (c >> 10));
+            c = 0xdc00 + (c & 0x3ff);
+        }
+        hash = 31 * hash + c;
+    }
+    return (int32_t) hash;
+}
+
+/*
+ * Text of the argument of a call: the sixth line of a fastjson body, without its quotes,
+ * or the sixth value of a Hessian2 one. NULL if the body does not have it.
+ */
+static const char *read_argument(const char *body, size_t len, bool hessian2, char *text, size_t *text_len) {
+    static char scratch[DUBBO_TEXT_BUF_SIZE]; // fields of a request skipped on the way to its argument
+    if (hessian2) {
+        size_t pos = 0;
+        for (int i = 0; i < 6; i++) {
+            // Dubbo version, service, its version, method and parameter types come first
+            char *out = i < 5 ? scratch : text;
+            int n = hessian_read_text(body + pos, len - pos, out, DUBBO_TEXT_BUF_SIZE, text_len);
+            if (n < 0) {
+                return NULL;
+            }
+            pos += n;
+        }
+        return text;
+    }
+
+    const char *line = body;
+    const char *end = body + len;
+    for (int i = 0; i < 5; i++) {
+        line = memchr(line, '\n', (size_t) (end - line));
+        if (line == NULL) {
+            return NULL;
+        }
+        line++;
+    }
+    const char *line_end = memchr(line, '\n', (size_t) (end - line));
+    if (line_end == NULL) {
+        line_end = end;
+    }
+    if (line_end - line >= 2 && line[0] == '"' && line_end[-1] == '"') {
+        line++;
+        line_end--;
+    }
+    *text_len = (size_t) (line_end - line);
+    return line;
+}
+
+/*
+ * Answer a complete request frame as the hash method of the demo service would, with the
+ * Java hash code of its argument in the serialization it came in. Heartbeats are answered
+ * too. Returns the length of the answer written to 'out', 0 for a one-way request and -1 if
+ * the call does not parse or the answer does not fit in 'size'.
+ */
+int dubbo_answer_call(char *out, size_t size, const char *frame, size_t len) {
+    static char arg_text[DUBBO_TEXT_BUF_SIZE];
+    uint8_t flags = (uint8_t) frame[2];
+    uint8_t serialization = flags & 0x1f;
+    if (UNLIKELY(!(flags & DUBBO_FLAG_REQUEST))) {
+        // Heartbeats of ours are not sent
+        return 0;
+    }
+    if (UNLIKELY(!(flags & DUBBO_FLAG_TWOWAY))) {
+        return 0;
+    }
+    if (UNLIKELY(size < DUBBO_HEADER_LEN + 16)) {
+        return -1;
+    }
+    if (UNLIKELY(flags & DUBBO_FLAG_EVENT)) {
+        return (int) dubbo_encode_heartbeat(out, serialization, DUBBO_STATUS_OK, frame + 4);
+    }
+
+    bool hessian2 = serialization == DUBBO_SERIALIZATION_HESSIAN2;
+    size_t arg_len;
+    const char *arg = read_argument(frame + DUBBO_HEADER_LEN, len - DUBBO_HEADER_LEN, hessian2, arg_text, &arg_len);
+    if (UNLIKELY(arg == NULL)) {
+        return -1;
+    }
+    int32_t hash = java_string_hash(arg, arg_len);
+
+    char *data = out + DUBBO_HEADER_LEN;
+    int data_len;
+    if (hessian2) {
+        data_len = hessian_write_int(data, size - DUBBO_HEADER_LEN, DUBBO_RESPONSE_VALUE);
+        data_len += hessian_write_int(data + data_len, size - DUBBO_HEADER_LEN - data_len, hash);
+    } else {
+        data_len = snprintf(data, size - DUBBO_HEADER_LEN, "%d\n%d\n", DUBBO_RESPONSE_VALUE, hash);
+        if (UNLIKELY((size_t) data_len >= size - DUBBO_HEADER_LEN)) {
+            return -1;
+        }
+    }
+
+    out[0] = (char) 0xda;
+    out[1] = (char) 0xbb;
+    out[2] = (char) serialization;
+    out[3] = DUBBO_STATUS_OK;
+    memcpy(out + 4, frame + 4, 8);
+    *((uint32_t *) &out[12]) = htonl((uint32_t) data_len);
+    return DUBBO_HEADER_LEN + data_len;
+}
@@ -0,0 +1,54 @@
+#ifndef MESH_AGENT_NATIVE_DUBBO_H
+#define MESH_AGENT_NATIVE_DUBBO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "common.h"
+
+#define DUBBO_HEADER_LEN 16
+#define DUBBO_VERSION "2.0.1"
+
+// Adjustable params
+#define DUBBO_TEXT_BUF_SIZE 4096  // of a text field read from a request, see dubbo_answer_call()
+
+// Flags of a Dubbo header, the low bits are the serialization ID
+#define DUBBO_FLAG_REQUEST 0x80
+#define DUBBO_FLAG_TWOWAY 0x40
+#define DUBBO_FLAG_EVENT 0x20  // heartbeat
+#define DUBBO_SERIALIZATION_HESSIAN2 2
+#define DUBBO_SERIALIZATION_FASTJSON 6
+
+// Status of a Dubbo response
+#define DUBBO_STATUS_OK 20
+#define DUBBO_STATUS_CLIENT_TIMEOUT 30
+#define DUBBO_STATUS_SERVER_TIMEOUT 31
+#define DUBBO_STATUS_THREADPOOL_EXHAUSTED 100
+
+// Response types, the first value of an OK response body
+#define DUBBO_RESPONSE_WITH_EXCEPTION 0
+#define DUBBO_RESPONSE_VALUE 1
+#define DUBBO_RESPONSE_NULL_VALUE 2
+#define DUBBO_RESPONSE_WITH_EXCEPTION_WITH_ATTACHMENTS 3
+#define DUBBO_RESPONSE_VALUE_WITH_ATTACHMENTS 4
+#define DUBBO_RESPONSE_NULL_VALUE_WITH_ATTACHMENTS 5
+
+int dubbo_frame_len(const char *buf, size_t len);
+
+int dubbo_encode_request(char *buf, size_t size, uint32_t id, int serialization,
+                         const char *service, int service_len, const char *method, int method_len,
+                         const char *type, int type_len, const char *arg, int arg_len);
+
+size_t dubbo_encode_heartbeat(char *buf, uint8_t flags, uint8_t status, const char *id);
+
+int dubbo_decode_response(const char *frame, size_t len, char *text, size_t text_size,
+                          const char **value, size_t *value_len);
+
+const char *dubbo_http_status(int status);
+
+int32_t java_string_hash(const char *text, size_t len);
+
+int dubbo_answer_call(char *out, size_t size, const char *frame, size_t len);
+
+#endif //MESH_AGENT_NATIVE_DUBBO_H
@@ -0,0 +1,266 @@
+#include "handoff.h"
+
+#define HANDOFF_MAX_FDS 4096
+#define HANDOFF_LISTEN_BACKLOG 16
+
+typedef struct inherited_fd {
+    handoff_msg_t msg;
+    int fd;
+} inherited_fd_t;
+
+static char neterr[256];
+
+static inherited_fd_t inherited[HANDOFF_MAX_FDS];
+static int num_inherited = 0;
+static int next_client = 0;
+
+static int server_fd = -1;
+static handoff_proc *takeover_proc = NULL;
+
+// Old process: socket to the new agent, kept open while draining
+static int successor_sock = -1;
+// New process: socket to the old agent, which passes connections as they become idle
+static int predecessor_sock = -1;
+static handoff_client_proc *adopt_proc = NULL;
+
+
+void accept_handoff_handler(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+void late_handoff_handler(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+
+/*
+ * Connect to the agent currently serving at 'path' and take all the descriptors
+ * it hands over. The old agent stops accepting once the listening socket is sent,
+ * and exits after its in-flight requests are done.
+ */
+int handoff_receive(char *path) {
+    int sock = anetUnixConnect(neterr, path);
+    if (sock == ANET_ERR) {
+        log_msg(INFO, "No running agent to take over at %s: %s", path, neterr);
+        return 0;
+    }
+    log_msg(INFO, "Taking over from running agent at %s", path);
+
+    handoff_msg_t msg;
+    int fd, nread;
+    while ((nread = anetRecvFd(neterr, sock, &fd, &msg, sizeof(msg))) == sizeof(msg)) {
+        if (msg.type == HANDOFF_DONE) {
+            break;
+        }
+        if (fd < 0) {
+            log_msg(WARN, "Handoff message of type %d without descriptor", msg.type);
+            continue;
+        }
+        if (num_inherited == HANDOFF_MAX_FDS) {
+            log_msg(WARN, "Too many descriptors handed off, drop socket %d", fd);
+            close(fd);
+            continue;
+        }
+        inherited[num_inherited].msg = msg;
+        inherited[num_inherited].fd = fd;
+        num_inherited++;
+    }
+    if (nread != sizeof(msg)) {
+        log_msg(ERR, "Handoff interrupted after %d descriptors: %s", num_inherited,
+                nread < 0 ? neterr : "connection closed");
+        close(sock);
+    } else {
+        predecessor_sock = sock;
+    }
+
+    log_msg(INFO, "Inherited %d descriptors from running agent", num_inherited);
+    return num_inherited;
+}
+
+static int take_inherited(int type, const char *ip, int port) {
+    for (int i = 0; i < num_inherited; i++) {
+        inherited_fd_t *in = &inherited[i];
+        if (in->fd < 0 || in->msg.type != type) {
+            continue;
+        }
+        if (ip != NULL && (in->msg.port != port || strcmp(in->msg.ip, ip) != 0)) {
+            continue;
+        }
+        int fd = in->fd;
+        in->fd = -1;
+        return fd;
+    }
+    return -1;
+}
+
+int handoff_take_listener() {
+    return take_inherited(HANDOFF_LISTENER, NULL, 0);
+}
+
+int handoff_count_upstream(const char *ip, int port) {
+    int n = 0;
+    for (int i = 0; i < num_inherited; i++) {
+        inherited_fd_t *in = &inherited[i];
+        if (in->fd >= 0 && in->msg.type == HANDOFF_UPSTREAM && in->msg.port == port && strcmp(in->msg.ip, ip) == 0) {
+            n++;
+        }
+    }
+    return n;
+}
+
+int handoff_take_upstream(const char *ip, int port) {
+    return take_inherited(HANDOFF_UPSTREAM, ip, port);
+}
+
+int handoff_take_client() {
+    for (; next_client < num_inherited; next_client++) {
+        inherited_fd_t *in = &inherited[next_client];
+        if (in->fd >= 0 && in->msg.type == HANDOFF_CLIENT) {
+            int fd = in->fd;
+            in->fd = -1;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+// New process: whether the old agent may still pass connections
+int handoff_pending() {
+    return predecessor_sock >= 0;
+}
+
+void handoff_close_unclaimed() {
+    int n = 0;
+    for (int i = 0; i < num_inherited; i++) {
+        if (inherited[i].fd >= 0) {
+            close(inherited[i].fd);
+            inherited[i].fd = -1;
+            n++;
+        }
+    }
+    if (n > 0) {
+        log_msg(WARN, "Closed %d inherited descriptors nobody claimed", n);
+    }
+    num_inherited = 0;
+    next_client = 0;
+}
+
+int handoff_serve(aeEventLoop *event_loop, char *path, handoff_proc *proc, handoff_client_proc *adopt) {
+    adopt_proc = adopt;
+    if (predecessor_sock >= 0) {
+        anetNonBlock(NULL, predecessor_sock);
+        if (aeCreateFileEvent(event_loop, predecessor_sock, AE_READABLE, late_handoff_handler, NULL) == AE_ERR) {
+            log_msg(ERR, "Failed to create file event for late_handoff_handler: %s", strerror(errno));
+            close(predecessor_sock);
+            predecessor_sock = -1;
+        }
+    }
+
+    unlink(path);
+    server_fd = anetUnixServer(neterr, path, 0600, HANDOFF_LISTEN_BACKLOG);
+    if (server_fd == ANET_ERR) {
+        log_msg(ERR, "Failed to create handoff socket at %s: %s", path, neterr);
+        return -1;
+    }
+    anetNonBlock(NULL, server_fd);
+
+    if (aeCreateFileEvent(event_loop, server_fd, AE_READABLE, accept_handoff_handler, NULL) == AE_ERR) {
+        log_msg(ERR, "Failed to create file event for accept_handoff_handler: %s", strerror(errno));
+        close(server_fd);
+        server_fd = -1;
+        return -1;
+    }
+    takeover_proc = proc;
+    log_msg(INFO, "Serve handoff at %s", path);
+    return 0;
+}
+
+void accept_handoff_handler(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    int sock = anetUnixAccept(neterr, fd);
+    if (sock == ANET_ERR) {
+        if (errno != EWOULDBLOCK) {
+            log_msg(ERR, "Failed to accept handoff connection: %s", neterr);
+        }
+        return;
+    }
+    log_msg(INFO, "New agent is taking over with socket %d", sock);
+
+    // Only one takeover, the path belongs to the new agent from now on
+    aeDeleteFileEvent(event_loop, fd, AE_READABLE);
+    close(fd);
+    server_fd = -1;
+
+    anetBlock(NULL, sock);
+    takeover_proc(event_loop, sock);
+    if (handoff_send(sock, HANDOFF_DONE, NULL, 0, -1) != ANET_OK) {
+        log_msg(ERR, "Failed to finish handoff: %s", neterr);
+        close(sock);
+        return;
+    }
+    successor_sock = sock;
+}
+
+/*
+ * Old process: pass a client connection whose in-flight request is done.
+ * The caller closes its own copy of the descriptor either way.
+ */
+static int pass_late(int type, const char *ip, int port, int fd) {
+    if (successor_sock < 0) {
+        return ANET_ERR;
+    }
+    if (handoff_send(successor_sock, type, ip, port, fd) != ANET_OK) {
+        close(successor_sock);
+        successor_sock = -1;
+        return ANET_ERR;
+    }
+    return ANET_OK;
+}
+
+int handoff_pass_client(int fd) {
+    return pass_late(HANDOFF_CLIENT, NULL, 0, fd);
+}
+
+// Old process: pass a connection to ip:port whose in-flight request is done
+int handoff_pass_upstream(const char *ip, int port, int fd) {
+    return pass_late(HANDOFF_UPSTREAM, ip, port, fd);
+}
+
+void late_handoff_handler(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    handoff_msg_t msg;
+    int client_fd;
+    int nread = anetRecvFd(neterr, fd, &client_fd, &msg, sizeof(msg));
+
+    if (nread == sizeof(msg)) {
+        if (client_fd < 0) {
+            return;
+        }
+        if (msg.type == HANDOFF_CLIENT) {
+            adopt_proc(event_loop, client_fd);
+        } else if (msg.type == HANDOFF_UPSTREAM && num_inherited < HANDOFF_MAX_FDS) {
+            // Picked up when a pool grows past what it preallocated
+            inherited[num_inherited].msg = msg;
+            inherited[num_inherited].fd = client_fd;
+            num_inherited++;
+        } else {
+            close(client_fd);
+        }
+        return;
+    }
+    if (nread < 0 && errno == EAGAIN) {
+        return;
+    }
+    // Old agent has finished draining
+    log_msg(INFO, "Running agent finished handoff");
+    aeDeleteFileEvent(event_loop, fd, AE_READABLE);
+    close(fd);
+    predecessor_sock = -1;
+}
+
+int handoff_send(int sock, int type, const char *ip, int port, int fd) {
+    handoff_msg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = type;
+    msg.port = port;
+    if (ip != NULL) {
+        strncpy(msg.ip, ip, sizeof(msg.ip) - 1);
+    }
+    if (anetSendFd(neterr, sock, fd, &msg, sizeof(msg)) == ANET_ERR) {
+        log_msg(ERR, "Failed to hand off socket %d: %s", fd, neterr);
+        return ANET_ERR;
+    }
+    return ANET_OK;
+}
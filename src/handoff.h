@@ -0,0 +1,40 @@
+#ifndef MESH_AGENT_NATIVE_HANDOFF_H
+#define MESH_AGENT_NATIVE_HANDOFF_H
+
+#include "common.h"
+#include "ae.h"
+#include "anet.h"
+
+// Kinds of descriptors passed from the old process to the new one
+#define HANDOFF_LISTENER 1  // listening socket
+#define HANDOFF_UPSTREAM 2  // idle connection to ip:port
+#define HANDOFF_CLIENT 3    // idle accepted connection
+#define HANDOFF_DONE 4      // no more descriptors
+
+typedef struct handoff_msg {
+    int type;
+    int port;
+    char ip[46];
+} handoff_msg_t;
+
+// Called in the old process to send its descriptors over 'sock'
+typedef void handoff_proc(aeEventLoop *event_loop, int sock);
+// Called in the new process for each client connection passed while the old one drains
+typedef void handoff_client_proc(aeEventLoop *event_loop, int fd);
+
+// New process: collect descriptors from a running agent, if any
+int handoff_receive(char *path);
+int handoff_take_listener();
+int handoff_count_upstream(const char *ip, int port);
+int handoff_take_upstream(const char *ip, int port);
+int handoff_take_client();
+void handoff_close_unclaimed();
+int handoff_pending();
+
+// Old process: wait for a new process to take over
+int handoff_serve(aeEventLoop *event_loop, char *path, handoff_proc *proc, handoff_client_proc *adopt);
+int handoff_send(int sock, int type, const char *ip, int port, int fd);
+int handoff_pass_client(int fd);
+int handoff_pass_upstream(const char *ip, int port, int fd);
+
+#endif //MESH_AGENT_NATIVE_HANDOFF_H
@@ -0,0 +1,541 @@
+#include "fmacros.h"
+#include <string.h>
+#include <inttypes.h>
+#include "hessian.h"
+
+/*
+ * Hessian 2.0 as Java writes it: strings are counted in UTF-16 units and characters
+ * outside the BMP go as two 3-byte surrogates, so they are converted from and to the
+ * 4-byte UTF-8 of HTTP bodies. Values are rendered as text for HTTP responses, maps as
+ * JSON objects.
+ */
+
+#define HESSIAN_MAX_DEPTH 8 // of nested maps read
+
+static int read_value(const uint8_t *in, size_t len, char *out, size_t size, size_t *pos, bool quoted, int depth) ;
+
+
+static inline void put_be16(char *out, uint32_t value) {
+    out[0] = (char) (value >> 8);
+    out[1] = (char) value;
+}
+
+static inline void put_be32(char *out, uint32_t value) {
+    out[0] = (char) (value >> 24);
+    out[1] = (char) (value >> 16);
+    out[2] = (char) (value >> 8);
+    out[3] = (char) value;
+}
+
+static inline uint32_t get_be16(const uint8_t *in) {
+    return (uint32_t) in[0] << 8 | in[1];
+}
+
+static inline uint32_t get_be32(const uint8_t *in) {
+    return (uint32_t) in[0] << 24 | (uint32_t) in[1] << 16 | (uint32_t) in[2] << 8 | in[3];
+}
+
+int hessian_write_null(char *out, size_t size) {
+    if (size < 1) {
+        return -1;
+    }
+    out[0] = 'N';
+    return 1;
+}
+
+int hessian_write_int(char *out, size_t size, int32_t value) {
+    if (value >= -16 && value <= 47) {
+        if (size < 1) {
+            return -1;
+        }
+        out[0] = (char) (0x90 + value);
+        return 1;
+    }
+    if (value >= -2048 && value <= 2047) {
+        if (size < 2) {
+            return -1;
+        }
+        out[0] = (char) (0xc8 + (value >> 8));
+        out[1] = (char) value;
+        return 2;
+    }
+    if (value >= -262144 && value <= 262143) {
+        if (size < 3) {
+            return -1;
+        }
+        out[0] = (char) (0xd4 + (value >> 16));
+        put_be16(out + 1, (uint32_t) value);
+        return 3;
+    }
+    if (size < 5) {
+        return -1;
+    }
+    out[0] = 'I';
+    put_be32(out + 1, (uint32_t) value);
+    return 5;
+}
+
+int hessian_write_long(char *out, size_t size, int64_t value) {
+    if (value >= -8 && value <= 15) {
+        if (size < 1) {
+            return -1;
+        }
+        out[0] = (char) (0xe0 + value);
+        return 1;
+    }
+    if (value >= -2048 && value <= 2047) {
+        if (size < 2) {
+            return -1;
+        }
+        out[0] = (char) (0xf8 + (value >> 8));
+        out[1] = (char) value;
+        return 2;
+    }
+    if (value >= -262144 && value <= 262143) {
+        if (size < 3) {
+            return -1;
+        }
+        out[0] = (char) (0x3c + (value >> 16));
+        put_be16(out + 1, (uint32_t) value);
+        return 3;
+    }
+    if (value >= INT32_MIN && value <= INT32_MAX) {
+        if (size < 5) {
+            return -1;
+        }
+        out[0] = 0x59;
+        put_be32(out + 1, (uint32_t) value);
+        return 5;
+    }
+    if (size < 9) {
+        return -1;
+    }
+    out[0] = 'L';
+    put_be32(out + 1, (uint32_t) ((uint64_t) value >> 32));
+    put_be32(out + 5, (uint32_t) value);
+    return 9;
+}
+
+static inline size_t put_surrogate(char *out, uint32_t unit) {
+    out[0] = (char) (0xe0 | unit >> 12);
+    out[1] = (char) (0x80 | (unit >> 6 & 0x3f));
+    out[2] = (char) (0x80 | (unit & 0x3f));
+    return 3;
+}
+
+/*
+ * Strings up to 65535 UTF-16 units, in one chunk.
+ */
+int hessian_write_string(char *out, size_t size, const char *str, size_t len) {
+    const uint8_t *s = (const uint8_t *) str;
+    size_t units = 0;
+    size_t bytes = 0;
+    for (size_t i = 0; i < len; i++) {
+        if ((s[i] & 0xc0) != 0x80) {
+            units++;
+        }
+        if (s[i] >= 0xf0) {
+            // Surrogate pair, 6 bytes instead of 4
+            units++;
+            bytes += 2;
+        }
+    }
+    bytes += len;
+
+    size_t head;
+    if (units < 32) {
+        head = 1;
+    } else if (units < 1024) {
+        head = 2;
+    } else if (units <= 65535) {
+        head = 3;
+    } else {
+        return -1;
+    }
+    if (size < head + bytes) {
+        return -1;
+    }
+
+    if (head == 1) {
+        out[0] = (char) units;
+    } else if (head == 2) {
+        out[0] = (char) (0x30 + (units >> 8));
+        out[1] = (char) units;
+    } else {
+        out[0] = 'S';
+        put_be16(out + 1, (uint32_t) units);
+    }
+    char *p = out + head;
+    for (size_t i = 0; i < len; i++) {
+        if (LIKELY(s[i] < 0xf0) || i + 3 >= len) {
+            *p++ = (char) s[i];
+            continue;
+        }
+        uint32_t code = (uint32_t) (s[i] & 0x07) << 18 | (uint32_t) (s[i + 1] & 0x3f) << 12 |
+                        (uint32_t) (s[i + 2] & 0x3f) << 6 | (s[i + 3] & 0x3f);
+        code -= 0x10000;
+        p += put_surrogate(p, 0xd800 | code >> 10);
+        p += put_surrogate(p, 0xdc00 | (code & 0x3ff));
+        i += 3;
+    }
+    return (int) (p - out);
+}
+
+int hessian_write_bytes(char *out, size_t size, const char *bytes, size_t len) {
+    size_t written = 0;
+    // Non-final chunks of 65535 bytes
+    while (len > 65535) {
+        if (size - written < 3 + 65535) {
+            return -1;
+        }
+        out[written] = 'A';
+        put_be16(out + written + 1, 65535);
+        memcpy(out + written + 3, bytes, 65535);
+        written += 3 + 65535;
+        bytes += 65535;
+        len -= 65535;
+    }
+
+    size_t head = len <= 15 ? 1 : len <= 1023 ? 2 : 3;
+    if (size - written < head + len) {
+        return -1;
+    }
+    char *p = out + written;
+    if (head == 1) {
+        p[0] = (char) (0x20 + len);
+    } else if (head == 2) {
+        p[0] = (char) (0x34 + (len >> 8));
+        p[1] = (char) len;
+    } else {
+        p[0] = 'B';
+        put_be16(p + 1, (uint32_t) len);
+    }
+    memcpy(p + head, bytes, len);
+    return (int) (written + head + len);
+}
+
+int hessian_write_map_start(char *out, size_t size) {
+    if (size < 1) {
+        return -1;
+    }
+    // Untyped map, a HashMap to Java
+    out[0] = 'H';
+    return 1;
+}
+
+int hessian_write_map_end(char *out, size_t size) {
+    if (size < 1) {
+        return -1;
+    }
+    out[0] = 'Z';
+    return 1;
+}
+
+static int read_int(const uint8_t *in, size_t len, int32_t *value) {
+    if (len < 1) {
+        return -1;
+    }
+    uint8_t tag = in[0];
+    if (tag >= 0x80 && tag <= 0xbf) {
+        *value = tag - 0x90;
+        return 1;
+    }
+    if (tag >= 0xc0 && tag <= 0xcf) {
+        if (len < 2) {
+            return -1;
+        }
+        *value = (tag - 0xc8) * 256 + in[1];
+        return 2;
+    }
+    if (tag >= 0xd0 && tag <= 0xd7) {
+        if (len < 3) {
+            return -1;
+        }
+        *value = (tag - 0xd4) * 65536 + (int32_t) get_be16(in + 1);
+        return 3;
+    }
+    if (tag == 'I') {
+        if (len < 5) {
+            return -1;
+        }
+        *value = (int32_t) get_be32(in + 1);
+        return 5;
+    }
+    return -1;
+}
+
+static int read_long(const uint8_t *in, size_t len, int64_t *value) {
+    if (len < 1) {
+        return -1;
+    }
+    uint8_t tag = in[0];
+    if (tag >= 0xd8 && tag <= 0xef) {
+        *value = tag - 0xe0;
+        return 1;
+    }
+    if (tag >= 0xf0) {
+        if (len < 2) {
+            return -1;
+        }
+        *value = (tag - 0xf8) * 256 + in[1];
+        return 2;
+    }
+    if (tag >= 0x38 && tag <= 0x3f) {
+        if (len < 3) {
+            return -1;
+        }
+        *value = (tag - 0x3c) * 65536 + (int64_t) get_be16(in + 1);
+        return 3;
+    }
+    if (tag == 0x59) {
+        if (len < 5) {
+            return -1;
+        }
+        *value = (int32_t) get_be32(in + 1);
+        return 5;
+    }
+    if (tag == 'L') {
+        if (len < 9) {
+            return -1;
+        }
+        *value = (int64_t) ((uint64_t) get_be32(in + 1) << 32 | get_be32(in + 5));
+        return 9;
+    }
+    return -1;
+}
+
+int hessian_read_int(const char *in, size_t len, int32_t *value) {
+    return read_int((const uint8_t *) in, len, value);
+}
+
+int hessian_read_long(const char *in, size_t len, int64_t *value) {
+    return read_long((const uint8_t *) in, len, value);
+}
+
+// Nothing is written to a NULL 'out', for values skipped
+static inline bool put_text(char *out, size_t size, size_t *pos, const char *text, size_t len) {
+    if (out == NULL) {
+        return true;
+    }
+    if (size - *pos < len) {
+        return false;
+    }
+    memcpy(out + *pos, text, len);
+    *pos += len;
+    return true;
+}
+
+// One byte of a string, escaped for JSON inside maps
+static inline bool put_char(char *out, size_t size, size_t *pos, uint8_t c, bool quoted) {
+    if (quoted && (c == '"' || c == '\\')) {
+        char escaped[2] = {'\\', (char) c};
+        return put_text(out, size, pos, escaped, 2);
+    }
+    if (quoted && c < 0x20) {
+        char escaped[8];
+        return put_text(out, size, pos, escaped, (size_t) sprintf(escaped, "\\u%04x", c));
+    }
+    return put_text(out, size, pos, (const char *) &c, 1);
+}
+
+static int read_string(const uint8_t *in, size_t len, char *out, size_t size, size_t *pos, bool quoted) {
+    size_t n = 0;
+    for (;;) {
+        if (n >= len) {
+            return -1;
+        }
+        uint8_t tag = in[n];
+        bool final = tag != 'R';
+        size_t units;
+        if (tag <= 0x1f) {
+            units = tag;
+            n += 1;
+        } else if (tag >= 0x30 && tag <= 0x33) {
+            if (len - n < 2) {
+                return -1;
+            }
+            units = (size_t) (tag - 0x30) << 8 | in[n + 1];
+            n += 2;
+        } else if (tag == 'S' || tag == 'R') {
+            if (len - n < 3) {
+                return -1;
+            }
+            units = get_be16(in + n + 1);
+            n += 3;
+        } else {
+            return -1;
+        }
+
+        while (units > 0) {
+            if (n >= len) {
+                return -1;
+            }
+            uint8_t c = in[n];
+            size_t seq = c < 0x80 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+            if (len - n < seq) {
+                return -1;
+            }
+            // A surrogate pair becomes one 4-byte character
+            if (seq == 3 && c == 0xed && (in[n + 1] & 0xf0) == 0xa0 && units >= 2 &&
+                len - n >= 6 && in[n + 3] == 0xed && (in[n + 4] & 0xf0) == 0xb0) {
+                uint32_t high = (uint32_t) (in[n + 1] & 0x0f) << 6 | (in[n + 2] & 0x3f);
+                uint32_t low = (uint32_t) (in[n + 4] & 0x0f) << 6 | (in[n + 5] & 0x3f);
+                uint32_t code = 0x10000 + (high << 10 | low);
+                char utf8[4] = {(char) (0xf0 | code >> 18), (char) (0x80 | (code >> 12 & 0x3f)),
+                                (char) (0x80 | (code >> 6 & 0x3f)), (char) (0x80 | (code & 0x3f))};
+                if (!put_text(out, size, pos, utf8, 4)) {
+                    return -1;
+                }
+                n += 6;
+                units -= 2;
+                continue;
+            }
+            for (size_t i = 0; i < seq; i++) {
+                if (!put_char(out, size, pos, in[n + i], quoted)) {
+                    return -1;
+                }
+            }
+            n += seq;
+            units -= seq == 4 && units >= 2 ? 2 : 1;
+        }
+        if (final) {
+            return (int) n;
+        }
+    }
+}
+
+static int read_bytes(const uint8_t *in, size_t len, char *out, size_t size, size_t *pos) {
+    size_t n = 0;
+    for (;;) {
+        if (n >= len) {
+            return -1;
+        }
+        uint8_t tag = in[n];
+        bool final = tag != 'A';
+        size_t chunk;
+        if (tag >= 0x20 && tag <= 0x2f) {
+            chunk = tag - 0x20u;
+            n += 1;
+        } else if (tag >= 0x34 && tag <= 0x37) {
+            if (len - n < 2) {
+                return -1;
+            }
+            chunk = (size_t) (tag - 0x34) << 8 | in[n + 1];
+            n += 2;
+        } else if (tag == 'B' || tag == 'A') {
+            if (len - n < 3) {
+                return -1;
+            }
+            chunk = get_be16(in + n + 1);
+            n += 3;
+        } else {
+            return -1;
+        }
+        if (len - n < chunk || !put_text(out, size, pos, (const char *) in + n, chunk)) {
+            return -1;
+        }
+        n += chunk;
+        if (final) {
+            return (int) n;
+        }
+    }
+}
+
+static int read_map(const uint8_t *in, size_t len, char *out, size_t size, size_t *pos, int depth) {
+    if (depth >= HESSIAN_MAX_DEPTH) {
+        return -1;
+    }
+    size_t n = 1;
+    if (in[0] == 'M') {
+        // Typed map, the Java type is of no use in text
+        size_t skipped = 0;
+        int32_t ref;
+        int type_len = read_int(in + n, len - n, &ref);
+        if (type_len < 0) {
+            type_len = read_string(in + n, len - n, NULL, 0, &skipped, false);
+        }
+        if (type_len < 0) {
+            return -1;
+        }
+        n += (size_t) type_len;
+    }
+
+    if (!put_text(out, size, pos, "{", 1)) {
+        return -1;
+    }
+    bool first = true;
+    while (n < len && in[n] != 'Z') {
+        if (!first && !put_text(out, size, pos, ",", 1)) {
+            return -1;
+        }
+        first = false;
+        int key_len = read_value(in + n, len - n, out, size, pos, true, depth + 1);
+        if (key_len < 0 || !put_text(out, size, pos, ":", 1)) {
+            return -1;
+        }
+        n += (size_t) key_len;
+        int value_len = read_value(in + n, len - n, out, size, pos, true, depth + 1);
+        if (value_len < 0) {
+            return -1;
+        }
+        n += (size_t) value_len;
+    }
+    if (n >= len || !put_text(out, size, pos, "}", 1)) {
+        return -1;
+    }
+    return (int) n + 1;
+}
+
+static int read_value(const uint8_t *in, size_t len, char *out, size_t size, size_t *pos, bool quoted, int depth) {
+    if (len < 1) {
+        return -1;
+    }
+    char number[24];
+    int32_t int_value;
+    int64_t long_value;
+    int n;
+    uint8_t tag = in[0];
+
+    switch (tag) {
+        case 'N':
+            return put_text(out, size, pos, "null", 4) ? 1 : -1;
+        case 'T':
+            return put_text(out, size, pos, "true", 4) ? 1 : -1;
+        case 'F':
+            return put_text(out, size, pos, "false", 5) ? 1 : -1;
+        case 'H':
+        case 'M':
+            return read_map(in, len, out, size, pos, depth);
+        default:
+            break;
+    }
+    if ((n = read_int(in, len, &int_value)) > 0) {
+        return put_text(out, size, pos, number, (size_t) sprintf(number, "%" PRId32, int_value)) ? n : -1;
+    }
+    if ((n = read_long(in, len, &long_value)) > 0) {
+        return put_text(out, size, pos, number, (size_t) sprintf(number, "%" PRId64, long_value)) ? n : -1;
+    }
+    if (tag <= 0x1f || (tag >= 0x30 && tag <= 0x33) || tag == 'S' || tag == 'R') {
+        if (quoted && !put_text(out, size, pos, "\"", 1)) {
+            return -1;
+        }
+        n = read_string(in, len, out, size, pos, quoted);
+        if (n < 0 || (quoted && !put_text(out, size, pos, "\"", 1))) {
+            return -1;
+        }
+        return n;
+    }
+    if ((tag >= 0x20 && tag <= 0x2f) || (tag >= 0x34 && tag <= 0x37) || tag == 'B' || tag == 'A') {
+        return read_bytes(in, len, out, size, pos);
+    }
+    // Lists, objects, doubles, dates and references are not expected from the services here
+    return -1;
+}
+
+/*
+ * Render one value as text into 'out', strings and bytes as they are.
+ */
+int hessian_read_text(const char *in, size_t len, char *out, size_t size, size_t *out_len) {
+    *out_len = 0;
+    return read_value((const uint8_t *) in, len, out, size, out_len, false, 0);
+}
@@ -0,0 +1,36 @@
+#ifndef MESH_AGENT_NATIVE_HESSIAN_H
+#define MESH_AGENT_NATIVE_HESSIAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "common.h"
+
+/*
+ * Hessian 2.0 serialization of the values Dubbo calls carry here: null, booleans, ints,
+ * longs, strings, bytes and untyped maps. Writers return the bytes written to 'out' and
+ * readers the bytes consumed from 'in', both -1 if it does not fit or is malformed.
+ */
+
+int hessian_write_null(char *out, size_t size);
+
+int hessian_write_int(char *out, size_t size, int32_t value);
+
+int hessian_write_long(char *out, size_t size, int64_t value);
+
+int hessian_write_string(char *out, size_t size, const char *str, size_t len);
+
+int hessian_write_bytes(char *out, size_t size, const char *bytes, size_t len);
+
+int hessian_write_map_start(char *out, size_t size);
+
+int hessian_write_map_end(char *out, size_t size);
+
+int hessian_read_int(const char *in, size_t len, int32_t *value);
+
+int hessian_read_long(const char *in, size_t len, int64_t *value);
+
+int hessian_read_text(const char *in, size_t len, char *out, size_t size, size_t *out_len);
+
+#endif //MESH_AGENT_NATIVE_HESSIAN_H
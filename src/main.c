@@ -1,10 +1,14 @@
 #include "main.h"
 #include "consumer.h"
 #include "provider.h"
+#include "stub.h"
 #include "debug.h"
+#include "profile.h"
+#include "trace.h"
 
 #define AGENT_CONSUMER 1
 #define AGENT_PROVIDER 2
+#define AGENT_STUB 3
 
 #define ETCD_PORT 2379
 #define NET_IP_STR_LEN 46
@@ -14,10 +18,36 @@
 #define EV_MAX_SET_SIZE 2048
 #define TCP_LISTEN_BACKLOG 40000
 #define MAX_ACCEPTS_PER_CALL 1
+#define HANDOFF_DRAIN_CHECK_MS 100
+#define HANDOFF_DRAIN_TIMEOUT_MS 30000
+#define RESPONSE_CACHE_TTL_MS 1000
+#define ECHO_REPORT_INTERVAL_MS 5000
+#define LOOP_STATS_INTERVAL_MS 10000
+#define DEFAULT_SERVICE "com.alibaba.dubbo.performance.demo.provider.IHelloService"
 
 
 static int dubbo_port = 0;
+static char *dubbo_path = NULL;
 static int agent_type = 0;
+static int provider_weight = 1;
+static char *provider_services = DEFAULT_SERVICE;
+static int forward_mode = FORWARD_MODE_COPY;
+static int hedge_percentile = 0;
+static int cache_mb = 0;
+static int cache_ttl_ms = RESPONSE_CACHE_TTL_MS;
+static bool coalesce = false;
+static char *idempotent_calls = NULL;
+static int agent_protocol = PROTOCOL_HTTP;
+static int ev_set_size = EV_MAX_SET_SIZE;
+static char *handoff_path = NULL;
+static int listen_fd = -1;
+static int drain_checks_left = 0;
+static bool echo = false;
+static long last_echoed = 0;
+static long last_report_us = 0;
+static struct rusage last_usage;
+static int profile_seconds = PROFILE_DEFAULT_SECONDS;
+static int trace_every = 0;
 
 static aeEventLoop *the_event_loop = NULL;
 static char neterr[256];
@@ -26,6 +56,14 @@ static char neterr[256];
 void init_signals() ;
 int do_listen(int server_port) ;
 void accept_tcp_handler(aeEventLoop *el, int fd, void *privdata, int mask) ;
+void adopt_inherited_clients() ;
+void adopt_client(aeEventLoop *event_loop, int client_fd) ;
+void on_handoff(aeEventLoop *event_loop, int sock) ;
+int check_drained(aeEventLoop *event_loop, long long id, void *client_data) ;
+int report_echo_cost(aeEventLoop *event_loop, long long id, void *client_data) ;
+#ifdef AE_STATS
+int report_loop_stats(aeEventLoop *event_loop, long long id, void *client_data) ;
+#endif
 
 //void set_cpu_affinity();
 void do_fork() ;
@@ -39,7 +77,7 @@ int main(int argc, char **argv) {
     char *etcd_host = NULL;
     char *log_dir = NULL;
 
-    while ((c = getopt(argc, argv, "t:e:p:d:l:")) != -1) {
+    while ((c = getopt(argc, argv, "t:e:p:d:l:f:u:H:C:ci:s:a:EP:T:")) != -1) {
         switch (c) {
             case 't':
                 if (strcmp(optarg, "consumer") == 0) {
@@ -48,11 +86,17 @@ int main(int argc, char **argv) {
                 } else if (strcmp(optarg, "provider-small") == 0) {
                     agent_type = AGENT_PROVIDER;
                     prctl(PR_SET_NAME, "agent-small", 0, 0, 0);
+                } else if (strcmp(optarg, "dubbo-stub") == 0) {
+                    // Stand-in provider to benchmark agents against
+                    agent_type = AGENT_STUB;
+                    prctl(PR_SET_NAME, "dubbo-stub", 0, 0, 0);
                 } else if (strcmp(optarg, "provider-medium") == 0) {
                     agent_type = AGENT_PROVIDER;
+                    provider_weight = 2;
                     prctl(PR_SET_NAME, "agent-medium", 0, 0, 0);
                 } else {
                     agent_type = AGENT_PROVIDER;
+                    provider_weight = 3;
                     prctl(PR_SET_NAME, "agent-large", 0, 0, 0);
                 }
                 break;
@@ -63,11 +107,71 @@ int main(int argc, char **argv) {
                 server_port = atoi(optarg);
                 break;
             case 'd':
-                dubbo_port = atoi(optarg);
+                // Port of local provider, or the path of its Unix socket, '@' for the abstract namespace
+                if (isdigit((unsigned char) optarg[0])) {
+                    dubbo_port = atoi(optarg);
+                } else {
+                    dubbo_path = optarg;
+                }
                 break;
             case 'l':
                 log_dir = optarg;
                 break;
+            case 'f':
+                if (strcmp(optarg, "splice") == 0) {
+                    forward_mode = FORWARD_MODE_SPLICE;
+                    // Splice pipes take up extra descriptors
+                    ev_set_size = EV_MAX_SET_SIZE * 2;
+                } else {
+                    forward_mode = FORWARD_MODE_COPY;
+                }
+                break;
+            case 'u':
+                handoff_path = optarg;
+                break;
+            case 'H':
+                // Latency percentile of an endpoint after which a request is hedged, 0 to disable
+                hedge_percentile = atoi(optarg);
+                break;
+            case 'C':
+                // Response cache of idempotent calls, "<megabytes>[,<TTL ms>]"
+                sscanf(optarg, "%d,%d", &cache_mb, &cache_ttl_ms);
+                break;
+            case 'c':
+                // Send one of identical idempotent calls in flight, share its response
+                coalesce = true;
+                break;
+            case 'i':
+                // Calls that may be cached and coalesced, "<interface>[#<method>]" comma separated
+                idempotent_calls = optarg;
+                break;
+            case 's':
+                // Interfaces the local provider serves, comma separated
+                provider_services = optarg;
+                break;
+            case 'a':
+                // Protocol between agents, "http", "dubbo" to encode requests in consumer agent or
+                // "direct" to also send them straight to providers
+                if (strcmp(optarg, "dubbo") == 0) {
+                    agent_protocol = PROTOCOL_DUBBO;
+                } else if (strcmp(optarg, "direct") == 0) {
+                    agent_protocol = PROTOCOL_DIRECT;
+                } else {
+                    agent_protocol = PROTOCOL_HTTP;
+                }
+                break;
+            case 'P':
+                // Length of a profile started by SIGUSR1, see profile.c
+                profile_seconds = atoi(optarg);
+                break;
+            case 'T':
+                // Trace 1 in this many requests through the agents, see trace.c
+                trace_every = atoi(optarg);
+                break;
+            case 'E':
+                // Answer requests without anything upstream, to measure the cost of the agent alone
+                echo = true;
+                break;
             default:
                 printf("Unknown option '%c'", c);
                 exit(EXIT_FAILURE);
@@ -84,32 +188,64 @@ int main(int argc, char **argv) {
     
 //    set_cpu_affinity();
 
+    // Profiles, traces and stats go next to the log
+    char *output_dir = dirname(strdup(log_dir != NULL ? log_dir : "."));
+
+    if (agent_type == AGENT_STUB) {
+        // Nothing of an agent is set up, no etcd and no handoff
+        the_event_loop = aeCreateEventLoop(ev_set_size);
+        stub_init(the_event_loop, dubbo_port, dubbo_path);
+#ifdef AE_STATS
+        aeCreateTimeEvent(the_event_loop, LOOP_STATS_INTERVAL_MS, report_loop_stats, NULL, NULL);
+#endif
+        profile_init(the_event_loop, output_dir, profile_seconds);
+        aeMain(the_event_loop);
+        log_msg(INFO, "Quit.");
+        return 0;
+    }
+
     etcd_init(etcd_host, ETCD_PORT, 0);
     log_msg(INFO, "Init etcd to host %s", etcd_host);
 
+    if (handoff_path != NULL) {
+        handoff_receive(handoff_path);
+        listen_fd = handoff_take_listener();
+    }
+    if (listen_fd < 0) {
+        listen_fd = do_listen(server_port);
+    }
+
     if (agent_type == AGENT_CONSUMER) {
 //        do_fork();
-        int listen_fd = do_listen(server_port);
         monitor_accepts(listen_fd);
-        consumer_init();
+        trace_init(the_event_loop, output_dir, TRACE_HOP_CONSUMER, trace_every);
+        consumer_init(the_event_loop, forward_mode, hedge_percentile, cache_mb, cache_ttl_ms, coalesce,
+                      idempotent_calls, output_dir, agent_protocol, echo);
     } else {
 //        do_fork();
-        int listen_fd = do_listen(server_port);
         monitor_accepts(listen_fd);
-        provider_init(server_port, dubbo_port);
+        trace_init(the_event_loop, output_dir, TRACE_HOP_PROVIDER, trace_every);
+        provider_init(the_event_loop, server_port, dubbo_port, dubbo_path, provider_weight, provider_services,
+                      echo);
     }
-
-#ifdef PROFILER
-    ProfilerStart("/root/logs/iprofile");
-    log_msg(INFO, "Start profiler");
+    if (echo) {
+        last_report_us = get_current_time_us();
+        getrusage(RUSAGE_SELF, &last_usage);
+        aeCreateTimeEvent(the_event_loop, ECHO_REPORT_INTERVAL_MS, report_echo_cost, NULL, NULL);
+    }
+#ifdef AE_STATS
+    aeCreateTimeEvent(the_event_loop, LOOP_STATS_INTERVAL_MS, report_loop_stats, NULL, NULL);
 #endif
-    aeMain(the_event_loop);
 
-#ifdef PROFILER
-    ProfilerStop();
-    log_msg(INFO, "Stop profiler..");
-    sleep(60);
-#endif
+    if (handoff_path != NULL) {
+        adopt_inherited_clients();
+        handoff_serve(the_event_loop, handoff_path, on_handoff, adopt_client);
+    }
+
+    profile_init(the_event_loop, output_dir, profile_seconds);
+
+    aeMain(the_event_loop);
+    trace_flush();
 
     if (agent_type == AGENT_CONSUMER) {
         consumer_cleanup();
@@ -165,8 +301,9 @@ void signal_handler(int sig) {
             //log_msg_r(INFO, "Receive SIGCHLD.");
             break;
         case SIGUSR1:
-            log_msg_r(INFO, "Receive SIGUSR1.");
-            break;
+            // Start or stop a profile, the loop goes on
+            profile_toggle();
+            return;
         case SIGURG:
             log_msg_r(INFO, "Receive SIGURG.");
             break;
@@ -188,7 +325,7 @@ int do_listen(int server_port) {
 }
 
 void monitor_accepts(int listen_fd) {
-    the_event_loop = aeCreateEventLoop(EV_MAX_SET_SIZE);
+    the_event_loop = aeCreateEventLoop(ev_set_size);
 
     int ret = aeCreateFileEvent(the_event_loop, listen_fd, AE_READABLE, accept_tcp_handler, NULL);
     if (ret == ANET_ERR) {
@@ -222,6 +359,92 @@ void accept_tcp_handler(aeEventLoop *el, int fd, void *privdata, int mask) {
     }
 }
 
+void adopt_inherited_clients() {
+    int client_fd;
+    while ((client_fd = handoff_take_client()) >= 0) {
+        adopt_client(the_event_loop, client_fd);
+    }
+    // Upstream connections not picked up by the pools are no longer needed
+    handoff_close_unclaimed();
+}
+
+void adopt_client(aeEventLoop *event_loop, int client_fd) {
+    if (agent_type == AGENT_CONSUMER) {
+        consumer_http_handler(event_loop, client_fd);
+    } else {
+        provider_http_handler(event_loop, client_fd);
+    }
+}
+
+/*
+ * A new agent asked to take over: pass the listening socket and idle connections,
+ * then keep serving in-flight requests until they are done or time is up.
+ */
+void on_handoff(aeEventLoop *event_loop, int sock) {
+    handoff_send(sock, HANDOFF_LISTENER, NULL, 0, listen_fd);
+    aeDeleteFileEvent(event_loop, listen_fd, AE_READABLE);
+    close(listen_fd);
+    listen_fd = -1;
+
+    if (agent_type == AGENT_CONSUMER) {
+        consumer_handoff(event_loop, sock);
+    } else {
+        provider_handoff(event_loop, sock);
+    }
+
+    drain_checks_left = HANDOFF_DRAIN_TIMEOUT_MS / HANDOFF_DRAIN_CHECK_MS;
+    aeCreateTimeEvent(event_loop, HANDOFF_DRAIN_CHECK_MS, check_drained, NULL, NULL);
+}
+
+int check_drained(aeEventLoop *event_loop, long long id, void *client_data) {
+    int active = agent_type == AGENT_CONSUMER ? consumer_active_connections() : provider_active_connections();
+    if (active == 0 || drain_checks_left-- <= 0) {
+        log_msg(INFO, "Drain finished with %d active connections, quit", active);
+        aeStop(event_loop);
+        return AE_NOMORE;
+    }
+    return HANDOFF_DRAIN_CHECK_MS;
+}
+
+static inline long timeval_us(struct timeval *tv) {
+    return tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/*
+ * Echo mode: nothing upstream is waited on, so the CPU time per request is the cost of the
+ * agent alone, split into user time (parsing, encoding, the event loop) and system time
+ * (socket syscalls and epoll), with the context switches it takes.
+ */
+int report_echo_cost(aeEventLoop *event_loop, long long id, void *client_data) {
+    long echoed = agent_type == AGENT_CONSUMER ? consumer_echoed_requests() : provider_echoed_requests();
+    long now_us = get_current_time_us();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    long num_reqs = echoed - last_echoed;
+    if (num_reqs > 0) {
+        long user_us = timeval_us(&usage.ru_utime) - timeval_us(&last_usage.ru_utime);
+        long sys_us = timeval_us(&usage.ru_stime) - timeval_us(&last_usage.ru_stime);
+        long switches = usage.ru_nvcsw + usage.ru_nivcsw - last_usage.ru_nvcsw - last_usage.ru_nivcsw;
+        long wall_us = now_us - last_report_us;
+        log_msg(INFO, "Echo: %ld requests/s, %.2f us CPU per request (user %.2f, system %.2f), "
+                      "%ld%% busy, %.3f context switches per request",
+                num_reqs * 1000000 / wall_us, (double) (user_us + sys_us) / num_reqs, (double) user_us / num_reqs,
+                (double) sys_us / num_reqs, (user_us + sys_us) * 100 / wall_us, (double) switches / num_reqs);
+    }
+    last_echoed = echoed;
+    last_report_us = now_us;
+    last_usage = usage;
+    return ECHO_REPORT_INTERVAL_MS;
+}
+
+#ifdef AE_STATS
+int report_loop_stats(aeEventLoop *event_loop, long long id, void *client_data) {
+    aeReportStats(event_loop);
+    return LOOP_STATS_INTERVAL_MS;
+}
+#endif
+
 void do_fork() {
     pid_t pid = fork();
     if (pid == -1) {
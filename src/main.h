@@ -7,10 +7,7 @@
 #include <signal.h>
 #include <sys/resource.h>
 #include <sys/prctl.h>
-
-#ifdef PROFILER
-#include <gperftools/profiler.h>
-#endif
+#include <libgen.h>
 
 #include "common.h"
 #include "etcd.h"
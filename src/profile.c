@@ -0,0 +1,260 @@
+#include "fmacros.h"
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include "profile.h"
+#include "util.h"
+
+/*
+ * On-demand profiling of a running agent. SIGUSR1 starts a profile for a number of seconds,
+ * and another SIGUSR1 ends it early. The event loop keeps serving meanwhile. The gperftools
+ * CPU profiler is loaded the first time it is asked for, so no build has to link it. It
+ * writes a timestamped file next to the log. In builds with LOOP_STATS the built-in sampler
+ * runs with it, or alone if gperftools is not installed. A CPU time timer samples the event
+ * handler that runs, see currentProc of the event loop, and the handlers with the most samples
+ * are logged when the profile ends.
+ */
+
+typedef struct handler_samples {
+    void *proc; // NULL for the event loop itself
+    long count;
+} handler_samples_t;
+
+static aeEventLoop *loop = NULL;
+static char profile_dir[256];
+static int profile_seconds = PROFILE_DEFAULT_SECONDS;
+static int trigger_fds[2] = {-1, -1};
+
+static bool profiling = false;
+static long long stop_timer = -1;
+static long start_us = 0;
+static char profile_path[320]; // empty if gperftools does not profile
+
+static bool profiler_loaded = false; // tried to, see load_profiler()
+static int (*profiler_start)(const char *fname) = NULL;
+static void (*profiler_stop)(void) = NULL;
+
+// Built-in sampler, written only by take_sample() while the sample timer is armed
+static bool sampler_ready = false;
+static timer_t sample_timer;
+static handler_samples_t samples[PROFILE_MAX_HANDLERS];
+static long num_samples = 0;
+static long lost_samples = 0; // of handlers beyond PROFILE_MAX_HANDLERS
+
+
+void on_profile_trigger(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+void start_profile() ;
+void stop_profile() ;
+int end_profile(aeEventLoop *event_loop, long long id, void *client_data) ;
+void report_samples(double seconds) ;
+
+
+void profile_init(aeEventLoop *event_loop, const char *dir, int seconds) {
+    loop = event_loop;
+    snprintf(profile_dir, sizeof(profile_dir), "%s", dir);
+    if (seconds > 0) {
+        profile_seconds = seconds;
+    }
+
+    // Signals only write to the pipe, the profile is started and stopped by the loop
+    if (pipe2(trigger_fds, O_NONBLOCK | O_CLOEXEC) == -1 ||
+        aeCreateFileEvent(event_loop, trigger_fds[0], AE_READABLE, on_profile_trigger, NULL) == AE_ERR) {
+        log_msg(ERR, "Failed to set up profiling trigger: %s", strerror(errno));
+        return;
+    }
+    log_msg(INFO, "Profile for %d seconds into %s on SIGUSR1", profile_seconds, profile_dir);
+}
+
+/*
+ * Start a profile, or stop the one running. Only writes to a pipe, so it is safe to call from
+ * a signal handler.
+ */
+void profile_toggle() {
+    int saved_errno = errno;
+    char c = 1;
+    if (trigger_fds[1] >= 0 && write(trigger_fds[1], &c, 1) < 0) {
+        // Full pipe, a toggle is pending already
+    }
+    errno = saved_errno;
+}
+
+void on_profile_trigger(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    char buf[16];
+    ssize_t n;
+    int toggles = 0;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        toggles += (int) n;
+    }
+    // Signals sent in a burst count as one
+    if (toggles > 0) {
+        if (profiling) {
+            stop_profile();
+        } else {
+            start_profile();
+        }
+    }
+}
+
+static void load_profiler() {
+    profiler_loaded = true;
+    // Already there if linked in or preloaded, otherwise loaded for good
+    void *lib = dlopen(PROFILER_LIBRARY, RTLD_NOW | RTLD_GLOBAL);
+    if (lib == NULL) {
+        log_msg(WARN, "No gperftools CPU profiler: %s", dlerror());
+        return;
+    }
+    profiler_start = (int (*)(const char *)) dlsym(lib, "ProfilerStart");
+    profiler_stop = (void (*)(void)) dlsym(lib, "ProfilerStop");
+    if (profiler_start == NULL || profiler_stop == NULL) {
+        log_msg(WARN, "No ProfilerStart/ProfilerStop in %s", PROFILER_LIBRARY);
+        profiler_start = NULL;
+        profiler_stop = NULL;
+    }
+}
+
+#ifdef AE_STATS
+// Signal of the sample timer, counts the handler it interrupted
+static void take_sample(int sig) {
+    void *proc = loop->currentProc;
+    // CPU time timers expire on scheduler ticks, the intervals since the last signal are missed
+    int overrun = timer_getoverrun(sample_timer);
+    long count = 1 + (overrun > 0 ? overrun : 0);
+    unsigned long slot = ((unsigned long) proc >> 4) & (PROFILE_MAX_HANDLERS - 1);
+    for (int i = 0; i < PROFILE_MAX_HANDLERS; i++) {
+        handler_samples_t *s = &samples[slot];
+        if (s->count == 0 || s->proc == proc) {
+            s->proc = proc;
+            s->count += count;
+            num_samples += count;
+            return;
+        }
+        slot = (slot + 1) & (PROFILE_MAX_HANDLERS - 1);
+    }
+    lost_samples += count;
+}
+
+static bool init_sampler() {
+    struct sigaction sigact;
+    memset(&sigact, 0, sizeof(sigact));
+    sigact.sa_handler = take_sample;
+    sigemptyset(&sigact.sa_mask);
+    // Restarts reads and writes of the agent. epoll_wait() fails with EINTR whatever the flags,
+    // which aeApiPoll() takes as no events.
+    sigact.sa_flags = SA_RESTART;
+    if (sigaction(SIGRTMIN, &sigact, NULL) == -1) {
+        return false;
+    }
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = SIGRTMIN;
+    return timer_create(CLOCK_PROCESS_CPUTIME_ID, &sev, &sample_timer) == 0;
+}
+#endif
+
+static void arm_sampler(long interval_us) {
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = interval_us / 1000000;
+    spec.it_interval.tv_nsec = interval_us % 1000000 * 1000;
+    spec.it_value = spec.it_interval;
+    if (timer_settime(sample_timer, 0, &spec, NULL) == -1) {
+        log_msg(WARN, "Failed to set sample timer: %s", strerror(errno));
+    }
+}
+
+void start_profile() {
+    if (!profiler_loaded) {
+        load_profiler();
+    }
+#ifdef AE_STATS
+    if (!sampler_ready && !(sampler_ready = init_sampler())) {
+        log_msg(WARN, "Failed to set up event handler sampler: %s", strerror(errno));
+    }
+#endif
+
+    profile_path[0] = '\0';
+    if (profiler_start != NULL) {
+        char stamp[32];
+        time_t now = time(NULL);
+        struct tm tm;
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime_r(&now, &tm));
+        snprintf(profile_path, sizeof(profile_path), "%s/cpu-%d-%s.prof", profile_dir, (int) getpid(), stamp);
+        if (!profiler_start(profile_path)) {
+            log_msg(WARN, "Failed to start CPU profile into %s", profile_path);
+            profile_path[0] = '\0';
+        }
+    }
+
+    if (profile_path[0] == '\0' && !sampler_ready) {
+        log_msg(WARN, "Nothing to profile with, event handlers are only sampled in builds with LOOP_STATS");
+        return;
+    }
+
+    memset(samples, 0, sizeof(samples));
+    num_samples = 0;
+    lost_samples = 0;
+    if (sampler_ready) {
+        arm_sampler(PROFILE_SAMPLE_US);
+    }
+
+    profiling = true;
+    start_us = get_current_time_us();
+    stop_timer = aeCreateTimeEvent(loop, profile_seconds * 1000LL, end_profile, NULL, NULL);
+    log_msg(INFO, "Start profile for %d seconds%s%s", profile_seconds,
+            profile_path[0] != '\0' ? ", CPU profile into " : "", profile_path);
+}
+
+void stop_profile() {
+    if (sampler_ready) {
+        arm_sampler(0);
+    }
+    if (profile_path[0] != '\0') {
+        profiler_stop();
+        log_msg(INFO, "CPU profile written to %s", profile_path);
+    }
+    if (stop_timer >= 0) {
+        aeDeleteTimeEvent(loop, stop_timer);
+        stop_timer = -1;
+    }
+    profiling = false;
+    report_samples((get_current_time_us() - start_us) / 1e6);
+}
+
+int end_profile(aeEventLoop *event_loop, long long id, void *client_data) {
+    // Ends itself, not to be deleted by stop_profile()
+    stop_timer = -1;
+    stop_profile();
+    return AE_NOMORE;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    const handler_samples_t *x = a, *y = b;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+// Event handlers by the share of CPU samples they were caught running in
+void report_samples(double seconds) {
+    if (!sampler_ready) {
+        return;
+    }
+    log_msg(INFO, "Profile of %.1f s: %ld samples of %d us CPU time, %.1f%% CPU", seconds, num_samples,
+            PROFILE_SAMPLE_US, seconds > 0 ? num_samples * PROFILE_SAMPLE_US / (seconds * 1e4) : 0.0);
+    if (num_samples == 0) {
+        return;
+    }
+    qsort(samples, PROFILE_MAX_HANDLERS, sizeof(handler_samples_t), compare_samples);
+    for (int i = 0; i < PROFILE_TOP_HANDLERS && samples[i].count > 0; i++) {
+        const char *name = "event loop";
+        Dl_info info;
+        if (samples[i].proc != NULL) {
+            name = dladdr(samples[i].proc, &info) && info.dli_sname != NULL ? info.dli_sname : "?";
+        }
+        log_msg(INFO, "  %5.1f%% %s (%p)", samples[i].count * 100.0 / num_samples, name, samples[i].proc);
+    }
+    if (lost_samples > 0) {
+        log_msg(INFO, "  %ld samples of other handlers", lost_samples);
+    }
+}
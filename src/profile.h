@@ -0,0 +1,18 @@
+#ifndef MESH_AGENT_NATIVE_PROFILE_H
+#define MESH_AGENT_NATIVE_PROFILE_H
+
+#include "common.h"
+#include "ae.h"
+
+// Adjustable params
+#define PROFILE_DEFAULT_SECONDS 30
+#define PROFILE_SAMPLE_US 1000     // CPU time between samples of the built-in sampler
+#define PROFILE_MAX_HANDLERS 64    // told apart by the sampler, a power of 2
+#define PROFILE_TOP_HANDLERS 10
+#define PROFILER_LIBRARY "libprofiler.so.0"
+
+void profile_init(aeEventLoop *event_loop, const char *dir, int seconds);
+
+void profile_toggle();
+
+#endif //MESH_AGENT_NATIVE_PROFILE_H
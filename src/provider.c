@@ -1,4 +1,5 @@
 #include "provider.h"
+#include "dubbo.h"
 
 //#define INTERFACE "en0"
 //#define INTERFACE "eth0"
@@ -12,30 +13,88 @@
 
 //#define DO_LEN_CHECK
 
-#define DUBBO_HEADER_LEN 16
-#define DUBBO_DATA_STATUS_LEN 2
+#define SERVICE_TIME_WINDOW 1000 // responses per reset of the minimum service time
+#define SERVICE_RATE_INTERVAL_MS 1000
+#define SERVICE_RATE_REPORT_STEP 120 // percent of the published rate a new peak must reach
+
+#define MAX_SERVICES 16
+
+#define KEEPALIVE_INTERVAL_MS 1000
+#define KEEPALIVE_IDLE_MS 30000    // idle time of a connection to local provider before a heartbeat
+#define KEEPALIVE_TIMEOUT_MS 5000  // heartbeat unanswered for longer replaces the connection
+
+#define MAX_SHM_PEERS 16
+#define SHM_LISTEN_BACKLOG 16
 
 static char neterr[256];
-static char etcd_key[128];
+static char etcd_keys[MAX_SERVICES][256]; // one per service served
+static char *service_names[MAX_SERVICES];
+static int service_serializations[MAX_SERVICES];
+static int num_services = 0;
 
-static char resp_buffer[128];
+static char resp_buffer[PROVIDER_RESP_OUT_BUF_SIZE];
+static char value_buffer[PROVIDER_DUBBO_RESP_BUF_SIZE]; // response value decoded to text
 static size_t pre_len = 0;
+static int pre_status = 0; // HTTP status of the status line in resp_buffer
+
+// Load of local provider reported to consumer agents, see update_load()
+static int num_inflight = 0;
+static long service_us = 0;  // moving average
+static long min_service_us = 0;
+static long win_min_service_us = 0;
+static int win_samples = 0;
+
+// Capacity published in etcd, see register_etcd_service()
+static int server_weight = 1;
+static int num_responses = 0;
+static int peak_service_rate = 0;
+static int published_service_rate = 0;
 
 static Pool *connection_caa_pool = NULL;
 static Pool *connection_ap_pool = NULL;
 
+// Connection objects, pooled or not, each bound to a connection to local provider for good
+static connection_caa_t *conn_caas[NUM_CONN_FOR_CONSUMER_AGENT];
+static int num_conn_caas = 0;
+
 static http_parser_settings parser_settings;
 
 static uint32_t cur_request_id = 1;
 
+static int local_dubbo_port = 0;
+static char *local_dubbo_path = NULL; // Unix socket of local provider, used instead of its port
+static char local_provider_addr[46];  // with the port, identifies connections passed in a handoff
+static bool draining = false;
+static bool echoing = false;  // requests are answered here, there is no local provider
+static long num_echoed = 0;
+
+// Consumer agents on the same host, see accept_shm_handler()
+static char shm_path[64];
+static int shm_listen_fd = -1;
+static shm_peer_t shm_peers[MAX_SHM_PEERS];
+
 
-void register_etcd_service(int server_port) ;
+void register_etcd_service() ;
+int measure_service_rate(aeEventLoop *event_loop, long long id, void *client_data) ;
 void deregister_etcd_service() ;
 
+int on_header_field(http_parser *parser, const char *at, size_t length) ;
+int on_header_value(http_parser *parser, const char *at, size_t length) ;
 int on_http_body(http_parser *parser, const char *at, size_t length) ;
-
+void start_span(connection_caa_t *conn_caa, uint32_t trace_id) ;
+void relay_request(connection_caa_t *conn_caa, const char *buf, size_t len) ;
+void echo_to_consumer_agent(connection_caa_t *conn_caa) ;
+void send_to_local_provider(connection_caa_t *conn_caa) ;
+int take_response(connection_caa_t *conn_caa, int fd) ;
+void skip_response(connection_caa_t *conn_caa) ;
+void answer_heartbeat(connection_caa_t *conn_caa, int fd, const char *frame) ;
+
+int connect_local_provider() ;
 int init_connection_ap(void *elem, void *data) ;
 void cleanup_connection_ap(void *elem) ;
+int keep_alive(aeEventLoop *event_loop, long long id, void *client_data) ;
+void send_heartbeat(aeEventLoop *event_loop, connection_caa_t *conn_caa, long now) ;
+void replace_connection_ap(aeEventLoop *event_loop, connection_caa_t *conn_caa) ;
 
 int init_connection_caa(void *elem, void *data) ;
 void cleanup_connection_caa(void *elem) ;
@@ -44,41 +103,188 @@ void read_from_consumer_agent(aeEventLoop *event_loop, int fd, void *privdata, i
 void write_to_local_provider(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
 bool _write_to_local_provider(aeEventLoop *event_loop, int fd, void *privdata) ;
 void read_from_local_provider(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+void answer_consumer_agent(aeEventLoop *event_loop, connection_caa_t *conn_caa) ;
 void write_to_consumer_agent(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
 bool _write_to_consumer_agent(aeEventLoop *event_loop, int fd, void *privdata) ;
-
+size_t build_response(connection_caa_t *conn_caa, char **out) ;
+void reset_connection_caa(connection_caa_t *conn_caa) ;
+
+bool listen_shm(aeEventLoop *event_loop) ;
+void accept_shm_handler(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+void take_shm_rings(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+void read_from_shm_consumer(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+void take_shm_request(aeEventLoop *event_loop, shm_peer_t *peer, uint32_t tag, const char *msg, size_t len) ;
+void reply_over_shm(aeEventLoop *event_loop, connection_caa_t *conn_caa) ;
+void release_shm_caa(connection_caa_t *conn_caa) ;
+void on_shm_peer_closed(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+void close_shm_peer(aeEventLoop *event_loop, shm_peer_t *peer) ;
+void close_shm_peer_if_idle(aeEventLoop *event_loop, shm_peer_t *peer) ;
+
+void update_load(connection_caa_t *conn_caa) ;
+
+void close_connection_caa(aeEventLoop *event_loop, connection_caa_t *conn_caa) ;
 void abort_connection_caa(aeEventLoop *event_loop, connection_caa_t *conn_caa) ;
 
 
-void provider_init(int server_port, int dubbo_port) {
+void provider_init(aeEventLoop *event_loop, int server_port, int dubbo_port, char *dubbo_path, int weight,
+                   const char *service_list, bool echo) {
     log_msg(INFO, "Provider init begin");
-    register_etcd_service(server_port);
+    if (echo) {
+        // Measures the agents alone, see echo_to_consumer_agent()
+        log_msg(INFO, "Echo mode, answer requests without local provider");
+        echoing = true;
+    } else if (dubbo_path != NULL) {
+        // Same host, so a Unix socket spares the TCP stack on both ends of each call
+        log_msg(INFO, "Connect to local provider at Unix socket %s", dubbo_path);
+        local_dubbo_path = dubbo_path;
+        snprintf(local_provider_addr, sizeof(local_provider_addr), "%s", dubbo_path);
+        local_dubbo_port = 0;
+    } else {
+        snprintf(local_provider_addr, sizeof(local_provider_addr), "127.0.0.1");
+        local_dubbo_port = dubbo_port;
+    }
+    server_weight = weight;
+
+    char *ip_addr = get_local_ip_addr(INTERFACE);
+    log_msg(INFO, "Local IP address: %s", ip_addr);
+    // Requests carry their interface, the local provider is asked for whichever one they name.
+    // Each is "<interface>[:<serialization>]", fastjson unless hessian2 is given.
+    for (const char *service = service_list; *service != '\0' && num_services < MAX_SERVICES; num_services++) {
+        const char *next = strchr(service, ',');
+        if (next == NULL) {
+            next = service + strlen(service);
+        }
+        const char *colon = memchr(service, ':', (size_t) (next - service));
+        service_names[num_services] = strndup(service, (size_t) ((colon != NULL ? colon : next) - service));
+        service_serializations[num_services] = DUBBO_SERIALIZATION_FASTJSON;
+        if (colon != NULL && next - colon - 1 == 8 && strncmp(colon + 1, "hessian2", 8) == 0) {
+            service_serializations[num_services] = DUBBO_SERIALIZATION_HESSIAN2;
+        } else if (colon != NULL && !(next - colon - 1 == 8 && strncmp(colon + 1, "fastjson", 8) == 0)) {
+            log_msg(WARN, "Unknown serialization %.*s, use fastjson", (int) (next - colon - 1), colon + 1);
+        }
+        log_msg(INFO, "Serve %s with %s serialization", service_names[num_services],
+                service_serializations[num_services] == DUBBO_SERIALIZATION_HESSIAN2 ? "hessian2" : "fastjson");
+        snprintf(etcd_keys[num_services], sizeof(etcd_keys[0]), "/dubbomesh/%s/%s:%d",
+                 service_names[num_services], ip_addr, server_port);
+        service = *next == ',' ? next + 1 : next;
+    }
+
+    // Consumer agents on the same host find it by the address it registers with
+    snprintf(shm_path, sizeof(shm_path), SHM_PATH_FORMAT, ip_addr, server_port);
+    if (!listen_shm(event_loop)) {
+        // A predecessor still has it, tried again by keep_alive()
+        log_msg(WARN, "Failed to listen for shared memory channels at %s: %s", shm_path, neterr);
+    }
+    register_etcd_service();
+    aeCreateTimeEvent(event_loop, SERVICE_RATE_INTERVAL_MS, measure_service_rate, NULL, NULL);
 
 
     log_msg(INFO, "Init Dubbo connection pool");
     connection_ap_pool = PoolInit(NUM_CONN_TO_PROVIDER, NUM_CONN_TO_PROVIDER, sizeof(connection_caa_t),
-                                   NULL, init_connection_ap, (void *) (uint64_t) dubbo_port, cleanup_connection_ap, NULL);
+                                   NULL, init_connection_ap, NULL, cleanup_connection_ap, NULL);
     PoolPrintSaturation(connection_ap_pool);
 
     log_msg(INFO, "Init HTTP connection pool");
     connection_caa_pool = PoolInit(NUM_CONN_FOR_CONSUMER_AGENT, NUM_CONN_FOR_CONSUMER_AGENT, sizeof(connection_caa_t),
                                    NULL, init_connection_caa, NULL, cleanup_connection_caa, NULL);
     PoolPrintSaturation(connection_caa_pool);
+    aeCreateTimeEvent(event_loop, KEEPALIVE_INTERVAL_MS, keep_alive, NULL, NULL);
 
     parser_settings.on_body = on_http_body;
+    if (trace_enabled()) {
+        // Headers are only looked at for the trace ID of consumer agents
+        parser_settings.on_header_field = on_header_field;
+        parser_settings.on_header_value = on_header_value;
+    }
 
-    sprintf(resp_buffer, "HTTP/1.1 200 OK\r\nContent-Length:");
-    pre_len = strlen(resp_buffer);
+    pre_len = (size_t) sprintf(resp_buffer, "HTTP/1.1 200 OK\r\nX-Load:");
+    pre_status = 200;
 
     log_msg(INFO, "Provider init done");
 }
 
 void provider_cleanup() {
     log_msg(INFO, "Provider cleanup begin");
-    deregister_etcd_service();
+    if (!draining) {
+        // After a handoff the registration belongs to the new agent
+        deregister_etcd_service();
+    }
     log_msg(INFO, "Provider cleanup done");
 }
 
+static int hand_off_connection_ap(aeEventLoop *event_loop, int sock, connection_ap_t *conn_ap) {
+    if (conn_ap == NULL || conn_ap->fd < 0) {
+        return 0;
+    }
+    int ret = handoff_send(sock, HANDOFF_UPSTREAM, local_provider_addr, local_dubbo_port, conn_ap->fd);
+    // Idle ones may be reading the answer to a heartbeat, see send_heartbeat()
+    aeDeleteFileEvent(event_loop, conn_ap->fd, AE_WRITABLE | AE_READABLE);
+    close(conn_ap->fd);
+    conn_ap->fd = -1;
+    return ret == ANET_OK;
+}
+
+/*
+ * Hand idle connections over to a new agent process: the ones to local provider
+ * held by pooled connection objects, and idle consumer agent connections along
+ * with theirs. Busy connections are passed once their response is written.
+ */
+void provider_handoff(aeEventLoop *event_loop, int sock) {
+    connection_caa_t *idle[NUM_CONN_FOR_CONSUMER_AGENT];
+    int num_idle = 0, num_upstream = 0, num_clients = 0;
+    draining = true;
+
+    // Consumer agents attach to the new agent once theirs go, which is when they are idle
+    if (shm_listen_fd >= 0) {
+        aeDeleteFileEvent(event_loop, shm_listen_fd, AE_READABLE);
+        close(shm_listen_fd);
+        shm_listen_fd = -1;
+    }
+    for (int i = 0; i < MAX_SHM_PEERS; i++) {
+        if (shm_attached(&shm_peers[i].channel)) {
+            close_shm_peer_if_idle(event_loop, &shm_peers[i]);
+        } else if (!shm_closed(&shm_peers[i].channel)) {
+            close_shm_peer(event_loop, &shm_peers[i]);
+        }
+    }
+
+    while (num_idle < NUM_CONN_FOR_CONSUMER_AGENT && (idle[num_idle] = PoolGet(connection_caa_pool)) != NULL) {
+        num_upstream += hand_off_connection_ap(event_loop, sock, idle[num_idle++]->conn_ap);
+    }
+    for (int i = 0; i < num_idle; i++) {
+        PoolReturn(connection_caa_pool, idle[i]);
+    }
+
+    for (int fd = 0; fd <= event_loop->maxfd; fd++) {
+        aeFileEvent *fe = &event_loop->events[fd];
+        if (!(fe->mask & AE_READABLE) || fe->rfileProc != read_from_consumer_agent) {
+            continue;
+        }
+        connection_caa_t *conn_caa = fe->clientData;
+        if (conn_caa->processing || conn_caa->nread_in > 0) {
+            continue;
+        }
+        aeDeleteFileEvent(event_loop, fd, AE_WRITABLE | AE_READABLE);
+        if (handoff_send(sock, HANDOFF_CLIENT, NULL, 0, fd) == ANET_OK) {
+            num_clients++;
+        }
+        close(fd);
+        conn_caa->fd = -1;
+        num_upstream += hand_off_connection_ap(event_loop, sock, conn_caa->conn_ap);
+        PoolReturn(connection_caa_pool, conn_caa);
+    }
+    log_msg(INFO, "Handed off %d connections to local provider, %d idle consumer agent connections, %d still active",
+            num_upstream, num_clients, connection_caa_pool->outstanding);
+}
+
+long provider_echoed_requests() {
+    return num_echoed;
+}
+
+int provider_active_connections() {
+    return connection_caa_pool->outstanding;
+}
+
 void provider_http_handler(aeEventLoop *event_loop, int fd) {
     // Fetch a connection object from pool
     connection_caa_t *conn_caa = PoolGet(connection_caa_pool);
@@ -94,12 +300,19 @@ void provider_http_handler(aeEventLoop *event_loop, int fd) {
     conn_caa->nread_in = 0;
     conn_caa->len_req = 0;
     conn_caa->nwrite_req = 0;
-    conn_caa->nread_resp = 0;
+    conn_caa->len_out = 0;
+    // Bytes after a response not written to a closed connection still belong to the next one
+    skip_response(conn_caa);
     conn_caa->event_loop = event_loop;
 
     http_parser_init(&conn_caa->parser, HTTP_REQUEST);
     conn_caa->parser.data = conn_caa;
     conn_caa->processing = false;
+    conn_caa->relay = false;
+    conn_caa->in_provider = false;
+    conn_caa->peer = NULL;
+    conn_caa->span.trace_id = 0;
+    conn_caa->trace_field = false;
 
     // Read from consumer agent
     if (UNLIKELY(aeCreateFileEvent(event_loop, fd, AE_READABLE, read_from_consumer_agent, conn_caa) == AE_ERR)) {
@@ -129,6 +342,13 @@ void read_from_consumer_agent(aeEventLoop *event_loop, int fd, void *privdata, i
         }
 #endif
 
+        if (UNLIKELY((uint8_t) conn_caa->buf_in[0] == 0xda)) {
+            // Dubbo frame of a consumer agent that encodes requests itself
+            conn_caa->nread_in += nread;
+            relay_request(conn_caa, conn_caa->buf_in, (size_t) conn_caa->nread_in);
+            return;
+        }
+
         // Feed input to HTTP parser
         size_t nparsed = http_parser_execute(&conn_caa->parser, &parser_settings,
                                              conn_caa->buf_in + conn_caa->nread_in, (size_t) nread);
@@ -156,12 +376,24 @@ void read_from_consumer_agent(aeEventLoop *event_loop, int fd, void *privdata, i
                             conn_caa->buf_in + conn_caa->nread_in, (size_t) nread);
 
         log_msg(ERR, "Consumer agent closed connection for socket %d", fd);
-        aeDeleteFileEvent(event_loop, fd, AE_WRITABLE | AE_READABLE);
-        close(fd);
-        conn_caa->fd = -1;
-        PoolReturn(connection_caa_pool, conn_caa);
-        log_msg(DEBUG, "Returned connection object to pool, active: %d", connection_caa_pool->outstanding);
+        close_connection_caa(event_loop, conn_caa);
+    }
+}
+
+int on_header_field(http_parser *parser, const char *at, size_t length) {
+    connection_caa_t *conn_caa = parser->data;
+    conn_caa->trace_field = UNLIKELY(length == TRACE_HEADER_LEN) && strncasecmp(at, TRACE_HEADER, length) == 0;
+    return 0;
+}
+
+int on_header_value(http_parser *parser, const char *at, size_t length) {
+    connection_caa_t *conn_caa = parser->data;
+    if (UNLIKELY(conn_caa->trace_field)) {
+        // Hex digits followed by the end of the line
+        conn_caa->trace_field = false;
+        start_span(conn_caa, (uint32_t) strtoul(at, NULL, 16));
     }
+    return 0;
 }
 
 int on_http_body(http_parser *parser, const char *at, size_t length) {
@@ -174,23 +406,6 @@ int on_http_body(http_parser *parser, const char *at, size_t length) {
     }
     conn_caa->processing = true;
 
-    // Assemble request buf
-    char *buf = conn_caa->buf_req;
-
-    // magic & flags
-    *((uint16_t *) buf) = htons(0xdabb);
-    buf[2] = (char) (0xc0 | 6);
-    buf += 4;
-
-    // request id
-    buf += 4;
-    *((uint32_t *) buf) = htonl(cur_request_id);
-    buf += 4;
-
-    // data length
-    char *buf_len = buf;
-    buf += 4;
-
     // real data
     char *body = (char *) at;
 
@@ -207,39 +422,23 @@ int on_http_body(http_parser *parser, const char *at, size_t length) {
     char *arg = strchr(body, '=') + 1;
     int arg_len = (int) (at + length - arg);
 
-    // No runtime decoding, just look up pre-defined mapping (or better: prefix tree)
-    if (LIKELY(strncmp(type, "Ljava%2Flang%2FString%3B", (size_t) type_len) == 0)) {
-        type = "Ljava/lang/String;";
-        type_len = (int) strlen(type);
-    }
-
-    /*
-       "\"2.0.1\"\n"  // dubbo version
-       "\"com.alibaba.dubbo.performance.demo.provider.IHelloService\"\n" // service name
-       "null\n"  // service version
-       "\"hash\"\n" // method name
-       "\"Ljava/lang/String;\"\n" // method parameter types
-       "\"123ab\"\n" // method arguments
-       "{\"path\":\"com.alibaba.dubbo.performance.demo.provider.IHelloService\"}\n" // attachments
-     */
-
-    int data_len = sprintf(buf,
-                           "\"2.0.1\"\n"  // dubbo version
-                           "\"%.*s\"\n"   // service name
-                           "null\n"       // service version
-                           "\"%.*s\"\n"   // method name
-                           "\"%.*s\"\n"   // method parameter types
-                           "\"%.*s\"\n"   // method arguments
-                           "{\"path\":\"%.*s\"}\n", // attachments
-                           service_len, service, method_len, method, type_len, type, arg_len, arg,
-                           service_len, service
-    );
-//    log_msg(DEBUG, "Request: %.*s", data_len, buf);
-
-    // Re-fill data length field
-    *((uint32_t *) buf_len) = htonl(data_len);
-
-    conn_caa->len_req = data_len + DUBBO_HEADER_LEN;
+    int serialization = DUBBO_SERIALIZATION_FASTJSON;
+    for (int i = 0; i < num_services; i++) {
+        if (strncmp(service_names[i], service, (size_t) service_len) == 0 && service_names[i][service_len] == '\0') {
+            serialization = service_serializations[i];
+            break;
+        }
+    }
+
+    conn_caa->len_req = dubbo_encode_request(conn_caa->buf_req, sizeof(conn_caa->buf_req), cur_request_id,
+                                             serialization, service, service_len, method, method_len,
+                                             type, type_len, arg, arg_len);
+    if (UNLIKELY(conn_caa->len_req < 0)) {
+        log_msg(ERR, "Request of %zu bytes does not fit in a Dubbo frame", length);
+        abort_connection_caa(conn_caa->event_loop, conn_caa);
+        return 0;
+    }
+//    log_msg(DEBUG, "Request: %.*s", conn_caa->len_req, conn_caa->buf_req);
 
 #ifdef DO_LEN_CHECK
     if (conn_caa->len_req > 1500) {
@@ -255,15 +454,93 @@ int on_http_body(http_parser *parser, const char *at, size_t length) {
 //    conn_caa->nread_in = 0;
 //    conn_caa->len_body = 0;
 
-#if 0
-    // For testing: skip dubbo and return imediatly
-    if (aeCreateFileEvent(conn_caa->event_loop, conn_caa->fd, AE_WRITABLE, write_to_consumer_agent, conn_caa) == AE_ERR) {
-        log_msg(ERR, "Failed to create writable event for write_to_consumer_agent");
-        close(conn_caa->fd);
+    if (UNLIKELY(echoing)) {
+        echo_to_consumer_agent(conn_caa);
+    } else {
+        send_to_local_provider(conn_caa);
     }
-#else
 
+    return 0;
+}
+
+/*
+ * Relay mode: a consumer agent that encodes requests itself sends Dubbo frames instead of
+ * HTTP, told apart by the first byte of each request. The frame goes to local provider as
+ * it is and the response frame comes back the same way, see _write_to_consumer_agent().
+ */
+void relay_request(connection_caa_t *conn_caa, const char *buf, size_t len) {
+    if (UNLIKELY(conn_caa->processing)) {
+        log_msg(WARN, "Dubbo request processing, ignored");
+        return;
+    }
+    int frame_len = dubbo_frame_len(buf, len);
+    if (UNLIKELY(frame_len < 0 || frame_len > (int) sizeof(conn_caa->buf_req))) {
+        log_msg(ERR, "Bad Dubbo frame from consumer agent with socket %d", conn_caa->fd);
+        abort_connection_caa(conn_caa->event_loop, conn_caa);
+        return;
+    }
+    if (frame_len == 0 || len < (size_t) frame_len) {
+        return;
+    }
+    conn_caa->processing = true;
+    conn_caa->relay = true;
+    memcpy(conn_caa->buf_req, buf, (size_t) frame_len);
+    conn_caa->len_req = frame_len;
+    uint32_t trace_id = *((uint32_t *) &buf[4]);
+    if (UNLIKELY(trace_id != 0) && trace_enabled()) {
+        // High half of the request ID, see trace.c
+        start_span(conn_caa, ntohl(trace_id));
+    }
+    if (UNLIKELY(echoing)) {
+        echo_to_consumer_agent(conn_caa);
+    } else {
+        send_to_local_provider(conn_caa);
+    }
+}
+
+// Stages of the request are recorded under the trace ID a consumer agent sent with it
+void start_span(connection_caa_t *conn_caa, uint32_t trace_id) {
+    memset(&conn_caa->span, 0, sizeof(conn_caa->span));
+    conn_caa->span.trace_id = trace_id;
+    conn_caa->span.accept_us = get_current_time_us();
+}
+
+/*
+ * Echo mode: the Dubbo request in buf_req is answered right away as the hash method of the
+ * demo service would, and the answer goes back the way a response of local provider does,
+ * so only the cost of the agents is measured, see report_echo_cost() of main.
+ */
+void echo_to_consumer_agent(connection_caa_t *conn_caa) {
+    conn_caa->in_provider = true;
+    conn_caa->req_start_us = get_current_time_us();
+    num_inflight++;
+    num_echoed++;
+
+    int len = dubbo_answer_call(conn_caa->buf_resp, sizeof(conn_caa->buf_resp), conn_caa->buf_req,
+                                (size_t) conn_caa->len_req);
+    if (UNLIKELY(len <= 0)) {
+        log_msg(ERR, "Failed to echo Dubbo request for socket %d", conn_caa->fd);
+        abort_connection_caa(conn_caa->event_loop, conn_caa);
+        return;
+    }
+    conn_caa->nread_resp = (size_t) len;
+    conn_caa->len_resp = (size_t) len;
+    update_load(conn_caa);
+    answer_consumer_agent(conn_caa->event_loop, conn_caa);
+}
+
+void send_to_local_provider(connection_caa_t *conn_caa) {
     connection_ap_t *conn_ap = conn_caa->conn_ap;
+    if (UNLIKELY(conn_ap->fd < 0)) {
+        replace_connection_ap(conn_caa->event_loop, conn_caa);
+        if (conn_ap->fd < 0) {
+            abort_connection_caa(conn_caa->event_loop, conn_caa);
+            return;
+        }
+    }
+    conn_caa->in_provider = true;
+    conn_caa->req_start_us = get_current_time_us();
+    num_inflight++;
 
     // Write to local dubbo provider
 //    if (UNLIKELY(!_write_to_local_provider(conn_caa->event_loop, conn_ap->fd, conn_caa))) {
@@ -271,6 +548,7 @@ int on_http_body(http_parser *parser, const char *at, size_t length) {
                                        write_to_local_provider, conn_caa) == AE_ERR)) {
             log_msg(ERR, "Failed to create writable event for write_to_local_provider");
             abort_connection_caa(conn_caa->event_loop, conn_caa);
+            return;
         }
 //    }
 
@@ -279,12 +557,8 @@ int on_http_body(http_parser *parser, const char *at, size_t length) {
         log_msg(ERR, "Failed to create readable event for read_from_local_provider");
         abort_connection_caa(conn_caa->event_loop, conn_caa);
     }
-#endif
-
-    return 0;
 }
 
-
 void write_to_local_provider(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
     _write_to_local_provider(event_loop, fd, privdata);
 }
@@ -306,6 +580,9 @@ bool _write_to_local_provider(aeEventLoop *event_loop, int fd, void *privdata) {
         if (conn_caa->nwrite_req == conn_caa->len_req) {
             // Done writing
             aeDeleteFileEvent(event_loop, fd, AE_WRITABLE);
+            if (UNLIKELY(conn_caa->span.trace_id != 0)) {
+                conn_caa->span.upstream_write_us = get_current_time_us();
+            }
 
 //             Reset req buf pointers
 //            conn_caa->nwrite_req = 0;
@@ -328,8 +605,9 @@ bool _write_to_local_provider(aeEventLoop *event_loop, int fd, void *privdata) {
 
 void read_from_local_provider(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
     connection_caa_t *conn_caa = privdata;
-    if (UNLIKELY(conn_caa->fd < 0)) {
-        log_msg(WARN, "Connection closed for socket %d, ignore read_from_local_provider", fd);
+    // Heartbeats are read while the connection object is idle or pooled too
+    if (UNLIKELY(conn_caa->conn_ap->fd != fd)) {
+        log_msg(WARN, "Connection replaced for socket %d, ignore read_from_local_provider", fd);
         aeDeleteFileEvent(event_loop, fd, AE_WRITABLE | AE_READABLE);
         return ;
     }
@@ -339,38 +617,27 @@ void read_from_local_provider(aeEventLoop *event_loop, int fd, void *privdata, i
 
     if (LIKELY(nread > 0)) {
         log_msg(DEBUG, "Read %d bytes from local provider for socket %d", nread, fd);
+        if (UNLIKELY(conn_caa->span.trace_id != 0) && conn_caa->in_provider &&
+            conn_caa->span.upstream_first_byte_us == 0) {
+            conn_caa->span.upstream_first_byte_us = get_current_time_us();
+        }
         conn_caa->nread_resp += nread;
 
-        if (conn_caa->nread_resp > DUBBO_HEADER_LEN) {
-            // Full header available
-            uint32_t data_len = ntohl(*((uint32_t *) &conn_caa->buf_resp[12]));
-            log_msg(DEBUG, "Got data_len %d", data_len);
-
-            if (conn_caa->nread_resp < DUBBO_HEADER_LEN + data_len) {
-                log_msg(WARN, "Incomplete response: %.*s", nread, conn_caa->buf_resp);
-                return;
-            }
-//            if (conn_caa->buf_resp[DUBBO_HEADER_LEN] != '1') {
-//                log_msg(WARN, "Not dubbo response: %.*s", conn_caa->nread_resp, conn_caa->buf_resp);
-//                conn_caa->nread_resp = 0;
-//                return;
-//            }
-
-#ifdef DO_LEN_CHECK
-            if (data_len > 100) {
-                log_msg(ERR, "Dubbo data: %.*s", conn_caa->buf_resp, conn_caa->nread_resp);
+        int ret = take_response(conn_caa, fd);
+        if (UNLIKELY(ret < 0)) {
+            if (conn_caa->in_provider) {
+                abort_connection_caa(event_loop, conn_caa);
+            } else {
+                replace_connection_ap(event_loop, conn_caa);
             }
-#endif
-
-            // Write back to consumer agent
-//            if (UNLIKELY(!_write_to_consumer_agent(event_loop, conn_caa->fd, conn_caa))) {
-                if (aeCreateFileEvent(event_loop, conn_caa->fd, AE_WRITABLE,
-                                      write_to_consumer_agent, conn_caa) == AE_ERR) {
-                    log_msg(ERR, "Failed to create writable event for write_to_consumer_agent");
-                    abort_connection_caa(event_loop, conn_caa);
-                }
-//            }
+            return;
+        }
+        if (ret == 0) {
+            log_msg(DEBUG, "Incomplete response for socket %d", fd);
+            return;
         }
+        update_load(conn_caa);
+        answer_consumer_agent(event_loop, conn_caa);
 
     } else if (UNLIKELY(nread < 0)) {
         if (errno == EAGAIN) {
@@ -378,11 +645,33 @@ void read_from_local_provider(aeEventLoop *event_loop, int fd, void *privdata, i
             return;
         }
         log_msg(ERR, "Failed to read from local provider: %s", strerror(errno));
-        abort_connection_caa(event_loop, conn_caa);
     } else {
         log_msg(ERR, "Local provider closed connection");
-        abort_connection_caa(event_loop, conn_caa);
     }
+    if (nread <= 0) {
+        // No request waits on an idle connection, it is just replaced
+        if (conn_caa->in_provider) {
+            abort_connection_caa(event_loop, conn_caa);
+        } else {
+            replace_connection_ap(event_loop, conn_caa);
+        }
+    }
+}
+
+// Response at the start of buf_resp is complete, back the way the request came
+void answer_consumer_agent(aeEventLoop *event_loop, connection_caa_t *conn_caa) {
+    if (conn_caa->peer != NULL) {
+        reply_over_shm(event_loop, conn_caa);
+        return;
+    }
+
+    // Write back to consumer agent
+//    if (UNLIKELY(!_write_to_consumer_agent(event_loop, conn_caa->fd, conn_caa))) {
+        if (aeCreateFileEvent(event_loop, conn_caa->fd, AE_WRITABLE, write_to_consumer_agent, conn_caa) == AE_ERR) {
+            log_msg(ERR, "Failed to create writable event for write_to_consumer_agent");
+            abort_connection_caa(event_loop, conn_caa);
+        }
+//    }
 }
 
 void write_to_consumer_agent(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
@@ -397,16 +686,18 @@ bool _write_to_consumer_agent(aeEventLoop *event_loop, int fd, void *privdata) {
         return true;
     }
 
-//    char *data = "hah";
-    char *data = conn_caa->buf_resp + DUBBO_HEADER_LEN + DUBBO_DATA_STATUS_LEN;
-    conn_caa->buf_resp[conn_caa->nread_resp - 1] = '\0'; // ignore last newline
-    size_t data_len = conn_caa->nread_resp - 19;
-
-    int add_len = sprintf(resp_buffer + pre_len, "%ld\r\n\r\n%s", data_len, data);
-    size_t buf_len = pre_len + add_len;
-//    log_msg(DEBUG, "Response: %.*s", buf_len, resp_buffer);
+    char *buf;
+    size_t buf_len;
+    if (LIKELY(conn_caa->len_out == 0)) {
+        buf_len = build_response(conn_caa, &buf);
+    } else {
+        // Rest of a response partially written, built again its load and length could differ
+        buf = conn_caa->buf_out + conn_caa->nwrite_out;
+        buf_len = conn_caa->len_out - conn_caa->nwrite_out;
+    }
+//    log_msg(DEBUG, "Response: %.*s", buf_len, buf);
 
-    ssize_t nwrite = write(fd, resp_buffer, buf_len);
+    ssize_t nwrite = write(fd, buf, buf_len);
 
     if (LIKELY(nwrite >= 0)) {
         log_msg(DEBUG, "Write %d bytes to consumer agent for socket %d", nwrite, fd);
@@ -414,18 +705,23 @@ bool _write_to_consumer_agent(aeEventLoop *event_loop, int fd, void *privdata) {
         if (LIKELY(nwrite == buf_len)) {
             // Done writing
             aeDeleteFileEvent(event_loop, fd, AE_WRITABLE);
-            http_parser_init(&conn_caa->parser, HTTP_REQUEST);
+            reset_connection_caa(conn_caa);
 
-            // Reset buf pointer
-            conn_caa->nread_in = 0;
-            conn_caa->len_req = 0;
-            conn_caa->nwrite_req = 0;
-            conn_caa->nread_resp = 0;
-
-            conn_caa->processing = false;
+            if (UNLIKELY(draining)) {
+                // Let the new agent serve further requests on this connection
+                handoff_pass_client(fd);
+                close_connection_caa(event_loop, conn_caa);
+            }
 
         } else {
-            log_msg(WARN, "Partial write for socket %d: %.*s", fd, resp_buffer, nwrite);
+            log_msg(WARN, "Partial write for socket %d: %.*s", fd, (int) nwrite, buf);
+            // Response buffers are shared or rewritten, the rest waits in buf_out
+            if (conn_caa->len_out == 0) {
+                memcpy(conn_caa->buf_out, buf, buf_len);
+                conn_caa->len_out = buf_len;
+                conn_caa->nwrite_out = 0;
+            }
+            conn_caa->nwrite_out += (size_t) nwrite;
         }
     } else {
 //        if (UNLIKELY(errno == EWOULDBLOCK)) {
@@ -442,44 +738,477 @@ bool _write_to_consumer_agent(aeEventLoop *event_loop, int fd, void *privdata) {
     return true;
 }
 
-void register_etcd_service(int server_port) {
-    char *ip_addr = get_local_ip_addr(INTERFACE);
-    log_msg(INFO, "Local IP address: %s", ip_addr);
+/*
+ * Response to the request of the connection, as it came: a relayed frame or an HTTP response,
+ * with the load of local provider in it.
+ */
+size_t build_response(connection_caa_t *conn_caa, char **out) {
+    // In flight, queued and service time of local provider, for the balancer of consumer agent
+    long queued = service_us > 0 ? num_inflight * (service_us - min_service_us) / service_us : 0;
+
+    char *buf;
+    size_t buf_len;
+    if (conn_caa->relay) {
+        // Requests are answered in order, the ID of a relayed response carries the load instead
+        buf = conn_caa->buf_resp;
+        buf_len = conn_caa->len_resp;
+        *((uint16_t *) &buf[4]) = htons((uint16_t) (num_inflight < 0xffff ? num_inflight : 0xffff));
+        *((uint16_t *) &buf[6]) = htons((uint16_t) (queued < 0xffff ? queued : 0xffff));
+        *((uint32_t *) &buf[8]) = htonl((uint32_t) service_us);
+    } else {
+//        char *data = "hah";
+        const char *data;
+        size_t data_len;
+        int status = dubbo_decode_response(conn_caa->buf_resp, conn_caa->len_resp, value_buffer, sizeof(value_buffer),
+                                           &data, &data_len);
+        if (UNLIKELY(status != pre_status)) {
+            pre_len = (size_t) sprintf(resp_buffer, "HTTP/1.1 %s\r\nX-Load:", dubbo_http_status(status));
+            pre_status = status;
+        }
+        int add_len = sprintf(resp_buffer + pre_len, "%d,%ld,%ld\r\nContent-Length:%zu\r\n\r\n%.*s",
+                              num_inflight, queued, service_us, data_len, (int) data_len, data);
+        buf = resp_buffer;
+        buf_len = pre_len + add_len;
+    }
+    *out = buf;
+    return buf_len;
+}
 
-    sprintf(etcd_key, "/dubbomesh/com.alibaba.dubbo.performance.demo.provider.IHelloService/%s:%d",
-            ip_addr, server_port);
+// Ready for the next request once the response is written
+void reset_connection_caa(connection_caa_t *conn_caa) {
+    if (UNLIKELY(conn_caa->span.trace_id != 0)) {
+        trace_finish(&conn_caa->span);
+    }
+    http_parser_init(&conn_caa->parser, HTTP_REQUEST);
+
+    // Reset buf pointer
+    conn_caa->nread_in = 0;
+    conn_caa->len_req = 0;
+    conn_caa->nwrite_req = 0;
+    conn_caa->len_out = 0;
+
+    skip_response(conn_caa);
+
+    conn_caa->processing = false;
+    conn_caa->relay = false;
+}
+
+/*
+ * Consume the frames read from the local provider up to the response to the current request,
+ * which is left at the start of buf_resp. Heartbeats from the provider are answered here and
+ * responses to requests of an aborted connection dropped, neither wakes the consumer agent.
+ * Returns 1 if the response is complete, 0 if more has to be read and -1 if the stream is
+ * not Dubbo or a frame does not fit the buffer.
+ */
+int take_response(connection_caa_t *conn_caa, int fd) {
+    for (;;) {
+        char *frame = conn_caa->buf_resp + conn_caa->len_resp;
+        size_t avail = conn_caa->nread_resp - conn_caa->len_resp;
+        int len = dubbo_frame_len(frame, avail);
+        if (UNLIKELY(len < 0)) {
+            log_msg(ERR, "Not a dubbo frame from local provider with socket %d", fd);
+            return -1;
+        }
+        size_t frame_len = (size_t) len;
+        if (UNLIKELY(frame_len > sizeof(conn_caa->buf_resp))) {
+            log_msg(ERR, "Dubbo frame of %zu bytes from local provider does not fit", frame_len);
+            return -1;
+        }
+        if (frame_len == 0 || avail < frame_len) {
+            return 0;
+        }
 
-    int ret = etcd_set(etcd_key, "", 3600, 0);
-    if (ret != 0) {
-        log_msg(ERR, "Failed to do etcd_set: %d", ret);
+        uint8_t flags = (uint8_t) frame[2];
+        if (LIKELY(!(flags & (DUBBO_FLAG_REQUEST | DUBBO_FLAG_EVENT)))) {
+            if (LIKELY(conn_caa->in_provider && memcmp(frame + 4, conn_caa->buf_req + 4, 8) == 0)) {
+                conn_caa->len_resp = frame_len;
+                return 1;
+            }
+            log_msg(WARN, "Drop stale response from local provider with socket %d", fd);
+        } else if ((flags & DUBBO_FLAG_EVENT) && (flags & DUBBO_FLAG_REQUEST)) {
+            if (flags & DUBBO_FLAG_TWOWAY) {
+                answer_heartbeat(conn_caa, fd, frame);
+            }
+        } else {
+            // Answer to a heartbeat of ours
+            conn_caa->conn_ap->heartbeat_ms = 0;
+            conn_caa->conn_ap->last_active_ms = get_current_time_ms();
+        }
+
+        // Only a response pending for the consumer agent may precede the frame
+        conn_caa->nread_resp -= frame_len;
+        memmove(frame, frame + frame_len, conn_caa->nread_resp - conn_caa->len_resp);
+    }
+}
+
+void skip_response(connection_caa_t *conn_caa) {
+    conn_caa->nread_resp -= conn_caa->len_resp;
+    memmove(conn_caa->buf_resp, conn_caa->buf_resp + conn_caa->len_resp, conn_caa->nread_resp);
+    conn_caa->len_resp = 0;
+}
+
+void answer_heartbeat(connection_caa_t *conn_caa, int fd, const char *frame) {
+    if (UNLIKELY(conn_caa->in_provider && conn_caa->nwrite_req < (size_t) conn_caa->len_req)) {
+        // A request is half written, the provider sends another heartbeat if it misses this one
+        log_msg(WARN, "Skip heartbeat of local provider with socket %d while writing request", fd);
+        return;
+    }
+    char buf[DUBBO_HEADER_LEN + 8];
+    size_t len = dubbo_encode_heartbeat(buf, (uint8_t) frame[2] & 0x1f, DUBBO_STATUS_OK, frame + 4);
+    if (UNLIKELY(write(fd, buf, len) != (ssize_t) len)) {
+        log_msg(WARN, "Failed to answer heartbeat of local provider with socket %d", fd);
+    }
+}
+
+/*
+ * Shared memory: a consumer agent on the same host connects to the Unix socket at shm_path
+ * and passes its rings, see shm_connect(). Each of its connections is a tag on the channel,
+ * served by a connection object of its own as if it came over TCP. The rings are taken once
+ * the socket is readable, a consumer agent that does not pass them in time is dropped by
+ * keep_alive().
+ */
+bool listen_shm(aeEventLoop *event_loop) {
+    int fd = anetUnixServer(neterr, shm_path, 0, SHM_LISTEN_BACKLOG);
+    if (fd == ANET_ERR) {
+        return false;
+    }
+    anetNonBlock(NULL, fd);
+    if (aeCreateFileEvent(event_loop, fd, AE_READABLE, accept_shm_handler, NULL) == AE_ERR) {
+        snprintf(neterr, sizeof(neterr), "%s", strerror(errno));
+        close(fd);
+        return false;
+    }
+    shm_listen_fd = fd;
+    log_msg(INFO, "Listen for shared memory channels at %s", shm_path);
+    return true;
+}
+
+void accept_shm_handler(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    int conn_fd = anetUnixAccept(neterr, fd);
+    if (UNLIKELY(conn_fd == ANET_ERR)) {
+        if (errno != EWOULDBLOCK) {
+            log_msg(ERR, "Failed to accept shared memory channel: %s", neterr);
+        }
+        return;
+    }
+    shm_peer_t *peer = NULL;
+    for (int i = 0; i < MAX_SHM_PEERS && peer == NULL; i++) {
+        if (shm_closed(&shm_peers[i].channel)) {
+            peer = &shm_peers[i];
+        }
+    }
+    if (UNLIKELY(peer == NULL)) {
+        // Goes on over TCP
+        log_msg(WARN, "Too many shared memory channels, refuse socket %d", conn_fd);
+        close(conn_fd);
+        return;
+    }
+    shm_accept(&peer->channel, conn_fd);
+    if (UNLIKELY(aeCreateFileEvent(event_loop, conn_fd, AE_READABLE, take_shm_rings, peer) == AE_ERR)) {
+        log_msg(ERR, "Failed to create readable event for shared memory channel: %s", strerror(errno));
+        shm_close(&peer->channel);
+    }
+}
+
+void take_shm_rings(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    shm_peer_t *peer = privdata;
+    int ret = shm_finish_accept(neterr, &peer->channel);
+    if (ret == SHM_AGAIN) {
+        return;
+    }
+    if (UNLIKELY(ret == SHM_ERR)) {
+        log_msg(ERR, "Failed to set up shared memory channel: %s", neterr);
+        close_shm_peer(event_loop, peer);
+        return;
+    }
+    memset(peer->slots, 0, sizeof(peer->slots));
+
+    aeDeleteFileEvent(event_loop, fd, AE_READABLE);
+    if (UNLIKELY(aeCreateFileEvent(event_loop, peer->channel.efd_rx, AE_READABLE, read_from_shm_consumer, peer) == AE_ERR
+                 || aeCreateFileEvent(event_loop, fd, AE_READABLE, on_shm_peer_closed, peer) == AE_ERR)) {
+        log_msg(ERR, "Failed to create readable events for shared memory channel: %s", strerror(errno));
+        close_shm_peer(event_loop, peer);
+        return;
+    }
+    log_msg(INFO, "Consumer agent attached over shared memory channel %d", fd);
+}
+
+void read_from_shm_consumer(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    shm_peer_t *peer = privdata;
+    shm_channel_t *ch = &peer->channel;
+    uint32_t tag;
+    size_t len;
+    const char *msg;
+    int ret;
+
+    shm_clear_wakeup(ch);
+    do {
+        while ((ret = shm_peek(ch, &msg, &tag, &len)) == SHM_OK) {
+            take_shm_request(event_loop, peer, tag, msg, len);
+            if (UNLIKELY(!shm_attached(ch))) {
+                // Closed while taking the request, the rings are gone
+                return;
+            }
+            shm_consume(ch);
+        }
+        if (UNLIKELY(ret == SHM_ERR)) {
+            // Like a bad tag, the consumer agent is broken
+            log_msg(ERR, "Bad message on shared memory channel %d, close it", ch->sock);
+            close_shm_peer(event_loop, peer);
+            return;
+        }
+    } while (!shm_sleep(ch));
+}
+
+/*
+ * Request bytes are parsed where they are in the ring, HTTP ones are only encoded into
+ * buf_req and frames copied there.
+ */
+void take_shm_request(aeEventLoop *event_loop, shm_peer_t *peer, uint32_t tag, const char *msg, size_t len) {
+    if (UNLIKELY(!shm_tag_valid(tag))) {
+        // Only a broken consumer agent sends these, nothing else of it is trusted either
+        log_msg(ERR, "Bad tag %u on shared memory channel %d, close it", tag, peer->channel.sock);
+        close_shm_peer(event_loop, peer);
+        return;
+    }
+    connection_caa_t *conn_caa = peer->slots[SHM_TAG_INDEX(tag)];
+    if (UNLIKELY(conn_caa == NULL || conn_caa->tag != tag)) {
+        // First request of a connection, the one it replaces may still be waiting for its response
+        if (conn_caa == NULL || conn_caa->processing) {
+            conn_caa = PoolGet(connection_caa_pool);
+            if (UNLIKELY(conn_caa == NULL)) {
+                log_msg(ERR, "No connection object available for shared memory channel %d", peer->channel.sock);
+                shm_send(&peer->channel, tag, "", 0);
+                return;
+            }
+            peer->slots[SHM_TAG_INDEX(tag)] = conn_caa;
+        }
+        conn_caa->fd = peer->channel.sock;
+        conn_caa->nread_in = 0;
+        conn_caa->len_req = 0;
+        conn_caa->nwrite_req = 0;
+        skip_response(conn_caa);
+        conn_caa->event_loop = event_loop;
+
+        http_parser_init(&conn_caa->parser, HTTP_REQUEST);
+        conn_caa->parser.data = conn_caa;
+        conn_caa->processing = false;
+        conn_caa->relay = false;
+        conn_caa->in_provider = false;
+        conn_caa->peer = peer;
+        conn_caa->tag = tag;
+        conn_caa->span.trace_id = 0;
+        conn_caa->trace_field = false;
+    }
+    if (UNLIKELY(len == 0)) {
+        return;
+    }
+
+    if ((uint8_t) msg[0] == 0xda) {
+        relay_request(conn_caa, msg, len);
+    } else if (UNLIKELY(http_parser_execute(&conn_caa->parser, &parser_settings, msg, len) != len)) {
+        log_msg(ERR, "Failed to parse HTTP request from shared memory channel %d", peer->channel.sock);
+    }
+}
+
+void reply_over_shm(aeEventLoop *event_loop, connection_caa_t *conn_caa) {
+    shm_peer_t *peer = conn_caa->peer;
+    char *buf;
+    size_t len = build_response(conn_caa, &buf);
+    if (UNLIKELY(!shm_send(&peer->channel, conn_caa->tag, buf, len))) {
+        log_msg(ERR, "No room for response on shared memory channel %d", peer->channel.sock);
+        abort_connection_caa(event_loop, conn_caa);
+        return;
+    }
+    reset_connection_caa(conn_caa);
+
+    if (UNLIKELY(peer->slots[SHM_TAG_INDEX(conn_caa->tag)] != conn_caa)) {
+        // Replaced by a new connection of the consumer agent while in provider
+        release_shm_caa(conn_caa);
+    } else if (UNLIKELY(draining)) {
+        close_shm_peer_if_idle(event_loop, peer);
+    }
+}
+
+void release_shm_caa(connection_caa_t *conn_caa) {
+    if (UNLIKELY(conn_caa->in_provider)) {
+        // Its response is dropped as stale, see take_response()
+        conn_caa->in_provider = false;
+        num_inflight--;
+    }
+    conn_caa->processing = false;
+    conn_caa->peer = NULL;
+    conn_caa->fd = -1;
+    PoolReturn(connection_caa_pool, conn_caa);
+}
+
+void on_shm_peer_closed(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    shm_peer_t *peer = privdata;
+    char c;
+    ssize_t nread = read(fd, &c, 1);
+    if (nread < 0 && errno == EAGAIN) {
+        return;
+    }
+    // Nothing else is sent on the socket
+    log_msg(INFO, "Consumer agent detached from shared memory channel %d", fd);
+    close_shm_peer(event_loop, peer);
+}
+
+void close_shm_peer(aeEventLoop *event_loop, shm_peer_t *peer) {
+    shm_channel_t *ch = &peer->channel;
+    if (ch->efd_rx >= 0) {
+        // Not passed yet if the rings were not taken
+        aeDeleteFileEvent(event_loop, ch->efd_rx, AE_READABLE);
+    }
+    aeDeleteFileEvent(event_loop, ch->sock, AE_READABLE);
+    // Connection objects replaced by newer ones of their tag too
+    for (int i = 0; i < num_conn_caas; i++) {
+        if (conn_caas[i]->peer == peer) {
+            release_shm_caa(conn_caas[i]);
+        }
+    }
+    shm_close(ch);
+}
+
+void close_shm_peer_if_idle(aeEventLoop *event_loop, shm_peer_t *peer) {
+    for (int i = 0; i < num_conn_caas; i++) {
+        if (conn_caas[i]->peer == peer && conn_caas[i]->processing) {
+            return;
+        }
+    }
+    log_msg(INFO, "Close idle shared memory channel %d", peer->channel.sock);
+    close_shm_peer(event_loop, peer);
+}
+
+/*
+ * Load reported with each response covers the requests of all consumer agents. Requests
+ * taking longer than the fastest recent ones are taken to have waited in the provider.
+ */
+void update_load(connection_caa_t *conn_caa) {
+    conn_caa->in_provider = false;
+    num_inflight--;
+    num_responses++;
+
+    long now_us = get_current_time_us();
+    long rtt_us = now_us - conn_caa->req_start_us;
+    conn_caa->conn_ap->last_active_ms = now_us / 1000;
+    conn_caa->conn_ap->heartbeat_ms = 0;
+    service_us = service_us == 0 ? rtt_us : service_us + (rtt_us - service_us) / 8;
+    if (win_samples == 0 || rtt_us < win_min_service_us) {
+        win_min_service_us = rtt_us;
+    }
+    if (min_service_us == 0 || rtt_us < min_service_us) {
+        min_service_us = rtt_us;
+    }
+    if (++win_samples == SERVICE_TIME_WINDOW) {
+        min_service_us = win_min_service_us;
+        win_samples = 0;
+    }
+}
+
+/*
+ * Capacity of this endpoint for consumer agents to size their pools and weigh it in balancing
+ * before they have measured it: weight of its size class, CPU cores, requests it takes at once
+ * and the highest rate of responses seen so far (0 until measured). The port of the local
+ * provider is published too, for consumer agents that call it directly, unless it is only
+ * reached by a Unix socket, and whether consumer agents on this host may attach over shared
+ * memory.
+ */
+void register_etcd_service() {
+    char value[192];
+    for (int i = 0; i < num_services; i++) {
+        // Consumer agents that encode requests need the serialization, see relay_request()
+        int len = sprintf(value, "weight=%d,cores=%d,max_concurrency=%d,service_rate=%d,serialization=%s,relay=1",
+                          server_weight, get_cpu_cores(), NUM_CONN_TO_PROVIDER, published_service_rate,
+                          service_serializations[i] == DUBBO_SERIALIZATION_HESSIAN2 ? "hessian2" : "fastjson");
+        if (local_dubbo_path == NULL && !echoing) {
+            len += sprintf(value + len, ",dubbo_port=%d", local_dubbo_port);
+        }
+        if (shm_listen_fd >= 0) {
+            sprintf(value + len, ",shm=1");
+        }
+        int ret = etcd_set(etcd_keys[i], value, 3600, 0);
+        if (ret != 0) {
+            log_msg(ERR, "Failed to do etcd_set: %d", ret);
+        }
+        log_msg(INFO, "Register service at: %s - %s", etcd_keys[i], value);
+    }
+}
+
+int measure_service_rate(aeEventLoop *event_loop, long long id, void *client_data) {
+    if (draining) {
+        return AE_NOMORE;
     }
-    log_msg(INFO, "Register service at: %s", etcd_key);
+    int rate = num_responses * 1000 / SERVICE_RATE_INTERVAL_MS;
+    num_responses = 0;
+    if (rate > peak_service_rate) {
+        peak_service_rate = rate;
+    }
+    // etcd is written synchronously, so only for a clearly higher peak
+    if (peak_service_rate * 100 >= published_service_rate * SERVICE_RATE_REPORT_STEP && peak_service_rate > 0) {
+        published_service_rate = peak_service_rate;
+        register_etcd_service();
+    }
+    return SERVICE_RATE_INTERVAL_MS;
 }
 
 void deregister_etcd_service() {
-    int ret = etcd_del(etcd_key);
-    if (ret != 0) {
-        log_msg(WARN, "Failed to do etcd_del: %d", ret);
+    for (int i = 0; i < num_services; i++) {
+        int ret = etcd_del(etcd_keys[i]);
+        if (ret != 0) {
+            log_msg(WARN, "Failed to do etcd_del: %d", ret);
+        }
+        log_msg(INFO, "Deregister service at: %s", etcd_keys[i]);
+    }
+}
+
+/*
+ * Blocking connect to local provider, at its Unix socket if it has one. Returns the socket
+ * made non-blocking, or -1 with the error in neterr.
+ */
+int connect_local_provider() {
+    int fd;
+    if (local_dubbo_path != NULL) {
+        fd = anetUnixConnect(neterr, local_dubbo_path);
+    } else {
+        fd = anetTcpConnect(neterr, "127.0.0.1", local_dubbo_port);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    anetNonBlock(NULL, fd);
+    if (local_dubbo_path == NULL) {
+        anetEnableTcpNoDelay(NULL, fd);
     }
-    log_msg(INFO, "Deregister service at: %s", etcd_key);
+    return fd;
 }
 
 int init_connection_ap(void *elem, void *data) {
     connection_ap_t *conn_ap = elem;
+    conn_ap->last_active_ms = get_current_time_ms();
+    conn_ap->heartbeat_ms = 0;
+    if (echoing) {
+        conn_ap->fd = -1;
+        return 1;
+    }
 
-    char *addr = "127.0.0.1";
-    int port = (int) data;
+    char *addr = local_provider_addr;
+    int port = local_dubbo_port;
+
+    int fd = handoff_take_upstream(addr, port);
+    if (fd >= 0) {
+        conn_ap->fd = fd;
+        log_msg(DEBUG, "Inherit connection to local provider %s:%d with socket %d", addr, port, fd);
+        return 1;
+    }
 
-    int fd;
     do {
-        fd = anetTcpConnect(neterr, addr, port);
+        fd = connect_local_provider();
         if (fd < 0) {
             log_msg(WARN, "Failed to connect to local provider %s:%d - %s, Sleep 1 seconds to retry later",
                     addr, port, neterr);
             sleep(1);
         } else {
-            anetNonBlock(NULL, fd);
-            anetEnableTcpNoDelay(NULL, fd);
             conn_ap->fd = fd;
             log_msg(DEBUG, "Build connection to local provider %s:%d with socket %d", addr, port, fd);
         }
@@ -498,6 +1227,85 @@ void cleanup_connection_ap(void *elem) {
     }
 }
 
+/*
+ * Idle connections to local provider get heartbeats, so neither the provider nor anything
+ * in between drops them unnoticed. One left unanswered, or closed, is replaced before a
+ * request finds it dead.
+ */
+int keep_alive(aeEventLoop *event_loop, long long id, void *client_data) {
+    if (draining) {
+        return AE_NOMORE;
+    }
+    if (UNLIKELY(shm_listen_fd < 0) && listen_shm(event_loop)) {
+        register_etcd_service();
+    }
+    long now = get_current_time_ms();
+    for (int i = 0; i < MAX_SHM_PEERS; i++) {
+        if (UNLIKELY(shm_expired(&shm_peers[i].channel, now))) {
+            log_msg(WARN, "Consumer agent did not pass shared memory rings on socket %d in %d ms",
+                    shm_peers[i].channel.sock, SHM_CONNECT_TIMEOUT_MS);
+            close_shm_peer(event_loop, &shm_peers[i]);
+        }
+    }
+    if (echoing) {
+        return KEEPALIVE_INTERVAL_MS;
+    }
+    for (int i = 0; i < num_conn_caas; i++) {
+        connection_caa_t *conn_caa = conn_caas[i];
+        connection_ap_t *conn_ap = conn_caa->conn_ap;
+        if (conn_caa->fd >= 0 && conn_caa->processing) {
+            // Its response tells
+            continue;
+        }
+        if (conn_ap->fd < 0 || (conn_ap->heartbeat_ms > 0 && now - conn_ap->heartbeat_ms >= KEEPALIVE_TIMEOUT_MS)) {
+            replace_connection_ap(event_loop, conn_caa);
+        } else if (conn_ap->heartbeat_ms == 0 && now - conn_ap->last_active_ms >= KEEPALIVE_IDLE_MS) {
+            send_heartbeat(event_loop, conn_caa, now);
+        }
+    }
+    return KEEPALIVE_INTERVAL_MS;
+}
+
+void send_heartbeat(aeEventLoop *event_loop, connection_caa_t *conn_caa, long now) {
+    connection_ap_t *conn_ap = conn_caa->conn_ap;
+    char id[8] = {0};
+    *((uint32_t *) &id[4]) = htonl(cur_request_id++);
+
+    char buf[DUBBO_HEADER_LEN + 8];
+    size_t len = dubbo_encode_heartbeat(buf, DUBBO_FLAG_REQUEST | DUBBO_FLAG_TWOWAY | service_serializations[0], 0, id);
+    if (UNLIKELY(write(conn_ap->fd, buf, len) != (ssize_t) len)) {
+        log_msg(WARN, "Failed to send heartbeat to local provider with socket %d", conn_ap->fd);
+        replace_connection_ap(event_loop, conn_caa);
+        return;
+    }
+    conn_ap->heartbeat_ms = now;
+
+    if (UNLIKELY(aeCreateFileEvent(event_loop, conn_ap->fd, AE_READABLE, read_from_local_provider, conn_caa) == AE_ERR)) {
+        log_msg(ERR, "Failed to create readable event for read_from_local_provider");
+    }
+}
+
+void replace_connection_ap(aeEventLoop *event_loop, connection_caa_t *conn_caa) {
+    connection_ap_t *conn_ap = conn_caa->conn_ap;
+    if (conn_ap->fd >= 0) {
+        log_msg(WARN, "Replace connection to local provider with socket %d", conn_ap->fd);
+        aeDeleteFileEvent(event_loop, conn_ap->fd, AE_WRITABLE | AE_READABLE);
+        close(conn_ap->fd);
+    }
+    conn_caa->nread_resp = 0;
+    conn_caa->len_resp = 0;
+    conn_ap->heartbeat_ms = 0;
+    conn_ap->last_active_ms = get_current_time_ms();
+
+    conn_ap->fd = connect_local_provider();
+    if (conn_ap->fd < 0) {
+        // Tried again by keep_alive()
+        log_msg(DEBUG, "Failed to connect to local provider: %s", neterr);
+        return;
+    }
+    log_msg(INFO, "Build connection to local provider with socket %d", conn_ap->fd);
+}
+
 int init_connection_caa(void *elem, void *data) {
     connection_caa_t *conn_caa = elem;
     // Binding connection to local provider
@@ -507,6 +1315,14 @@ int init_connection_caa(void *elem, void *data) {
         abort_connection_caa(conn_caa->event_loop, conn_caa);
     }
     conn_caa->conn_ap = conn_ap;
+    conn_caa->fd = -1;
+    conn_caa->nread_resp = 0;
+    conn_caa->len_resp = 0;
+    conn_caa->processing = false;
+    conn_caa->relay = false;
+    conn_caa->in_provider = false;
+    conn_caa->peer = NULL;
+    conn_caas[num_conn_caas++] = conn_caa;
     return 1;
 }
 
@@ -514,6 +1330,19 @@ void cleanup_connection_caa(void *elem) {
     log_msg(DEBUG, "Cleanup connection to consumer agent");
 }
 
+void close_connection_caa(aeEventLoop *event_loop, connection_caa_t *conn_caa) {
+    int fd = conn_caa->fd;
+    if (UNLIKELY(conn_caa->in_provider)) {
+        conn_caa->in_provider = false;
+        num_inflight--;
+    }
+    aeDeleteFileEvent(event_loop, fd, AE_WRITABLE | AE_READABLE);
+    close(fd);
+    conn_caa->fd = -1;
+    PoolReturn(connection_caa_pool, conn_caa);
+    log_msg(DEBUG, "Returned connection object to pool, active: %d", connection_caa_pool->outstanding);
+}
+
 void abort_connection_caa(aeEventLoop *event_loop, connection_caa_t *conn_caa) {
     // Dump data
     log_msg(WARN, "Conn caa: nread_in - %d, len_req - %d, nwrite_req - %d, nread_resp - %d,",
@@ -523,12 +1352,30 @@ void abort_connection_caa(aeEventLoop *event_loop, connection_caa_t *conn_caa) {
 //            conn_caa->nread_resp, conn_caa->buf_resp) ;
 
     log_msg(ERR, "Abort connection to consumer agent with socket: %d", conn_caa->fd);
-    aeDeleteFileEvent(event_loop, conn_caa->fd, AE_WRITABLE | AE_READABLE);
-    close(conn_caa->fd);
+    shm_peer_t *peer = conn_caa->peer;
+    if (peer != NULL) {
+        // Only the request fails, an empty response tells the consumer agent to replace its connection
+        shm_send(&peer->channel, conn_caa->tag, "", 0);
+        if (peer->slots[SHM_TAG_INDEX(conn_caa->tag)] == conn_caa) {
+            peer->slots[SHM_TAG_INDEX(conn_caa->tag)] = NULL;
+        }
+        conn_caa->peer = NULL;
+    } else {
+        aeDeleteFileEvent(event_loop, conn_caa->fd, AE_WRITABLE | AE_READABLE);
+        close(conn_caa->fd);
+    }
     conn_caa->fd = -1;
 
+    if (conn_caa->in_provider) {
+        conn_caa->in_provider = false;
+        num_inflight--;
+    }
+
+    conn_caa->processing = false;
+
+    // Replaced by keep_alive() or the next request on it
     connection_ap_t *conn_ap = conn_caa->conn_ap;
-    if (conn_ap != NULL) {
+    if (conn_ap != NULL && conn_ap->fd >= 0) {
         log_msg(ERR, "Abort connection to local provider with socket: %d", conn_ap->fd);
         aeDeleteFileEvent(event_loop, conn_ap->fd, AE_WRITABLE | AE_READABLE);
         close(conn_ap->fd);
@@ -8,11 +8,15 @@
 #include "util.h"
 #include "etcd.h"
 #include "anet.h"
+#include "handoff.h"
+#include "shm.h"
+#include "trace.h"
 
 // Adjustable params
 #define PROVIDER_HTTP_REQ_BUF_SIZE 2048
 #define PROVIDER_DUBBO_REQ_BUF_SIZE 2048
 #define PROVIDER_DUBBO_RESP_BUF_SIZE 256
+#define PROVIDER_RESP_OUT_BUF_SIZE (PROVIDER_DUBBO_RESP_BUF_SIZE + 128)
 
 // Consumer Agent <-> Agent
 typedef struct connection_caa {
@@ -26,23 +30,55 @@ typedef struct connection_caa {
 
     char buf_resp[PROVIDER_DUBBO_RESP_BUF_SIZE];
     size_t nread_resp;
+    size_t len_resp;    // response at the start of buf_resp, 0 until one is complete
+
+    // Response partially written to consumer agent, written on from here instead of built again
+    char buf_out[PROVIDER_RESP_OUT_BUF_SIZE];
+    size_t len_out;     // 0 if none
+    size_t nwrite_out;
 
     http_parser parser;
     bool processing;
+    bool in_provider;   // sent to local provider and not answered yet
+    bool relay;         // request came as a Dubbo frame and is answered with one
+    long req_start_us;
 
     aeEventLoop *event_loop;
     struct connection_ap *conn_ap;
+
+    // Consumer agent on the same host, requests come over shared memory, see take_shm_request()
+    struct shm_peer *peer;
+    uint32_t tag;
+
+    // Request traced by the consumer agent, see start_span()
+    trace_span_t span;
+    bool trace_field;   // header being parsed is TRACE_HEADER
 } connection_caa_t;
 
+// Consumer agent attached over shared memory, its connections are tags on the channel
+typedef struct shm_peer {
+    shm_channel_t channel;
+    connection_caa_t *slots[SHM_MAX_TAGS]; // by tag index, the latest connection of each
+} shm_peer_t;
+
 // Agent <-> Provider
 typedef struct connection_ap {
     int fd;
+    long last_active_ms;    // last heard from local provider
+    long heartbeat_ms;      // sent a heartbeat not answered yet, 0 if none
 } connection_ap_t;
 
-void provider_init(int server_port, int dubbo_port);
+void provider_init(aeEventLoop *event_loop, int server_port, int dubbo_port, char *dubbo_path, int weight,
+                   const char *service_list, bool echo);
 
 void provider_http_handler(aeEventLoop *event_loop, int fd);
 
 void provider_cleanup();
 
+void provider_handoff(aeEventLoop *event_loop, int sock);
+
+int provider_active_connections();
+
+long provider_echoed_requests();
+
 #endif //MESH_AGENT_NATIVE_PROVIDER_H
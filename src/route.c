@@ -0,0 +1,144 @@
+#include "fmacros.h"
+#include <string.h>
+#include "route.h"
+#include "util.h"
+
+/*
+ * Routing index of the services known from etcd, by interface name. The set only changes at
+ * discovery, so it is a perfect hash: a seed is searched for that gives every name a slot of
+ * its own, and a lookup is one hash of the name and one compare. The name is taken from the
+ * request without parsing the rest of it, see route_request().
+ */
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static char **service_names = NULL;
+static size_t name_lens[ROUTE_MAX_SERVICES];
+static int num_services = 0;
+
+static int8_t *slots = NULL; // service index, -1 if empty
+static uint32_t slot_mask = 0;
+static uint64_t seed = 0;
+
+
+static inline uint32_t hash_name(uint64_t hash_seed, const char *name, size_t len) {
+    uint64_t hash = FNV_OFFSET_BASIS ^ hash_seed;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t) name[i]) * FNV_PRIME;
+    }
+    // Low bits of FNV only depend on low bits of the input, mix the high ones in
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return (uint32_t) hash;
+}
+
+static bool try_seed(uint64_t try, uint32_t mask) {
+    memset(slots, -1, mask + 1);
+    for (int i = 0; i < num_services; i++) {
+        uint32_t slot = hash_name(try, service_names[i], name_lens[i]) & mask;
+        if (slots[slot] >= 0) {
+            return false;
+        }
+        slots[slot] = (int8_t) i;
+    }
+    return true;
+}
+
+/*
+ * Index the given distinct names, a name is looked up as its position in 'names'. Fails on
+ * a name given twice, no seed ever separates those.
+ */
+int route_build(char **names, int num_names) {
+    if (num_names > ROUTE_MAX_SERVICES) {
+        log_msg(ERR, "Too many services to route: %d, at most %d", num_names, ROUTE_MAX_SERVICES);
+        return -1;
+    }
+    for (int i = 0; i < num_names; i++) {
+        for (int j = 0; j < i; j++) {
+            if (strcmp(names[i], names[j]) == 0) {
+                log_msg(ERR, "Service %s to route is given twice", names[i]);
+                return -1;
+            }
+        }
+    }
+    service_names = names;
+    num_services = num_names;
+    for (int i = 0; i < num_names; i++) {
+        name_lens[i] = strlen(names[i]);
+    }
+
+    // Twice as many slots as names to start with, doubled until a seed separates them
+    uint32_t size = 8;
+    while (size < (uint32_t) num_names * 2) {
+        size <<= 1;
+    }
+    for (; size <= ROUTE_MAX_SLOTS; size <<= 1) {
+        free(slots);
+        slots = malloc(size);
+        if (slots == NULL) {
+            log_msg(ERR, "Failed to allocate routing index of %u slots", size);
+            return -1;
+        }
+        for (uint64_t try = 0; try < ROUTE_MAX_SEEDS; try++) {
+            if (try_seed(try, size - 1)) {
+                seed = try;
+                slot_mask = size - 1;
+                log_msg(INFO, "Routing index of %d services in %u slots, seed %lu", num_names, size, seed);
+                return 0;
+            }
+        }
+    }
+    log_msg(ERR, "No seed separates %d services in %d slots", num_names, ROUTE_MAX_SLOTS);
+    return -1;
+}
+
+int route_lookup(const char *name, size_t len) {
+    int i = slots[hash_name(seed, name, len) & slot_mask];
+    if (i < 0 || name_lens[i] != len || memcmp(service_names[i], name, len) != 0) {
+        return -1;
+    }
+    return i;
+}
+
+// Whether the whole body is in [body, end), a body without Content-Length is
+static bool body_complete(const char *req, const char *body, const char *end) {
+    const char *header = find_header(req, body, "Content-Length:", 15);
+    return header == NULL || strtol(header, NULL, 10) <= end - body;
+}
+
+/*
+ * Service of an HTTP request by its interface= field, looked for at the start of the body
+ * where clients put it, so the rest of the form is not parsed. Returns the index of the
+ * service, ROUTE_INCOMPLETE if more of the request has to be read to tell, or ROUTE_UNKNOWN.
+ */
+int route_request(const char *req, size_t len) {
+    const char *end = req + len;
+    const char *body = memmem(req, len, "\r\n\r\n", 4);
+    if (UNLIKELY(body == NULL)) {
+        return ROUTE_INCOMPLETE;
+    }
+    body += 4;
+
+    const char *name;
+    if (LIKELY((size_t) (end - body) >= 10 && memcmp(body, "interface=", 10) == 0)) {
+        name = body + 10;
+    } else {
+        const char *field = memmem(body, (size_t) (end - body), "&interface=", 11);
+        if (field == NULL) {
+            return body_complete(req, body, end) ? ROUTE_UNKNOWN : ROUTE_INCOMPLETE;
+        }
+        name = field + 11;
+    }
+
+    const char *name_end = memchr(name, '&', (size_t) (end - name));
+    if (name_end == NULL) {
+        if (!body_complete(req, body, end)) {
+            return ROUTE_INCOMPLETE;
+        }
+        name_end = end;
+    }
+    int i = route_lookup(name, (size_t) (name_end - name));
+    return i >= 0 ? i : ROUTE_UNKNOWN;
+}
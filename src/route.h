@@ -0,0 +1,25 @@
+#ifndef MESH_AGENT_NATIVE_ROUTE_H
+#define MESH_AGENT_NATIVE_ROUTE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "common.h"
+
+// Adjustable params
+#define ROUTE_MAX_SERVICES 64
+#define ROUTE_MAX_SEEDS 4096          // tried per table size before it is doubled
+#define ROUTE_MAX_SLOTS 65536         // table size given up at
+
+// Results of route_request() other than a service index
+#define ROUTE_INCOMPLETE (-1)  // interface not read in full yet
+#define ROUTE_UNKNOWN (-2)     // no interface, or none of the services
+
+int route_build(char **names, int num_names);
+
+int route_lookup(const char *name, size_t len);
+
+int route_request(const char *req, size_t len);
+
+#endif //MESH_AGENT_NATIVE_ROUTE_H
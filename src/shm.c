@@ -0,0 +1,358 @@
+#include "fmacros.h"
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "shm.h"
+#include "util.h"
+
+/*
+ * Shared memory transport between agents on the same host. The consumer agent creates the
+ * memfd with both rings and an eventfd per direction, and passes them over a Unix socket of
+ * the provider agent. Messages are a length and a tag followed by the bytes, written once
+ * into the ring and read in place by the peer. Each message starts at a multiple of 8 and
+ * never wraps, the rest of the ring is skipped instead. A reader signals that it sleeps, and
+ * only then does the writer pay a syscall to wake it, see shm_sleep().
+ */
+
+#define SHM_MSG_HEADER_LEN 8
+#define SHM_MSG_WRAP 0xffffffffu  // length of a marker at the end of the ring, the next message is at 0
+#define SHM_HELLO 'k'
+#define SHM_NUM_FDS 3  // memfd and the eventfds
+
+static void shm_set_error(char *err, const char *what) {
+    if (err != NULL) {
+        snprintf(err, ANET_ERR_LEN, "%s: %s", what, strerror(errno));
+    }
+}
+
+static inline size_t msg_space(size_t len) {
+    return (SHM_MSG_HEADER_LEN + len + 7) & ~(size_t) 7;
+}
+
+static int map_rings(char *err, shm_channel_t *ch, int memfd) {
+    ch->base = mmap(NULL, 2 * sizeof(shm_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (ch->base == MAP_FAILED) {
+        ch->base = NULL;
+        shm_set_error(err, "mmap");
+        return SHM_ERR;
+    }
+    return SHM_OK;
+}
+
+/*
+ * Memfd of the rings and the eventfds of both directions, passed in one message so that the
+ * handshake takes a single readable event on either side.
+ */
+static int send_rings(char *err, int sock, int fds[SHM_NUM_FDS]) {
+    char hello = SHM_HELLO;
+    struct iovec iov = {.iov_base = &hello, .iov_len = 1};
+    char control[CMSG_SPACE(sizeof(int) * SHM_NUM_FDS)];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * SHM_NUM_FDS);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * SHM_NUM_FDS);
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != 1) {
+        shm_set_error(err, "sendmsg");
+        return SHM_ERR;
+    }
+    return SHM_OK;
+}
+
+static int recv_rings(char *err, int sock, int fds[SHM_NUM_FDS]) {
+    char hello;
+    struct iovec iov = {.iov_base = &hello, .iov_len = 1};
+    char control[CMSG_SPACE(sizeof(int) * SHM_NUM_FDS)];
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    ssize_t nread = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (nread == -1 && errno == EAGAIN) {
+        return SHM_AGAIN;
+    }
+    if (nread == -1) {
+        shm_set_error(err, "recvmsg");
+        return SHM_ERR;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * SHM_NUM_FDS)) {
+        // Whatever fds came along with a short message are closed with it
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int *passed = (int *) CMSG_DATA(cmsg);
+            for (size_t i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++) {
+                close(passed[i]);
+            }
+        }
+        if (err != NULL) {
+            snprintf(err, ANET_ERR_LEN, "consumer agent did not pass the rings");
+        }
+        return SHM_ERR;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * SHM_NUM_FDS);
+    if (nread != 1 || hello != SHM_HELLO) {
+        for (int i = 0; i < SHM_NUM_FDS; i++) {
+            close(fds[i]);
+        }
+        if (err != NULL) {
+            snprintf(err, ANET_ERR_LEN, "consumer agent did not pass the rings");
+        }
+        return SHM_ERR;
+    }
+    return SHM_OK;
+}
+
+/*
+ * Consumer agent side: create the rings and pass them to the provider agent listening at
+ * 'path'. Does not wait for it, the channel is in handshake until shm_finish_connect() sees
+ * the provider agent has mapped them, which it must do by 'deadline_ms'.
+ */
+int shm_connect(char *err, shm_channel_t *ch, char *path) {
+    memset(ch, 0, sizeof(*ch));
+    ch->efd_rx = ch->efd_tx = -1;
+
+    // Nothing is set up for a provider agent that is not on this host
+    ch->sock = anetUnixNonBlockConnect(err, path);
+    if (ch->sock == ANET_ERR) {
+        return SHM_ERR;
+    }
+    int memfd = memfd_create("mesh-agent-shm", MFD_CLOEXEC);
+    if (memfd == -1) {
+        shm_set_error(err, "memfd_create");
+        shm_close(ch);
+        return SHM_ERR;
+    }
+    if (ftruncate(memfd, 2 * sizeof(shm_ring_t)) == -1) {
+        shm_set_error(err, "ftruncate");
+        goto error;
+    }
+    if (map_rings(err, ch, memfd) == SHM_ERR) {
+        goto error;
+    }
+    // Requests first, then responses
+    ch->tx = (shm_ring_t *) ch->base;
+    ch->rx = ch->tx + 1;
+    atomic_store(&ch->tx->waiting, 1);
+    atomic_store(&ch->rx->waiting, 1);
+
+    ch->efd_rx = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ch->efd_tx = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ch->efd_rx == -1 || ch->efd_tx == -1) {
+        shm_set_error(err, "eventfd");
+        goto error;
+    }
+
+    // Queued on the socket even before the provider agent accepts it
+    int fds[SHM_NUM_FDS] = {memfd, ch->efd_tx, ch->efd_rx};
+    if (send_rings(err, ch->sock, fds) == SHM_ERR) {
+        goto error;
+    }
+    close(memfd);
+    ch->state = SHM_HANDSHAKE;
+    ch->deadline_ms = get_current_time_ms() + SHM_CONNECT_TIMEOUT_MS;
+    return SHM_OK;
+
+error:
+    close(memfd);
+    shm_close(ch);
+    return SHM_ERR;
+}
+
+/*
+ * The socket of a channel in handshake is readable: SHM_OK once the provider agent has mapped
+ * the rings, SHM_AGAIN if nothing came yet. The caller closes the channel on SHM_ERR, after
+ * deleting the events of its socket.
+ */
+int shm_finish_connect(char *err, shm_channel_t *ch) {
+    char hello;
+    ssize_t nread = read(ch->sock, &hello, 1);
+    if (nread == -1 && errno == EAGAIN) {
+        return SHM_AGAIN;
+    }
+    if (nread != 1 || hello != SHM_HELLO) {
+        if (err != NULL) {
+            snprintf(err, ANET_ERR_LEN, "provider agent did not take the rings");
+        }
+        return SHM_ERR;
+    }
+    ch->state = SHM_UP;
+    return SHM_OK;
+}
+
+/*
+ * Provider agent side: wait for the rings of a consumer agent that connected on 'sock', which
+ * is the channel's from now on, closed with it. They are taken by shm_finish_accept() once the
+ * socket is readable, by 'deadline_ms'.
+ */
+void shm_accept(shm_channel_t *ch, int sock) {
+    memset(ch, 0, sizeof(*ch));
+    ch->sock = sock;
+    ch->efd_rx = ch->efd_tx = -1;
+    anetNonBlock(NULL, sock);
+    ch->state = SHM_HANDSHAKE;
+    ch->deadline_ms = get_current_time_ms() + SHM_CONNECT_TIMEOUT_MS;
+}
+
+/*
+ * The socket of a channel in handshake is readable: SHM_OK once the rings passed on it are
+ * mapped, SHM_AGAIN if they did not come yet. The caller closes the channel on SHM_ERR, after
+ * deleting the events of its socket.
+ */
+int shm_finish_accept(char *err, shm_channel_t *ch) {
+    int fds[SHM_NUM_FDS];
+    int ret = recv_rings(err, ch->sock, fds);
+    if (ret != SHM_OK) {
+        return ret;
+    }
+    ch->efd_rx = fds[1];
+    ch->efd_tx = fds[2];
+
+    struct stat st;
+    if (fstat(fds[0], &st) == -1 || st.st_size != (off_t) (2 * sizeof(shm_ring_t))) {
+        if (err != NULL) {
+            snprintf(err, ANET_ERR_LEN, "rings of another size");
+        }
+        close(fds[0]);
+        return SHM_ERR;
+    }
+    ret = map_rings(err, ch, fds[0]);
+    close(fds[0]);
+    if (ret == SHM_ERR) {
+        return SHM_ERR;
+    }
+    ch->rx = (shm_ring_t *) ch->base;
+    ch->tx = ch->rx + 1;
+
+    // The socket buffer is empty, a byte always fits
+    char hello = SHM_HELLO;
+    if (write(ch->sock, &hello, 1) != 1) {
+        shm_set_error(err, "write");
+        return SHM_ERR;
+    }
+    ch->state = SHM_UP;
+    return SHM_OK;
+}
+
+/*
+ * Write a message into the ring to the peer, and wake it if it sleeps. False if it does not
+ * fit in the space the peer has not read yet.
+ */
+bool shm_send(shm_channel_t *ch, uint32_t tag, const char *data, size_t len) {
+    shm_ring_t *ring = ch->tx;
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t space = msg_space(len);
+    size_t offset = head & (SHM_RING_SIZE - 1);
+    size_t skip = offset + space > SHM_RING_SIZE ? SHM_RING_SIZE - offset : 0;
+    if (UNLIKELY(head + skip + space - tail > SHM_RING_SIZE)) {
+        return false;
+    }
+    if (UNLIKELY(skip > 0)) {
+        *((uint32_t *) &ring->data[offset]) = SHM_MSG_WRAP;
+        head += skip;
+        offset = 0;
+    }
+
+    uint32_t *header = (uint32_t *) &ring->data[offset];
+    header[0] = (uint32_t) len;
+    header[1] = tag;
+    memcpy(header + 2, data, len);
+    atomic_store_explicit(&ring->head, head + space, memory_order_release);
+
+    // Pairs with the fence in shm_sleep(), either the peer sees the message or this sees it waiting
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->waiting, memory_order_relaxed) && atomic_exchange(&ring->waiting, 0)) {
+        uint64_t one = 1;
+        if (UNLIKELY(write(ch->efd_tx, &one, sizeof(one)) != sizeof(one))) {
+            log_msg(WARN, "Failed to wake agent on shared memory channel %d: %s", ch->sock, strerror(errno));
+        }
+    }
+    return true;
+}
+
+/*
+ * Oldest message from the peer, read in place until shm_consume(). SHM_AGAIN if there is
+ * none, SHM_ERR if the peer wrote past its ring or a length that does not fit in it, nothing
+ * of it can be read safely after that.
+ */
+int shm_peek(shm_channel_t *ch, const char **msg, uint32_t *tag, size_t *len) {
+    shm_ring_t *ring = ch->rx;
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail == head) {
+        return SHM_AGAIN;
+    }
+    if (UNLIKELY(head - tail > SHM_RING_SIZE)) {
+        return SHM_ERR;
+    }
+    size_t offset = tail & (SHM_RING_SIZE - 1);
+    uint32_t *header = (uint32_t *) &ring->data[offset];
+    if (UNLIKELY(header[0] == SHM_MSG_WRAP)) {
+        // Written along with the message after it
+        tail += SHM_RING_SIZE - offset;
+        offset = 0;
+        header = (uint32_t *) ring->data;
+        if (UNLIKELY(head - tail > SHM_RING_SIZE)) {
+            return SHM_ERR;
+        }
+    }
+    if (UNLIKELY(header[0] > SHM_RING_SIZE - offset - SHM_MSG_HEADER_LEN)) {
+        return SHM_ERR;
+    }
+    ch->rx_next = tail + msg_space(header[0]);
+    if (UNLIKELY(ch->rx_next > head)) {
+        return SHM_ERR;
+    }
+    *len = header[0];
+    *tag = header[1];
+    *msg = (const char *) (header + 2);
+    return SHM_OK;
+}
+
+void shm_consume(shm_channel_t *ch) {
+    atomic_store_explicit(&ch->rx->tail, ch->rx_next, memory_order_release);
+}
+
+void shm_clear_wakeup(shm_channel_t *ch) {
+    uint64_t count;
+    if (read(ch->efd_rx, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        log_msg(WARN, "Failed to read eventfd of shared memory channel %d: %s", ch->sock, strerror(errno));
+    }
+}
+
+/*
+ * Ask the peer to signal the next message. False if one came in meanwhile, it has to be
+ * read before the eventfd can be waited on.
+ */
+bool shm_sleep(shm_channel_t *ch) {
+    shm_ring_t *ring = ch->rx;
+    atomic_store_explicit(&ring->waiting, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->head, memory_order_acquire) ==
+        atomic_load_explicit(&ring->tail, memory_order_relaxed)) {
+        return true;
+    }
+    atomic_store_explicit(&ring->waiting, 0, memory_order_relaxed);
+    return false;
+}
+
+void shm_close(shm_channel_t *ch) {
+    if (ch->base != NULL) {
+        munmap(ch->base, 2 * sizeof(shm_ring_t));
+        ch->base = NULL;
+    }
+    if (ch->sock >= 0) {
+        close(ch->sock);
+    }
+    if (ch->efd_rx >= 0) {
+        close(ch->efd_rx);
+    }
+    if (ch->efd_tx >= 0) {
+        close(ch->efd_tx);
+    }
+    ch->sock = ch->efd_rx = ch->efd_tx = -1;
+    ch->rx = ch->tx = NULL;
+    ch->state = SHM_CLOSED;
+}
@@ -0,0 +1,99 @@
+#ifndef MESH_AGENT_NATIVE_SHM_H
+#define MESH_AGENT_NATIVE_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "common.h"
+#include "anet.h"
+
+// Adjustable params
+#define SHM_RING_SIZE (4 << 20)        // per direction, a power of 2 that holds a request of every tag
+#define SHM_MAX_TAGS 1024              // connections multiplexed over a channel
+#define SHM_CONNECT_TIMEOUT_MS 1000    // for the peer to take or pass the rings
+
+// Abstract Unix socket a provider agent takes channels at, by the address it registers with
+#define SHM_PATH_FORMAT "@mesh-agent-shm-%s:%d"
+
+#define SHM_OK 0
+#define SHM_ERR -1
+#define SHM_AGAIN 1  // handshake goes on once the socket is readable again, or no message yet
+
+// States of a channel
+#define SHM_CLOSED 0
+#define SHM_HANDSHAKE 1  // rings are being passed over the socket, see shm_connect() and shm_accept()
+#define SHM_UP 2
+
+// Tags name a connection by its index and a generation, so a response to a connection that is
+// gone is not taken for one of the next connection of that index
+#define SHM_TAG_INDEX(tag) ((tag) & 0xffff)
+#define SHM_TAG(index, generation) ((uint32_t) (index) | ((uint32_t) (generation) << 16))
+
+// Only a broken peer sends a tag of an index past the connections of a channel
+static inline bool shm_tag_valid(uint32_t tag) {
+    return SHM_TAG_INDEX(tag) < SHM_MAX_TAGS;
+}
+
+// Single producer, single consumer, each position only grows and is masked into data
+typedef struct shm_ring {
+    _Atomic uint64_t head;      // written up to, by the producer
+    char pad1[56];
+    _Atomic uint64_t tail;      // read up to, by the consumer
+    _Atomic uint32_t waiting;   // consumer sleeps on its eventfd until the producer clears this
+    char pad2[52];
+    char data[SHM_RING_SIZE];
+} shm_ring_t;
+
+/*
+ * Two rings in a memfd shared by a consumer agent and a provider agent on the same host,
+ * requests one way and responses the other. Each message is tagged with the connection it
+ * belongs to, so the pairing of requests and responses is the same as over sockets.
+ */
+typedef struct shm_channel {
+    int state;
+    long deadline_ms;  // of the handshake
+    int sock;    // Unix socket the rings were set up over, EOF when the peer is gone
+    int efd_rx;  // signalled by the peer when it writes to rx
+    int efd_tx;
+    void *base;  // NULL unless set up
+    shm_ring_t *rx;
+    shm_ring_t *tx;
+    uint64_t rx_next;  // end of the message peeked at
+} shm_channel_t;
+
+static inline bool shm_attached(shm_channel_t *ch) {
+    return ch->state == SHM_UP;
+}
+
+static inline bool shm_closed(shm_channel_t *ch) {
+    return ch->state == SHM_CLOSED;
+}
+
+// Handshake not done in time, the peer is stuck or gone
+static inline bool shm_expired(shm_channel_t *ch, long now_ms) {
+    return ch->state == SHM_HANDSHAKE && now_ms > ch->deadline_ms;
+}
+
+int shm_connect(char *err, shm_channel_t *ch, char *path);
+
+int shm_finish_connect(char *err, shm_channel_t *ch);
+
+void shm_accept(shm_channel_t *ch, int sock);
+
+int shm_finish_accept(char *err, shm_channel_t *ch);
+
+bool shm_send(shm_channel_t *ch, uint32_t tag, const char *data, size_t len);
+
+int shm_peek(shm_channel_t *ch, const char **msg, uint32_t *tag, size_t *len);
+
+void shm_consume(shm_channel_t *ch);
+
+void shm_clear_wakeup(shm_channel_t *ch);
+
+bool shm_sleep(shm_channel_t *ch);
+
+void shm_close(shm_channel_t *ch);
+
+#endif //MESH_AGENT_NATIVE_SHM_H
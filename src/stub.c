@@ -0,0 +1,168 @@
+#include "fmacros.h"
+#include <string.h>
+#include "stub.h"
+
+/*
+ * Stand-in Dubbo provider to benchmark agents against, without the JVM: each call is
+ * answered right away with the Java hash code of its argument, like the hash method of
+ * the demo service, in the serialization it came in. Heartbeats are answered too. It
+ * listens on a TCP port or a Unix socket, so both ways to reach a local provider can be
+ * compared.
+ */
+
+static char neterr[256];
+
+static bool unix_socket = false;
+static Pool *stub_conn_pool = NULL;
+
+
+void accept_stub_handler(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+void read_from_agent(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+void write_to_agent(aeEventLoop *event_loop, int fd, void *privdata, int mask) ;
+int answer_frame(stub_conn_t *conn, const char *frame, size_t len) ;
+void close_stub_conn(aeEventLoop *event_loop, stub_conn_t *conn) ;
+
+
+void stub_init(aeEventLoop *event_loop, int port, char *path) {
+    log_msg(INFO, "Stub provider init begin");
+    int listen_fd;
+    if (path != NULL) {
+        if (path[0] != '@') {
+            unlink(path);
+        }
+        listen_fd = anetUnixServer(neterr, path, 0666, STUB_LISTEN_BACKLOG);
+        unix_socket = true;
+        log_msg(INFO, "Listen on Unix socket %s", path);
+    } else {
+        listen_fd = anetTcpServer(neterr, port, NULL, STUB_LISTEN_BACKLOG);
+        log_msg(INFO, "Listen on port %d", port);
+    }
+    if (listen_fd == ANET_ERR) {
+        log_msg(FATAL, "Failed to create listening socket: %s", neterr);
+        exit(EXIT_FAILURE);
+    }
+    anetNonBlock(NULL, listen_fd);
+    if (aeCreateFileEvent(event_loop, listen_fd, AE_READABLE, accept_stub_handler, NULL) == AE_ERR) {
+        log_msg(FATAL, "Failed to create file event for accept_stub_handler: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    stub_conn_pool = PoolInit(STUB_MAX_CONNS, STUB_CONNS_PREALLOC, sizeof(stub_conn_t),
+                              NULL, NULL, NULL, NULL, NULL);
+    PoolPrintSaturation(stub_conn_pool);
+    log_msg(INFO, "Stub provider init done");
+}
+
+void accept_stub_handler(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    int conn_fd = unix_socket ? anetUnixAccept(neterr, fd) : anetTcpAccept(neterr, fd, NULL, 0, NULL);
+    if (UNLIKELY(conn_fd == ANET_ERR)) {
+        if (errno != EWOULDBLOCK) {
+            log_msg(ERR, "Failed to accept agent connection: %s", neterr);
+        }
+        return;
+    }
+    anetNonBlock(NULL, conn_fd);
+    if (!unix_socket) {
+        anetEnableTcpNoDelay(NULL, conn_fd);
+    }
+
+    stub_conn_t *conn = PoolGet(stub_conn_pool);
+    if (UNLIKELY(conn == NULL)) {
+        log_msg(ERR, "No connection object available, abort connection");
+        close(conn_fd);
+        return;
+    }
+    conn->fd = conn_fd;
+    conn->nread_in = 0;
+    conn->len_out = 0;
+    conn->nwrite_out = 0;
+    if (UNLIKELY(aeCreateFileEvent(event_loop, conn_fd, AE_READABLE, read_from_agent, conn) == AE_ERR)) {
+        log_msg(ERR, "Failed to create readable event for read_from_agent: %s", strerror(errno));
+        close_stub_conn(event_loop, conn);
+    }
+}
+
+void read_from_agent(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    stub_conn_t *conn = privdata;
+    ssize_t nread = read(fd, conn->buf_in + conn->nread_in, sizeof(conn->buf_in) - conn->nread_in);
+    if (UNLIKELY(nread <= 0)) {
+        if (nread < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (nread < 0) {
+            log_msg(ERR, "Failed to read from agent: %s", strerror(errno));
+        }
+        close_stub_conn(event_loop, conn);
+        return;
+    }
+    conn->nread_in += nread;
+
+    // Agents wait for each response, so a read holds one call and maybe a heartbeat
+    size_t offset = 0;
+    for (;;) {
+        int frame_len = dubbo_frame_len(conn->buf_in + offset, conn->nread_in - offset);
+        if (UNLIKELY(frame_len < 0 || frame_len > (int) sizeof(conn->buf_in))) {
+            log_msg(ERR, "Bad Dubbo request from agent with socket %d", fd);
+            close_stub_conn(event_loop, conn);
+            return;
+        }
+        if (frame_len == 0 || conn->nread_in - offset < (size_t) frame_len) {
+            break;
+        }
+        if (UNLIKELY(answer_frame(conn, conn->buf_in + offset, (size_t) frame_len) < 0)) {
+            log_msg(ERR, "Failed to answer Dubbo request from agent with socket %d", fd);
+            close_stub_conn(event_loop, conn);
+            return;
+        }
+        offset += frame_len;
+    }
+    conn->nread_in -= offset;
+    memmove(conn->buf_in, conn->buf_in + offset, conn->nread_in);
+
+    if (conn->len_out > conn->nwrite_out) {
+        write_to_agent(event_loop, fd, conn, 0);
+    }
+}
+
+void write_to_agent(aeEventLoop *event_loop, int fd, void *privdata, int mask) {
+    stub_conn_t *conn = privdata;
+    ssize_t nwrite = write(fd, conn->buf_out + conn->nwrite_out, conn->len_out - conn->nwrite_out);
+    if (UNLIKELY(nwrite < 0)) {
+        if (errno != EAGAIN) {
+            log_msg(ERR, "Failed to write to agent: %s", strerror(errno));
+            close_stub_conn(event_loop, conn);
+        }
+        return;
+    }
+    conn->nwrite_out += nwrite;
+    if (LIKELY(conn->nwrite_out == conn->len_out)) {
+        conn->len_out = 0;
+        conn->nwrite_out = 0;
+        if (mask & AE_WRITABLE) {
+            aeDeleteFileEvent(event_loop, fd, AE_WRITABLE);
+        }
+    } else if (UNLIKELY(aeCreateFileEvent(event_loop, fd, AE_WRITABLE, write_to_agent, conn) == AE_ERR)) {
+        log_msg(ERR, "Failed to create writable event for write_to_agent: %s", strerror(errno));
+        close_stub_conn(event_loop, conn);
+    }
+}
+
+/*
+ * Append the answer to a request frame to buf_out, nothing for one-way ones. Returns -1 if
+ * the call does not parse or the answer does not fit.
+ */
+int answer_frame(stub_conn_t *conn, const char *frame, size_t len) {
+    int n = dubbo_answer_call(conn->buf_out + conn->len_out, sizeof(conn->buf_out) - conn->len_out, frame, len);
+    if (UNLIKELY(n < 0)) {
+        return -1;
+    }
+    conn->len_out += n;
+    return 0;
+}
+
+void close_stub_conn(aeEventLoop *event_loop, stub_conn_t *conn) {
+    aeDeleteFileEvent(event_loop, conn->fd, AE_WRITABLE | AE_READABLE);
+    close(conn->fd);
+    conn->fd = -1;
+    PoolReturn(stub_conn_pool, conn);
+}
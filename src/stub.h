@@ -0,0 +1,30 @@
+#ifndef MESH_AGENT_NATIVE_STUB_H
+#define MESH_AGENT_NATIVE_STUB_H
+
+#include "common.h"
+#include "pool.h"
+#include "ae.h"
+#include "anet.h"
+#include "dubbo.h"
+
+// Adjustable params
+#define STUB_MAX_CONNS 4096
+#define STUB_CONNS_PREALLOC 512
+#define STUB_BUF_SIZE 4096
+#define STUB_LISTEN_BACKLOG 1024
+
+// Agent <-> Stand-in provider
+typedef struct stub_conn {
+    int fd;
+
+    char buf_in[STUB_BUF_SIZE];
+    size_t nread_in;
+
+    char buf_out[STUB_BUF_SIZE];
+    size_t len_out;
+    size_t nwrite_out;
+} stub_conn_t;
+
+void stub_init(aeEventLoop *event_loop, int port, char *path);
+
+#endif //MESH_AGENT_NATIVE_STUB_H
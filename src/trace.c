@@ -0,0 +1,137 @@
+#include "fmacros.h"
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include "trace.h"
+#include "util.h"
+
+/*
+ * Sampled tracing of requests across agents. The consumer agent samples 1 in N requests and
+ * sends a trace ID upstream with each, as the TRACE_HEADER of an HTTP request or in the high
+ * half of the ID of a Dubbo frame, which is unused otherwise. Every agent on the way records
+ * a span of its stages of the request under that ID, see trace_span_t, and a request that is
+ * not sampled only pays the branch of each stage on its trace ID. Finished spans are put in a
+ * ring, written out in batches by a timer as a line per span:
+ *
+ *   <trace ID> <hop> <wall clock us at accept> <us to upstream write> <us to upstream first byte> <us to response write>
+ *
+ * with -1 for a stage not reached. Spans of a trace are joined by ID across the files of the
+ * agents, the wall clock only lines them up.
+ */
+
+static char trace_hop = TRACE_HOP_CONSUMER;
+static int sample_every = 0; // 0 unless tracing
+static int trace_fd = -1;
+static char trace_path[320];
+static long wall_offset_us = 0; // of the wall clock from get_current_time_us()
+static uint32_t id_state = 1;
+
+long trace_countdown = LONG_MAX;
+
+// Written by trace_finish() and read by trace_flush(), both on the event loop
+static trace_span_t ring[TRACE_RING_SIZE];
+static unsigned long ring_head = 0;
+static unsigned long ring_tail = 0;
+static long num_dropped = 0;
+static char export_buf[TRACE_EXPORT_BUF_SIZE];
+
+
+int export_spans(aeEventLoop *event_loop, long long id, void *client_data) ;
+
+
+/*
+ * A consumer agent samples 1 in 'sample_every' requests, a provider agent records the spans
+ * of the requests consumer agents traced. Nothing is traced if 'sample_every' is not positive.
+ */
+void trace_init(aeEventLoop *event_loop, const char *dir, char hop, int sample_every_reqs) {
+    if (sample_every_reqs <= 0) {
+        return;
+    }
+    trace_hop = hop;
+    snprintf(trace_path, sizeof(trace_path), "%s/trace-%s-%d.log", dir,
+             hop == TRACE_HOP_CONSUMER ? "consumer" : "provider", (int) getpid());
+    trace_fd = open(trace_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd == -1) {
+        log_msg(ERR, "Failed to open trace file %s: %s", trace_path, strerror(errno));
+        return;
+    }
+
+    struct timespec spec;
+    clock_gettime(CLOCK_REALTIME, &spec);
+    wall_offset_us = spec.tv_sec * 1000000 + spec.tv_nsec / 1000 - get_current_time_us();
+    id_state = (uint32_t) (getpid() ^ spec.tv_nsec ^ spec.tv_sec);
+    if (id_state == 0) {
+        id_state = 1;
+    }
+
+    sample_every = sample_every_reqs;
+    if (hop == TRACE_HOP_CONSUMER) {
+        trace_countdown = sample_every;
+        log_msg(INFO, "Trace 1 in %d requests into %s", sample_every, trace_path);
+    } else {
+        log_msg(INFO, "Record spans of traced requests into %s", trace_path);
+    }
+    aeCreateTimeEvent(event_loop, TRACE_EXPORT_INTERVAL_MS, export_spans, NULL, NULL);
+}
+
+bool trace_enabled() {
+    return trace_fd >= 0;
+}
+
+// ID of a trace sampled by this agent, never 0
+uint32_t trace_new_id() {
+    trace_countdown = sample_every;
+    // xorshift32
+    id_state ^= id_state << 13;
+    id_state ^= id_state >> 17;
+    id_state ^= id_state << 5;
+    return id_state;
+}
+
+// The response is written, the span goes to export and the next request starts untraced
+void trace_finish(trace_span_t *span) {
+    span->response_write_us = get_current_time_us();
+    if (LIKELY(ring_head - ring_tail < TRACE_RING_SIZE)) {
+        ring[ring_head & (TRACE_RING_SIZE - 1)] = *span;
+        ring_head++;
+    } else {
+        num_dropped++;
+    }
+    span->trace_id = 0;
+}
+
+static inline long stage_us(const trace_span_t *span, long us) {
+    return us != 0 ? us - span->accept_us : -1;
+}
+
+void trace_flush() {
+    if (trace_fd < 0) {
+        return;
+    }
+    while (ring_tail != ring_head) {
+        size_t len = 0;
+        // Longest line is well under 128 bytes
+        while (ring_tail != ring_head && len + 128 <= sizeof(export_buf)) {
+            const trace_span_t *span = &ring[ring_tail & (TRACE_RING_SIZE - 1)];
+            len += (size_t) sprintf(export_buf + len, "%08x %c %ld %ld %ld %ld\n", span->trace_id, trace_hop,
+                                    span->accept_us + wall_offset_us,
+                                    stage_us(span, span->upstream_write_us),
+                                    stage_us(span, span->upstream_first_byte_us),
+                                    stage_us(span, span->response_write_us));
+            ring_tail++;
+        }
+        if (UNLIKELY(write(trace_fd, export_buf, len) != (ssize_t) len)) {
+            log_msg(WARN, "Failed to write spans to %s: %s", trace_path, strerror(errno));
+        }
+    }
+    if (UNLIKELY(num_dropped > 0)) {
+        log_msg(WARN, "Dropped %ld spans, more than %d finished between exports", num_dropped, TRACE_RING_SIZE);
+        num_dropped = 0;
+    }
+}
+
+int export_spans(aeEventLoop *event_loop, long long id, void *client_data) {
+    trace_flush();
+    return TRACE_EXPORT_INTERVAL_MS;
+}
@@ -0,0 +1,54 @@
+#ifndef MESH_AGENT_NATIVE_TRACE_H
+#define MESH_AGENT_NATIVE_TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "common.h"
+#include "ae.h"
+
+// Adjustable params
+#define TRACE_RING_SIZE 4096          // spans waiting for export, a power of 2
+#define TRACE_EXPORT_INTERVAL_MS 1000
+#define TRACE_EXPORT_BUF_SIZE 65536   // spans written at once
+
+// Header the consumer agent adds to a sampled request, right after the request line
+#define TRACE_HEADER "X-Trace-Id"
+#define TRACE_HEADER_LEN 10
+#define TRACE_HEADER_MAX (TRACE_HEADER_LEN + 12) // "X-Trace-Id:%08x\r\n"
+
+// Hops a span is recorded at
+#define TRACE_HOP_CONSUMER 'c'
+#define TRACE_HOP_PROVIDER 'p'
+
+/*
+ * Stages of a sampled request at one agent, in us of get_current_time_us(), 0 if not reached.
+ * Upstream is the remote agent for a consumer agent and the local provider for a provider agent.
+ */
+typedef struct trace_span {
+    uint32_t trace_id;  // 0 unless sampled
+    long accept_us;              // request read
+    long upstream_write_us;      // request written upstream
+    long upstream_first_byte_us; // first byte of the response read from upstream
+    long response_write_us;      // response written back
+} trace_span_t;
+
+// Requests until the next one is sampled, never reaches 0 unless tracing
+extern long trace_countdown;
+
+// Whether to trace the request just read, counts it towards the next sample
+static inline bool trace_sampled() {
+    return UNLIKELY(--trace_countdown == 0);
+}
+
+void trace_init(aeEventLoop *event_loop, const char *dir, char hop, int sample_every);
+
+bool trace_enabled();
+
+uint32_t trace_new_id();
+
+void trace_finish(trace_span_t *span);
+
+void trace_flush();
+
+#endif //MESH_AGENT_NATIVE_TRACE_H
@@ -1,6 +1,8 @@
+#include "fmacros.h"
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -8,6 +10,7 @@
 #include <netinet/in.h>
 #include <net/if.h>
 #include <arpa/inet.h>
+#include <stdlib.h>
 
 #include "util.h"
 
@@ -35,3 +38,73 @@ long get_current_time_ms() {
     clock_gettime(CLOCK_REALTIME, &spec);
     return spec.tv_sec * 1000 + (long)(spec.tv_nsec / 1.0e6);
 }
+
+long get_current_time_us() {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_sec * 1000000 + spec.tv_nsec / 1000;
+}
+
+/*
+ * CPUs this process may use, a container's CPU quota if it has one.
+ */
+int get_cpu_cores() {
+    long quota = -1, period = 0;
+    FILE *f = fopen("/sys/fs/cgroup/cpu.max", "r"); // cgroup v2: "<quota|max> <period>"
+    if (f != NULL) {
+        char buf[32];
+        if (fscanf(f, "%31s %ld", buf, &period) == 2 && strcmp(buf, "max") != 0) {
+            quota = atol(buf);
+        }
+        fclose(f);
+    } else if ((f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) != NULL) {
+        if (fscanf(f, "%ld", &quota) != 1) {
+            quota = -1;
+        }
+        fclose(f);
+        if ((f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")) != NULL) {
+            if (fscanf(f, "%ld", &period) != 1) {
+                period = 0;
+            }
+            fclose(f);
+        }
+    }
+    if (quota > 0 && period > 0) {
+        return (int) ((quota + period - 1) / period);
+    }
+    return (int) sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+// Value of a header in the header block [req, end), names are case-insensitive
+const char *find_header(const char *req, const char *end, const char *name, size_t name_len) {
+    const char *line = req;
+    while ((line = memchr(line, '\n', (size_t) (end - line))) != NULL) {
+        line++;
+        if ((size_t) (end - line) >= name_len && strncasecmp(line, name, name_len) == 0) {
+            return line + name_len;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Length of the HTTP message at the start of 'msg' by its Content-Length, 0 until all of its
+ * headers are in the 'len' bytes, -1 without a valid Content-Length.
+ */
+ssize_t http_message_length(const char *msg, size_t len) {
+    const char *body = memmem(msg, len, "\r\n\r\n", 4);
+    if (body == NULL) {
+        return 0;
+    }
+    body += 4;
+    const char *header = find_header(msg, body, "Content-Length:", 15);
+    if (header == NULL) {
+        return -1;
+    }
+    char *end;
+    long content_length = strtol(header, &end, 10);
+    if (end == header || content_length < 0) {
+        return -1;
+    }
+    return body - msg + content_length;
+}
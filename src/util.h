@@ -1,8 +1,19 @@
 #ifndef MESH_AGENT_NATIVE_UTIL_H
 #define MESH_AGENT_NATIVE_UTIL_H
 
+#include <stddef.h>
+#include <sys/types.h>
+
 char *get_local_ip_addr(const char *interface);
 
 long get_current_time_ms();
 
+long get_current_time_us();
+
+int get_cpu_cores();
+
+const char *find_header(const char *req, const char *end, const char *name, size_t name_len);
+
+ssize_t http_message_length(const char *msg, size_t len);
+
 #endif //MESH_AGENT_NATIVE_UTIL_H
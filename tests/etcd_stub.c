@@ -0,0 +1,43 @@
+#include <string.h>
+#include "etcd.h"
+
+/*
+ * etcd for tests that run agents without a server: the directory lists the keys put in
+ * etcd_stub_keys, with empty values, and writes are dropped.
+ */
+
+const char *etcd_stub_keys[8];
+
+int etcd_init(const char *server, int port, int flags) {
+    return 0;
+}
+
+int etcd_get(const char *key, char **value, int *modifiedIndex) {
+    return 1;
+}
+
+int etcd_get_directory(const char *directory, etcd_key_value_callback callback, void *arg, long long *modifiedIndex) {
+    for (int i = 0; i < 8 && etcd_stub_keys[i] != NULL; i++) {
+        if (strncmp(etcd_stub_keys[i], directory, strlen(directory)) == 0) {
+            callback(etcd_stub_keys[i], "", arg);
+        }
+    }
+    return 0;
+}
+
+int etcd_set(const char *key, const char *value, int ttl, bool prevExist) {
+    return 0;
+}
+
+int etcd_set_with_check(const char *key, const char *value, int ttl, bool always_write) {
+    return 0;
+}
+
+int etcd_del(const char *key) {
+    return 0;
+}
+
+int etcd_watch(const char *key, long long index, char **action, char **prevValue, char **value, char **rkey,
+               long long *modifiedIndex) {
+    return 1;
+}
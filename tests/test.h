@@ -0,0 +1,20 @@
+#ifndef MESH_AGENT_NATIVE_TEST_H
+#define MESH_AGENT_NATIVE_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Fails the test binary at the first broken expectation, ctest reports the line
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define RUN(test) do { \
+        test(); \
+        printf("%s passed\n", #test); \
+    } while (0)
+
+#endif //MESH_AGENT_NATIVE_TEST_H
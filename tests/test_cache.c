@@ -0,0 +1,233 @@
+#include "fmacros.h"
+#include <string.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "cache.h"
+#include "log.h"
+
+/*
+ * Any call parses into a key, for the Dubbo encoding and echoing alike, but the response
+ * cache takes only listed calls. It finds every entry of a probe run after one before it is
+ * deleted, ages entries out by TTL, and evicts the entries not hit since the CLOCK hand last
+ * passed them first.
+ */
+
+#define SERVICE "com.example.IService"
+#define VALUE "HTTP/1.1 200 OK\r\nContent-Length:5\r\n\r\nhello"
+#define TTL_MS 1000
+#define SHORT_TTL_MS 50
+
+static char params[64][16];
+
+// Key of a call with the given parameter in shard 0, its probe run starting at 'home'
+static cache_key_t make_key(int param, int home) {
+    cache_key_t key;
+    memset(&key, 0, sizeof(key));
+    snprintf(params[param], sizeof(params[0]), "p%d", param);
+    key.field[CACHE_KEY_INTERFACE] = SERVICE;
+    key.len[CACHE_KEY_INTERFACE] = (uint32_t) strlen(SERVICE);
+    key.field[CACHE_KEY_METHOD] = "hash";
+    key.len[CACHE_KEY_METHOD] = 4;
+    key.field[CACHE_KEY_TYPES] = "";
+    key.field[CACHE_KEY_PARAMETER] = params[param];
+    key.len[CACHE_KEY_PARAMETER] = (uint32_t) strlen(params[param]);
+    key.hash = (uint64_t) home;
+    return key;
+}
+
+static bool cached(const cache_key_t *key) {
+    size_t len;
+    const char *value = cache_get(key, &len);
+    return value != NULL && len == strlen(VALUE) && memcmp(value, VALUE, len) == 0;
+}
+
+static void put(const cache_key_t *key) {
+    cache_put(key, VALUE, strlen(VALUE));
+}
+
+static void test_parse_without_list() {
+    char req[256];
+    cache_key_t key;
+    const char *body = "interface=" SERVICE "&method=hash&parameterTypesString=S&parameter=abc";
+    size_t len = (size_t) snprintf(req, sizeof(req), "POST / HTTP/1.1\r\nContent-Length: %zu\r\n\r\n%s",
+                                   strlen(body), body);
+    CHECK(cache_parse_key(req, len, &key));
+    CHECK(key.len[CACHE_KEY_TYPES] == 1 && key.field[CACHE_KEY_TYPES][0] == 'S');
+    CHECK(!cache_call_allowed(&key));
+
+    // Not a call
+    body = "method=hash&parameter=abc";
+    len = (size_t) snprintf(req, sizeof(req), "POST / HTTP/1.1\r\nContent-Length: %zu\r\n\r\n%s", strlen(body), body);
+    CHECK(!cache_parse_key(req, len, &key));
+}
+
+static void test_parse_listed_calls() {
+    CHECK(cache_allow(SERVICE "#hash,com.example.IOther") == 2);
+    char req[256];
+    cache_key_t a, b;
+
+    const char *body = "interface=" SERVICE "&method=hash&parameterTypesString=S&parameter=abc";
+    size_t len = (size_t) snprintf(req, sizeof(req), "POST / HTTP/1.1\r\nContent-Length: %zu\r\n\r\n%s",
+                                   strlen(body), body);
+    CHECK(cache_parse_key(req, len, &a) && cache_call_allowed(&a));
+    CHECK(a.len[CACHE_KEY_PARAMETER] == 3 && memcmp(a.field[CACHE_KEY_PARAMETER], "abc", 3) == 0);
+    CHECK(cache_parse_key(req, len, &b) && cache_key_equal(&a, &b));
+    // Not read in full
+    CHECK(!cache_parse_key(req, len - 1, &b));
+
+    body = "interface=" SERVICE "&method=hash&parameterTypesString=S&parameter=abd";
+    len = (size_t) snprintf(req, sizeof(req), "POST / HTTP/1.1\r\nContent-Length: %zu\r\n\r\n%s", strlen(body), body);
+    CHECK(cache_parse_key(req, len, &b) && !cache_key_equal(&a, &b));
+
+    // Every method of a listed interface
+    body = "interface=com.example.IOther&method=any&parameter=abc";
+    len = (size_t) snprintf(req, sizeof(req), "POST / HTTP/1.1\r\nContent-Length: %zu\r\n\r\n%s", strlen(body), body);
+    CHECK(cache_parse_key(req, len, &b) && cache_call_allowed(&b));
+
+    // Methods and interfaces not listed, parsed all the same
+    body = "interface=" SERVICE "&method=update&parameter=abc";
+    len = (size_t) snprintf(req, sizeof(req), "POST / HTTP/1.1\r\nContent-Length: %zu\r\n\r\n%s", strlen(body), body);
+    CHECK(cache_parse_key(req, len, &b) && !cache_call_allowed(&b));
+    body = "interface=com.example.IOth&method=hash&parameter=abc";
+    len = (size_t) snprintf(req, sizeof(req), "POST / HTTP/1.1\r\nContent-Length: %zu\r\n\r\n%s", strlen(body), body);
+    CHECK(cache_parse_key(req, len, &b) && !cache_call_allowed(&b));
+}
+
+static void test_response_complete() {
+    CHECK(cache_response_complete(VALUE, strlen(VALUE)));
+    CHECK(!cache_response_complete(VALUE, strlen(VALUE) - 1));
+    const char *error = "HTTP/1.1 500 Internal Server Error\r\nContent-Length:0\r\n\r\n";
+    CHECK(!cache_response_complete(error, strlen(error)));
+}
+
+// Stats are counted from the start, over every init of the tests
+static void test_get_put() {
+    cache_init(1 << 20, TTL_MS);
+    cache_stats_t before, after;
+    cache_get_stats(&before);
+    cache_key_t key = make_key(0, 7);
+    CHECK(!cached(&key));
+    put(&key);
+    CHECK(cached(&key));
+    // Put again, replaces the entry
+    put(&key);
+    CHECK(cached(&key));
+    cache_get_stats(&after);
+    CHECK(after.hits - before.hits == 2);
+    CHECK(after.misses - before.misses == 1);
+    CHECK(after.insertions - before.insertions == 2);
+    CHECK(after.entries - before.entries == 1);
+}
+
+static void test_delete_shifts_back_probe_run() {
+    cache_init(1 << 20, TTL_MS);
+    cache_stats_t before, after;
+    cache_get_stats(&before);
+    // Runs of slots 10 to 13 and 20 to 22
+    cache_key_t keys[] = {make_key(1, 10), make_key(2, 10), make_key(3, 11), make_key(4, 12),
+                          make_key(5, 20), make_key(6, 21), make_key(7, 20)};
+    int num_keys = sizeof(keys) / sizeof(keys[0]);
+    for (int i = 0; i < num_keys; i++) {
+        put(&keys[i]);
+    }
+    // Deleting the head of each run moves the rest up, unless they are at home past the hole
+    put(&keys[0]);
+    put(&keys[4]);
+    for (int i = 0; i < num_keys; i++) {
+        CHECK(cached(&keys[i]));
+    }
+    cache_get_stats(&after);
+    CHECK(after.entries - before.entries == num_keys);
+}
+
+static void test_delete_shifts_back_across_wrap() {
+    cache_init(1 << 20, TTL_MS);
+    cache_key_t keys[] = {make_key(1, CACHE_SHARD_SLOTS - 1), make_key(2, CACHE_SHARD_SLOTS - 1),
+                          make_key(3, 0), make_key(4, 1)};
+    int num_keys = sizeof(keys) / sizeof(keys[0]);
+    for (int i = 0; i < num_keys; i++) {
+        put(&keys[i]);
+    }
+    put(&keys[0]);
+    put(&keys[2]);
+    for (int i = 0; i < num_keys; i++) {
+        CHECK(cached(&keys[i]));
+    }
+}
+
+static void test_ttl() {
+    cache_init(1 << 20, SHORT_TTL_MS);
+    cache_stats_t before, after;
+    cache_get_stats(&before);
+    cache_key_t key = make_key(0, 100);
+    cache_key_t later = make_key(1, 100);
+    put(&key);
+    put(&later);
+    CHECK(cached(&key));
+    usleep(SHORT_TTL_MS * 2 * 1000);
+    CHECK(!cached(&key));
+    // Past the expired entry that was ahead in its run
+    put(&key);
+    CHECK(cached(&key));
+    CHECK(!cached(&later));
+    cache_get_stats(&after);
+    CHECK(after.expirations - before.expirations == 2);
+    CHECK(after.entries - before.entries == 1);
+}
+
+static void test_clock_eviction() {
+    // Room for 4 entries in a shard
+    cache_key_t keys[8];
+    for (int i = 0; i < 8; i++) {
+        keys[i] = make_key(i, 200 + i);
+    }
+    size_t entry_size = 0;
+    cache_init(1 << 20, TTL_MS);
+    cache_stats_t before, after;
+    cache_get_stats(&before);
+    put(&keys[0]);
+    cache_get_stats(&after);
+    entry_size = (size_t) (after.bytes - before.bytes);
+    cache_init((long) entry_size * 4 * CACHE_NUM_SHARDS, TTL_MS);
+
+    cache_get_stats(&before);
+    for (int i = 0; i < 4; i++) {
+        put(&keys[i]);
+    }
+    // Hit since the hand passed, gets a second chance
+    CHECK(cached(&keys[0]));
+    put(&keys[4]);
+    CHECK(!cached(&keys[1]));
+    CHECK(cached(&keys[0]));
+    CHECK(cached(&keys[2]));
+    CHECK(cached(&keys[3]));
+    CHECK(cached(&keys[4]));
+
+    // All were hit, the hand clears them on its way round and evicts the first past it
+    put(&keys[5]);
+    CHECK(!cached(&keys[2]));
+    CHECK(cached(&keys[0]) && cached(&keys[5]));
+    cache_get_stats(&after);
+    CHECK(after.evictions - before.evictions == 2);
+    CHECK(after.entries - before.entries == 4);
+
+    // Larger than a shard, not cached
+    static char big[1 << 16];
+    cache_put(&keys[6], big, sizeof(big));
+    size_t len;
+    CHECK(cache_get(&keys[6], &len) == NULL);
+}
+
+int main() {
+    init_log("test_cache.log");
+    RUN(test_parse_without_list);
+    RUN(test_parse_listed_calls);
+    RUN(test_response_complete);
+    RUN(test_get_put);
+    RUN(test_delete_shifts_back_probe_run);
+    RUN(test_delete_shifts_back_across_wrap);
+    RUN(test_ttl);
+    RUN(test_clock_eviction);
+    return 0;
+}
@@ -0,0 +1,216 @@
+#include "fmacros.h"
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "test.h"
+#include "dubbo.h"
+#include "hessian.h"
+#include "log.h"
+
+/*
+ * Dubbo frames encoded by the consumer agent are answered by the stub provider, and the
+ * answers decode to the HTTP status and body the agents send back, in both serializations.
+ */
+
+#define SERVICE "com.alibaba.dubbo.performance.demo.provider.IHelloService"
+#define STRING_TYPE "Ljava%2Flang%2FString%3B"
+
+static char frame[8192];
+static char answer[8192];
+static char text[8192];
+
+static int encode_hash_call(int serialization, uint32_t id, const char *arg) {
+    return dubbo_encode_request(frame, sizeof(frame), id, serialization, SERVICE, (int) strlen(SERVICE),
+                                "hash", 4, STRING_TYPE, (int) strlen(STRING_TYPE), arg, (int) strlen(arg));
+}
+
+// Response frame of the given status and body
+static size_t make_response(int serialization, int status, const char *body, size_t body_len) {
+    answer[0] = (char) 0xda;
+    answer[1] = (char) 0xbb;
+    answer[2] = (char) serialization;
+    answer[3] = (char) status;
+    memset(answer + 4, 0, 8);
+    *((uint32_t *) &answer[12]) = htonl((uint32_t) body_len);
+    memcpy(answer + DUBBO_HEADER_LEN, body, body_len);
+    return DUBBO_HEADER_LEN + body_len;
+}
+
+static int decode(size_t len, const char **value, size_t *value_len) {
+    return dubbo_decode_response(answer, len, text, sizeof(text), value, value_len);
+}
+
+static void test_frame_len() {
+    int len = encode_hash_call(DUBBO_SERIALIZATION_FASTJSON, 7, "abc");
+    CHECK(len > DUBBO_HEADER_LEN);
+    CHECK(dubbo_frame_len(frame, 1) == 0);
+    CHECK(dubbo_frame_len(frame, DUBBO_HEADER_LEN - 1) == 0);
+    CHECK(dubbo_frame_len(frame, DUBBO_HEADER_LEN) == len);
+    CHECK(dubbo_frame_len("GET / HTTP/1.1\r\n", 16) == -1);
+}
+
+static void test_encode_fastjson_request() {
+    int len = encode_hash_call(DUBBO_SERIALIZATION_FASTJSON, 0x12345678, "abc");
+    CHECK((uint8_t) frame[0] == 0xda && (uint8_t) frame[1] == 0xbb);
+    CHECK((uint8_t) frame[2] == (DUBBO_FLAG_REQUEST | DUBBO_FLAG_TWOWAY | DUBBO_SERIALIZATION_FASTJSON));
+    CHECK(ntohl(*((uint32_t *) &frame[8])) == 0x12345678);
+    const char *body = "\"2.0.1\"\n\"" SERVICE "\"\nnull\n\"hash\"\n\"Ljava/lang/String;\"\n\"abc\"\n"
+                       "{\"path\":\"" SERVICE "\"}\n";
+    CHECK(len == DUBBO_HEADER_LEN + (int) strlen(body));
+    CHECK(memcmp(frame + DUBBO_HEADER_LEN, body, strlen(body)) == 0);
+
+    // Does not fit
+    CHECK(dubbo_encode_request(frame, (size_t) len - 1, 1, DUBBO_SERIALIZATION_FASTJSON, SERVICE,
+                               (int) strlen(SERVICE), "hash", 4, STRING_TYPE, (int) strlen(STRING_TYPE),
+                               "abc", 3) == -1);
+}
+
+static void test_encode_hessian2_request() {
+    int len = encode_hash_call(DUBBO_SERIALIZATION_HESSIAN2, 1, "abc");
+    CHECK(len > DUBBO_HEADER_LEN);
+    CHECK(((uint8_t) frame[2] & 0x1f) == DUBBO_SERIALIZATION_HESSIAN2);
+
+    // Each field is one value, in order
+    const char *fields[] = {"2.0.1", SERVICE, "null", "hash", "Ljava/lang/String;", "abc",
+                            "{\"path\":\"" SERVICE "\"}"};
+    size_t pos = DUBBO_HEADER_LEN;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        size_t text_len;
+        int n = hessian_read_text(frame + pos, (size_t) len - pos, text, sizeof(text), &text_len);
+        CHECK(n > 0);
+        CHECK(text_len == strlen(fields[i]) && memcmp(text, fields[i], text_len) == 0);
+        pos += (size_t) n;
+    }
+    CHECK(pos == (size_t) len);
+
+    // Integer and long parameters are written as numbers
+    len = dubbo_encode_request(frame, sizeof(frame), 1, DUBBO_SERIALIZATION_HESSIAN2, SERVICE, (int) strlen(SERVICE),
+                               "add", 3, "I", 1, "-300", 4);
+    CHECK(len > DUBBO_HEADER_LEN);
+    CHECK(hessian_write_int(text, sizeof(text), -300) == 2);
+    CHECK(memmem(frame, (size_t) len, "\x01I", 2) != NULL);
+    CHECK(memmem(frame, (size_t) len, text, 2) != NULL);
+}
+
+static void test_java_string_hash() {
+    CHECK(java_string_hash("", 0) == 0);
+    CHECK(java_string_hash("hello", 5) == 99162322);
+    // "你好", one UTF-16 unit each
+    CHECK(java_string_hash("\xe4\xbd\xa0\xe5\xa5\xbd", 6) == 31 * 0x4f60 + 0x597d);
+    // U+1F600, a surrogate pair
+    CHECK(java_string_hash("\xf0\x9f\x98\x80", 4) == 31 * 0xd83d + 0xde00);
+}
+
+// The stub answers a call with the hash of its argument, which decodes to the text of the number
+static void check_answer(int serialization, const char *arg) {
+    int len = encode_hash_call(serialization, 42, arg);
+    int answer_len = dubbo_answer_call(answer, sizeof(answer), frame, (size_t) len);
+    CHECK(answer_len > DUBBO_HEADER_LEN);
+    CHECK(dubbo_frame_len(answer, (size_t) answer_len) == answer_len);
+    CHECK(memcmp(answer + 4, frame + 4, 8) == 0);
+
+    const char *value;
+    size_t value_len;
+    CHECK(decode((size_t) answer_len, &value, &value_len) == 200);
+    char expected[16];
+    snprintf(expected, sizeof(expected), "%d", java_string_hash(arg, strlen(arg)));
+    CHECK(value_len == strlen(expected) && memcmp(value, expected, value_len) == 0);
+}
+
+static void test_answer_calls() {
+    check_answer(DUBBO_SERIALIZATION_FASTJSON, "abc");
+    check_answer(DUBBO_SERIALIZATION_HESSIAN2, "abc");
+    check_answer(DUBBO_SERIALIZATION_HESSIAN2, "\xe4\xbd\xa0\xe5\xa5\xbd\xf0\x9f\x98\x80");
+}
+
+static void test_answer_heartbeat() {
+    char id[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    size_t len = dubbo_encode_heartbeat(frame, DUBBO_FLAG_REQUEST | DUBBO_FLAG_TWOWAY | DUBBO_SERIALIZATION_HESSIAN2,
+                                        0, id);
+    CHECK(len == DUBBO_HEADER_LEN + 1);
+    int answer_len = dubbo_answer_call(answer, sizeof(answer), frame, len);
+    CHECK(answer_len == DUBBO_HEADER_LEN + 1);
+    CHECK((uint8_t) answer[2] == (DUBBO_FLAG_EVENT | DUBBO_SERIALIZATION_HESSIAN2));
+    CHECK(answer[3] == DUBBO_STATUS_OK);
+    CHECK(memcmp(answer + 4, id, 8) == 0);
+    CHECK(answer[DUBBO_HEADER_LEN] == 'N');
+
+    // One-way requests and responses are not answered
+    frame[2] = (char) (DUBBO_FLAG_REQUEST | DUBBO_SERIALIZATION_FASTJSON);
+    CHECK(dubbo_answer_call(answer, sizeof(answer), frame, len) == 0);
+    frame[2] = (char) DUBBO_SERIALIZATION_FASTJSON;
+    CHECK(dubbo_answer_call(answer, sizeof(answer), frame, len) == 0);
+}
+
+static void test_decode_fastjson_responses() {
+    const char *value;
+    size_t value_len;
+
+    const char *with_attachments = "4\n\"ok\"\n{\"dubbo\":\"2.0.2\"}\n";
+    CHECK(decode(make_response(DUBBO_SERIALIZATION_FASTJSON, DUBBO_STATUS_OK, with_attachments,
+                               strlen(with_attachments)), &value, &value_len) == 200);
+    CHECK(value_len == 4 && memcmp(value, "\"ok\"", 4) == 0);
+
+    CHECK(decode(make_response(DUBBO_SERIALIZATION_FASTJSON, DUBBO_STATUS_OK, "2\n", 2), &value, &value_len) == 200);
+    CHECK(value_len == 4 && memcmp(value, "null", 4) == 0);
+
+    const char *exception = "0\n{\"message\":\"boom\"}\n";
+    CHECK(decode(make_response(DUBBO_SERIALIZATION_FASTJSON, DUBBO_STATUS_OK, exception, strlen(exception)),
+                 &value, &value_len) == 500);
+    CHECK(value_len == 18 && memcmp(value, "{\"message\":\"boom\"}", 18) == 0);
+
+    const char *busy = "\"Thread pool is exhausted\"\n";
+    CHECK(decode(make_response(DUBBO_SERIALIZATION_FASTJSON, DUBBO_STATUS_THREADPOOL_EXHAUSTED, busy, strlen(busy)),
+                 &value, &value_len) == 503);
+    CHECK(value_len == strlen(busy) - 1 && memcmp(value, busy, value_len) == 0);
+    CHECK(decode(make_response(DUBBO_SERIALIZATION_FASTJSON, DUBBO_STATUS_SERVER_TIMEOUT, "", 0),
+                 &value, &value_len) == 503);
+    CHECK(decode(make_response(DUBBO_SERIALIZATION_FASTJSON, 90, "", 0), &value, &value_len) == 500);
+
+    // No line of the response type, or an unknown one
+    CHECK(decode(make_response(DUBBO_SERIALIZATION_FASTJSON, DUBBO_STATUS_OK, "1", 1), &value, &value_len) == 500);
+    CHECK(value_len == 0);
+    CHECK(decode(make_response(DUBBO_SERIALIZATION_FASTJSON, DUBBO_STATUS_OK, "9\n1\n", 4), &value, &value_len) == 500);
+    CHECK(value_len == 0);
+}
+
+static void test_decode_hessian2_responses() {
+    const char *value;
+    size_t value_len;
+    char body[64];
+    size_t len;
+
+    len = (size_t) hessian_write_int(body, sizeof(body), DUBBO_RESPONSE_VALUE);
+    len += (size_t) hessian_write_long(body + len, sizeof(body) - len, -5000000000LL);
+    CHECK(decode(make_response(DUBBO_SERIALIZATION_HESSIAN2, DUBBO_STATUS_OK, body, len), &value, &value_len) == 200);
+    CHECK(value_len == 11 && memcmp(value, "-5000000000", 11) == 0);
+
+    len = (size_t) hessian_write_int(body, sizeof(body), DUBBO_RESPONSE_NULL_VALUE_WITH_ATTACHMENTS);
+    CHECK(decode(make_response(DUBBO_SERIALIZATION_HESSIAN2, DUBBO_STATUS_OK, body, len), &value, &value_len) == 200);
+    CHECK(value_len == 4 && memcmp(value, "null", 4) == 0);
+
+    len = (size_t) hessian_write_string(body, sizeof(body), "timeout", 7);
+    CHECK(decode(make_response(DUBBO_SERIALIZATION_HESSIAN2, DUBBO_STATUS_CLIENT_TIMEOUT, body, len),
+                 &value, &value_len) == 503);
+    CHECK(value_len == 7 && memcmp(value, "timeout", 7) == 0);
+
+    // Value cut short
+    len = (size_t) hessian_write_int(body, sizeof(body), DUBBO_RESPONSE_VALUE);
+    len += (size_t) hessian_write_string(body + len, sizeof(body) - len, "abcdef", 6);
+    CHECK(decode(make_response(DUBBO_SERIALIZATION_HESSIAN2, DUBBO_STATUS_OK, body, len - 1),
+                 &value, &value_len) == 500);
+    CHECK(value_len == 0);
+}
+
+int main() {
+    init_log("test_dubbo.log");
+    RUN(test_frame_len);
+    RUN(test_encode_fastjson_request);
+    RUN(test_encode_hessian2_request);
+    RUN(test_java_string_hash);
+    RUN(test_answer_calls);
+    RUN(test_answer_heartbeat);
+    RUN(test_decode_fastjson_responses);
+    RUN(test_decode_hessian2_responses);
+    return 0;
+}
@@ -0,0 +1,202 @@
+#include "fmacros.h"
+#include <string.h>
+#include <inttypes.h>
+
+#include "test.h"
+#include "hessian.h"
+#include "log.h"
+
+/*
+ * Hessian2 values written by the agents read back as they were, in the shortest form of the
+ * spec, and malformed or cut short input is rejected instead of read past.
+ */
+
+static char buf[200000];
+static char text[200000];
+
+static void check_int(int32_t value, int expected_len) {
+    CHECK(hessian_write_int(buf, sizeof(buf), value) == expected_len);
+    CHECK(hessian_write_int(buf, (size_t) expected_len - 1, value) == -1);
+    int32_t read;
+    CHECK(hessian_read_int(buf, (size_t) expected_len, &read) == expected_len);
+    CHECK(read == value);
+    CHECK(hessian_read_int(buf, (size_t) expected_len - 1, &read) == -1);
+}
+
+static void check_long(int64_t value, int expected_len) {
+    CHECK(hessian_write_long(buf, sizeof(buf), value) == expected_len);
+    CHECK(hessian_write_long(buf, (size_t) expected_len - 1, value) == -1);
+    int64_t read;
+    CHECK(hessian_read_long(buf, (size_t) expected_len, &read) == expected_len);
+    CHECK(read == value);
+    CHECK(hessian_read_long(buf, (size_t) expected_len - 1, &read) == -1);
+}
+
+static void test_int_ranges() {
+    check_int(0, 1);
+    check_int(-16, 1);
+    check_int(47, 1);
+    check_int(-17, 2);
+    check_int(48, 2);
+    check_int(-2048, 2);
+    check_int(2047, 2);
+    check_int(-2049, 3);
+    check_int(2048, 3);
+    check_int(-262144, 3);
+    check_int(262143, 3);
+    check_int(-262145, 5);
+    check_int(262144, 5);
+    check_int(INT32_MIN, 5);
+    check_int(INT32_MAX, 5);
+
+    // Examples of the spec
+    CHECK(hessian_write_int(buf, sizeof(buf), 0) == 1 && (uint8_t) buf[0] == 0x90);
+    CHECK(hessian_write_int(buf, sizeof(buf), -256) == 2 && (uint8_t) buf[0] == 0xc7 && buf[1] == 0);
+}
+
+static void test_long_ranges() {
+    check_long(0, 1);
+    check_long(-8, 1);
+    check_long(15, 1);
+    check_long(-9, 2);
+    check_long(16, 2);
+    check_long(-2048, 2);
+    check_long(2047, 2);
+    check_long(-2049, 3);
+    check_long(262143, 3);
+    check_long(262144, 5);
+    check_long(INT32_MIN, 5);
+    check_long(INT32_MAX, 5);
+    check_long((int64_t) INT32_MAX + 1, 9);
+    check_long(INT64_MIN, 9);
+    check_long(INT64_MAX, 9);
+
+    CHECK(hessian_write_long(buf, sizeof(buf), 0) == 1 && (uint8_t) buf[0] == 0xe0);
+}
+
+// Written 'str' reads back as the same text, with a head of 'head_len' bytes
+static void check_string(const char *str, size_t len, size_t head_len) {
+    int n = hessian_write_string(buf, sizeof(buf), str, len);
+    CHECK(n > 0);
+    size_t text_len;
+    CHECK(hessian_read_text(buf, (size_t) n, text, sizeof(text), &text_len) == n);
+    CHECK(text_len == len && memcmp(text, str, len) == 0);
+    // Cut short anywhere, in the head or the characters
+    CHECK(hessian_read_text(buf, head_len - 1, text, sizeof(text), &text_len) == -1);
+    CHECK(hessian_read_text(buf, (size_t) n - 1, text, sizeof(text), &text_len) == -1);
+    // Does not fit
+    CHECK(hessian_write_string(buf, (size_t) n - 1, str, len) == -1);
+    CHECK(hessian_read_text(buf, (size_t) n, text, len - 1, &text_len) == -1);
+}
+
+static void test_strings() {
+    static char long_str[65536];
+    memset(long_str, 'x', sizeof(long_str));
+
+    CHECK(hessian_write_string(buf, sizeof(buf), "hello", 5) == 6);
+    CHECK(buf[0] == 5 && memcmp(buf + 1, "hello", 5) == 0);
+
+    check_string("a", 1, 1);
+    check_string(long_str, 31, 1);
+    check_string(long_str, 32, 2);
+    check_string(long_str, 1023, 2);
+    check_string(long_str, 1024, 3);
+    check_string(long_str, 65535, 3);
+    CHECK(hessian_write_string(buf, sizeof(buf), long_str, 65536) == -1);
+
+    // Characters of 2 and 3 bytes are one UTF-16 unit each
+    const char *chinese = "\xe4\xbd\xa0\xe5\xa5\xbd";
+    CHECK(hessian_write_string(buf, sizeof(buf), chinese, 6) == 7 && buf[0] == 2);
+    check_string(chinese, 6, 1);
+    check_string("caf\xc3\xa9", 5, 1);
+}
+
+static void test_surrogate_pairs() {
+    // U+1F600 is a surrogate pair to Java, 2 units of 3 bytes each
+    const char *emoji = "a\xf0\x9f\x98\x80z";
+    int n = hessian_write_string(buf, sizeof(buf), emoji, 6);
+    CHECK(n == 1 + 1 + 6 + 1);
+    CHECK(buf[0] == 4);
+    CHECK(memcmp(buf + 2, "\xed\xa0\xbd\xed\xb8\x80", 6) == 0);
+    check_string(emoji, 6, 1);
+}
+
+static void test_bytes() {
+    static char bytes[70000];
+    for (size_t i = 0; i < sizeof(bytes); i++) {
+        bytes[i] = (char) (i * 7);
+    }
+    size_t lens[] = {0, 15, 16, 1023, 1024, 65535, 65536, sizeof(bytes)};
+    for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        int n = hessian_write_bytes(buf, sizeof(buf), bytes, lens[i]);
+        CHECK(n > 0);
+        size_t text_len;
+        CHECK(hessian_read_text(buf, (size_t) n, text, sizeof(text), &text_len) == n);
+        CHECK(text_len == lens[i] && memcmp(text, bytes, lens[i]) == 0);
+        CHECK(hessian_read_text(buf, (size_t) n - 1, text, sizeof(text), &text_len) == -1);
+        CHECK(hessian_write_bytes(buf, (size_t) n - 1, bytes, lens[i]) == -1);
+    }
+    // Over 65535 bytes, a non-final chunk first
+    CHECK(hessian_write_bytes(buf, sizeof(buf), bytes, 65536) == 3 + 65535 + 1 + 1);
+    CHECK(buf[0] == 'A');
+}
+
+static void test_maps_as_json() {
+    char *p = buf;
+    char *end = buf + sizeof(buf);
+    p += hessian_write_map_start(p, (size_t) (end - p));
+    p += hessian_write_string(p, (size_t) (end - p), "path", 4);
+    p += hessian_write_string(p, (size_t) (end - p), "a\"b\\c\n", 6);
+    p += hessian_write_string(p, (size_t) (end - p), "n", 1);
+    p += hessian_write_int(p, (size_t) (end - p), -300);
+    p += hessian_write_string(p, (size_t) (end - p), "m", 1);
+    p += hessian_write_map_start(p, (size_t) (end - p));
+    p += hessian_write_map_end(p, (size_t) (end - p));
+    p += hessian_write_string(p, (size_t) (end - p), "z", 1);
+    p += hessian_write_null(p, (size_t) (end - p));
+    p += hessian_write_map_end(p, (size_t) (end - p));
+
+    const char *json = "{\"path\":\"a\\\"b\\\\c\\u000a\",\"n\":-300,\"m\":{},\"z\":null}";
+    size_t text_len;
+    CHECK(hessian_read_text(buf, (size_t) (p - buf), text, sizeof(text), &text_len) == p - buf);
+    CHECK(text_len == strlen(json) && memcmp(text, json, text_len) == 0);
+    // No end of map
+    CHECK(hessian_read_text(buf, (size_t) (p - buf) - 1, text, sizeof(text), &text_len) == -1);
+}
+
+static void test_nesting_limit() {
+    size_t n = 0;
+    for (int i = 0; i < 100; i++) {
+        buf[n++] = 'H';
+        buf[n++] = 1;
+        buf[n++] = 'k';
+    }
+    buf[n++] = 'N';
+    for (int i = 0; i < 100; i++) {
+        buf[n++] = 'Z';
+    }
+    size_t text_len;
+    CHECK(hessian_read_text(buf, n, text, sizeof(text), &text_len) == -1);
+}
+
+static void test_unexpected_values() {
+    size_t text_len;
+    // Double, list, and nothing at all
+    CHECK(hessian_read_text("D\x40\x09\x21\xfb\x54\x44\x2d\x18", 9, text, sizeof(text), &text_len) == -1);
+    CHECK(hessian_read_text("\x57\x90\x91\x5a", 4, text, sizeof(text), &text_len) == -1);
+    CHECK(hessian_read_text("", 0, text, sizeof(text), &text_len) == -1);
+    CHECK(hessian_read_text("T", 1, text, sizeof(text), &text_len) == 1 && text_len == 4);
+}
+
+int main() {
+    init_log("test_hessian.log");
+    RUN(test_int_ranges);
+    RUN(test_long_ranges);
+    RUN(test_strings);
+    RUN(test_surrogate_pairs);
+    RUN(test_bytes);
+    RUN(test_maps_as_json);
+    RUN(test_nesting_limit);
+    RUN(test_unexpected_values);
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include "fmacros.h"
+#include <string.h>
+
+#include "test.h"
+#include "route.h"
+#include "log.h"
+
+/*
+ * The routing index gives every service name a slot of its own and finds the service of an
+ * HTTP request by its interface field, wherever the field is in the body.
+ */
+
+#define REQUEST_HEAD "POST / HTTP/1.1\r\nContent-Length: "
+
+static char *names[ROUTE_MAX_SERVICES + 1];
+
+static void make_names(int num_names) {
+    for (int i = 0; i < num_names; i++) {
+        free(names[i]);
+        names[i] = malloc(64);
+        snprintf(names[i], 64, "com.example.service%d.IService", i);
+    }
+}
+
+// Request with the given form body, Content-Length of its full length
+static size_t make_request(char *req, size_t size, const char *body) {
+    return (size_t) snprintf(req, size, REQUEST_HEAD "%zu\r\n\r\n%s", strlen(body), body);
+}
+
+static void test_lookup_every_name() {
+    for (int num_names = 2; num_names <= ROUTE_MAX_SERVICES; num_names++) {
+        make_names(num_names);
+        CHECK(route_build(names, num_names) == 0);
+        for (int i = 0; i < num_names; i++) {
+            CHECK(route_lookup(names[i], strlen(names[i])) == i);
+        }
+        CHECK(route_lookup("com.example.IOther", 18) == -1);
+        // A prefix of a name is another name
+        CHECK(route_lookup(names[0], strlen(names[0]) - 1) == -1);
+    }
+}
+
+static void test_reject_duplicate_names() {
+    make_names(4);
+    strcpy(names[3], names[1]);
+    // Returns instead of doubling the table forever
+    CHECK(route_build(names, 4) == -1);
+}
+
+static void test_reject_too_many_names() {
+    make_names(ROUTE_MAX_SERVICES + 1);
+    CHECK(route_build(names, ROUTE_MAX_SERVICES + 1) == -1);
+}
+
+static void test_route_request() {
+    make_names(3);
+    CHECK(route_build(names, 3) == 0);
+    char req[512];
+    char body[256];
+
+    snprintf(body, sizeof(body), "interface=%s&method=hash&parameter=a", names[2]);
+    CHECK(route_request(req, make_request(req, sizeof(req), body)) == 2);
+
+    snprintf(body, sizeof(body), "method=hash&interface=%s&parameter=a", names[1]);
+    CHECK(route_request(req, make_request(req, sizeof(req), body)) == 1);
+
+    // Last field, ends with the body
+    snprintf(body, sizeof(body), "method=hash&interface=%s", names[0]);
+    CHECK(route_request(req, make_request(req, sizeof(req), body)) == 0);
+
+    snprintf(body, sizeof(body), "interface=com.example.IOther&method=hash");
+    CHECK(route_request(req, make_request(req, sizeof(req), body)) == ROUTE_UNKNOWN);
+
+    snprintf(body, sizeof(body), "method=hash&parameter=a");
+    CHECK(route_request(req, make_request(req, sizeof(req), body)) == ROUTE_UNKNOWN);
+}
+
+static void test_route_partial_request() {
+    make_names(3);
+    CHECK(route_build(names, 3) == 0);
+    char req[512];
+    char body[256];
+    snprintf(body, sizeof(body), "method=hash&interface=%s", names[1]);
+    size_t len = make_request(req, sizeof(req), body);
+    size_t body_start = (size_t) (strstr(req, "\r\n\r\n") + 4 - req);
+
+    // Headers cut short, or the name cut short at the end of what is read
+    CHECK(route_request(req, body_start - 1) == ROUTE_INCOMPLETE);
+    CHECK(route_request(req, len - 3) == ROUTE_INCOMPLETE);
+    // Field not read yet
+    CHECK(route_request(req, body_start + 5) == ROUTE_INCOMPLETE);
+    CHECK(route_request(req, len) == 1);
+}
+
+int main() {
+    init_log("test_route.log");
+    RUN(test_lookup_every_name);
+    RUN(test_reject_duplicate_names);
+    RUN(test_reject_too_many_names);
+    RUN(test_route_request);
+    RUN(test_route_partial_request);
+    return 0;
+}
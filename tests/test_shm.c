@@ -0,0 +1,235 @@
+#include "fmacros.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "test.h"
+#include "shm.h"
+#include "util.h"
+#include "log.h"
+
+/*
+ * A shared memory channel set up between two agents carries messages of any size in order
+ * while its rings wrap around many times, refuses a message that does not fit instead of
+ * overwriting one not read yet, and wakes a peer that sleeps. A length or position the peer
+ * corrupted is not read past. A handshake without the rings fails, one that stalls expires,
+ * and tags past the connections of a channel are told apart.
+ */
+
+#define MAX_MSG_LEN 100000
+#define NUM_MSGS 2000
+#define BATCH_LEN 65536
+
+static char path[64];
+static int server = -1;
+static char msg[MAX_MSG_LEN];
+
+static size_t msg_len(int seq) {
+    return (size_t) seq * 7919 % MAX_MSG_LEN;
+}
+
+static uint32_t msg_tag(int seq) {
+    return SHM_TAG(seq % SHM_MAX_TAGS, seq / SHM_MAX_TAGS);
+}
+
+static void fill_msg(int seq, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        msg[i] = (char) (seq + i);
+    }
+}
+
+// Next message is the one of 'seq'
+static void check_msg(shm_channel_t *ch, int seq, size_t len) {
+    uint32_t tag;
+    size_t read_len;
+    const char *data;
+    CHECK(shm_peek(ch, &data, &tag, &read_len) == SHM_OK);
+    CHECK(tag == msg_tag(seq));
+    CHECK(read_len == len);
+    for (size_t i = 0; i < len; i++) {
+        CHECK(data[i] == (char) (seq + i));
+    }
+    shm_consume(ch);
+}
+
+static void open_channel(shm_channel_t *consumer, shm_channel_t *provider) {
+    char err[ANET_ERR_LEN];
+    CHECK(shm_connect(err, consumer, path) == SHM_OK);
+    CHECK(!shm_attached(consumer));
+    // Nothing back before the provider agent takes the rings
+    CHECK(shm_finish_connect(err, consumer) == SHM_AGAIN);
+
+    int sock = anetUnixAccept(err, server);
+    CHECK(sock != ANET_ERR);
+    shm_accept(provider, sock);
+    CHECK(shm_finish_accept(err, provider) == SHM_OK);
+    CHECK(shm_finish_connect(err, consumer) == SHM_OK);
+    CHECK(shm_attached(consumer) && shm_attached(provider));
+}
+
+static void test_messages_in_order_across_wraps() {
+    shm_channel_t consumer, provider;
+    open_channel(&consumer, &provider);
+
+    int sent = 0;
+    int received = 0;
+    int num_full = 0;
+    while (received < NUM_MSGS) {
+        // Send until the ring is full, take a few, and so on, the free space ends anywhere
+        while (sent < NUM_MSGS) {
+            fill_msg(sent, msg_len(sent));
+            if (!shm_send(&consumer, msg_tag(sent), msg, msg_len(sent))) {
+                num_full++;
+                break;
+            }
+            sent++;
+        }
+        for (int i = 0; i < 3 && received < sent; i++, received++) {
+            check_msg(&provider, received, msg_len(received));
+        }
+    }
+    const char *data;
+    uint32_t tag;
+    size_t len;
+    CHECK(shm_peek(&provider, &data, &tag, &len) == SHM_AGAIN);
+    CHECK(num_full > 0);
+    CHECK(atomic_load(&consumer.tx->head) > 10 * (uint64_t) SHM_RING_SIZE);
+
+    // Responses go the other way
+    fill_msg(7, 10);
+    CHECK(shm_send(&provider, msg_tag(7), msg, 10));
+    check_msg(&consumer, 7, 10);
+
+    shm_close(&consumer);
+    shm_close(&provider);
+    CHECK(shm_closed(&consumer) && shm_closed(&provider));
+}
+
+static void test_full_ring() {
+    shm_channel_t consumer, provider;
+    open_channel(&consumer, &provider);
+
+    int num_sent = 0;
+    for (;;) {
+        fill_msg(num_sent, BATCH_LEN);
+        if (!shm_send(&consumer, msg_tag(num_sent), msg, BATCH_LEN)) {
+            break;
+        }
+        num_sent++;
+    }
+    CHECK(num_sent == SHM_RING_SIZE / (BATCH_LEN + 8));
+
+    // Room for one more once the oldest is read, at the start of the ring after a wrap marker
+    check_msg(&provider, 0, BATCH_LEN);
+    fill_msg(num_sent, BATCH_LEN);
+    CHECK(shm_send(&consumer, msg_tag(num_sent), msg, BATCH_LEN));
+    CHECK(!shm_send(&consumer, msg_tag(num_sent + 1), msg, BATCH_LEN));
+    for (int seq = 1; seq <= num_sent; seq++) {
+        check_msg(&provider, seq, BATCH_LEN);
+    }
+
+    shm_close(&consumer);
+    shm_close(&provider);
+}
+
+static void test_wake_sleeping_peer() {
+    shm_channel_t consumer, provider;
+    open_channel(&consumer, &provider);
+    uint64_t count;
+
+    CHECK(shm_sleep(&provider));
+    CHECK(read(provider.efd_rx, &count, sizeof(count)) < 0);
+    CHECK(shm_send(&consumer, msg_tag(0), "a", 1));
+    CHECK(read(provider.efd_rx, &count, sizeof(count)) == sizeof(count));
+
+    // Awake, no syscall to signal it
+    CHECK(shm_send(&consumer, msg_tag(1), "b", 1));
+    CHECK(read(provider.efd_rx, &count, sizeof(count)) < 0);
+    // Cannot sleep with messages to read
+    CHECK(!shm_sleep(&provider));
+
+    shm_close(&consumer);
+    shm_close(&provider);
+}
+
+// Length at the start of the message 'offset' bytes into the ring to the peer
+static void corrupt_length(shm_channel_t *ch, size_t offset, uint32_t len) {
+    *((uint32_t *) &ch->tx->data[offset]) = len;
+}
+
+static void test_corrupt_length() {
+    shm_channel_t consumer, provider;
+    open_channel(&consumer, &provider);
+    const char *data;
+    uint32_t tag;
+    size_t len;
+
+    // Past the end of the ring
+    fill_msg(0, 3);
+    CHECK(shm_send(&consumer, msg_tag(0), msg, 3));
+    corrupt_length(&consumer, 0, SHM_RING_SIZE - 4);
+    CHECK(shm_peek(&provider, &data, &tag, &len) == SHM_ERR);
+    corrupt_length(&consumer, 0, 0xfffffff0u);
+    CHECK(shm_peek(&provider, &data, &tag, &len) == SHM_ERR);
+
+    // Within the ring, but past what was written
+    corrupt_length(&consumer, 0, 100);
+    CHECK(shm_peek(&provider, &data, &tag, &len) == SHM_ERR);
+    corrupt_length(&consumer, 0, 3);
+    check_msg(&provider, 0, 3);
+
+    // Written past the space it was given
+    atomic_store(&consumer.tx->head, atomic_load(&consumer.tx->head) + SHM_RING_SIZE + 8);
+    CHECK(shm_peek(&provider, &data, &tag, &len) == SHM_ERR);
+
+    shm_close(&consumer);
+    shm_close(&provider);
+}
+
+static void test_handshake_without_rings() {
+    char err[ANET_ERR_LEN];
+    int peer = anetUnixConnect(err, path);
+    CHECK(peer != ANET_ERR);
+    int sock = anetUnixAccept(err, server);
+    CHECK(sock != ANET_ERR);
+    shm_channel_t provider;
+    shm_accept(&provider, sock);
+    CHECK(shm_finish_accept(err, &provider) == SHM_AGAIN);
+
+    // Stalled
+    long now_ms = get_current_time_ms();
+    CHECK(!shm_expired(&provider, now_ms));
+    CHECK(shm_expired(&provider, now_ms + SHM_CONNECT_TIMEOUT_MS + 1));
+
+    // A byte with no fds along
+    CHECK(write(peer, "k", 1) == 1);
+    CHECK(shm_finish_accept(err, &provider) == SHM_ERR);
+    CHECK(!shm_attached(&provider));
+    shm_close(&provider);
+    close(peer);
+}
+
+static void test_tags() {
+    CHECK(shm_tag_valid(SHM_TAG(0, 0)));
+    CHECK(shm_tag_valid(SHM_TAG(SHM_MAX_TAGS - 1, 0xffff)));
+    CHECK(SHM_TAG_INDEX(SHM_TAG(SHM_MAX_TAGS - 1, 0xffff)) == SHM_MAX_TAGS - 1);
+    CHECK(SHM_TAG(3, 1) != SHM_TAG(3, 2));
+    CHECK(!shm_tag_valid(SHM_TAG(SHM_MAX_TAGS, 0)));
+    CHECK(!shm_tag_valid(0xffffffffu));
+}
+
+int main() {
+    init_log("test_shm.log");
+    char err[ANET_ERR_LEN];
+    snprintf(path, sizeof(path), "@mesh-agent-shm-test-%d", getpid());
+    server = anetUnixServer(err, path, 0, 16);
+    CHECK(server != ANET_ERR);
+
+    RUN(test_messages_in_order_across_wraps);
+    RUN(test_full_ring);
+    RUN(test_wake_sleeping_peer);
+    RUN(test_corrupt_length);
+    RUN(test_handshake_without_rings);
+    RUN(test_tags);
+    return 0;
+}
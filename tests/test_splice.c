@@ -0,0 +1,156 @@
+#include "fmacros.h"
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "test.h"
+#include "consumer.h"
+#include "util.h"
+#include "log.h"
+
+/*
+ * A consumer agent in splice mode relays responses far larger than one segment, from a remote
+ * agent that sends them through a small socket buffer, to a consumer that takes them through
+ * another. Each response must reach the consumer whole, and the next request on the same
+ * connection must get its own response and not the rest of the previous one. The load header
+ * of the remote agent is not passed on.
+ */
+
+#define BODY_SIZE 65536
+#define SMALL_SOCKET_BUF 4096
+#define NUM_REQUESTS 4
+#define TIMEOUT_US 5000000
+
+extern const char *etcd_stub_keys[8];
+
+static int agent_fd;
+static int num_responses = 0;
+
+static const char request[] = "POST / HTTP/1.1\r\nContent-Length: 9\r\n\r\nparameter";
+
+// Remote agent answering every request with a body of the letter of its order
+static void *serve_remote_agent(void *arg) {
+    struct pollfd fds[1024];
+    int nfds = 1;
+    fds[0].fd = agent_fd;
+    fds[0].events = POLLIN;
+    char req[1024];
+    char *resp = malloc(BODY_SIZE + 64);
+
+    for (;;) {
+        CHECK(poll(fds, (nfds_t) nfds, -1) > 0);
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(agent_fd, NULL, NULL);
+            int size = SMALL_SOCKET_BUF;
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+            CHECK(nfds < 1024);
+            fds[nfds].fd = fd;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+        for (int i = 1; i < nfds; i++) {
+            if (!(fds[i].revents & POLLIN)) {
+                continue;
+            }
+            // Requests are short and arrive whole on a connection from a pool
+            ssize_t nread = read(fds[i].fd, req, sizeof(req));
+            if (nread <= 0) {
+                close(fds[i].fd);
+                fds[i--] = fds[--nfds];
+                continue;
+            }
+            CHECK(http_message_length(req, (size_t) nread) == nread);
+
+            int len = sprintf(resp, "HTTP/1.1 200 OK\r\nX-Load:1,0,100\r\nContent-Length: %d\r\n\r\n", BODY_SIZE);
+            memset(resp + len, 'a' + num_responses++ % 26, BODY_SIZE);
+            len += BODY_SIZE;
+            for (ssize_t nwrite = 0; nwrite < len;) {
+                ssize_t n = write(fds[i].fd, resp + nwrite, (size_t) (len - nwrite));
+                CHECK(n > 0);
+                nwrite += n;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void start_remote_agent() {
+    agent_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    CHECK(bind(agent_fd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+    CHECK(listen(agent_fd, 1024) == 0);
+    socklen_t addr_len = sizeof(addr);
+    CHECK(getsockname(agent_fd, (struct sockaddr *) &addr, &addr_len) == 0);
+
+    static char key[128];
+    snprintf(key, sizeof(key), "/dubbomesh/com.alibaba.dubbo.performance.demo.provider.IHelloService/127.0.0.1:%d",
+             ntohs(addr.sin_port));
+    etcd_stub_keys[0] = key;
+
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, serve_remote_agent, NULL) == 0);
+}
+
+static void test_splice_large_responses() {
+    aeEventLoop *event_loop = aeCreateEventLoop(8192);
+    consumer_init(event_loop, FORWARD_MODE_SPLICE, 0, 0, 0, false, NULL, NULL, PROTOCOL_HTTP, false);
+
+    int sv[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    int size = SMALL_SOCKET_BUF;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    CHECK(anetNonBlock(NULL, sv[0]) == ANET_OK);
+    consumer_http_handler(event_loop, sv[0]);
+
+    static char resp[BODY_SIZE + 64];
+    for (int i = 0; i < NUM_REQUESTS; i++) {
+        CHECK(write(sv[1], request, sizeof(request) - 1) == sizeof(request) - 1);
+
+        ssize_t len = 0;
+        ssize_t nread = 0;
+        long deadline_us = get_current_time_us() + TIMEOUT_US;
+        while (len == 0 || nread < len) {
+            CHECK(get_current_time_us() < deadline_us);
+            aeProcessEvents(event_loop, AE_ALL_EVENTS | AE_DONT_WAIT);
+            ssize_t n = recv(sv[1], resp + nread, sizeof(resp) - nread, MSG_DONTWAIT);
+            CHECK(n > 0 || (n < 0 && errno == EAGAIN));
+            if (n > 0) {
+                nread += n;
+                len = http_message_length(resp, (size_t) nread);
+                CHECK(len >= 0);
+            }
+        }
+        CHECK(nread == len);
+        CHECK(len - BODY_SIZE > 0);
+        CHECK(memmem(resp, (size_t) (len - BODY_SIZE), "X-Load", 6) == NULL);
+        for (ssize_t j = len - BODY_SIZE; j < len; j++) {
+            CHECK(resp[j] == 'a' + i);
+        }
+    }
+
+    // Nothing is left over on either side
+    for (int i = 0; i < 100; i++) {
+        aeProcessEvents(event_loop, AE_ALL_EVENTS | AE_DONT_WAIT);
+    }
+    CHECK(recv(sv[1], resp, sizeof(resp), MSG_DONTWAIT) < 0 && errno == EAGAIN);
+    CHECK(num_responses == NUM_REQUESTS);
+    CHECK(consumer_active_connections() == 1);
+}
+
+int main() {
+    // Connections to the remote agent are warmed up all at once
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    init_log("test_splice.log");
+
+    start_remote_agent();
+    RUN(test_splice_large_responses);
+    return 0;
+}